@@ -1,92 +1,116 @@
-#include "benchmark.nb.h"
 #include "libnbuf.h"
+#include "benchmark.nb.h"
 
 #include <assert.h>
 
 #include "common.h"
+#include "workload.h"
 
-static void create_serialize(struct nbuf_buf *buf)
+static void print_text_format(FILE *f, Root root)
 {
-	static const float vec[3] = { 3.141, 2.718, 1.618 };
-	size_t i, j;
-	Root root;
-	Entry entry;
-
-	memset(buf->base, 0, buf->len);
-	buf->len = 0;
-	alloc_Root(&root, buf);
-	Root_alloc_entries(&entry, root, MAX_ENTRY);
-	for (i = 0; i < MAX_ENTRY; i++) {
-		if (i % 3 == 0)
-			Entry_set_magic(entry, 0xDEADBEEFull * i);
-		Entry_set_id(entry, i);
-		if (i % 5 == 0)
-			Entry_set_pi(entry, 3.14159265358979323846 + i);
-		if (i % 7 == 0) {
-			float *coord = (float *) Entry_alloc_coordinates(entry, 3);
-			for (j = 0; j < 3; j++)
-				nbuf_set_f32(&coord[j], vec[j]);
-		}
-		if (i % 2 == 0)
-			Entry_set_msg(entry, "100 bottles on the wall", -1);
-		nbuf_next(NBUF_OBJ(entry));
-	}
+	extern const nbuf_MsgDef refl_Root;
+	struct nbuf_print_opt opt = { .f = f, .indent = 2 };
+	nbuf_print(&opt, NBUF_OBJ(root), refl_Root);
 }
 
-static void deserialize_use(struct nbuf_buf *buf)
+static void parse_text_format(struct nbuf_buf *in, struct nbuf_buf *out)
 {
-	static const float vec[3] = { 3.141, 2.718, 1.618 };
+	extern const nbuf_MsgDef refl_Root;
+	struct nbuf_parse_opt opt = { .outbuf = out, .filename = "benchmark.nb.txt" };
+	struct nbuf_obj o;
+
+	memset(out->base, 0, out->len);
+	out->len = 0;
+	nbuf_parse(&opt, &o, in->base, in->len, refl_Root);
+}
+
+/* Same as create_serialize, with the strings interned */
+static void create_interned(struct nbuf_buf *buf)
+{
+	nbuf_intern_reset(buf->intern);
+	create_serialize(buf);
+}
+
+/* Appends the entries of b to those of a, field by field */
+static void merge_by_hand(struct nbuf_buf *out, Root a, Root b)
+{
+	const Root roots[2] = { a, b };
 	Root root;
-	Entry entry;
-	size_t n;
-	size_t i, j, len;
-
-	get_Root(&root, buf, 0);
-	n = Root_entries(&entry, root, 0);
-	assert(n == MAX_ENTRY);
-	for (i = 0; i < n; i++) {
-		if (i % 3 == 0)
-			assert(Entry_magic(entry) == 0xDEADBEEFull * i);
-		assert(Entry_id(entry) == (int) i);
-		if (i % 5 == 0)
-			assert(Entry_pi(entry) == 3.14159265358979323846 + i);
-		if (i % 7 == 0) {
-#if 1  // faster alternative
-			const float *coord;
-			struct nbuf_obj o;
-			Entry_raw_coordinates(&o, entry);
-			coord = (const float *) nbuf_obj_base(&o);
-			for (j = 0; j < 3; j++)
-				assert(nbuf_f32(&coord[j]) == vec[j]);
-#else
-			for (j = 0; j < 3; j++)
-				assert(Entry_coordinates(entry, j) == vec[j]);
-#endif
-		}
-		if (i % 2 == 0) {
-			Entry_msg(entry, &len);
-			assert(len == strlen("100 bottles on the wall"));
+	Entry entry, src;
+	size_t i, j, k, n, len;
+	const char *s;
+
+	memset(out->base, 0, out->len);
+	out->len = 0;
+	alloc_Root(&root, out);
+	n = Root_entries_size(a) + Root_entries_size(b);
+	Root_alloc_entries(&entry, root, n);
+	for (k = 0; k < 2; k++) {
+		n = Root_entries(&src, roots[k], 0);
+		for (i = 0; i < n; i++) {
+			Entry_set_magic(entry, Entry_magic(src));
+			Entry_set_id(entry, Entry_id(src));
+			Entry_set_pi(entry, Entry_pi(src));
+			if ((len = Entry_coordinates_size(src)) > 0) {
+				float *coord = (float *) Entry_alloc_coordinates(entry, len);
+				for (j = 0; j < len; j++)
+					nbuf_set_f32(&coord[j], Entry_coordinates(src, j));
+			}
+			s = Entry_msg(src, &len);
+			if (len > 0)
+				Entry_set_msg(entry, s, len);
+			nbuf_next(NBUF_OBJ(entry));
+			nbuf_next(NBUF_OBJ(src));
 		}
-		nbuf_next(NBUF_OBJ(entry));
 	}
 }
 
-static void print_text_format(FILE *f, Root root)
+static void merge(struct nbuf_buf *out, Root a, Root b)
 {
 	extern const nbuf_MsgDef refl_Root;
-	struct nbuf_print_opt opt = { .f = f, .indent = 2 };
-	nbuf_print(&opt, NBUF_OBJ(root), refl_Root);
+	struct nbuf_merge_opt opt = { .outbuf = out };
+	struct nbuf_obj o;
+
+	out->len = 0;
+	nbuf_merge(&opt, &o, NBUF_OBJ(a), NBUF_OBJ(b), refl_Root);
 }
 
-static void parse_text_format(struct nbuf_buf *in, struct nbuf_buf *out)
+static void equal(Root a, Root b)
+{
+	bool eq = equal_Root(a, b);
+
+	BENCH_KEEP(eq);
+}
+
+static void hash(Root root)
+{
+	uint64_t h = hash_Root(root, 0);
+
+	BENCH_KEEP(h);
+}
+
+static void canonicalize(struct nbuf_buf *out, Root root)
 {
 	extern const nbuf_MsgDef refl_Root;
-	struct nbuf_parse_opt opt = { .outbuf = out, .filename = "benchmark.nb.txt" };
 	struct nbuf_obj o;
 
-	memset(out->base, 0, out->len);
 	out->len = 0;
-	nbuf_parse(&opt, &o, in->base, in->len, refl_Root);
+	nbuf_canonicalize(out, &o, NBUF_OBJ(root), refl_Root);
+}
+
+static void use(struct nbuf_buf *buf)
+{
+	uint64_t sum = deserialize_use(buf);
+
+	BENCH_KEEP(sum);
+}
+
+static void is_canonical(Root root)
+{
+	extern const nbuf_MsgDef refl_Root;
+	bool canon = nbuf_is_canonical(NBUF_OBJ(root), refl_Root);
+
+	BENCH_KEEP(canon);
 }
 
 int main()
@@ -97,8 +121,49 @@ int main()
 	nbuf_init_ex(&buf, 0);
 	BENCH(create_serialize(&buf), 100000);
 	nbuf_save_file(&buf, "benchmark.nb.bin");
-	BENCH(deserialize_use(&buf), 100000);
+	BENCH_NAMED("deserialize_use(&buf)", use(&buf), 100000);
+	{
+		struct nbuf_buf ibuf;
+		struct nbuf_intern intern;
+
+		nbuf_init_ex(&ibuf, 0);
+		nbuf_intern_init(&intern);
+		ibuf.intern = &intern;
+		BENCH(create_interned(&ibuf), 100000);
+		fprintf(stderr, "size: %zu bytes, %zu interned\n", buf.len, ibuf.len);
+		nbuf_intern_free(&intern);
+		nbuf_clear(&ibuf);
+	}
 	get_Root(&root, &buf, 0);
+	{
+		struct nbuf_buf out;
+
+		nbuf_init_ex(&out, 0);
+		BENCH(merge_by_hand(&out, root, root), 10000);
+		BENCH(merge(&out, root, root), 10000);
+		nbuf_clear(&out);
+	}
+	{
+		struct nbuf_buf copy;
+		Root other;
+
+		nbuf_init_ex(&copy, 0);
+		nbuf_add(&copy, buf.base, buf.len);
+		get_Root(&other, &copy, 0);
+		BENCH(equal(root, other), 100000);
+		BENCH(hash(root), 100000);
+		nbuf_clear(&copy);
+	}
+	{
+		struct nbuf_buf out;
+		Root canon;
+
+		nbuf_init_ex(&out, 0);
+		BENCH(canonicalize(&out, root), 100000);
+		get_Root(&canon, &out, 0);
+		BENCH(is_canonical(canon), 100000);
+		nbuf_clear(&out);
+	}
 	{
 		FILE *f = fopen(NUL_FILE, "w");
 		BENCH(print_text_format(f, root), 2000);
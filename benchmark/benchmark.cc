@@ -4,7 +4,7 @@
 
 #include "common.h"
 
-static void create_serialize(nbuf::buffer *buf)
+static BENCH_NOINLINE void create_serialize(nbuf::buffer *buf)
 {
 	static const float vec[3] = { 3.141, 2.718, 1.618 };
 	size_t i = 0;
@@ -29,7 +29,34 @@ static void create_serialize(nbuf::buffer *buf)
 	}
 }
 
-static void deserialize_use(nbuf::buffer *buf)
+/* Same message, written with builders */
+static BENCH_NOINLINE void create_serialize_builder(nbuf::buffer *buf)
+{
+	static const float vec[3] = { 3.141, 2.718, 1.618 };
+
+	buf->len = 0;
+	nbuf::arena a(buf);
+	auto root = Root::build(a);
+	auto entries = root.alloc_entries(MAX_ENTRY);
+	for (size_t i = 0; i < entries.size(); i++) {
+		auto entry = entries[i];
+		if (i % 3 == 0)
+			entry.set_magic(0xDEADBEEFull * i);
+		entry.set_id(i);
+		if (i % 5 == 0)
+			entry.set_pi(3.14159265358979323846 + i);
+		if (i % 7 == 0) {
+			auto coord = entry.alloc_coordinates(3);
+			for (size_t j = 0; j < coord.size(); j++)
+				coord[j] = vec[j];
+		}
+		if (i % 2 == 0)
+			(void) entry.set_msg("100 bottles on the wall");
+	}
+	assert(a.error() == nbuf::status::ok);
+}
+
+static BENCH_NOINLINE void deserialize_use(nbuf::buffer *buf)
 {
 	static const float vec[3] = { 3.141, 2.718, 1.618 };
 	size_t i = 0;
@@ -53,6 +80,32 @@ static void deserialize_use(nbuf::buffer *buf)
 	assert(i == MAX_ENTRY);
 }
 
+/* Same, reading the scalars through a view */
+static BENCH_NOINLINE void deserialize_use_view(nbuf::buffer *buf)
+{
+	static const float vec[3] = { 3.141, 2.718, 1.618 };
+	size_t i = 0;
+
+	auto root = Root::get(buf);
+	for (auto entry : root.entries()) {
+		Entry::view v(entry);
+		if (i % 3 == 0)
+			assert(v.magic() == 0xDEADBEEFull * i);
+		assert(v.id() == (int) i);
+		if (i % 5 == 0)
+			assert(v.pi() == 3.14159265358979323846 + i);
+		if (i % 7 == 0) {
+			auto coord = entry.coordinates();
+			for (size_t j = 0; j < 3; j++)
+				assert(coord[j] == vec[j]);
+		}
+		if (i % 2 == 0)
+			assert(entry.msg().size() == strlen("100 bottles on the wall"));
+		i++;
+	}
+	assert(i == MAX_ENTRY);
+}
+
 int main()
 {
 	static char mem[8192];
@@ -60,7 +113,9 @@ int main()
 
 	nbuf_init_rw(&buf, mem, sizeof mem);
 	BENCH(create_serialize(&buf), 100000);
+	BENCH(create_serialize_builder(&buf), 100000);
 	BENCH(deserialize_use(&buf), 100000);
+	BENCH(deserialize_use_view(&buf), 100000);
 	nbuf_clear(&buf);
 	return 0;
 }
@@ -0,0 +1,729 @@
+/* Schema-driven workload generator.
+ *
+ * Builds random messages of any type through reflection, following a
+ * distribution spec, and benchmarks create, read, print and parse over a
+ * sweep of message sizes.
+ *
+ * The message size is controlled by the length of the repeated fields of
+ * the root message; the spec applies to everything below it.
+ */
+#include "libnbuf.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+struct spec {
+	unsigned array_min, array_max;  /* length of repeated fields */
+	unsigned string_min, string_max;  /* length of strings */
+	unsigned presence;  /* percentage of fields that are set */
+	int max_depth;  /* of nested messages */
+	uint64_t seed;
+};
+
+struct gen {
+	struct spec spec;
+	struct nbuf_buf *buf;
+	uint64_t rng;
+	size_t root_len;  /* length of repeated fields of the root */
+	struct nbuf_buf vals;  /* scratch for packed fields */
+};
+
+/* xorshift64* */
+static uint64_t
+gen_rand(struct gen *g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * UINT64_C(2685821657736338717);
+}
+
+/* Returns a random number in [lo, hi]. */
+static unsigned
+gen_range(struct gen *g, unsigned lo, unsigned hi)
+{
+	return (hi <= lo) ? lo : lo + gen_rand(g) % (hi - lo + 1);
+}
+
+static bool
+gen_present(struct gen *g)
+{
+	return gen_rand(g) % 100 < g->spec.presence;
+}
+
+/* Returns an integer of up to `bits` bits, with a log-uniform magnitude,
+ * which is closer to real data than a uniform one.
+ */
+static uint64_t
+gen_int(struct gen *g, unsigned bits, bool sign)
+{
+	unsigned n = gen_range(g, 0, sign ? bits - 1 : bits);
+	uint64_t v = (n == 64) ? gen_rand(g) :
+		gen_rand(g) & ((UINT64_C(1) << n) - 1);
+
+	if (sign && (gen_rand(g) & 1))
+		v = -v;
+	return v;
+}
+
+static int
+gen_enum(struct gen *g, nbuf_EnumDef edef)
+{
+	nbuf_EnumVal eval;
+	size_t n = nbuf_EnumDef_values(&eval, edef, 0);
+
+	if (!n)
+		return 0;
+	nbuf_EnumDef_values(&eval, edef, gen_range(g, 0, n - 1));
+	return nbuf_EnumVal_value(eval);
+}
+
+static void
+gen_scalar(struct gen *g, void *ptr, nbuf_Kind kind, unsigned size)
+{
+	uint64_t v;
+
+	switch (kind) {
+	case nbuf_Kind_FLT:
+		if (size == 4)
+			nbuf_set_f32(ptr, (gen_rand(g) >> 40) / 1024.0f);
+		else
+			nbuf_set_f64(ptr, (gen_rand(g) >> 11) / 1048576.0);
+		return;
+	case nbuf_Kind_BOOL:
+		nbuf_set_u8(ptr, gen_rand(g) & 1);
+		return;
+	default:
+		v = gen_int(g, size * 8, kind == nbuf_Kind_SINT);
+		break;
+	}
+	switch (size) {
+	case 1: nbuf_set_u8(ptr, v); break;
+	case 2: nbuf_set_u16(ptr, v); break;
+	case 4: nbuf_set_u32(ptr, v); break;
+	case 8: nbuf_set_u64(ptr, v); break;
+	}
+}
+
+static bool
+gen_str(struct gen *g, struct nbuf_obj *o)
+{
+	size_t i, len = gen_range(g, g->spec.string_min, g->spec.string_max);
+	char *p;
+
+	o->buf = g->buf;
+	if (!(p = nbuf_alloc_str(o, NULL, len)))
+		return false;
+	for (i = 0; i < len; i++)
+		p[i] = 'a' + gen_rand(g) % 26;
+	return true;
+}
+
+static bool
+gen_alloced_msg(struct gen *g, struct nbuf_obj *o, nbuf_MsgDef mdef,
+	int depth);
+
+static bool
+gen_msg(struct gen *g, struct nbuf_obj *o, nbuf_MsgDef mdef, int depth)
+{
+	return nbuf_refl_alloc_msg(o, g->buf, mdef) &&
+		gen_alloced_msg(g, o, mdef, depth);
+}
+
+static bool
+gen_packed(struct gen *g, struct nbuf_obj *o, nbuf_FieldDef fdef,
+	nbuf_Kind kind, unsigned size, size_t n)
+{
+	unsigned flags = 0;
+	uint64_t *vals, v = 0;
+	size_t i;
+
+	if (kind == nbuf_Kind_SINT)
+		flags |= NBUF_PACK_SIGNED;
+	if (nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_DELTA)
+		flags |= NBUF_PACK_DELTA;
+	g->vals.len = 0;
+	if (!(vals = (uint64_t *) nbuf_alloc(&g->vals, n * sizeof *vals)))
+		return false;
+	for (i = 0; i < n; i++) {
+		/* delta-encoded fields are typically sorted */
+		if (flags & NBUF_PACK_DELTA)
+			v += gen_int(g, size * 4, false);
+		else
+			v = gen_int(g, size * 8, flags & NBUF_PACK_SIGNED);
+		if (size < 8) {
+			uint64_t mask = (UINT64_C(1) << (size * 8)) - 1;
+
+			v &= mask;
+			if ((flags & NBUF_PACK_SIGNED) && (v >> (size * 8 - 1)))
+				v |= ~mask;
+		}
+		vals[i] = v;
+	}
+	o->buf = g->buf;
+	return nbuf_alloc_packed(o, vals, n, sizeof *vals, flags) != 0;
+}
+
+static bool
+gen_field(struct gen *g, struct nbuf_obj *o, nbuf_FieldDef fdef, int depth)
+{
+	union {
+		struct nbuf_obj o;
+		nbuf_EnumDef edef;
+		nbuf_MsgDef mdef;
+	} u;
+	nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+	nbuf_Kind base_kind = nbuf_base_kind(kind);
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	unsigned count = nbuf_FieldDef_count(fdef);
+	unsigned bits = nbuf_FieldDef_bits(fdef);
+	nbuf_Encoding enc = nbuf_FieldDef_encoding(fdef);
+	unsigned size;
+	struct nbuf_obj oo = {g->buf}, it = {g->buf};
+	struct nbuf_key key;
+	size_t i, n;
+
+	if (kind == (nbuf_Kind) -1)
+		return false;
+	if (base_kind == nbuf_Kind_MSG && !nbuf_MsgDef_is_struct(u.mdef) &&
+		depth >= g->spec.max_depth)
+		return true;
+	n = (depth == 0 && g->root_len) ? g->root_len :
+		gen_range(g, g->spec.array_min, g->spec.array_max);
+	size = (base_kind == nbuf_Kind_ENUM) ? 2 : u.o.ssize;
+
+	if (bits && !nbuf_is_repeated(kind)) {
+		unsigned v = (base_kind == nbuf_Kind_ENUM) ?
+			(unsigned) gen_enum(g, u.edef) : gen_rand(g) & 1;
+
+		nbuf_set_bits(nbuf_obj_s(o, offset, 1),
+			nbuf_FieldDef_shift(fdef), bits, v);
+		return true;
+	}
+	if (bits) {
+		if (!nbuf_alloc_bitset(&oo, n))
+			return false;
+		for (i = 0; i < n; i++)
+			nbuf_bitset_set(&oo, i, gen_rand(g) & 1);
+		return nbuf_obj_set_p(o, offset, &oo) != 0;
+	}
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA) {
+		return gen_packed(g, &oo, fdef, base_kind, size, n) &&
+			nbuf_obj_set_p(o, offset, &oo);
+	}
+
+	if (nbuf_is_repeated(kind)) {
+		if (base_kind == nbuf_Kind_MSG) {
+			it.ssize = nbuf_MsgDef_ssize(u.mdef);
+			it.psize = nbuf_MsgDef_psize(u.mdef);
+		} else if (base_kind == nbuf_Kind_STR) {
+			it.ssize = 0;
+			it.psize = 1;
+		} else {
+			it.ssize = size;
+			it.psize = 0;
+		}
+		/* elements allocate after the array, whose length is known */
+		if (!n || !nbuf_alloc_arr(&it, n) || !nbuf_obj_set_p(o, offset, &it))
+			return n == 0;
+		for (i = 0; i < n; i++, nbuf_next(&it)) {
+			bool ok = true;
+
+			if (base_kind == nbuf_Kind_MSG)
+				ok = gen_alloced_msg(g, &it, u.mdef, depth + 1);
+			else if (base_kind == nbuf_Kind_STR)
+				ok = gen_str(g, &oo) && nbuf_obj_set_p(&it, 0, &oo);
+			else if (base_kind == nbuf_Kind_ENUM)
+				nbuf_set_i16(nbuf_obj_base(&it), gen_enum(g, u.edef));
+			else
+				gen_scalar(g, nbuf_obj_base(&it), base_kind, size);
+			if (!ok)
+				return false;
+		}
+		if (enc != nbuf_Encoding_HASHED || !nbuf_lookup_key(&key, fdef))
+			return true;
+		/* as the parser does: sort by key, then index the elements */
+		nbuf_advance(&it, -n);
+		return nbuf_sort_by_key(&it, n, key.offset, key.width,
+				key.flags) &&
+			nbuf_alloc_hash_index(&oo, &it, n, key.offset) &&
+			nbuf_obj_set_p(o, offset + 1, &oo);
+	}
+
+	switch (base_kind) {
+	case nbuf_Kind_STR:
+		return gen_str(g, &oo) && nbuf_obj_set_p(o, offset, &oo);
+	case nbuf_Kind_MSG:
+		if (nbuf_MsgDef_is_struct(u.mdef))
+			return nbuf_obj_inline(&oo, o, offset,
+					nbuf_MsgDef_ssize(u.mdef)) &&
+				gen_alloced_msg(g, &oo, u.mdef, depth + 1);
+		return gen_msg(g, &oo, u.mdef, depth + 1) &&
+			nbuf_obj_set_p(o, offset, &oo);
+	default:
+		for (i = 0; i < (count ? count : 1); i++) {
+			char *ptr = nbuf_obj_s(o, offset + i * size, size);
+
+			if (base_kind == nbuf_Kind_ENUM)
+				nbuf_set_i16(ptr, gen_enum(g, u.edef));
+			else
+				gen_scalar(g, ptr, base_kind, size);
+		}
+		return true;
+	}
+}
+
+static bool
+gen_alloced_msg(struct gen *g, struct nbuf_obj *o, nbuf_MsgDef mdef,
+	int depth)
+{
+	nbuf_FieldDef fdef;
+	nbuf_UnionDef udef;
+	size_t n;
+
+	/* pick a member of each union: member t replaces the previous
+	 * pick with probability 1/t, so all are equally likely */
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		unsigned tag = nbuf_FieldDef_tag(fdef);
+
+		if (nbuf_lookup_union(&udef, mdef, fdef) &&
+			gen_range(g, 1, tag) == 1)
+			nbuf_set_u16(nbuf_obj_s(o, nbuf_UnionDef_offset(udef), 2),
+				tag);
+	}
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		bool is_member = nbuf_lookup_union(&udef, mdef, fdef);
+		char *tag = is_member ?
+			nbuf_obj_s(o, nbuf_UnionDef_offset(udef), 2) : NULL;
+
+		if (is_member && nbuf_u16(tag) != nbuf_FieldDef_tag(fdef))
+			continue;
+		/* the root's repeated fields are always set to scale it */
+		if (!(depth == 0 && g->root_len &&
+			nbuf_is_repeated(nbuf_FieldDef_kind(fdef))) &&
+			!gen_present(g)) {
+			if (is_member)
+				nbuf_set_u16(tag, 0);
+			continue;
+		}
+		if (!gen_field(g, o, fdef, depth))
+			return false;
+	}
+	return true;
+}
+
+/* Generates a root message in buf, replacing its content. */
+static bool
+generate(struct gen *g, struct nbuf_buf *buf, nbuf_MsgDef mdef,
+	size_t root_len)
+{
+	struct nbuf_obj o;
+
+	if (buf->len)
+		memset(buf->base, 0, buf->len);
+	buf->len = 0;
+	g->buf = buf;
+	g->rng = g->spec.seed ? g->spec.seed : 1;
+	g->root_len = root_len;
+	return gen_msg(g, &o, mdef, 0);
+}
+
+/* Reads every field through reflection, and returns a checksum so the
+ * reads cannot be optimized away.
+ */
+static uint64_t
+read_msg(struct gen *g, const struct nbuf_obj *o, nbuf_MsgDef mdef);
+
+static uint64_t
+read_scalars(const struct nbuf_obj *o, size_t n, unsigned size)
+{
+	const char *p = (const char *) nbuf_obj_base(o);
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += size) {
+		switch (size) {
+		case 1: sum += nbuf_u8(p); break;
+		case 2: sum += nbuf_u16(p); break;
+		case 4: sum += nbuf_u32(p); break;
+		case 8: sum += nbuf_u64(p); break;
+		}
+	}
+	return sum;
+}
+
+static uint64_t
+read_field(struct gen *g, const struct nbuf_obj *o, nbuf_FieldDef fdef)
+{
+	union {
+		struct nbuf_obj o;
+		nbuf_EnumDef edef;
+		nbuf_MsgDef mdef;
+	} u;
+	nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+	nbuf_Kind base_kind = nbuf_base_kind(kind);
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	unsigned count = nbuf_FieldDef_count(fdef);
+	unsigned bits = nbuf_FieldDef_bits(fdef);
+	unsigned size = (base_kind == nbuf_Kind_ENUM) ? 2 : u.o.ssize;
+	nbuf_Encoding enc = nbuf_FieldDef_encoding(fdef);
+	struct nbuf_obj oo, ooo;
+	uint64_t sum = 0;
+	size_t i, n, len;
+	const char *p;
+
+	if (bits && !nbuf_is_repeated(kind)) {
+		p = nbuf_obj_s(o, offset, 1);
+		return p ? nbuf_get_bits(p, nbuf_FieldDef_shift(fdef), bits) : 0;
+	}
+	if (bits) {
+		n = nbuf_bitset_size(&oo, nbuf_obj_p(&oo, o, offset));
+		for (i = 0; i < n; i++)
+			sum += nbuf_bitset_get(&oo, i);
+		return sum;
+	}
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA) {
+		unsigned flags = (base_kind == nbuf_Kind_SINT) ?
+			NBUF_PACK_SIGNED : 0;
+		uint64_t *vals;
+
+		if (enc == nbuf_Encoding_DELTA)
+			flags |= NBUF_PACK_DELTA;
+		len = nbuf_obj_p(&oo, o, offset);
+		if (!(n = nbuf_packed_size(&oo, len)))
+			return 0;
+		g->vals.len = 0;
+		if (!(vals = (uint64_t *) nbuf_alloc(&g->vals, n * sizeof *vals)))
+			return 0;
+		n = nbuf_unpack(vals, n, sizeof *vals, flags, &oo, len);
+		for (i = 0; i < n; i++)
+			sum += vals[i];
+		return sum;
+	}
+
+	switch (base_kind) {
+	case nbuf_Kind_STR:
+		if (!nbuf_is_repeated(kind)) {
+			len = nbuf_obj_p(&ooo, o, offset);
+			p = nbuf_obj2str(&ooo, len, &len);
+			return len + (len ? (unsigned char) p[0] : 0);
+		}
+		n = nbuf_obj_p(&oo, o, offset);
+		for (i = 0; i < n; i++, nbuf_next(&oo)) {
+			len = nbuf_obj_p(&ooo, &oo, 0);
+			p = nbuf_obj2str(&ooo, len, &len);
+			sum += len + (len ? (unsigned char) p[0] : 0);
+		}
+		return sum;
+	case nbuf_Kind_MSG:
+		n = (!nbuf_is_repeated(kind) && nbuf_MsgDef_is_struct(u.mdef)) ?
+			nbuf_obj_inline(&oo, o, offset, nbuf_MsgDef_ssize(u.mdef)) :
+			nbuf_obj_p(&oo, o, offset);
+		for (i = 0; i < n; i++, nbuf_next(&oo))
+			sum += read_msg(g, &oo, u.mdef);
+		return sum;
+	default:
+		if (nbuf_is_repeated(kind)) {
+			n = nbuf_obj_p(&oo, o, offset);
+			return n ? read_scalars(&oo, n, size) : 0;
+		}
+		n = count ? count : 1;
+		if (!nbuf_obj_inline(&oo, o, offset, size * n))
+			return 0;
+		return read_scalars(&oo, n, size);
+	}
+}
+
+static uint64_t
+read_msg(struct gen *g, const struct nbuf_obj *o, nbuf_MsgDef mdef)
+{
+	nbuf_FieldDef fdef;
+	uint64_t sum = 0;
+	size_t n;
+
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		nbuf_UnionDef udef;
+
+		if (nbuf_lookup_union(&udef, mdef, fdef) &&
+			nbuf_obj_union_tag(o, nbuf_UnionDef_offset(udef)) !=
+				nbuf_FieldDef_tag(fdef))
+			continue;
+		sum += read_field(g, o, fdef);
+	}
+	return sum;
+}
+
+static void
+read_root(struct gen *g, struct nbuf_buf *buf, nbuf_MsgDef mdef)
+{
+	struct nbuf_obj o = {buf};
+	uint64_t sum = nbuf_get_obj(&o) ? read_msg(g, &o, mdef) : 0;
+
+	BENCH_KEEP(sum);
+}
+
+static void
+print_root(FILE *f, struct nbuf_buf *buf, nbuf_MsgDef mdef)
+{
+	struct nbuf_print_opt opt = { .f = f, .indent = 2 };
+	struct nbuf_obj o = {buf};
+
+	if (nbuf_get_obj(&o))
+		nbuf_print(&opt, &o, mdef);
+}
+
+static void
+parse_root(struct nbuf_buf *in, struct nbuf_buf *out, nbuf_MsgDef mdef)
+{
+	struct nbuf_parse_opt opt = { .outbuf = out, .filename = "<gen>" };
+	struct nbuf_obj o;
+
+	memset(out->base, 0, out->len);
+	out->len = 0;
+	nbuf_parse(&opt, &o, in->base, in->len, mdef);
+}
+
+/* Finds the length of the root's repeated fields for a message of about
+ * target bytes, by extrapolating from two small messages.
+ * Returns 0 if the root has no repeated field.
+ */
+static size_t
+find_root_len(struct gen *g, struct nbuf_buf *buf, nbuf_MsgDef mdef,
+	size_t target)
+{
+	nbuf_FieldDef fdef;
+	size_t n, base, per;
+
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef)))
+		if (nbuf_is_repeated(nbuf_FieldDef_kind(fdef)))
+			break;
+	if (n + 1 == 0)
+		return 0;
+	if (!generate(g, buf, mdef, 1))
+		return 0;
+	base = buf->len;
+	if (!generate(g, buf, mdef, 65))
+		return 0;
+	per = (buf->len > base) ? (buf->len - base) / 64 : 0;
+	if (per == 0)
+		per = 1;
+	return (target > base) ? (target - base + per / 2) / per + 1 : 1;
+}
+
+static const char *
+size_name(char *s, size_t size)
+{
+	static const char units[] = "BKMGT";
+	int i = 0;
+
+	while (size >= 1000 && size % 1000 == 0 && units[i + 1]) {
+		size /= 1000;
+		i++;
+	}
+	sprintf(s, "%zu%c%s", size, units[i], i ? "B" : "");
+	return s;
+}
+
+static bool
+parse_range(const char *arg, unsigned *lo, unsigned *hi)
+{
+	char *end;
+
+	*lo = strtoul(arg, &end, 10);
+	if (*end == '\0') {
+		*hi = *lo;
+		return true;
+	}
+	if (*end != ':')
+		return false;
+	*hi = strtoul(end + 1, &end, 10);
+	return *end == '\0' && *lo <= *hi;
+}
+
+static size_t
+parse_size(const char *arg)
+{
+	char *end;
+	size_t n = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'G': n *= 1000;  /* fallthrough */
+	case 'M': n *= 1000;  /* fallthrough */
+	case 'K': n *= 1000; end++; break;
+	}
+	return (*end == '\0' || strcmp(end, "B") == 0) ? n : 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [options] schema msg_type\n", progname);
+	fprintf(stderr, "Options\n"
+		"  -I=<dir>          add directory to search path\n"
+		"  -array=<min:max>  length of repeated fields (default 0:8)\n"
+		"  -string=<min:max> length of strings (default 0:32)\n"
+		"  -presence=<pct>   percentage of fields that are set "
+		"(default 75)\n"
+		"  -depth=<n>        max depth of nested messages (default 4)\n"
+		"  -seed=<n>         random seed\n"
+		"  -min_size=<size>  smallest message (default 100B)\n"
+		"  -max_size=<size>  largest message (default 1GB)\n"
+		"  -ops=<list>       any of create,read,print,parse "
+		"(default all)\n"
+		"  -save             save each message to gen.<size>.bin\n"
+		"Sizes may have a K, M or G suffix, and the sweep goes up "
+		"by 10x.\n");
+	exit(1);
+}
+
+#define MAXINCDIR 63
+#define MAX_OPS 1000000
+
+int main(int argc, char *argv[])
+{
+	struct gen g[1];
+	struct spec *spec = &g->spec;
+	const char *progname = *argv++, *arg;
+	const char *search_path[MAXINCDIR+1];
+	size_t search_path_count = 0;
+	size_t size, min_size = 100, max_size = 1000000000;
+	const char *ops = "create,read,print,parse";
+	bool save = false;
+	struct nbuf_buf outbuf, buf, buf1, text;
+	struct nbuf_compile_opt opt = { .outbuf = &outbuf };
+	struct nbuf_schema_set *ss;
+	nbuf_Schema schema;
+	nbuf_MsgDef mdef;
+	nbuf_Kind kind;
+	unsigned type_id;
+	int rc = 1;
+
+	memset(g, 0, sizeof g);
+	spec->array_min = 0;
+	spec->array_max = 8;
+	spec->string_min = 0;
+	spec->string_max = 32;
+	spec->presence = 75;
+	spec->max_depth = 4;
+	spec->seed = 1;
+	for (; (arg = *argv) && *arg == '-'; argv++) {
+		const char *val = strchr(arg, '=');
+		size_t len = val ? (size_t) (val++ - arg) : strlen(arg);
+
+#define OPT(X) (len == strlen(X) && strncmp(arg, X, len) == 0 && val)
+		if (OPT("-I") && search_path_count < MAXINCDIR)
+			search_path[search_path_count++] = val;
+		else if (OPT("-array") &&
+			parse_range(val, &spec->array_min, &spec->array_max))
+			;
+		else if (OPT("-string") &&
+			parse_range(val, &spec->string_min, &spec->string_max))
+			;
+		else if (OPT("-presence"))
+			spec->presence = atoi(val);
+		else if (OPT("-depth"))
+			spec->max_depth = atoi(val);
+		else if (OPT("-seed"))
+			spec->seed = strtoull(val, NULL, 0);
+		else if (OPT("-min_size") && (min_size = parse_size(val)))
+			;
+		else if (OPT("-max_size") && (max_size = parse_size(val)))
+			;
+		else if (OPT("-ops"))
+			ops = val;
+		else if (strcmp(arg, "-save") == 0)
+			save = true;
+		else {
+			fprintf(stderr, "bad option %s\n", arg);
+			usage(progname);
+		}
+#undef OPT
+	}
+	if (!argv[0] || !argv[1])
+		usage(progname);
+	search_path[search_path_count] = NULL;
+	opt.search_path = search_path;
+	nbuf_init_ex(&outbuf, 0);
+	if (!(ss = nbuf_compile(&opt, argv[0]))) {
+		fprintf(stderr, "%s: compilation failed\n", argv[0]);
+		goto out;
+	}
+	if (!nbuf_get_Schema(&schema, &ss->buf, 0) ||
+		!nbuf_lookup_defined_type(schema, argv[1], &kind, &type_id) ||
+		kind != nbuf_Kind_MSG ||
+		!nbuf_Schema_messages(&mdef, schema, type_id)) {
+		fprintf(stderr, "'%s' is not a message type name\n", argv[1]);
+		goto out;
+	}
+
+	nbuf_init_ex(&buf, 0);
+	nbuf_init_ex(&buf1, 0);
+	nbuf_init_ex(&g->vals, 0);
+	for (size = min_size; size <= max_size; size *= 10) {
+		size_t root_len = find_root_len(g, &buf, mdef, size);
+		char name[64], sz[16];
+		double t, cost;
+		long n;
+		FILE *f;
+
+		if (!root_len) {
+			fprintf(stderr, "'%s' has no repeated field to scale\n",
+				argv[1]);
+			goto err;
+		}
+		t = bench_now_ns();
+		if (!generate(g, &buf, mdef, root_len))
+			goto err;
+		t = bench_now_ns() - t;
+		fprintf(stderr, "# %s: %zu bytes, %zu elements per root array\n",
+			size_name(sz, size), buf.len, root_len);
+		/* about 1s of work for create and read, from the actual
+		 * size, which may be far from the target, or the time to
+		 * create it if that is more than 1ns per byte */
+		cost = (t > buf.len) ? t : buf.len;
+		n = (cost > 1e9 / MAX_OPS) ? (long) (1e9 / cost) : MAX_OPS;
+		if (save) {
+			snprintf(name, sizeof name, "gen.%s.bin", sz);
+			if (!nbuf_save_file(&buf, name))
+				goto err;
+		}
+#define RUN(op, expr, n) \
+	if (strstr(ops, op)) { \
+		snprintf(name, sizeof name, "%s/%s", op, sz); \
+		BENCH_NAMED(name, expr, (n) > 1 ? (n) : 1); \
+	}
+		RUN("create", generate(g, &buf1, mdef, root_len), n);
+		RUN("read", read_root(g, &buf, mdef), n);
+		if (!strstr(ops, "print") && !strstr(ops, "parse"))
+			continue;
+		if ((f = fopen(NUL_FILE, "w")) != NULL) {
+			RUN("print", print_root(f, &buf, mdef), n / 50);
+			fclose(f);
+		}
+		if (!strstr(ops, "parse") || !(f = tmpfile()))
+			continue;
+		print_root(f, &buf, mdef);
+		rewind(f);
+		if (nbuf_load_fp(&text, f)) {
+			RUN("parse", parse_root(&text, &buf1, mdef), n / 50);
+			nbuf_clear(&text);
+		}
+		fclose(f);
+#undef RUN
+	}
+	rc = 0;
+err:
+	nbuf_clear(&g->vals);
+	nbuf_clear(&buf1);
+	nbuf_clear(&buf);
+out:
+	nbuf_free_compiled(&opt);
+	return rc;
+}
@@ -0,0 +1,206 @@
+/* Multi-threaded scaling benchmark.
+ *
+ * Runs the benchmark workload on 1, 2, 4, ... threads and reports the
+ * throughput, speedup and parallel efficiency for:
+ *
+ *   read         deserialize_use on one shared, mmapped buffer
+ *   create       create_serialize, each thread reusing its own buffer
+ *   create_adj   same, but the per-thread struct nbuf_buf are adjacent in
+ *                memory, so their updates can share cache lines
+ *   create_new   same, but a new buffer is allocated and freed per message,
+ *                so threads contend on the system allocator
+ *
+ * Each thread does the same number of operations (weak scaling).  The ratio
+ * of create_adj or create_new to create, at the same thread count, shows
+ * the cost of false sharing or of allocator contention.
+ */
+#include "benchmark.nb.h"
+#include "libnbuf.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "workload.h"
+
+#define CACHE_LINE 64
+
+enum scenario { READ, CREATE, CREATE_ADJ, CREATE_NEW, NSCENARIOS };
+
+static const char *const scenario_names[NSCENARIOS] = {
+	"read", "create", "create_adj", "create_new",
+};
+
+struct worker {
+	pthread_t thread;
+	enum scenario scenario;
+	long iters;
+	struct nbuf_buf *buf;
+	pthread_barrier_t *start;
+	double t0, t1;  /* when the worker started and finished */
+};
+
+/* A buffer on its own cache line */
+union padded_buf {
+	struct nbuf_buf buf;
+	char pad[(sizeof (struct nbuf_buf) + CACHE_LINE - 1) &~ (CACHE_LINE - 1)];
+};
+
+static struct nbuf_buf shared;
+
+static void *
+run_worker(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	uint64_t sum = 0;
+	long i;
+
+	pthread_barrier_wait(w->start);
+	w->t0 = bench_now_ns();
+	for (i = 0; i < w->iters; i++) {
+		switch (w->scenario) {
+		case READ:
+			sum += deserialize_use(&shared);
+			break;
+		case CREATE:
+		case CREATE_ADJ:
+			create_serialize(w->buf);
+			break;
+		case CREATE_NEW: {
+			struct nbuf_buf buf;
+
+			nbuf_init_ex(&buf, 4096);
+			create_serialize(&buf);
+			nbuf_clear(&buf);
+			break;
+		}
+		default:
+			break;
+		}
+		BENCH_CLOBBER();
+	}
+	w->t1 = bench_now_ns();
+	BENCH_KEEP(sum);
+	return NULL;
+}
+
+/* Returns the throughput in ops/s, or 0 on failure. */
+static double
+run(enum scenario scenario, int nthreads, long iters)
+{
+	struct worker *workers = (struct worker *) calloc(nthreads, sizeof *workers);
+	union padded_buf *padded = NULL;
+	struct nbuf_buf *adjacent = NULL;
+	pthread_barrier_t start;
+	double t0, t1 = 0;
+	int i;
+
+	if (posix_memalign((void **) &padded, CACHE_LINE,
+			nthreads * sizeof *padded) != 0)
+		padded = NULL;
+	adjacent = (struct nbuf_buf *) calloc(nthreads, sizeof *adjacent);
+	if (!workers || !padded || !adjacent)
+		goto err;
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		w->scenario = scenario;
+		w->iters = iters;
+		w->start = &start;
+		w->buf = (scenario == CREATE_ADJ) ? &adjacent[i] : &padded[i].buf;
+		nbuf_init_ex(w->buf, 4096);
+		if (pthread_create(&w->thread, NULL, run_worker, w) != 0) {
+			/* the others would wait at the barrier forever */
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&start);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	/* from the first worker to start to the last one to finish */
+	t0 = workers[0].t0;
+	t1 = workers[0].t1;
+	for (i = 1; i < nthreads; i++) {
+		if (workers[i].t0 < t0)
+			t0 = workers[i].t0;
+		if (workers[i].t1 > t1)
+			t1 = workers[i].t1;
+	}
+	pthread_barrier_destroy(&start);
+	for (i = 0; i < nthreads; i++)
+		nbuf_clear(workers[i].buf);
+err:
+	free(adjacent);
+	free(padded);
+	free(workers);
+	return (t1 > 0) ? nthreads * iters / ((t1 - t0) / 1e9) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *json = getenv("BENCH_JSON");
+	const char *s = getenv("BENCH_ITERS");
+	long iters = s ? atol(s) : 20000;
+	int max_threads = (argc > 1) ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	double base[NSCENARIOS];
+	enum scenario sc;
+	FILE *f = NULL;
+	int n;
+
+	if (max_threads < 1 || iters < 1) {
+		fprintf(stderr, "usage: %s [max_threads]\n", argv[0]);
+		return 1;
+	}
+	if (json && !(f = fopen(json, "a")))
+		perror(json);
+
+	/* the shared buffer is a file mapped into memory, as in a server */
+	nbuf_init_ex(&shared, 0);
+	create_serialize(&shared);
+	nbuf_save_file(&shared, "benchmark.nb.bin");
+	nbuf_clear(&shared);
+	if (!nbuf_load_file(&shared, "benchmark.nb.bin")) {
+		fprintf(stderr, "cannot load benchmark.nb.bin\n");
+		return 1;
+	}
+
+	fprintf(stderr, "%-12s %7s %14s %8s %6s %10s\n", "scenario", "threads",
+		"ops/s", "speedup", "eff", "vs create");
+	for (n = 1;; n *= 2) {
+		double create = 0;
+
+		if (n > max_threads)
+			n = max_threads;
+		for (sc = 0; sc < NSCENARIOS; sc++) {
+			double ops = run(sc, n, iters);
+
+			if (ops == 0) {
+				fprintf(stderr, "%s: failed\n", scenario_names[sc]);
+				return 1;
+			}
+			if (n == 1)
+				base[sc] = ops;
+			if (sc == CREATE)
+				create = ops;
+			fprintf(stderr, "%-12s %7d %14.0f %7.2fx %5.0f%%", scenario_names[sc],
+				n, ops, ops / base[sc], ops / base[sc] / n * 100);
+			if (sc > CREATE)
+				fprintf(stderr, " %9.2fx", ops / create);
+			fprintf(stderr, "\n");
+			if (f) {
+				fprintf(f, "{\"name\": \"%s/%dt\", \"threads\": %d, "
+					"\"ops_per_sec\": %.0f, \"speedup\": %.3f}\n",
+					scenario_names[sc], n, n, ops, ops / base[sc]);
+			}
+		}
+		if (n == max_threads)
+			break;
+	}
+	if (f)
+		fclose(f);
+	nbuf_clear(&shared);
+	return 0;
+}
@@ -1,12 +1,36 @@
+/* Benchmark harness.
+ *
+ * BENCH(expr, n) runs expr n times, split into BENCH_RUNS runs (default 15)
+ * after one warmup run.  Each run is timed in up to BENCH_BATCHES batches.
+ * It prints the median time per operation over the runs, the p99 over the
+ * batches, the 95% confidence interval of the mean, and, on Linux, hardware
+ * counters per operation if perf_event_open is permitted.
+ *
+ * Only memory writes are kept by BENCH: expr must store its results, or pass
+ * them to BENCH_KEEP, else the compiler may drop it.
+ *
+ * Environment variables:
+ *   BENCH_RUNS=<n>         number of timed runs
+ *   BENCH_JSON=<file>      append one JSON object per benchmark to file
+ *   BENCH_BASELINE=<file>  compare with a file written by BENCH_JSON
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-#define BENCH(expr, n) do { \
-	clock_t start = clock(), stop; \
-	for (int i = 0; i < n; i++) expr; \
-	stop = clock(); \
-	fprintf(stderr, "%s: %.fns/op\n", #expr, \
-		(double) (stop - start) / (n) / CLOCKS_PER_SEC * 1e9); \
-} while (0)
+#ifdef _WIN32
+# include <windows.h>
+#elif defined __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+# define BENCH_HAVE_PERF 1
+#endif
+
 #ifdef _WIN32
 # define NUL_FILE "nul"
 #else
@@ -14,4 +38,338 @@
 #endif
 
 #define MAX_ENTRY 100
+#define BENCH_BATCHES 100
+
+/* Keeps the compiler from optimizing away memory writes, or a value.
+ * BENCH_NOINLINE keeps a workload out of main, where inlining it makes
+ * timings depend on its place in main rather than on the workload.
+ */
+#if defined __GNUC__
+# define BENCH_CLOBBER() __asm__ __volatile__("" : : : "memory")
+# define BENCH_KEEP(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+# define BENCH_NOINLINE __attribute__((noinline))
+#else
+# define BENCH_CLOBBER() ((void) 0)
+# define BENCH_NOINLINE
+# define BENCH_KEEP(x) do { \
+	static volatile const void *bench_sink_; \
+	bench_sink_ = (const void *) &(x); \
+} while (0)
+#endif
+
+#define BENCH(expr, n) BENCH_NAMED(#expr, expr, n)
+
+/* Same as BENCH, but reports the result under name instead of expr. */
+#define BENCH_NAMED(name, expr, n) do { \
+	struct bench bench_; \
+	bench_begin(&bench_, name, n); \
+	while (bench_next_batch(&bench_)) { \
+		for (long i = 0; i < bench_.batch_iters; i++) { \
+			expr; \
+			BENCH_CLOBBER(); \
+		} \
+	} \
+	bench_end(&bench_); \
+} while (0)
+
+enum { BENCH_CYCLES, BENCH_CACHE_MISSES, BENCH_BRANCH_MISSES, BENCH_NCOUNTERS };
+
+static const char *const bench_counter_names[BENCH_NCOUNTERS] = {
+	"cycles", "cache_misses", "branch_misses",
+};
+
+struct bench {
+	const char *name;
+	long iters;  /* per run */
+	long batch_iters;
+	int runs, started;  /* the first run started is the warmup */
+	int nbatch, batch;  /* batches per run, and the current one */
+	double start, batch_start;
+	double *samples;  /* ns/op of each run */
+	double *batches;  /* ns/op of each batch, runs * nbatch */
+	uint64_t counters[BENCH_NCOUNTERS];
+};
+
+static inline double
+bench_now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, t;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (double) t.QuadPart / freq.QuadPart * 1e9;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+#if BENCH_HAVE_PERF
+/* File descriptors of the counters; -1 if unavailable. */
+static inline int *
+bench_perf_fds(void)
+{
+	static const uint64_t configs[BENCH_NCOUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+	static int fds[BENCH_NCOUNTERS];
+	static int opened;
+	int i;
+
+	if (opened)
+		return fds;
+	opened = 1;
+	for (i = 0; i < BENCH_NCOUNTERS; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof attr;
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	return fds;
+}
+#endif
+
+static inline void
+bench_perf_start(void)
+{
+#if BENCH_HAVE_PERF
+	int *fds = bench_perf_fds();
+	int i;
+
+	for (i = 0; i < BENCH_NCOUNTERS; i++) {
+		if (fds[i] < 0)
+			continue;
+		ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static inline void
+bench_perf_stop(uint64_t *counters)
+{
+#if BENCH_HAVE_PERF
+	int *fds = bench_perf_fds();
+	int i;
+
+	for (i = 0; i < BENCH_NCOUNTERS; i++) {
+		uint64_t v;
+
+		if (fds[i] < 0)
+			continue;
+		ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fds[i], &v, sizeof v) == sizeof v)
+			counters[i] += v;
+	}
+#else
+	(void) counters;
+#endif
+}
+
+static inline int
+bench_has_counter(int i)
+{
+#if BENCH_HAVE_PERF
+	return bench_perf_fds()[i] >= 0;
+#else
+	(void) i;
+	return 0;
+#endif
+}
+
+static inline void
+bench_begin(struct bench *b, const char *name, long n)
+{
+	const char *s = getenv("BENCH_RUNS");
+
+	memset(b, 0, sizeof *b);
+	b->name = name;
+	b->runs = s ? atoi(s) : 15;
+	if (b->runs < 1)
+		b->runs = 1;
+	b->iters = n / b->runs;
+	if (b->iters < 1)
+		b->iters = 1;
+	b->nbatch = b->iters < BENCH_BATCHES ? (int) b->iters : BENCH_BATCHES;
+	b->batch_iters = b->iters / b->nbatch;
+	b->iters = b->batch_iters * b->nbatch;
+	b->samples = (double *) calloc(b->runs, sizeof *b->samples);
+	b->batches = (double *) calloc((size_t) b->runs * b->nbatch,
+		sizeof *b->batches);
+}
+
+/* Finishes the current run, and starts the next one if any.
+ * Returns 0 when all runs are done.
+ */
+static inline int
+bench_next_run(struct bench *b)
+{
+	double stop = bench_now_ns();
+
+	if (b->started > 1) {
+		bench_perf_stop(b->counters);
+		if (b->samples)
+			b->samples[b->started - 2] = (stop - b->start) / b->iters;
+	}
+	if (b->started > b->runs)
+		return 0;
+	/* the warmup is not counted */
+	if (b->started++ > 0)
+		bench_perf_start();
+	b->start = bench_now_ns();
+	return 1;
+}
+
+/* Finishes the current batch, and starts the next one if any.
+ * Returns 0 when all runs are done.
+ */
+static inline int
+bench_next_batch(struct bench *b)
+{
+	double stop = bench_now_ns();
+
+	if (b->batch > 0 && b->started > 1 && b->batches)
+		b->batches[(b->started - 2) * b->nbatch + b->batch - 1] =
+			(stop - b->batch_start) / b->batch_iters;
+	if (b->batch == 0 || b->batch == b->nbatch) {
+		if (!bench_next_run(b))
+			return 0;
+		b->batch = 0;
+	}
+	b->batch++;
+	b->batch_start = bench_now_ns();
+	return 1;
+}
+
+static inline int
+bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static inline void
+bench_json_string(FILE *f, const char *s)
+{
+	putc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			putc('\\', f);
+		putc(*s, f);
+	}
+	putc('"', f);
+}
+
+/* Looks up the median of name in a file written by BENCH_JSON.
+ * Returns a negative value if not found.
+ */
+static inline double
+bench_baseline(const char *filename, const char *name)
+{
+	char line[4096], key[1024];
+	double median = -1;
+	FILE *f = fopen(filename, "r");
+	size_t n = 0;
+	const char *s;
+
+	if (!f)
+		return -1;
+	/* the name as it appears in the file */
+	key[n++] = '"';
+	for (s = name; *s && n + 3 < sizeof key; s++) {
+		if (*s == '"' || *s == '\\')
+			key[n++] = '\\';
+		key[n++] = *s;
+	}
+	key[n++] = '"';
+	key[n] = '\0';
+	while (fgets(line, sizeof line, f)) {
+		const char *p = strstr(line, "\"name\": ");
+
+		if (!p || strncmp(p + 8, key, strlen(key)) != 0)
+			continue;
+		if ((p = strstr(line, "\"median_ns\": ")) != NULL)
+			median = strtod(p + 13, NULL);
+	}
+	fclose(f);
+	return median;
+}
+
+static inline void
+bench_end(struct bench *b)
+{
+	const char *json = getenv("BENCH_JSON");
+	const char *baseline = getenv("BENCH_BASELINE");
+	double median, p99, mean = 0, var = 0, ci, base;
+	double total_ops = (double) b->iters * b->runs;
+	int i, n = b->runs;
+
+	if (!b->samples || !b->batches) {
+		fprintf(stderr, "%s: out of memory\n", b->name);
+		free(b->samples);
+		free(b->batches);
+		return;
+	}
+	qsort(b->samples, n, sizeof *b->samples, bench_cmp_double);
+	median = (n % 2) ? b->samples[n / 2] :
+		(b->samples[n / 2 - 1] + b->samples[n / 2]) / 2;
+	qsort(b->batches, (size_t) n * b->nbatch, sizeof *b->batches,
+		bench_cmp_double);
+	/* nearest rank */
+	p99 = b->batches[(99 * (size_t) n * b->nbatch + 99) / 100 - 1];
+	for (i = 0; i < n; i++)
+		mean += b->samples[i];
+	mean /= n;
+	for (i = 0; i < n; i++)
+		var += (b->samples[i] - mean) * (b->samples[i] - mean);
+	var = (n > 1) ? var / (n - 1) : 0;
+	/* 95% confidence interval of the mean, relative */
+	ci = (mean > 0) ? 1.96 * sqrt(var / n) / mean * 100 : 0;
+
+	fprintf(stderr, "%s: %.fns/op (p99 %.f, +-%.1f%%", b->name, median, p99, ci);
+	for (i = 0; i < BENCH_NCOUNTERS; i++)
+		if (bench_has_counter(i))
+			fprintf(stderr, ", %.1f %s/op", b->counters[i] / total_ops,
+				bench_counter_names[i]);
+	if (baseline && (base = bench_baseline(baseline, b->name)) > 0) {
+		double diff = (median - base) / base * 100;
+
+		fprintf(stderr, ", %+.1f%% vs baseline%s", diff,
+			(diff > ci && diff > 5) ? " REGRESSION" : "");
+	}
+	fprintf(stderr, ")\n");
+
+	if (json) {
+		FILE *f = fopen(json, "a");
 
+		if (f) {
+			fprintf(f, "{\"name\": ");
+			bench_json_string(f, b->name);
+			fprintf(f, ", \"runs\": %d, \"iters\": %ld, "
+				"\"median_ns\": %.3f, \"p99_ns\": %.3f, "
+				"\"mean_ns\": %.3f, \"ci95_pct\": %.3f",
+				n, b->iters, median, p99, mean, ci);
+			for (i = 0; i < BENCH_NCOUNTERS; i++)
+				if (bench_has_counter(i))
+					fprintf(f, ", \"%s\": %.3f",
+						bench_counter_names[i],
+						b->counters[i] / total_ops);
+			fprintf(f, "}\n");
+			fclose(f);
+		} else {
+			perror(json);
+		}
+	}
+	free(b->samples);
+	free(b->batches);
+}
@@ -0,0 +1,81 @@
+/* The benchmark workload: a message with MAX_ENTRY entries of mixed fields.
+ * Shared by the single-threaded and multi-threaded C benchmarks.
+ */
+static void create_serialize(struct nbuf_buf *buf)
+{
+	static const float vec[3] = { 3.141, 2.718, 1.618 };
+	size_t i, j;
+	Root root;
+	Entry entry;
+
+	memset(buf->base, 0, buf->len);
+	buf->len = 0;
+	alloc_Root(&root, buf);
+	Root_alloc_entries(&entry, root, MAX_ENTRY);
+	for (i = 0; i < MAX_ENTRY; i++) {
+		if (i % 3 == 0)
+			Entry_set_magic(entry, 0xDEADBEEFull * i);
+		Entry_set_id(entry, i);
+		if (i % 5 == 0)
+			Entry_set_pi(entry, 3.14159265358979323846 + i);
+		if (i % 7 == 0) {
+			float *coord = (float *) Entry_alloc_coordinates(entry, 3);
+			for (j = 0; j < 3; j++)
+				nbuf_set_f32(&coord[j], vec[j]);
+		}
+		if (i % 2 == 0)
+			Entry_set_msg(entry, "100 bottles on the wall", -1);
+		nbuf_next(NBUF_OBJ(entry));
+	}
+}
+
+/* Returns a sum of the values read, so that they are not optimized away
+ * when the asserts are compiled out.
+ */
+static uint64_t deserialize_use(struct nbuf_buf *buf)
+{
+	static const float vec[3] = { 3.141, 2.718, 1.618 };
+	Root root;
+	Entry entry;
+	size_t n;
+	size_t i, j, len;
+	uint64_t sum = 0;
+
+	get_Root(&root, buf, 0);
+	n = Root_entries(&entry, root, 0);
+	assert(n == MAX_ENTRY);
+	for (i = 0; i < n; i++) {
+		if (i % 3 == 0) {
+			uint64_t magic = Entry_magic(entry);
+			assert(magic == 0xDEADBEEFull * i);
+			sum += magic;
+		}
+		sum += Entry_id(entry);
+		assert(Entry_id(entry) == (int) i);
+		if (i % 5 == 0) {
+			double pi = Entry_pi(entry);
+			assert(pi == 3.14159265358979323846 + i);
+			sum += (uint64_t) pi;
+		}
+		if (i % 7 == 0) {
+#if 1  // faster alternative
+			const float *coord;
+			struct nbuf_obj o;
+			Entry_raw_coordinates(&o, entry);
+			coord = (const float *) nbuf_obj_base(&o);
+			for (j = 0; j < 3; j++)
+				sum += nbuf_f32(&coord[j]) == vec[j];
+#else
+			for (j = 0; j < 3; j++)
+				sum += Entry_coordinates(entry, j) == vec[j];
+#endif
+		}
+		if (i % 2 == 0) {
+			Entry_msg(entry, &len);
+			assert(len == strlen("100 bottles on the wall"));
+			sum += len;
+		}
+		nbuf_next(NBUF_OBJ(entry));
+	}
+	return sum;
+}
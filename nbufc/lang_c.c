@@ -18,6 +18,16 @@ struct ctx {
 	struct nbuf_buf strbuf;
 	nbuf_Schema schema;
 	char *prefix;  /* pre-computed package prefix */
+	/* If the current field is a union member: */
+	unsigned tag_offset, tag;
+	/* If the current field is a fixed array: */
+	unsigned count;
+	/* If the current field is a bitfield or bitset: */
+	unsigned bits, shift;
+	/* Encoding of a repeated integer field */
+	nbuf_Encoding encoding;
+	/* If the current field is a keyed repeated message: */
+	const struct nbuf_key *key;
 };
 
 char *
@@ -125,6 +135,21 @@ static void out_ptr_accessor(struct ctx *ctx,
 {
 	FILE *f = ctx->f;
 
+	if (ctx->tag) {
+		fprintf(f, "static inline size_t\n");
+		fprintf(f, "%s%s_raw_%s(struct nbuf_obj *o, %s%s msg)\n{\n"
+			"\treturn nbuf_obj_union_p(o, NBUF_OBJ(msg), %u, %u, %u);\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+			offset, ctx->tag_offset, ctx->tag);
+		fprintf(f, "static inline size_t\n");
+		fprintf(f, "%s%s_set_raw_%s(%s%s msg, const struct nbuf_obj *o)\n{\n"
+			"\treturn nbuf_obj_set_union_p(NBUF_OBJ(msg), %u, %u, %u, o);\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+			offset, ctx->tag_offset, ctx->tag);
+		return;
+	}
 	fprintf(f, "static inline size_t\n");
 	fprintf(f, "%s%s_raw_%s(struct nbuf_obj *o, %s%s msg)\n{\n"
 		"\treturn nbuf_obj_p(o, NBUF_OBJ(msg), %u);\n"
@@ -137,6 +162,33 @@ static void out_ptr_accessor(struct ctx *ctx,
 		ctx->prefix, msg_name, fname, ctx->prefix, msg_name, offset);
 }
 
+static void out_union(struct ctx *ctx, nbuf_MsgDef mdef,
+	nbuf_UnionDef udef, unsigned union_id)
+{
+	FILE *f = ctx->f;
+	const char *msg_name = nbuf_MsgDef_name(mdef, NULL);
+	const char *name = nbuf_UnionDef_name(udef, NULL);
+	nbuf_FieldDef fdef;
+	size_t n;
+
+	fprintf(f, "typedef enum {\n");
+	fprintf(f, "\t%s%s_%s_NONE = 0,\n", ctx->prefix, msg_name, name);
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--; nbuf_next(NBUF_OBJ(fdef))) {
+		if (nbuf_FieldDef_union_id(fdef) != union_id)
+			continue;
+		fprintf(f, "\t%s%s_%s_%s = %u,\n", ctx->prefix, msg_name, name,
+			nbuf_FieldDef_name(fdef, NULL), nbuf_FieldDef_tag(fdef));
+	}
+	fprintf(f, "} %s%s_%s_case;\n\n", ctx->prefix, msg_name, name);
+
+	fprintf(f, "static inline %s%s_%s_case\n", ctx->prefix, msg_name, name);
+	fprintf(f, "%s%s_%s_which(%s%s msg)\n{\n"
+		"\treturn (%s%s_%s_case) nbuf_obj_union_tag(NBUF_OBJ(msg), %u);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, name, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, name, nbuf_UnionDef_offset(udef));
+}
+
 static void out_size(struct ctx *ctx,
 	const char *msg_name, const char *fname)
 {
@@ -151,6 +203,27 @@ static void out_size(struct ctx *ctx,
 		ctx->prefix, msg_name, fname);
 }
 
+/* Begins and ends appending to a repeated field; see nbuf_append. */
+static void out_appender(struct ctx *ctx, const char *msg_name, const char *fname,
+	unsigned ssize, unsigned psize)
+{
+	FILE *f = ctx->f;
+
+	fprintf(f, "static inline void\n");
+	fprintf(f, "%s%s_begin_%s(struct nbuf_appender *ap, %s%s msg)\n{\n"
+		"\tnbuf_appender_init(ap, NBUF_OBJ(msg)->buf, %u, %u);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name, ssize, psize);
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_end_%s(%s%s msg, struct nbuf_appender *ap)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\tsize_t n = nbuf_appender_finish(ap, &o);\n"
+		"\treturn (n && !%s%s_set_raw_%s(msg, &o)) ? 0 : n;\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname);
+}
+
 static const char *get_prefix(struct ctx *ctx, const struct nbuf_obj *typedesc)
 {
 	nbuf_Schema schema;
@@ -171,6 +244,114 @@ static const char *get_prefix(struct ctx *ctx, const struct nbuf_obj *typedesc)
 	return ctx->strbuf.base;
 }
 
+static void out_bitfield(struct ctx *ctx, const char *msg_name, const char *fname,
+	int repeated, unsigned offset,
+	const char *typenam_prefix, const char *typenam)
+{
+	FILE *f = ctx->f;
+
+	if (!repeated) {
+		fprintf(f, "static inline %s%s\n", typenam_prefix, typenam);
+		fprintf(f, "%s%s_%s(%s%s msg)\n{\n"
+			"\tconst void *p = nbuf_obj_s(NBUF_OBJ(msg), %u, 1);\n"
+			"\treturn (%s%s) (p ? nbuf_get_bits(p, %u, %u) : 0);\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+			offset, typenam_prefix, typenam, ctx->shift, ctx->bits);
+		fprintf(f, "static inline void *\n");
+		fprintf(f, "%s%s_set_%s(%s%s msg, %s%s val)\n{\n"
+			"\tvoid *p = nbuf_obj_s(NBUF_OBJ(msg), %u, 1);\n"
+			"\tif (p) nbuf_set_bits(p, %u, %u, (unsigned) val);\n"
+			"\treturn p;\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+			typenam_prefix, typenam, offset, ctx->shift, ctx->bits);
+		return;
+	}
+
+	// Bitset.
+	out_ptr_accessor(ctx, msg_name, fname, offset);
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_%s_size(%s%s msg)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\treturn nbuf_bitset_size(&o, %s%s_raw_%s(&o, msg));\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname);
+	fprintf(f, "static inline bool\n");
+	fprintf(f, "%s%s_%s(%s%s msg, size_t i)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\tsize_t n = nbuf_bitset_size(&o, %s%s_raw_%s(&o, msg));\n"
+		"\treturn i < n && nbuf_bitset_get(&o, i);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname);
+	fprintf(f, "static inline void *\n");
+	fprintf(f, "%s%s_set_%s(%s%s msg, size_t i, bool val)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\tif (i >= nbuf_bitset_size(&o, %s%s_raw_%s(&o, msg)))\n"
+		"\t\treturn NULL;\n"
+		"\tnbuf_bitset_set(&o, i, val);\n"
+		"\treturn (char *) nbuf_obj_base(&o) + i / 8;\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname);
+	fprintf(f, "static inline void *\n");
+	fprintf(f, "%s%s_alloc_%s(%s%s msg, size_t n)\n{\n"
+		"\tstruct nbuf_obj o = {NBUF_OBJ(msg)->buf};\n"
+		"\tif (NBUF_OBJ(msg)->psize <= %u || !nbuf_alloc_bitset(&o, n) ||\n"
+		"\t\t\t!%s%s_set_raw_%s(msg, &o))\n"
+		"\t\treturn NULL;\n"
+		"\treturn nbuf_obj_base(&o);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		offset, ctx->prefix, msg_name, fname);
+}
+
+static void out_packed(struct ctx *ctx, const char *msg_name, const char *fname,
+	int is_signed, unsigned offset, const char *typenam)
+{
+	FILE *f = ctx->f;
+	const char *flags;
+
+	if (ctx->encoding == nbuf_Encoding_DELTA)
+		flags = is_signed ? "NBUF_PACK_SIGNED|NBUF_PACK_DELTA" :
+			"NBUF_PACK_DELTA";
+	else
+		flags = is_signed ? "NBUF_PACK_SIGNED" : "0";
+
+	out_ptr_accessor(ctx, msg_name, fname, offset);
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_%s_size(%s%s msg)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\treturn nbuf_packed_size(&o, %s%s_raw_%s(&o, msg));\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname);
+
+	// Bulk getter.
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_%s(%s%s msg, %s *dst, size_t n)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\tsize_t len = %s%s_raw_%s(&o, msg);\n"
+		"\treturn nbuf_unpack(dst, n, sizeof *dst, %s, &o, len);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name, typenam,
+		ctx->prefix, msg_name, fname, flags);
+
+	// Bulk setter.
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_set_%s(%s%s msg, const %s *src, size_t n)\n{\n"
+		"\tstruct nbuf_obj o = {NBUF_OBJ(msg)->buf};\n"
+		"\tif (NBUF_OBJ(msg)->psize <= %u ||\n"
+		"\t\t\t!nbuf_alloc_packed(&o, src, n, sizeof *src, %s))\n"
+		"\t\treturn 0;\n"
+		"\treturn %s%s_set_raw_%s(msg, &o);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name, typenam,
+		offset, flags, ctx->prefix, msg_name, fname);
+}
+
 static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *fname,
 	nbuf_Kind kind, unsigned offset, const struct nbuf_obj *typedesc)
 {
@@ -179,6 +360,7 @@ static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *
 	const char *typenam_prefix = "";
 	char qbuf[16];
 	int repeated = nbuf_is_repeated(kind);
+	int fixed = ctx->count > 0;
 	unsigned sz = typedesc->ssize;
 
 	ctx->strbuf.len = 0;
@@ -205,6 +387,16 @@ static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *
 		break;
 	}
 
+	if (ctx->bits) {
+		out_bitfield(ctx, msg_name, fname, repeated, offset,
+			typenam_prefix, typenam);
+		return;
+	}
+	if (ctx->encoding != nbuf_Encoding_FIXED) {
+		out_packed(ctx, msg_name, fname, kind == nbuf_Kind_SINT,
+			offset, typenam);
+		return;
+	}
 	if (repeated) {
 		// Allocator.
 		out_ptr_accessor(ctx, msg_name, fname, offset);
@@ -218,18 +410,47 @@ static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *
 			"\t\treturn NULL;\n"
 			"\treturn nbuf_obj_base(&o);\n"
 			"}\n\n", sz, offset, ctx->prefix, msg_name, fname);
+
+		// Appender.
+		out_appender(ctx, msg_name, fname, sz, 0);
+		fprintf(f, "static inline void *\n");
+		fprintf(f, "%s%s_add_%s(struct nbuf_appender *ap, %s%s val)\n{\n"
+			"\tstruct nbuf_obj o;\n"
+			"\tvoid *p;\n"
+			"\tif (!nbuf_append(ap, &o))\n"
+			"\t\treturn NULL;\n"
+			"\tp = nbuf_obj_base(&o);\n"
+			"\tnbuf_set_%c%u(p, %sval);\n"
+			"\treturn p;\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, typenam_prefix, typenam,
+			*qbuf, sz * 8,
+			(kind == nbuf_Kind_BOOL) ? "!!" :
+			(kind == nbuf_Kind_ENUM) ? "(int16_t) " : "");
+	} else if (fixed) {
+		fprintf(f, "static inline size_t\n");
+		fprintf(f, "%s%s_%s_size(%s%s msg)\n{\n"
+			"\t(void) msg;\n"
+			"\treturn %u;\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+			ctx->count);
 	}
 
 	// Getter.
 	fprintf(f, "static inline %s%s\n", typenam_prefix, typenam);
 	fprintf(f, "%s%s_%s(%s%s msg%s)\n{\n",
 		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
-		repeated ? ", size_t i" : "");
+		(repeated || fixed) ? ", size_t i" : "");
 	if (repeated) {
 		fprintf(f, "\tstruct nbuf_obj o;\n"
 			"\tconst void *p = (i >= %s%s_raw_%s(&o, msg) ?\n"
 			"\t\tNULL : (nbuf_advance(&o, i), nbuf_obj_base(&o)));\n",
 			ctx->prefix, msg_name, fname);
+	} else if (fixed) {
+		fprintf(f, "\tconst void *p = (i >= %u) ? NULL :\n"
+			"\t\tnbuf_obj_s(NBUF_OBJ(msg), %u + i * %u, %u);\n",
+			ctx->count, offset, sz, sz);
 	} else {
 		fprintf(f, "\tconst void *p = nbuf_obj_s(NBUF_OBJ(msg), %u, %u);\n",
 			offset, sz);
@@ -241,12 +462,16 @@ static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *
 	fprintf(f, "static inline void *\n");
 	fprintf(f, "%s%s_set_%s(%s%s msg%s, %s%s val)\n{\n",
 		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
-		repeated ? ", size_t i" : "", typenam_prefix, typenam);
+		(repeated || fixed) ? ", size_t i" : "", typenam_prefix, typenam);
 	if (repeated) {
 		fprintf(f, "\tstruct nbuf_obj o;\n"
 			"\tvoid *p = (i >= %s%s_raw_%s(&o, msg) ?\n"
 			"\t\tNULL : (nbuf_advance(&o, i), nbuf_obj_base(&o)));\n",
 			ctx->prefix, msg_name, fname);
+	} else if (fixed) {
+		fprintf(f, "\tvoid *p = (i >= %u) ? NULL :\n"
+			"\t\tnbuf_obj_s(NBUF_OBJ(msg), %u + i * %u, %u);\n",
+			ctx->count, offset, sz, sz);
 	} else {
 		fprintf(f, "\tvoid *p = nbuf_obj_s(NBUF_OBJ(msg), %u, %u);\n",
 			offset, sz);
@@ -258,6 +483,84 @@ static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *
 	fprintf(f, "\treturn p;\n}\n\n");
 }
 
+static const char *key_flags(const struct nbuf_key *key)
+{
+	switch (key->flags) {
+	case NBUF_KEY_SIGNED:
+		return "NBUF_KEY_SIGNED";
+	case NBUF_KEY_STRING:
+		return "NBUF_KEY_STRING";
+	default:
+		return "0";
+	}
+}
+
+static void out_key(struct ctx *ctx, const char *msg_name, const char *fname,
+	unsigned offset, const char *field_prefix, const char *field_typenam)
+{
+	FILE *f = ctx->f;
+	const struct nbuf_key *key = ctx->key;
+	const char *kname = nbuf_FieldDef_name(key->fdef, NULL);
+	int is_str = (key->flags & NBUF_KEY_STRING) != 0;
+
+	// Sorter.
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_sort_%s(%s%s msg)\n{\n"
+		"\tstruct nbuf_obj o;\n"
+		"\tsize_t n = %s%s_raw_%s(&o, msg);\n"
+		"\treturn nbuf_sort_by_key(&o, n, %u, %u, %s);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname,
+		key->offset, key->width, key_flags(key));
+
+	// Lookup by key; the array must be sorted.
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_find_%s_by_%s(%s%s *field, %s%s msg, %s)\n{\n",
+		ctx->prefix, msg_name, fname, kname, field_prefix, field_typenam,
+		ctx->prefix, msg_name,
+		is_str ? "const char *key, size_t len" :
+		(key->flags & NBUF_KEY_SIGNED) ? "int64_t key" : "uint64_t key");
+	fprintf(f, "\tstruct nbuf_obj *o = (struct nbuf_obj *) field;\n"
+		"\tsize_t n = %s%s_raw_%s(o, msg);\n",
+		ctx->prefix, msg_name, fname);
+	if (is_str)
+		fprintf(f, "\treturn nbuf_find_str_key(o, n, %u, key, len);\n",
+			key->offset);
+	else
+		fprintf(f, "\treturn nbuf_find_key(o, n, %u, %u, %s, "
+			"(uint64_t) key);\n",
+			key->offset, key->width, key_flags(key));
+	fprintf(f, "}\n\n");
+
+	if (ctx->encoding != nbuf_Encoding_HASHED)
+		return;
+
+	// Hash index builder.
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_index_%s(%s%s msg)\n{\n"
+		"\tstruct nbuf_obj o, idx;\n"
+		"\tsize_t n = %s%s_raw_%s(&o, msg);\n"
+		"\treturn nbuf_alloc_hash_index(&idx, &o, n, %u) &&\n"
+		"\t\tnbuf_obj_set_p(NBUF_OBJ(msg), %u, &idx);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, ctx->prefix, msg_name,
+		ctx->prefix, msg_name, fname, key->offset, offset + 1);
+
+	// Lookup by the hash index.
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_lookup_%s_by_%s(%s%s *field, %s%s msg, "
+		"const char *key, size_t len)\n{\n",
+		ctx->prefix, msg_name, fname, kname, field_prefix, field_typenam,
+		ctx->prefix, msg_name);
+	fprintf(f, "\tstruct nbuf_obj *o = (struct nbuf_obj *) field, idx;\n"
+		"\tsize_t n = %s%s_raw_%s(o, msg);\n"
+		"\tsize_t m = nbuf_obj_p(&idx, NBUF_OBJ(msg), %u);\n"
+		"\treturn nbuf_find_hashed(o, n, %u, &idx, m, key, len);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, offset + 1, key->offset);
+}
+
 static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fname,
 	nbuf_Kind kind, unsigned offset, nbuf_MsgDef mdef)
 {
@@ -265,9 +568,22 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 	int repeated = nbuf_is_repeated(kind);
 	const char *field_prefix, *field_typenam;
 
+	ctx->strbuf.len = 0;
 	field_typenam = nbuf_MsgDef_name(mdef, NULL);
 	field_prefix = get_prefix(ctx, NBUF_OBJ(mdef));
 
+	if (!repeated && nbuf_MsgDef_is_struct(mdef)) {
+		// Inline struct: a view into the scalar part.
+		fprintf(f, "static inline size_t\n");
+		fprintf(f, "%s%s_%s(%s%s *field, %s%s msg)\n{\n"
+			"\treturn nbuf_obj_inline((struct nbuf_obj *) field, "
+			"NBUF_OBJ(msg), %u, %u);\n"
+			"}\n\n",
+			ctx->prefix, msg_name, fname, field_prefix, field_typenam,
+			ctx->prefix, msg_name, offset, nbuf_MsgDef_ssize(mdef));
+		return;
+	}
+
 	out_ptr_accessor(ctx, msg_name, fname, offset);
 
 	// Getter.
@@ -288,6 +604,9 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 	if (repeated)
 		out_size(ctx, msg_name, fname);
 
+	if (ctx->key)
+		out_key(ctx, msg_name, fname, offset, field_prefix, field_typenam);
+
 	// It's not possible to set indiviual elements if repeated.
 	// Leave only set_raw_*.
 
@@ -301,6 +620,18 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 		"}\n\n",
 		field_prefix, repeated ? "multi_" : "", field_typenam,
 		repeated ? ", n" : "", ctx->prefix, msg_name, fname);
+
+	if (!repeated)
+		return;
+
+	// Appender.
+	out_appender(ctx, msg_name, fname, nbuf_MsgDef_ssize(mdef),
+		nbuf_MsgDef_psize(mdef));
+	fprintf(f, "static inline size_t\n");
+	fprintf(f, "%s%s_add_%s(%s%s *field, struct nbuf_appender *ap)\n{\n"
+		"\treturn nbuf_append(ap, (struct nbuf_obj *) field);\n"
+		"}\n\n",
+		ctx->prefix, msg_name, fname, field_prefix, field_typenam);
 }
 
 static void out_str_field(struct ctx *ctx, const char *msg_name, const char *fname,
@@ -361,6 +692,20 @@ static void out_str_field(struct ctx *ctx, const char *msg_name, const char *fna
 			"\t\treturn 0;\n"
 			"\treturn %s%s_set_raw_%s(msg, &o);\n"
 			"}\n\n", ctx->prefix, msg_name, fname);
+
+		// Appender.
+		out_appender(ctx, msg_name, fname, 0, 1);
+		fprintf(f, "static inline char *\n");
+		fprintf(f, "%s%s_add_%s(struct nbuf_appender *ap, "
+			"const char *str, size_t len)\n{\n"
+			"\tstruct nbuf_obj o = {ap->arr.buf}, oo;\n"
+			"\tchar *p;\n"
+			"\tif (!nbuf_append(ap, &oo) ||\n"
+			"\t\t\t!(p = nbuf_alloc_str(&o, str, len)) ||\n"
+			"\t\t\t!nbuf_obj_set_p(&oo, 0, &o))\n"
+			"\t\treturn NULL;\n"
+			"\treturn p;\n"
+			"}\n\n", ctx->prefix, msg_name, fname);
 	}
 }
 
@@ -368,9 +713,15 @@ static void out_accessors(struct ctx *ctx, nbuf_MsgDef mdef)
 {
 	const char *name;
 	nbuf_FieldDef fdef;
+	nbuf_UnionDef udef;
 	size_t n;
+	unsigned i;
 
 	name = nbuf_MsgDef_name(mdef, NULL);
+	for (n = nbuf_MsgDef_unions(&udef, mdef, 0), i = 1; n--; i++) {
+		out_union(ctx, mdef, udef, i);
+		nbuf_next(NBUF_OBJ(udef));
+	}
 	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--; nbuf_next(NBUF_OBJ(fdef))) {
 		union {
 			struct nbuf_obj o;
@@ -381,7 +732,18 @@ static void out_accessors(struct ctx *ctx, nbuf_MsgDef mdef)
 		nbuf_Kind base_kind = nbuf_base_kind(kind);
 		const char *fname = nbuf_FieldDef_name(fdef, NULL);
 		unsigned offset = nbuf_FieldDef_offset(fdef);
+		struct nbuf_key key;
 
+		ctx->tag = ctx->tag_offset = 0;
+		ctx->count = nbuf_FieldDef_count(fdef);
+		ctx->bits = nbuf_FieldDef_bits(fdef);
+		ctx->shift = nbuf_FieldDef_shift(fdef);
+		ctx->encoding = nbuf_FieldDef_encoding(fdef);
+		ctx->key = nbuf_lookup_key(&key, fdef) ? &key : NULL;
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			ctx->tag = nbuf_FieldDef_tag(fdef);
+			ctx->tag_offset = nbuf_UnionDef_offset(udef);
+		}
 		switch (base_kind) {
 		case nbuf_Kind_BOOL:
 		case nbuf_Kind_UINT:
@@ -424,6 +786,325 @@ static void out_inc(struct ctx *ctx)
 
 #define SCHEMA_FILE_PREFIX "nbuf_schema_file_"
 
+/* Deep equality and hashing
+ *
+ * Each message type gets code that reads it the way nbuf_equal and
+ * nbuf_hash do, with what they look up in the schema known here: the mask
+ * of its scalar part, and how to compare each pointer field, calling the
+ * functions of the type of a sub-message.  The results are the same, so
+ * hashes from either can be mixed.
+ */
+
+/* Writes the mask of the scalar part of mdef as a static array, unless its
+ * fields use all of its bits.  Returns whether it did.
+ */
+static int out_mask(struct ctx *ctx, nbuf_MsgDef mdef, const char *name,
+	const char *indent)
+{
+	size_t ssize = nbuf_MsgDef_ssize(mdef), i;
+	struct nbuf_buf buf;
+	unsigned char *m;
+	int dense = 1;
+
+	nbuf_init_ex(&buf, ssize);
+	if (!(m = (unsigned char *) nbuf_alloc(&buf, ssize))) {
+		nbuf_clear(&buf);
+		return 0;
+	}
+	nbuf_scalar_mask(m, mdef);
+	for (i = 0; i < ssize; i++)
+		if (m[i] != 0xff)
+			dense = 0;
+	if (!dense) {
+		fprintf(ctx->f, "%sstatic const unsigned char %s[%zu] = {",
+			indent, name, ssize);
+		for (i = 0; i < ssize; i++) {
+			if (i % 8 == 0)
+				fprintf(ctx->f, "\n%s\t", indent);
+			fprintf(ctx->f, "0x%02x,%s", m[i], i % 8 == 7 ? "" : " ");
+		}
+		fprintf(ctx->f, "\n%s};\n", indent);
+	}
+	nbuf_clear(&buf);
+	return !dense;
+}
+
+/* A pointer field, as nbuf_equal and nbuf_hash read it */
+enum eq_kind {
+	EQ_NONE,
+	EQ_STR,
+	EQ_STR_ARR,
+	EQ_BITSET,
+	EQ_PACKED,
+	EQ_SCALAR_ARR,
+	EQ_MSG,
+	EQ_MSG_ARR,
+};
+
+static enum eq_kind get_eq_kind(nbuf_FieldDef fdef, nbuf_MsgDef *type,
+	unsigned *size)
+{
+	nbuf_Encoding enc = nbuf_FieldDef_encoding(fdef);
+	nbuf_Kind kind = nbuf_get_field_type(NBUF_OBJ(*type), fdef);
+
+	if (!nbuf_is_repeated(kind)) {
+		if (kind == nbuf_Kind_STR)
+			return EQ_STR;
+		if (kind == nbuf_Kind_MSG && !nbuf_MsgDef_is_struct(*type))
+			return EQ_MSG;
+		return EQ_NONE;
+	}
+	if (nbuf_FieldDef_bits(fdef))
+		return EQ_BITSET;
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA)
+		return EQ_PACKED;
+	switch (nbuf_base_kind(kind)) {
+	case nbuf_Kind_STR:
+		return EQ_STR_ARR;
+	case nbuf_Kind_MSG:
+		return EQ_MSG_ARR;
+	case nbuf_Kind_ENUM:
+		*size = 2;
+		return EQ_SCALAR_ARR;
+	default:
+		*size = NBUF_OBJ(*type)->ssize;
+		return EQ_SCALAR_ARR;
+	}
+}
+
+static const char *const eq_helpers[] = {
+	NULL, "str", "str_arr", "bitset", "packed", "scalar_arr",
+};
+
+/* Sets ctx->tag and ctx->tag_offset if fdef is a union member, or clears
+ * ctx->tag.
+ */
+static void lookup_member(struct ctx *ctx, nbuf_MsgDef mdef, nbuf_FieldDef fdef)
+{
+	nbuf_UnionDef udef;
+
+	ctx->tag = ctx->tag_offset = 0;
+	if (nbuf_lookup_union(&udef, mdef, fdef)) {
+		ctx->tag = nbuf_FieldDef_tag(fdef);
+		ctx->tag_offset = nbuf_UnionDef_offset(udef);
+	}
+}
+
+/* Begins the code for a field of obj, which is skipped unless it is the
+ * union member that is set.
+ */
+static void out_field_block(struct ctx *ctx, const char *obj)
+{
+	if (ctx->tag)
+		fprintf(ctx->f, "\tif (nbuf_obj_union_tag(%s, %u) == %u) {\n",
+			obj, ctx->tag_offset, ctx->tag);
+	else
+		fprintf(ctx->f, "\t{\n");
+}
+
+static void out_equal_msg(struct ctx *ctx, nbuf_MsgDef mdef)
+{
+	FILE *f = ctx->f;
+	const char *name = nbuf_MsgDef_name(mdef, NULL);
+	nbuf_FieldDef fdef;
+	size_t n;
+	int has_mask;
+
+	fprintf(f, "static inline bool\n"
+		"%sequal_%s_(%s%s a, %s%s b, int depth)\n{\n",
+		ctx->prefix, name, ctx->prefix, name, ctx->prefix, name);
+	has_mask = out_mask(ctx, mdef, "mask", "\t");
+	fprintf(f, "\tconst struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);\n"
+		"\n\tif (nbuf_obj_is(x, y))\n\t\treturn true;\n"
+		"\tif (++depth > NBUF_MAX_DEPTH");
+	if (nbuf_MsgDef_ssize(mdef) > 0)
+		fprintf(f, " ||\n\t\t!nbuf_same_scalars(x, y, %s, %u)",
+			has_mask ? "mask" : "NULL", nbuf_MsgDef_ssize(mdef));
+	fprintf(f, ")\n\t\treturn false;\n");
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--; nbuf_next(NBUF_OBJ(fdef))) {
+		const char *type_prefix, *type_name;
+		unsigned index = nbuf_FieldDef_offset(fdef), size = 0;
+		nbuf_MsgDef type;
+		enum eq_kind kind = get_eq_kind(fdef, &type, &size);
+
+		if (kind == EQ_NONE)
+			continue;
+		lookup_member(ctx, mdef, fdef);
+		if (kind != EQ_MSG && kind != EQ_MSG_ARR) {
+			fprintf(f, "\tif (");
+			if (ctx->tag)
+				fprintf(f, "nbuf_obj_union_tag(x, %u) == %u &&\n\t\t",
+					ctx->tag_offset, ctx->tag);
+			fprintf(f, "!nbuf_same_%s_field(x, y, %u", eq_helpers[kind],
+				index);
+			if (kind == EQ_SCALAR_ARR)
+				fprintf(f, ", %u", size);
+			fprintf(f, "))\n\t\treturn false;\n");
+			continue;
+		}
+		ctx->strbuf.len = 0;
+		type_name = nbuf_MsgDef_name(type, NULL);
+		type_prefix = get_prefix(ctx, NBUF_OBJ(type));
+		out_field_block(ctx, "x");
+		fprintf(f, "\t\t%s%s u, v;\n", type_prefix, type_name);
+		if (kind == EQ_MSG) {
+			fprintf(f, "\n\t\tif ((nbuf_obj_p(NBUF_OBJ(u), x, %u) |\n"
+				"\t\t\tnbuf_obj_p(NBUF_OBJ(v), y, %u)) &&\n"
+				"\t\t\t!%sequal_%s_(u, v, depth))\n"
+				"\t\t\treturn false;\n\t}\n",
+				index, index, type_prefix, type_name);
+			continue;
+		}
+		fprintf(f, "\t\tsize_t n = nbuf_obj_p(NBUF_OBJ(u), x, %u), i;\n\n"
+			"\t\tif (n != nbuf_obj_p(NBUF_OBJ(v), y, %u))\n"
+			"\t\t\treturn false;\n", index, index);
+		/* elements without pointers are first compared in bulk */
+		if (nbuf_MsgDef_psize(type) == 0)
+			fprintf(f, "\t\tif (nbuf_same_bytes(NBUF_OBJ(u), NBUF_OBJ(v), n))\n"
+				"\t\t\tn = 0;\n");
+		fprintf(f, "\t\tfor (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), "
+			"nbuf_next(NBUF_OBJ(v)))\n"
+			"\t\t\tif (!%sequal_%s_(u, v, depth))\n"
+			"\t\t\t\treturn false;\n\t}\n", type_prefix, type_name);
+	}
+	fprintf(f, "\treturn true;\n}\n\n");
+}
+
+static void out_hash_msg(struct ctx *ctx, nbuf_MsgDef mdef)
+{
+	FILE *f = ctx->f;
+	const char *name = nbuf_MsgDef_name(mdef, NULL);
+	nbuf_FieldDef fdef;
+	size_t n;
+	unsigned k;
+	int has_mask, elem_mask = 0, has_ptrs = nbuf_MsgDef_psize(mdef) > 0;
+
+	fprintf(f, "static inline bool\n"
+		"%shash_%s_(uint64_t *h, %s%s msg, uint64_t seed, int depth)\n{\n",
+		ctx->prefix, name, ctx->prefix, name);
+	has_mask = out_mask(ctx, mdef, "mask", "\t");
+	fprintf(f, "\tconst struct nbuf_obj *o = NBUF_OBJ(msg);\n"
+		"\tstruct nbuf_hasher s;\n"
+		"\tbool set;\n\n"
+		"\tnbuf_hasher_init(&s, seed);\n");
+	if (nbuf_MsgDef_ssize(mdef) > 0)
+		fprintf(f, "\tset = nbuf_hash_scalars(&s, o, %s, %u);\n",
+			has_mask ? "mask" : "NULL", nbuf_MsgDef_ssize(mdef));
+	else
+		fprintf(f, "\tset = false;\n");
+	if (has_ptrs)
+		fprintf(f, "\tif (++depth > NBUF_MAX_DEPTH)\n\t\tgoto out;\n");
+	else
+		fprintf(f, "\t(void) depth;\n");
+	for (k = 0, n = nbuf_MsgDef_fields(&fdef, mdef, 0); k < n;
+		k++, nbuf_next(NBUF_OBJ(fdef))) {
+		const char *type_prefix, *type_name;
+		unsigned index = nbuf_FieldDef_offset(fdef), size = 0, ssize;
+		nbuf_MsgDef type;
+		enum eq_kind kind = get_eq_kind(fdef, &type, &size);
+		char mask_name[32];
+
+		if (kind == EQ_NONE)
+			continue;
+		lookup_member(ctx, mdef, fdef);
+		if (kind != EQ_MSG && kind != EQ_MSG_ARR) {
+			fprintf(f, "\tif (");
+			if (ctx->tag)
+				fprintf(f, "nbuf_obj_union_tag(o, %u) == %u &&\n\t\t",
+					ctx->tag_offset, ctx->tag);
+			fprintf(f, "nbuf_hash_%s_field(&s, o, %u, %u",
+				eq_helpers[kind], index, k);
+			if (kind == EQ_SCALAR_ARR)
+				fprintf(f, ", %u", size);
+			fprintf(f, "))\n\t\tset = true;\n");
+			continue;
+		}
+		ctx->strbuf.len = 0;
+		type_name = nbuf_MsgDef_name(type, NULL);
+		type_prefix = get_prefix(ctx, NBUF_OBJ(type));
+		out_field_block(ctx, "o");
+		if (kind == EQ_MSG) {
+			fprintf(f, "\t\t%s%s u;\n\t\tuint64_t hu;\n\n"
+				"\t\tif (nbuf_obj_p(NBUF_OBJ(u), o, %u) &&\n"
+				"\t\t\t%shash_%s_(&hu, u, seed, depth)) {\n"
+				"\t\t\tnbuf_hasher_update_u64(&s, %u);\n"
+				"\t\t\tnbuf_hasher_update_u64(&s, hu);\n"
+				"\t\t\tset = true;\n\t\t}\n\t}\n",
+				type_prefix, type_name, index, type_prefix,
+				type_name, k);
+			continue;
+		}
+		/* Elements without pointers go into the stream by their
+		 * scalar part, and in bulk if they have no padding. */
+		ssize = nbuf_MsgDef_ssize(type);
+		snprintf(mask_name, sizeof mask_name, "mask_%u", k);
+		if (nbuf_MsgDef_psize(type) == 0)
+			elem_mask = out_mask(ctx, type, mask_name, "\t\t");
+		fprintf(f, "\t\t%s%s u;\n"
+			"\t\tsize_t n = nbuf_obj_p(NBUF_OBJ(u), o, %u), i;\n",
+			type_prefix, type_name, index);
+		if (nbuf_MsgDef_psize(type) > 0)
+			fprintf(f, "\t\tuint64_t hu;\n");
+		fprintf(f, "\n\t\tif (n) {\n"
+			"\t\t\tnbuf_hasher_update_u64(&s, %u);\n"
+			"\t\t\tnbuf_hasher_update_u64(&s, n);\n"
+			"\t\t\tset = true;\n\t\t}\n", k);
+		if (nbuf_MsgDef_psize(type) > 0) {
+			fprintf(f, "\t\tfor (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {\n"
+				"\t\t\t%shash_%s_(&hu, u, seed, depth);\n"
+				"\t\t\tnbuf_hasher_update_u64(&s, hu);\n"
+				"\t\t}\n\t}\n", type_prefix, type_name);
+			continue;
+		}
+		if (!elem_mask)
+			fprintf(f, "\t\tif (NBUF_OBJ(u)->ssize == %u && NBUF_OBJ(u)->psize == 0) {\n"
+				"\t\t\tnbuf_hasher_update(&s, nbuf_obj_base(NBUF_OBJ(u)), n * %u);\n"
+				"\t\t\tn = 0;\n\t\t}\n", ssize, ssize);
+		fprintf(f, "\t\tfor (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)))\n"
+			"\t\t\tnbuf_hash_scalars(&s, NBUF_OBJ(u), %s, %u);\n\t}\n",
+			elem_mask ? mask_name : "NULL", ssize);
+	}
+	if (has_ptrs)
+		fprintf(f, "out:\n");
+	fprintf(f, "\t*h = nbuf_hasher_digest(&s);\n\treturn set;\n}\n\n");
+}
+
+static void out_equal(struct ctx *ctx)
+{
+	nbuf_MsgDef mdef;
+	size_t n;
+
+	for (n = nbuf_Schema_messages(&mdef, ctx->schema, 0); n--; nbuf_next(NBUF_OBJ(mdef))) {
+		const char *name = nbuf_MsgDef_name(mdef, NULL);
+
+		fprintf(ctx->f, "static inline bool\n"
+			"%sequal_%s_(%s%s a, %s%s b, int depth);\n",
+			ctx->prefix, name, ctx->prefix, name, ctx->prefix, name);
+		fprintf(ctx->f, "static inline bool\n"
+			"%shash_%s_(uint64_t *h, %s%s msg, uint64_t seed, int depth);\n",
+			ctx->prefix, name, ctx->prefix, name);
+	}
+	fprintf(ctx->f, "\n");
+	for (n = nbuf_Schema_messages(&mdef, ctx->schema, 0); n--; nbuf_next(NBUF_OBJ(mdef))) {
+		const char *name = nbuf_MsgDef_name(mdef, NULL);
+
+		out_equal_msg(ctx, mdef);
+		out_hash_msg(ctx, mdef);
+		fprintf(ctx->f, "static inline bool\n"
+			"%sequal_%s(%s%s a, %s%s b)\n{\n"
+			"\treturn %sequal_%s_(a, b, 0);\n"
+			"}\n\n", ctx->prefix, name, ctx->prefix, name,
+			ctx->prefix, name, ctx->prefix, name);
+		fprintf(ctx->f, "static inline uint64_t\n"
+			"%shash_%s(%s%s msg, uint64_t seed)\n{\n"
+			"\tuint64_t h;\n\n"
+			"\t%shash_%s_(&h, msg, seed, 0);\n"
+			"\treturn h;\n"
+			"}\n\n", ctx->prefix, name, ctx->prefix, name,
+			ctx->prefix, name);
+	}
+}
+
 static void out_body(struct ctx *ctx)
 {
 	nbuf_EnumDef edef;
@@ -437,6 +1118,7 @@ static void out_body(struct ctx *ctx)
 		out_struct(ctx, mdef);
 	for (n = nbuf_Schema_messages(&mdef, ctx->schema, 0); n--; nbuf_next(NBUF_OBJ(mdef)))
 		out_accessors(ctx, mdef);
+	out_equal(ctx);
 	src_name = nbuf_Schema_src_name(ctx->schema, NULL);
 	fprintf(ctx->f, "extern const struct nbuf_schema_set " SCHEMA_FILE_PREFIX);
 	nbufc_out_path_ident(ctx->f, src_name);
@@ -523,6 +1205,7 @@ int nbufc_codegen_c(const struct nbufc_codegen_opt *opt, struct nbuf_schema_set
 	struct ctx ctx[1];
 	const char *src_name;
 	char *out_filename = NULL;
+	struct nbufc_out out;
 	const char suffix[] = ".nb.h";
 
 	memset(ctx, 0, sizeof ctx);
@@ -552,11 +1235,8 @@ int nbufc_codegen_c(const struct nbufc_codegen_opt *opt, struct nbuf_schema_set
 	memcpy(out_filename, src_name, n);
 	strcpy(out_filename + n, suffix);
 
-	ctx->f = f = fopen(out_filename, "w");
-	if (!f) {
-		perror("fopen");
+	if (!(ctx->f = f = nbufc_out_open(&out, out_filename)))
 		goto err;
-	}
 
 	/* Prologue. */
 	fprintf(f, "/* Generated by nbufc.  DO NOT EDIT!\n"
@@ -577,18 +1257,13 @@ int nbufc_codegen_c(const struct nbufc_codegen_opt *opt, struct nbuf_schema_set
 	nbufc_out_upper_ident(f, out_filename);
 	fprintf(f, "_ */\n");
 
-	rc = ferror(f);
-	fclose(f);
-	fprintf(stderr, "%s%s\n", rc ? "error generating " : "", out_filename);
+	rc = nbufc_out_close(&out);
 	if (rc) goto err;
 
 	/* .nb.c */
 	out_filename[n + sizeof suffix-2] = 'c';
-	ctx->f = f = fopen(out_filename, "w");
-	if (!f) {
-		perror("fopen");
+	if (!(ctx->f = f = nbufc_out_open(&out, out_filename)))
 		goto err;
-	}
 	/* Prologue. */
 	fprintf(f, "/* Generated by nbufc.  DO NOT EDIT!\n"
 		" * source: %s\n"
@@ -604,9 +1279,7 @@ int nbufc_codegen_c(const struct nbufc_codegen_opt *opt, struct nbuf_schema_set
 	fprintf(f, "#include \"%.*s%s\"\n"
 		"#include \"libnbuf.h\"\n\n", (int) n, src_name, suffix);
 	out_refl_c(ctx);
-	rc = ferror(f);
-	fclose(f);
-	fprintf(stderr, "%s%s\n", rc ? "error generating " : "", out_filename);
+	rc = nbufc_out_close(&out);
 err:
 	nbuf_clear(&ctx->strbuf);
 	free(out_filename);
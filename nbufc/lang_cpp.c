@@ -17,11 +17,67 @@ struct ctx {
 	struct nbuf_buf strbuf;
 	nbuf_Schema schema;
 	int pass;
+	/* If the current field is a union member: */
+	unsigned tag_offset, tag;
+	/* If the current field is a fixed array: */
+	unsigned count;
+	/* If the current field is a bitfield or bitset: */
+	unsigned bits, shift;
+	/* Encoding of a repeated integer field */
+	nbuf_Encoding encoding;
+	/* If the current field is a keyed repeated message: */
+	const struct nbuf_key *key;
 };
 
 char *nbufc_replace_dots(struct nbuf_buf *, const char *, const char *);
 void nbufc_out_upper_ident(FILE *f, const char *s);
 
+/* Prints the call that reads pointer field `index` into `o`. */
+static void
+out_get_ptr(struct ctx *ctx, unsigned index)
+{
+	if (ctx->tag)
+		fprintf(ctx->f, "::nbuf::object::union_field(&o, %u, %u, %u)",
+			index, ctx->tag_offset, ctx->tag);
+	else
+		fprintf(ctx->f, "::nbuf::object::pointer_field(&o, %u)", index);
+}
+
+/* Prints the call that sets pointer field `index` to `o`. */
+static void
+out_set_ptr(struct ctx *ctx, unsigned index)
+{
+	if (ctx->tag)
+		fprintf(ctx->f, "::nbuf::object::set_union_field(%u, %u, %u, o)",
+			index, ctx->tag_offset, ctx->tag);
+	else
+		fprintf(ctx->f, "::nbuf::object::set_pointer_field(%u, o)", index);
+}
+
+static void
+out_union_cases(struct ctx *ctx, nbuf_MsgDef mdef)
+{
+	FILE *f = ctx->f;
+	nbuf_UnionDef udef;
+	nbuf_FieldDef fdef;
+	size_t n, m;
+	unsigned union_id;
+
+	n = nbuf_MsgDef_unions(&udef, mdef, 0);
+	for (union_id = 1; n--; union_id++, nbuf_next(NBUF_OBJ(udef))) {
+		fprintf(f, "\tenum class %s_case : uint16_t {\n"
+			"\t\tNONE = 0,\n", nbuf_UnionDef_name(udef, NULL));
+		m = nbuf_MsgDef_fields(&fdef, mdef, 0);
+		for (; m--; nbuf_next(NBUF_OBJ(fdef))) {
+			if (nbuf_FieldDef_union_id(fdef) != union_id)
+				continue;
+			fprintf(f, "\t\t%s = %u,\n", nbuf_FieldDef_name(fdef, NULL),
+				nbuf_FieldDef_tag(fdef));
+		}
+		fprintf(f, "\t};\n");
+	}
+}
+
 static void
 out_enum(struct ctx *ctx, nbuf_EnumDef edef)
 {
@@ -51,9 +107,19 @@ static void out_struct(struct ctx *ctx, nbuf_MsgDef mdef)
 		fprintf(f, "struct %s {\n"
 			"\tstruct reader;\n"
 			"\tstruct writer;\n", name);
+		out_union_cases(ctx, mdef);
 		fprintf(f, "\tstatic inline reader get(::nbuf::buffer *buf, size_t offset = 0);\n");
 		fprintf(f, "\tstatic inline writer alloc(::nbuf::buffer *buf);\n");
 		fprintf(f, "\tstatic inline ::nbuf::pointer_array<writer> alloc(::nbuf::buffer *buf, size_t n);\n");
+		fprintf(f, "#if NBUF_HAVE_BUILDER\n"
+			"\tclass builder;\n"
+			"\tstatic inline builder build(::nbuf::arena &a);\n"
+			"#endif\n");
+		fprintf(f, "#if NBUF_HAVE_FIELDS\n"
+			"\tstruct fields;\n"
+			"\tstruct all_fields;\n"
+			"\tclass view;\n"
+			"#endif\n");
 		fprintf(f, "};\n\n");
 	} else if (ctx->pass == 2) {
 		ssize = nbuf_MsgDef_ssize(mdef);
@@ -99,58 +165,157 @@ static const char *full_typenam(struct ctx *ctx, const struct nbuf_obj *typedesc
 	return ctx->strbuf.base;
 }
 
-static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *fname,
-	nbuf_Kind kind, unsigned offset, const struct nbuf_obj *typedesc)
+/* Returns the C++ type of a scalar field, or NULL on error. */
+static const char *scalar_typenam(struct ctx *ctx, nbuf_Kind kind,
+	const struct nbuf_obj *typedesc)
 {
-	FILE *f = ctx->f;
-	const char *typenam = NULL;
-	int repeated = nbuf_is_repeated(kind);
+	char *p;
 
 	ctx->strbuf.len = 0;
-	kind = nbuf_base_kind(kind);
-	switch (kind) {
+	switch (nbuf_base_kind(kind)) {
 	case nbuf_Kind_BOOL:
-		typenam = "bool";
-		break;
+		return "bool";
 	case nbuf_Kind_FLT:
-		typenam = (typedesc->ssize == 4) ? "float" : "double";
-		break;
+		return (typedesc->ssize == 4) ? "float" : "double";
 	case nbuf_Kind_ENUM:
-		typenam = full_typenam(ctx, typedesc);
-		break;
-	default: {
-		int n;
-		char *p;
+		return full_typenam(ctx, typedesc);
+	default:
 		if (!(p = nbuf_alloc(&ctx->strbuf, 32)))
-			return;
-		n = sprintf(p, "%sint%u_t",
-			kind == nbuf_Kind_UINT ? "u" : "", typedesc->ssize * 8);
-		if (n == -1)
-			return;
-		typenam = p;
-		break;
-	}
+			return NULL;
+		if (sprintf(p, "%sint%u_t", nbuf_base_kind(kind) == nbuf_Kind_UINT ?
+			"u" : "", typedesc->ssize * 8) < 0)
+			return NULL;
+		return p;
 	}
+}
+
+/* Returns the flags of nbuf_alloc_packed for the current field. */
+static const char *pack_flags(struct ctx *ctx, nbuf_Kind kind)
+{
+	if (ctx->encoding == nbuf_Encoding_DELTA)
+		return (kind == nbuf_Kind_SINT) ?
+			"NBUF_PACK_SIGNED|NBUF_PACK_DELTA" : "NBUF_PACK_DELTA";
+	return (kind == nbuf_Kind_SINT) ? "NBUF_PACK_SIGNED" : "0";
+}
+
+static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *fname,
+	nbuf_Kind kind, unsigned offset, const struct nbuf_obj *typedesc)
+{
+	FILE *f = ctx->f;
+	const char *typenam;
+	int repeated = nbuf_is_repeated(kind);
+
+	typenam = scalar_typenam(ctx, kind, typedesc);
+	kind = nbuf_base_kind(kind);
 	if (!typenam) {
 		fprintf(stderr, "internal error: cannot get type name for field %s\n", fname);
 		return;
 	}
 
-	if (repeated) {
+	if (ctx->encoding != nbuf_Encoding_FIXED) {
+		const char *flags = pack_flags(ctx, kind);
+
+		if (ctx->pass == 0) {
+			// Bulk getter.
+			fprintf(f, "\tsize_t %s_size() const {\n", fname);
+			fprintf(f, "\t\t::nbuf::object o;\n"
+				"\t\tsize_t len = ");
+			out_get_ptr(ctx, offset);
+			fprintf(f, ";\n"
+				"\t\treturn ::nbuf_packed_size(&o, len);\n"
+				"\t}\n");
+			fprintf(f, "\tsize_t %s(%s *dst, size_t n) const {\n",
+				fname, typenam);
+			fprintf(f, "\t\t::nbuf::object o;\n"
+				"\t\tsize_t len = ");
+			out_get_ptr(ctx, offset);
+			fprintf(f, ";\n"
+				"\t\treturn ::nbuf_unpack(dst, n, sizeof *dst, %s, &o, len);\n"
+				"\t}\n", flags);
+		} else if (ctx->pass == 1) {
+			// Bulk setter.
+			fprintf(f, "\tsize_t set_%s(const %s *src, size_t n) const {\n",
+				fname, typenam);
+			fprintf(f, "\t\t::nbuf::object o;\n"
+				"\t\to.buf = buf;\n"
+				"\t\tif (!::nbuf_alloc_packed(&o, src, n, sizeof *src, %s))\n"
+				"\t\t\treturn 0;\n"
+				"\t\treturn ", flags);
+			out_set_ptr(ctx, offset);
+			fprintf(f, ";\n"
+				"\t}\n");
+		}
+	} else if (ctx->bits && repeated) {
+		if (ctx->pass == 0) {
+			// Getter.
+			fprintf(f, "\t::nbuf::bitset %s() const {\n", fname);
+			fprintf(f, "\t\t::nbuf::object o;\n"
+				"\t\tsize_t n = ");
+			out_get_ptr(ctx, offset);
+			fprintf(f, ";\n"
+				"\t\treturn ::nbuf::bitset(o, n);\n"
+				"\t}\n");
+		} else if (ctx->pass == 1) {
+			// Allocator.
+			fprintf(f, "\t::nbuf::bitset alloc_%s(size_t n) const {\n", fname);
+			fprintf(f, "\t\tauto o = ::nbuf::bitset::alloc(buf, n);\n"
+				"\t\tif (o) ");
+			out_set_ptr(ctx, offset);
+			fprintf(f, ";\n"
+				"\t\treturn o;\n"
+				"\t}\n");
+		}
+	} else if (ctx->bits) {
+		if (ctx->pass == 0) {
+			// Getter.
+			fprintf(f, "\t%s %s() const {\n", typenam, fname);
+			fprintf(f, "\t\treturn static_cast<%s>("
+				"::nbuf::object::bit_field(%u, %u, %u));\n\t}\n\n",
+				typenam, offset, ctx->shift, ctx->bits);
+		} else if (ctx->pass == 1) {
+			// Setter.
+			fprintf(f, "\tbool set_%s(%s v) const {\n", fname, typenam);
+			fprintf(f, "\t\treturn ::nbuf::object::set_bit_field("
+				"%u, %u, %u, static_cast<unsigned>(v));\n\t}\n\n",
+				offset, ctx->shift, ctx->bits);
+		}
+	} else if (ctx->count) {
+		unsigned sz = (kind == nbuf_Kind_ENUM) ? 2 : typedesc->ssize;
+		int pass;
+
+		// Getter, and a mutable view for the writer.
+		for (pass = 0; pass <= 1; pass++) {
+			const char *cv = pass ? "" : "const ";
+
+			if (ctx->pass != pass)
+				continue;
+			fprintf(f, "\t::nbuf::scalar_array<%s::nbuf::scalar<%s>> %s() const {\n",
+				cv, typenam, fname);
+			fprintf(f, "\t\t::nbuf::object o;\n"
+				"\t\tsize_t n = ::nbuf::object::inline_field(&o, %u, %u, %u);\n",
+				offset, sz, ctx->count);
+			fprintf(f, "\t\treturn ::nbuf::scalar_array<%s::nbuf::scalar<%s>>(o, n);\n"
+				"\t}\n", cv, typenam);
+		}
+	} else if (repeated) {
 		if (ctx->pass == 0) {
 			// Getter.
 			fprintf(f, "\t::nbuf::scalar_array<const ::nbuf::scalar<%s>> %s() const {\n", typenam, fname);
 			fprintf(f, "\t::nbuf::object o;\n"
-				"size_t n = ::nbuf::object::pointer_field(&o, %u);\n", offset);
+				"size_t n = ");
+			out_get_ptr(ctx, offset);
+			fprintf(f, ";\n");
 			fprintf(f, "\t\treturn ::nbuf::scalar_array<const ::nbuf::scalar<%s>>(o, n);\n"
 				"\t}\n", typenam);
 		} else if (ctx->pass == 1) {
 			// Allocator.
 			fprintf(f, "\t::nbuf::scalar_array<::nbuf::scalar<%s>> alloc_%s(size_t n) const {\n", typenam, fname);
 			fprintf(f, "\t\tauto o = ::nbuf::scalar_array<::nbuf::scalar<%s>>::alloc(buf, n);\n"
-				"\t\tif (o) ::nbuf::object::set_pointer_field(%u, o);\n"
+				"\t\tif (o) ", typenam);
+			out_set_ptr(ctx, offset);
+			fprintf(f, ";\n"
 				"\t\treturn o;\n"
-				"\t}\n", typenam, offset);
+				"\t}\n");
 		}
 
 	} else {
@@ -172,6 +337,137 @@ static void out_scalar_field(struct ctx *ctx, const char *msg_name, const char *
 	}
 }
 
+/* Returns the flags of nbuf_find_key for a key. */
+static const char *key_flags(const struct nbuf_key *key)
+{
+	switch (key->flags) {
+	case NBUF_KEY_SIGNED:
+		return "NBUF_KEY_SIGNED";
+	case NBUF_KEY_STRING:
+		return "NBUF_KEY_STRING";
+	default:
+		return "0";
+	}
+}
+
+/* Prints the lookup by a string key, by binary search ("find") or by the
+ * hash index ("lookup").
+ */
+static void out_find_str_key(struct ctx *ctx, const char *msg_name, const char *fname,
+	unsigned offset, const char *typenam, int hashed)
+{
+	FILE *f = ctx->f;
+	const struct nbuf_key *key = ctx->key;
+	const char *kname = nbuf_FieldDef_name(key->fdef, NULL);
+	const char *verb = hashed ? "lookup" : "find";
+
+	if (ctx->pass == 0) {
+		fprintf(f, "\tinline %s::reader %s_%s_by_%s(const char *key, size_t len) const;\n"
+			"\ttemplate <typename U>\n"
+			"\tinline %s::reader %s_%s_by_%s(const U &key) const;\n",
+			typenam, verb, fname, kname, typenam, verb, fname, kname);
+		return;
+	}
+	fprintf(f, "%s::reader %s::reader::%s_%s_by_%s(const char *key, size_t len) const {\n",
+		typenam, msg_name, verb, fname, kname);
+	fprintf(f, "\t%s::reader o;\n", typenam);
+	if (hashed)
+		fprintf(f, "\t::nbuf::object idx;\n"
+			"\tsize_t m = ::nbuf::object::pointer_field(&idx, %u);\n",
+			offset + 1);
+	fprintf(f, "\tsize_t n = ");
+	out_get_ptr(ctx, offset);
+	fprintf(f, ";\n");
+	if (hashed)
+		fprintf(f, "\tif (!::nbuf_find_hashed(&o, n, %u, &idx, m, key, len))\n",
+			key->offset);
+	else
+		fprintf(f, "\tif (!::nbuf_find_str_key(&o, n, %u, key, len))\n",
+			key->offset);
+	fprintf(f, "\t\treturn %s::reader();\n"
+		"\treturn o;\n"
+		"}\n\n", typenam);
+	fprintf(f, "template <typename U>\n"
+		"%s::reader %s::reader::%s_%s_by_%s(const U &key) const {\n"
+		"\treturn %s_%s_by_%s(key.data(), key.size());\n"
+		"}\n\n", typenam, msg_name, verb, fname, kname, verb, fname, kname);
+}
+
+/* Prints the lookup by key of a keyed field.  The element type name is
+ * computed again after the key type, as they share ctx->strbuf.
+ */
+static void out_find_key(struct ctx *ctx, const char *msg_name, const char *fname,
+	unsigned offset, nbuf_MsgDef mdef)
+{
+	FILE *f = ctx->f;
+	const struct nbuf_key *key = ctx->key;
+	const char *kname = nbuf_FieldDef_name(key->fdef, NULL);
+	struct nbuf_obj typedesc;
+	nbuf_Kind kind = nbuf_get_field_type(&typedesc, key->fdef);
+	const char *typenam, *ktypenam;
+
+	ctx->strbuf.len = 0;
+	if (!(typenam = full_typenam(ctx, NBUF_OBJ(mdef))))
+		return;
+	if (key->flags & NBUF_KEY_STRING) {
+		out_find_str_key(ctx, msg_name, fname, offset, typenam, 0);
+		if (ctx->encoding == nbuf_Encoding_HASHED)
+			out_find_str_key(ctx, msg_name, fname, offset, typenam, 1);
+		return;
+	}
+
+	if (ctx->pass == 0)
+		fprintf(f, "\tinline %s::reader ", typenam);
+	else
+		fprintf(f, "%s::reader %s::reader::", typenam, msg_name);
+	if (!(ktypenam = scalar_typenam(ctx, kind, &typedesc)))
+		return;
+	fprintf(f, "find_%s_by_%s(%s key) const", fname, kname, ktypenam);
+	if (ctx->pass == 0) {
+		fprintf(f, ";\n");
+		return;
+	}
+	fprintf(f, " {\n");
+	ctx->strbuf.len = 0;
+	if (!(typenam = full_typenam(ctx, NBUF_OBJ(mdef))))
+		return;
+	fprintf(f, "\t%s::reader o;\n"
+		"\tsize_t n = ", typenam);
+	out_get_ptr(ctx, offset);
+	fprintf(f, ";\n"
+		"\tif (!::nbuf_find_key(&o, n, %u, %u, %s, static_cast<uint64_t>(%s)))\n"
+		"\t\treturn %s::reader();\n"
+		"\treturn o;\n"
+		"}\n\n", key->offset, key->width, key_flags(key),
+		(key->flags & NBUF_KEY_SIGNED) ?
+		"static_cast<int64_t>(key)" : "key", typenam);
+}
+
+/* Prints the sorter of a keyed field, in the writer. */
+static void out_sort_key(struct ctx *ctx, const char *fname, unsigned offset)
+{
+	FILE *f = ctx->f;
+	const struct nbuf_key *key = ctx->key;
+
+	fprintf(f, "\tbool sort_%s() const {\n"
+		"\t\t::nbuf::object o;\n"
+		"\t\tsize_t n = ", fname);
+	out_get_ptr(ctx, offset);
+	fprintf(f, ";\n"
+		"\t\treturn ::nbuf_sort_by_key(&o, n, %u, %u, %s) != 0;\n"
+		"\t}\n", key->offset, key->width, key_flags(key));
+	if (ctx->encoding != nbuf_Encoding_HASHED)
+		return;
+	fprintf(f, "\tbool index_%s() const {\n"
+		"\t\t::nbuf::object o, idx;\n"
+		"\t\tsize_t n = ", fname);
+	out_get_ptr(ctx, offset);
+	fprintf(f, ";\n"
+		"\t\treturn ::nbuf_alloc_hash_index(&idx, &o, n, %u) &&\n"
+		"\t\t\t::nbuf::object::set_pointer_field(%u, idx);\n"
+		"\t}\n", key->offset, offset + 1);
+}
+
 static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fname,
 	nbuf_Kind kind, unsigned offset, nbuf_MsgDef mdef)
 {
@@ -186,6 +482,38 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 		return;
 	}
 
+	if (!repeated && nbuf_MsgDef_is_struct(mdef)) {
+		// Inline struct: a view into the scalar part.
+		int pass;
+
+		if (ctx->pass < 2) {
+			fprintf(f, "\tinline %s::%s %s() const;\n", typenam,
+				ctx->pass ? "writer" : "reader", fname);
+			return;
+		}
+		for (pass = 0; pass <= 1; pass++) {
+			const char *cls = pass ? "writer" : "reader";
+			fprintf(f, "%s::%s %s::%s::%s() const {\n",
+				typenam, cls, msg_name, cls, fname);
+			fprintf(f, "\t%s::%s o;\n", typenam, cls);
+			fprintf(f, "\t::nbuf::object::inline_field(&o, %u, %u);\n",
+				offset, nbuf_MsgDef_ssize(mdef));
+			fprintf(f, "\treturn o;\n"
+				"}\n\n");
+		}
+		return;
+	}
+
+	if (repeated && ctx->key) {
+		if (ctx->pass == 1)
+			out_sort_key(ctx, fname, offset);
+		else
+			out_find_key(ctx, msg_name, fname, offset, mdef);
+		// The element type name was overwritten.
+		ctx->strbuf.len = 0;
+		typenam = full_typenam(ctx, NBUF_OBJ(mdef));
+	}
+
 	if (ctx->pass == 0) {
 		if (repeated) {
 			fprintf(f, "\tinline ::nbuf::pointer_array<%s::reader> %s() const;\n", typenam, fname);
@@ -208,7 +536,9 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 				fprintf(f, "::nbuf::pointer_array<%s::%s> %s::%s::%s() const {\n",
 					typenam, cls, msg_name, cls, fname);
 				fprintf(f, "\t::nbuf::object o;\n");
-				fprintf(f, "\tsize_t n = ::nbuf::object::pointer_field(&o, %u);\n", offset);
+				fprintf(f, "\tsize_t n = ");
+				out_get_ptr(ctx, offset);
+				fprintf(f, ";\n");
 				fprintf(f, "\treturn ::nbuf::pointer_array<%s::%s>(o, n);\n"
 					"}\n\n",
 					typenam, cls);
@@ -217,16 +547,20 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 				typenam, msg_name, fname);
 			fprintf(f, "\tauto o = %s::alloc(buf, n);\n", typenam);
 			fprintf(f, "\tif (o)\n");
-			fprintf(f, "\t\t::nbuf::object::set_pointer_field(%u, o);\n"
+			fprintf(f, "\t\t");
+			out_set_ptr(ctx, offset);
+			fprintf(f, ";\n"
 				"\treturn o;\n"
-				"}\n\n", offset);
+				"}\n\n");
 		} else {
 			for (pass = 0; pass <= 1; pass++) {
 				const char *cls = pass ? "writer" : "reader";
 				fprintf(f, "%s::%s %s::%s::%s() const {\n",
 					typenam, cls, msg_name, cls, fname);
 				fprintf(f, "\t%s::%s o;\n", typenam, cls);
-				fprintf(f, "\t::nbuf::object::pointer_field(&o, %u);\n", offset);
+				fprintf(f, "\t");
+				out_get_ptr(ctx, offset);
+				fprintf(f, ";\n");
 				fprintf(f, "\treturn o;\n"
 					"}\n\n");
 			}
@@ -234,9 +568,11 @@ static void out_msg_field(struct ctx *ctx, const char *msg_name, const char *fna
 				typenam, msg_name, fname);
 			fprintf(f, "\tauto o = %s::alloc(buf);\n", typenam);
 			fprintf(f, "\tif (o)\n");
-			fprintf(f, "\t\t::nbuf::object::set_pointer_field(%u, o);\n"
+			fprintf(f, "\t\t");
+			out_set_ptr(ctx, offset);
+			fprintf(f, ";\n"
 				"\treturn o;\n"
-				"}\n\n", offset);
+				"}\n\n");
 		}
 	}
 }
@@ -252,21 +588,31 @@ static void out_str_field(struct ctx *ctx, const char *msg_name, const char *fna
 		// Getter.
 		fprintf(f, "\t::nbuf::%s %s() {\n", typenam, fname);
 		fprintf(f, "\t\t::nbuf::object o;\n"
-			"\t\tsize_t n = ::nbuf::object::pointer_field(&o, %u);\n", offset);
+			"\t\tsize_t n = ");
+		out_get_ptr(ctx, offset);
+		fprintf(f, ";\n");
 		fprintf(f, "\t\treturn ::nbuf::%s(o, n);\n"
 			"\t\t}\n", typenam);
 	} else if (ctx->pass == 1) {
 		if (repeated) {
 			// Allocator.
 			fprintf(f, "\t::nbuf::string_array alloc_%s(size_t n) {\n", fname);
-			fprintf(f, "\t\treturn ::nbuf::string_array::alloc(buf, n);\n"
+			fprintf(f, "\t\tauto o = ::nbuf::string_array::alloc(buf, n);\n"
+				"\t\tif (o) ");
+			out_set_ptr(ctx, offset);
+			fprintf(f, ";\n"
+				"\t\treturn o;\n"
 				"\t}\n");
 		} else {
 			// Setter.
 			fprintf(f, "\ttemplate <typename U>\n");
 			fprintf(f, "\t::nbuf::string set_%s(const U &s) {\n", fname);
-			fprintf(f, "\t\treturn ::nbuf::object::set_string_field(%u, s);\n"
-				"\t}\n", offset);
+			if (ctx->tag)
+				fprintf(f, "\t\treturn ::nbuf::object::set_union_string_field(%u, %u, %u, s);\n"
+					"\t}\n", offset, ctx->tag_offset, ctx->tag);
+			else
+				fprintf(f, "\t\treturn ::nbuf::object::set_string_field(%u, s);\n"
+					"\t}\n", offset);
 		}
 	}
 }
@@ -275,11 +621,19 @@ static void out_accessors(struct ctx *ctx, nbuf_MsgDef mdef)
 {
 	const char *name;
 	nbuf_FieldDef fdef;
+	nbuf_UnionDef udef;
 	size_t n;
 
 	name = nbuf_MsgDef_name(mdef, NULL);
 	if (ctx->pass == 0) {
 		fprintf(ctx->f, "struct %s::reader : ::nbuf::object {\n", name);
+		for (n = nbuf_MsgDef_unions(&udef, mdef, 0); n--; nbuf_next(NBUF_OBJ(udef))) {
+			const char *uname = nbuf_UnionDef_name(udef, NULL);
+
+			fprintf(ctx->f, "\t%s_case which_%s() const {\n"
+				"\t\treturn static_cast<%s_case>(::nbuf::object::union_tag(%u));\n"
+				"\t}\n", uname, uname, uname, nbuf_UnionDef_offset(udef));
+		}
 	} else if (ctx->pass == 1) {
 		fprintf(ctx->f, "struct %s::writer : %s::reader {\n", name, name);
 	}
@@ -293,7 +647,18 @@ static void out_accessors(struct ctx *ctx, nbuf_MsgDef mdef)
 		nbuf_Kind base_kind = nbuf_base_kind(kind);
 		const char *fname = nbuf_FieldDef_name(fdef, NULL);
 		unsigned offset = nbuf_FieldDef_offset(fdef);
+		struct nbuf_key key;
 
+		ctx->tag = ctx->tag_offset = 0;
+		ctx->count = nbuf_FieldDef_count(fdef);
+		ctx->bits = nbuf_FieldDef_bits(fdef);
+		ctx->shift = nbuf_FieldDef_shift(fdef);
+		ctx->encoding = nbuf_FieldDef_encoding(fdef);
+		ctx->key = nbuf_lookup_key(&key, fdef) ? &key : NULL;
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			ctx->tag = nbuf_FieldDef_tag(fdef);
+			ctx->tag_offset = nbuf_UnionDef_offset(udef);
+		}
 		switch (base_kind) {
 		case nbuf_Kind_BOOL:
 		case nbuf_Kind_UINT:
@@ -321,6 +686,269 @@ static void out_accessors(struct ctx *ctx, nbuf_MsgDef mdef)
 	}
 }
 
+/* Prints the arguments that make a builder allocation a union member. */
+static void
+out_builder_tag(struct ctx *ctx, unsigned psize)
+{
+	if (ctx->tag)
+		fprintf(ctx->f, ", %u, %u", ctx->tag_offset + psize * 4, ctx->tag);
+}
+
+/* Prints a builder field.  Scalar offsets are relative to the first pointer,
+ * so that each store is at a constant offset.
+ *
+ * Pass 3 prints the members, pass 4 the definitions that need the builders
+ * of other messages.
+ */
+static void out_builder_field(struct ctx *ctx, const char *msg_name, const char *fname,
+	nbuf_Kind kind, unsigned offset, const struct nbuf_obj *typedesc, unsigned psize)
+{
+	FILE *f = ctx->f;
+	nbuf_Kind base_kind = nbuf_base_kind(kind);
+	int repeated = nbuf_is_repeated(kind);
+	const char *typenam;
+
+	if (base_kind == nbuf_Kind_STR) {
+		if (ctx->pass != 3)
+			return;
+		if (repeated) {
+			fprintf(f, "\t::nbuf::string_appender append_%s() const {\n"
+				"\t\treturn append_strings(%u", fname, offset);
+			out_builder_tag(ctx, psize);
+			fprintf(f, ");\n\t}\n");
+			fprintf(f, "\t::nbuf::string_array_builder alloc_%s(size_t n) const {\n"
+				"\t\treturn alloc_strings(n, %u", fname, offset);
+		} else {
+			fprintf(f, "\t::nbuf::status set_%s(std::string_view s) const {\n"
+				"\t\treturn put_string(s, %u", fname, offset);
+		}
+		out_builder_tag(ctx, psize);
+		fprintf(f, ");\n\t}\n");
+		return;
+	}
+	if (base_kind == nbuf_Kind_MSG) {
+		nbuf_MsgDef mdef = * (const nbuf_MsgDef *) typedesc;
+		int is_inline = !repeated && nbuf_MsgDef_is_struct(mdef);
+
+		ctx->strbuf.len = 0;
+		if (!(typenam = full_typenam(ctx, typedesc))) {
+			fprintf(stderr, "internal error: cannot get type name for field %s\n", fname);
+			return;
+		}
+		if (ctx->pass == 3 && ctx->key) {
+			fprintf(f, "\t::nbuf::status sort_%s() const {\n"
+				"\t\treturn sort_by_key(%u, %u, %u, %s",
+				fname, offset, ctx->key->offset, ctx->key->width,
+				key_flags(ctx->key));
+			out_builder_tag(ctx, psize);
+			fprintf(f, ");\n\t}\n");
+			if (ctx->encoding == nbuf_Encoding_HASHED)
+				fprintf(f, "\t::nbuf::status index_%s() const {\n"
+					"\t\treturn hash_index(%u, %u);\n"
+					"\t}\n", fname, offset, ctx->key->offset);
+		}
+		if (ctx->pass == 3) {
+			if (is_inline)
+				fprintf(f, "\tinline %s::builder %s() const;\n", typenam, fname);
+			else if (repeated)
+				fprintf(f, "\tinline ::nbuf::array_builder<%s::builder> alloc_%s(size_t n) const;\n"
+					"\tinline ::nbuf::message_appender<%s::builder> append_%s() const;\n",
+					typenam, fname, typenam, fname);
+			else
+				fprintf(f, "\tinline %s::builder alloc_%s() const;\n", typenam, fname);
+			return;
+		}
+		if (is_inline) {
+			fprintf(f, "%s::builder %s::builder::%s() const {\n"
+				"\treturn %s::builder(a_, p_ + %u);\n"
+				"}\n\n", typenam, msg_name, fname, typenam, offset + psize * 4);
+			return;
+		}
+		if (repeated) {
+			fprintf(f, "::nbuf::message_appender<%s::builder> %s::builder::append_%s() const {\n"
+				"\treturn append_messages<%s::builder>(%u",
+				typenam, msg_name, fname, typenam, offset);
+			out_builder_tag(ctx, psize);
+			fprintf(f, ");\n}\n\n");
+			fprintf(f, "::nbuf::array_builder<%s::builder> %s::builder::alloc_%s(size_t n) const {\n"
+				"\treturn alloc_messages<%s::builder>(n, %u",
+				typenam, msg_name, fname, typenam, offset);
+		} else
+			fprintf(f, "%s::builder %s::builder::alloc_%s() const {\n"
+				"\treturn alloc_message<%s::builder>(%u",
+				typenam, msg_name, fname, typenam, offset);
+		out_builder_tag(ctx, psize);
+		fprintf(f, ");\n}\n\n");
+		return;
+	}
+
+	if (ctx->pass != 3)
+		return;
+	if (!(typenam = scalar_typenam(ctx, kind, typedesc))) {
+		fprintf(stderr, "internal error: cannot get type name for field %s\n", fname);
+		return;
+	}
+	if (ctx->encoding != nbuf_Encoding_FIXED) {
+		fprintf(f, "\t::nbuf::status set_%s(const %s *src, size_t n) const {\n"
+			"\t\treturn put_packed(src, n, %s, %u",
+			fname, typenam, pack_flags(ctx, base_kind), offset);
+		out_builder_tag(ctx, psize);
+		fprintf(f, ");\n\t}\n");
+	} else if (ctx->bits && repeated) {
+		fprintf(f, "\t::nbuf::bitset_builder alloc_%s(size_t n) const {\n"
+			"\t\treturn alloc_bitset(n, %u", fname, offset);
+		out_builder_tag(ctx, psize);
+		fprintf(f, ");\n\t}\n");
+	} else if (ctx->bits) {
+		fprintf(f, "\tvoid set_%s(%s v) const {\n"
+			"\t\tput_bits(%u, %u, %u, static_cast<unsigned>(v));\n\t}\n",
+			fname, typenam, offset + psize * 4, ctx->shift, ctx->bits);
+	} else if (ctx->count) {
+		fprintf(f, "\t::nbuf::scalar_array_builder<%s> %s() const {\n"
+			"\t\treturn ::nbuf::scalar_array_builder<%s>(p_ + %u, %u);\n\t}\n",
+			typenam, fname, typenam, offset + psize * 4, ctx->count);
+	} else if (repeated) {
+		fprintf(f, "\t::nbuf::scalar_appender<%s> append_%s() const {\n"
+			"\t\treturn append_scalars<%s>(%u", typenam, fname, typenam, offset);
+		out_builder_tag(ctx, psize);
+		fprintf(f, ");\n\t}\n");
+		fprintf(f, "\t::nbuf::scalar_array_builder<%s> alloc_%s(size_t n) const {\n"
+			"\t\treturn alloc_scalars<%s>(n, %u", typenam, fname, typenam, offset);
+		out_builder_tag(ctx, psize);
+		fprintf(f, ");\n\t}\n");
+	} else {
+		fprintf(f, "\tvoid set_%s(%s v) const {\n"
+			"\t\tput<%s>(%u, v);\n\t}\n",
+			fname, typenam, typenam, offset + psize * 4);
+	}
+}
+
+static void out_builder(struct ctx *ctx, nbuf_MsgDef mdef)
+{
+	FILE *f = ctx->f;
+	const char *name = nbuf_MsgDef_name(mdef, NULL);
+	unsigned ssize = nbuf_MsgDef_ssize(mdef);
+	unsigned psize = nbuf_MsgDef_psize(mdef);
+	nbuf_FieldDef fdef;
+	nbuf_UnionDef udef;
+	size_t n;
+
+	if (ctx->pass == 3) {
+		fprintf(f, "class %s::builder : public ::nbuf::builder_base {\n"
+			"public:\n"
+			"\tstatic constexpr size_t ssize = %u, psize = %u;\n"
+			"\tusing ::nbuf::builder_base::builder_base;\n",
+			name, ssize, psize);
+	} else {
+		fprintf(f, "%s::builder %s::build(::nbuf::arena &a) {\n"
+			"\treturn ::nbuf::build<builder>(a);\n"
+			"}\n\n", name, name);
+	}
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--; nbuf_next(NBUF_OBJ(fdef))) {
+		struct nbuf_obj typedesc;
+		nbuf_Kind kind = nbuf_get_field_type(&typedesc, fdef);
+		struct nbuf_key key;
+
+		ctx->tag = ctx->tag_offset = 0;
+		ctx->count = nbuf_FieldDef_count(fdef);
+		ctx->bits = nbuf_FieldDef_bits(fdef);
+		ctx->shift = nbuf_FieldDef_shift(fdef);
+		ctx->encoding = nbuf_FieldDef_encoding(fdef);
+		ctx->key = nbuf_lookup_key(&key, fdef) ? &key : NULL;
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			ctx->tag = nbuf_FieldDef_tag(fdef);
+			ctx->tag_offset = nbuf_UnionDef_offset(udef);
+		}
+		out_builder_field(ctx, name, nbuf_FieldDef_name(fdef, NULL), kind,
+			nbuf_FieldDef_offset(fdef), &typedesc, psize);
+	}
+	if (ctx->pass == 3)
+		fprintf(f, "};\n\n");
+}
+
+/* Prints the field descriptors and the view of a message.
+ * Pass 5 prints the descriptors, pass 6 the view.  Descriptors are named
+ * f_<field>, so that no field name clashes with their members.
+ */
+static void out_fields(struct ctx *ctx, nbuf_MsgDef mdef)
+{
+	FILE *f = ctx->f;
+	const char *name = nbuf_MsgDef_name(mdef, NULL);
+	nbuf_FieldDef fdef;
+	size_t n, i;
+
+	if (ctx->pass == 5)
+		fprintf(f, "struct %s::fields {\n", name);
+	else
+		fprintf(f, "class %s::view : public ::nbuf::basic_view<%u> {\n"
+			"public:\n"
+			"\tusing ::nbuf::basic_view<%u>::basic_view;\n",
+			name, nbuf_MsgDef_ssize(mdef), nbuf_MsgDef_ssize(mdef));
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--; nbuf_next(NBUF_OBJ(fdef))) {
+		struct nbuf_obj typedesc;
+		nbuf_Kind kind = nbuf_get_field_type(&typedesc, fdef);
+		nbuf_Kind base_kind = nbuf_base_kind(kind);
+		const char *fname = nbuf_FieldDef_name(fdef, NULL);
+		unsigned offset = nbuf_FieldDef_offset(fdef);
+		unsigned count = nbuf_FieldDef_count(fdef);
+		unsigned bits = nbuf_FieldDef_bits(fdef);
+		const char *typenam = NULL;
+
+		if (base_kind == nbuf_Kind_STR || base_kind == nbuf_Kind_MSG ||
+			(nbuf_is_repeated(kind) && !count)) {
+			nbuf_MsgDef field_mdef = * (nbuf_MsgDef *) &typedesc;
+
+			if (base_kind == nbuf_Kind_MSG && !nbuf_is_repeated(kind) &&
+				nbuf_MsgDef_is_struct(field_mdef)) {
+				if (ctx->pass == 5)
+					fprintf(f, "\tstruct f_%s : ::nbuf::inline_field_info<%u, %u> {\n",
+						fname, offset, nbuf_MsgDef_ssize(field_mdef));
+			} else if (ctx->pass == 5) {
+				fprintf(f, "\tstruct f_%s : ::nbuf::pointer_field_info<%u> {\n",
+					fname, offset);
+			}
+			if (ctx->pass == 5)
+				fprintf(f, "\t\tstatic constexpr const char *field_name() { return \"%s\"; }\n"
+					"\t};\n", fname);
+			continue;
+		}
+		if (!(typenam = scalar_typenam(ctx, kind, &typedesc))) {
+			fprintf(stderr, "internal error: cannot get type name for field %s\n", fname);
+			continue;
+		}
+		if (ctx->pass == 6) {
+			if (count)
+				fprintf(f, "\t%s %s(size_t i) const {\n"
+					"\t\treturn basic_view::get<fields::f_%s>(i);\n\t}\n",
+					typenam, fname, fname);
+			else
+				fprintf(f, "\t%s %s() const {\n"
+					"\t\treturn basic_view::get<fields::f_%s>();\n\t}\n",
+					typenam, fname, fname);
+			continue;
+		}
+		if (count)
+			fprintf(f, "\tstruct f_%s : ::nbuf::array_field_info<%s, %u, %u> {\n",
+				fname, typenam, offset, count);
+		else if (bits)
+			fprintf(f, "\tstruct f_%s : ::nbuf::bit_field_info<%s, %u, %u, %u> {\n",
+				fname, typenam, offset, nbuf_FieldDef_shift(fdef), bits);
+		else
+			fprintf(f, "\tstruct f_%s : ::nbuf::scalar_field_info<%s, %u> {\n",
+				fname, typenam, offset);
+		fprintf(f, "\t\tstatic constexpr const char *field_name() { return \"%s\"; }\n"
+			"\t};\n", fname);
+	}
+	fprintf(f, "};\n\n");
+	if (ctx->pass == 5) {
+		fprintf(f, "struct %s::all_fields : ::nbuf::field_list<", name);
+		i = 0;
+		for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--; nbuf_next(NBUF_OBJ(fdef)))
+			fprintf(f, "%sfields::f_%s", i++ ? ", " : "", nbuf_FieldDef_name(fdef, NULL));
+		fprintf(f, "> {};\n\n");
+	}
+}
+
 static void out_inc(struct ctx *ctx)
 {
 	size_t n = ctx->ss->nimports;
@@ -400,6 +1028,18 @@ static void out_body(struct ctx *ctx)
 		out_struct(ctx, mdef);
 	for (n = nbuf_Schema_messages(&mdef, ctx->schema, 0); n--; nbuf_next(NBUF_OBJ(mdef)))
 		out_accessors(ctx, mdef);
+	fprintf(ctx->f, "#if NBUF_HAVE_BUILDER\n");
+	for (ctx->pass = 3; ctx->pass <= 4; ctx->pass++) {
+		for (n = nbuf_Schema_messages(&mdef, ctx->schema, 0); n--; nbuf_next(NBUF_OBJ(mdef)))
+			out_builder(ctx, mdef);
+	}
+	fprintf(ctx->f, "#endif  // NBUF_HAVE_BUILDER\n");
+	fprintf(ctx->f, "#if NBUF_HAVE_FIELDS\n");
+	for (ctx->pass = 5; ctx->pass <= 6; ctx->pass++) {
+		for (n = nbuf_Schema_messages(&mdef, ctx->schema, 0); n--; nbuf_next(NBUF_OBJ(mdef)))
+			out_fields(ctx, mdef);
+	}
+	fprintf(ctx->f, "#endif  // NBUF_HAVE_FIELDS\n");
 	end_namespace(ctx, pkg_name);
 }
 
@@ -411,6 +1051,7 @@ int nbufc_codegen_cpp(const struct nbufc_codegen_opt *opt, struct nbuf_schema_se
 	struct ctx ctx[1];
 	const char *src_name;
 	char *out_filename = NULL;
+	struct nbufc_out out;
 	const char suffix[] = ".nb.hpp";
 
 	memset(ctx, 0, sizeof ctx);
@@ -429,11 +1070,8 @@ int nbufc_codegen_cpp(const struct nbufc_codegen_opt *opt, struct nbuf_schema_se
 	memcpy(out_filename, src_name, n);
 	strcpy(out_filename + n, suffix);
 
-	ctx->f = f = fopen(out_filename, "w");
-	if (!f) {
-		perror("fopen");
+	if (!(ctx->f = f = nbufc_out_open(&out, out_filename)))
 		goto err;
-	}
 
 	/* Prologue. */
 	fprintf(f, "// Generated by nbufc.  DO NOT EDIT!\n"
@@ -454,9 +1092,7 @@ int nbufc_codegen_cpp(const struct nbufc_codegen_opt *opt, struct nbuf_schema_se
 	nbufc_out_upper_ident(f, out_filename);
 	fprintf(f, "_\n");
 
-	rc = ferror(f);
-	fclose(f);
-	fprintf(stderr, "%s%s\n", rc ? "error generating " : "", out_filename);
+	rc = nbufc_out_close(&out);
 err:
 	nbuf_clear(&ctx->strbuf);
 	free(out_filename);
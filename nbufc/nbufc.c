@@ -1,7 +1,9 @@
+#include "config.h"
 #include "libnbuf.h"
 #include "libnbufc.h"
 #include "util.h"
 
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,32 +12,62 @@
 # include <fcntl.h>
 # include <io.h>
 #endif
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 struct ctx {
 	const char *progname;
 	struct nbuf_schema_set *ss;
+	/* Compressed input/output */
+	bool compress;
+	struct nbuf_zopt zopt;
 };
 
 static void
 usage(struct ctx *ctx, bool quit)
 {
-	fprintf(stderr, "usage: %s [options] [schema]\n", ctx->progname);
-	fprintf(stderr, "Options\n"
+	fprintf(stderr, "usage: %s [options] [schema...]\n", ctx->progname);
+	fprintf(stderr, "Schemas given together are compiled sharing their imports.\n"
+		"Options\n"
 		"  -help     show this help\n"
 		"  -I=<dir>  add directory to search path\n"
+		"  -cache=<dir>\n"
+		"            reuse schemas compiled by previous runs in dir\n"
 		"  -c_out    compile schema and generate C source files\n"
 		"  -cpp_out  compile schema and generate C++ source files\n"
+		"  -bin_out  compile schema and its imports into .nb files,\n"
+		"            which can be given as schema instead of .nbuf files\n"
+		"  -manifest=<file>\n"
+		"            also compile the schemas listed in file, one per line\n"
+		"  -j=<n>    generate the outputs of several schemas on n threads\n"
 		"  -encode=<msg_type>\n"
 		"            encode a text message into binary\n"
 		"  -decode=<msg_type>\n"
 		"            decode a binary message into text\n"
+		"  -diff=<msg_type> <old> <new>\n"
+		"            print the changes from one binary message to another\n"
 		"  -decode_raw\n"
 		"            dump a binary message in raw format "
+		"(schema is not needed)\n"
+		"  -z        with -encode/-decode/-diff, write/read compressed files\n"
+		"  -zdict=<file>\n"
+		"            use a compression dictionary with -z\n"
+		"  -train_zdict=<file> sample...\n"
+		"            train a compression dictionary from binary messages "
 		"(schema is not needed)\n");
 	if (quit)
 		exit(1);
 }
 
+/* Tells whether filename is a compiled schema (see -bin_out). */
+static bool is_compiled(const char *filename)
+{
+	size_t len = strlen(filename);
+
+	return len > 3 && strcmp(filename + len - 3, ".nb") == 0;
+}
+
 /* Removes extension (if any) from in_filename, and appends suffix.
  */
 static char *construct_out_filename(const char *in_filename, const char *suffix)
@@ -53,27 +85,28 @@ static char *construct_out_filename(const char *in_filename, const char *suffix)
 }
 
 static int
-c_out(struct ctx *ctx, const char *path)
+c_out(struct nbuf_schema_set *ss, const char *path)
 {
 	struct nbufc_codegen_opt opt;
 
 	memset(&opt, 0, sizeof opt);
-	return nbufc_codegen_c(&opt, ctx->ss);
+	return nbufc_codegen_c(&opt, ss);
 }
 
 static int
-cpp_out(struct ctx *ctx, const char *path)
+cpp_out(struct nbuf_schema_set *ss, const char *path)
 {
 	struct nbufc_codegen_opt opt;
 
 	memset(&opt, 0, sizeof opt);
-	return nbufc_codegen_cpp(&opt, ctx->ss);
+	return nbufc_codegen_cpp(&opt, ss);
 }
 
 static int
-bin_out(struct ctx *ctx, const char *path)
+save_bin(struct nbuf_schema_set *ss, const char *path)
 {
 	char *newpath;
+	int rc = 1;
 
 	newpath = construct_out_filename(path, ".nb");
 	if (!newpath) {
@@ -81,13 +114,215 @@ bin_out(struct ctx *ctx, const char *path)
 			"internal error: cannot construct output filename\n");
 		return 1;
 	}
-	if (!nbuf_save_file(&ctx->ss->buf, newpath)) {
-		fprintf(stderr, "cannot write to %s", newpath);
+	if (nbufc_save_if_changed(newpath, ss->buf.base, ss->buf.len))
+		fprintf(stderr, "cannot write to %s\n", newpath);
+	else
+		rc = 0;
+	free(newpath);
+	return rc;
+}
+
+static int
+bin_out(struct nbuf_schema_set *ss, const char *path)
+{
+	if (is_compiled(path)) {
+		fprintf(stderr, "%s is compiled already\n", path);
 		return 1;
 	}
-	fprintf(stderr, "%s\n", newpath);
-	free(newpath);
-	return 0;
+	return save_bin(ss, path);
+}
+
+enum action {
+	NONE, C_OUT, CPP_OUT, BIN_OUT, DECODE, ENCODE, DIFF,
+};
+
+/* A schema to compile, and generate output for. */
+struct job {
+	const char *path;
+	struct nbuf_schema_set *ss;
+	int rc;
+};
+
+/* Jobs are taken in order by any number of threads. */
+struct batch {
+	enum action action;
+	struct job *jobs;
+	size_t njobs, next;
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+};
+
+static void *
+run_batch(void *arg)
+{
+	struct batch *b = (struct batch *) arg;
+	struct job *job;
+
+	for (;;) {
+#if HAVE_PTHREAD_H
+		pthread_mutex_lock(&b->lock);
+#endif
+		job = (b->next < b->njobs) ? &b->jobs[b->next++] : NULL;
+#if HAVE_PTHREAD_H
+		pthread_mutex_unlock(&b->lock);
+#endif
+		if (!job)
+			break;
+		switch (b->action) {
+		case C_OUT:
+			job->rc = c_out(job->ss, job->path);
+			break;
+		case CPP_OUT:
+			job->rc = cpp_out(job->ss, job->path);
+			break;
+		case BIN_OUT:
+			job->rc = bin_out(job->ss, job->path);
+			break;
+		default:
+			fprintf(stderr, "%s: no errors found.\n", job->path);
+			job->rc = 0;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Code generation only reads the compiled schemas, so it can run on
+ * several threads.  Returns 0 if all jobs succeed.
+ */
+static int
+generate(struct batch *b, int nthreads)
+{
+	size_t i;
+	int rc = 0;
+#if HAVE_PTHREAD_H
+	pthread_t *threads = NULL;
+	int n = 0;
+
+	if (nthreads > 1 && b->njobs > 1) {
+		if ((size_t) nthreads > b->njobs)
+			nthreads = (int) b->njobs;
+		threads = (pthread_t *) calloc(nthreads, sizeof *threads);
+	}
+	pthread_mutex_init(&b->lock, NULL);
+	/* this thread takes part too */
+	while (threads && n < nthreads - 1 &&
+		pthread_create(&threads[n], NULL, run_batch, b) == 0)
+		n++;
+	run_batch(b);
+	while (n > 0)
+		pthread_join(threads[--n], NULL);
+	pthread_mutex_destroy(&b->lock);
+	free(threads);
+#else
+	(void) nthreads;
+	run_batch(b);
+#endif
+	for (i = 0; i < b->njobs; i++)
+		if (b->jobs[i].rc)
+			rc = 1;
+	return rc;
+}
+
+/* Appends the imports of ss, recursively, to the array sets,
+ * unless they are in it already.
+ */
+static bool
+collect_imports(struct nbuf_buf *sets, struct nbuf_schema_set *ss)
+{
+	size_t i, j, n;
+
+	for (i = 0; i < ss->nimports; i++) {
+		struct nbuf_schema_set *imp = ss->imports[i], *other;
+		char *p;
+
+		n = sets->len / sizeof imp;
+		for (j = 0; j < n; j++) {
+			memcpy(&other, sets->base + j * sizeof imp, sizeof imp);
+			if (other == imp)
+				break;
+		}
+		if (j < n)
+			continue;
+		if (!(p = (char *) nbuf_alloc(sets, sizeof imp)))
+			return false;
+		memcpy(p, &imp, sizeof imp);
+		if (!collect_imports(sets, imp))
+			return false;
+	}
+	return true;
+}
+
+/* nbuf_load_schema_set loads the imports of a .nb file from their own
+ * files, so -bin_out writes those too.  Jobs may share imports, so they
+ * are written here, each once, after the jobs have written theirs.
+ */
+static int
+save_imports(struct batch *b)
+{
+	struct nbuf_buf sets;
+	struct nbuf_schema_set *ss;
+	size_t i, j, n;
+	int rc = 0;
+
+	nbuf_init_ex(&sets, 0);
+	for (i = 0; i < b->njobs; i++)
+		if (!collect_imports(&sets, b->jobs[i].ss)) {
+			rc = 1;
+			goto out;
+		}
+	n = sets.len / sizeof ss;
+	for (i = 0; i < n; i++) {
+		nbuf_Schema schema;
+
+		memcpy(&ss, sets.base + i * sizeof ss, sizeof ss);
+		for (j = 0; j < b->njobs && b->jobs[j].ss != ss; j++)
+			;
+		if (j < b->njobs)
+			continue;  /* written by its job */
+		nbuf_get_Schema(&schema, &ss->buf, 0);
+		if (save_bin(ss, nbuf_Schema_src_name(schema, NULL)))
+			rc = 1;
+	}
+out:
+	nbuf_clear(&sets);
+	return rc;
+}
+
+/* Appends the schemas listed in a manifest, as '\0'-terminated strings.
+ * Blank lines and lines beginning with '#' are ignored.
+ */
+static bool
+read_manifest(struct nbuf_buf *names, const char *filename)
+{
+	struct nbuf_buf buf;
+	const char *p, *end, *eol;
+
+	if (!nbuf_load_file(&buf, filename))
+		return false;
+	for (p = buf.base, end = p + buf.len; p < end; p = eol + 1) {
+		const char *q = p;
+		char *name;
+		size_t len;
+
+		if (!(eol = (const char *) memchr(p, '\n', end - p)))
+			eol = end;
+		while (q < eol && isspace((unsigned char) *q))
+			q++;
+		for (len = eol - q; len && isspace((unsigned char) q[len-1]); len--)
+			;
+		if (len == 0 || *q == '#')
+			continue;
+		if (!(name = nbuf_alloc(names, len + 1))) {
+			nbuf_clear(&buf);
+			return false;
+		}
+		memcpy(name, q, len);
+		name[len] = '\0';
+	}
+	nbuf_clear(&buf);
+	return true;
 }
 
 static int
@@ -120,7 +355,8 @@ decode(struct ctx *ctx, const char *msg_type)
 #ifdef _WIN32
 	_setmode(_fileno(stdin), _O_BINARY);
 #endif
-	if (!nbuf_load_fp(&buf, stdin)) {
+	if (!(ctx->compress ? nbuf_load_zfp(&ctx->zopt, &buf, stdin) :
+		nbuf_load_fp(&buf, stdin))) {
 		fprintf(stderr, "error: cannot read input\n");
 		return 1;
 	}
@@ -177,7 +413,8 @@ encode(struct ctx *ctx, const char *msg_type)
 #ifdef _WIN32
 	_setmode(_fileno(stdout), _O_BINARY);
 #endif
-	if (nbuf_save_fp(&outbuf, stdout))
+	if (ctx->compress ? nbuf_save_zfp(&ctx->zopt, &outbuf, stdout) :
+		nbuf_save_fp(&outbuf, stdout))
 		rc = 0;
 err:
 	nbuf_clear(&outbuf);
@@ -187,6 +424,113 @@ err:
 	return rc;
 }
 
+static bool
+load_input(struct ctx *ctx, struct nbuf_buf *buf, const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	size_t n;
+
+	if (!f) {
+		fprintf(stderr, "error: cannot open %s\n", filename);
+		return false;
+	}
+	n = ctx->compress ? nbuf_load_zfp(&ctx->zopt, buf, f) :
+		nbuf_load_fp(buf, f);
+	fclose(f);
+	if (!n)
+		fprintf(stderr, "error: cannot read %s\n", filename);
+	return n != 0;
+}
+
+static int
+diff(struct ctx *ctx, const char *msg_type, const char *const files[2])
+{
+	nbuf_MsgDef mdef;
+	struct nbuf_print_opt opt = {
+		.f = stdout,
+		.indent = 2,
+		.loose_escape = true,
+	};
+	struct nbuf_buf bufs[2] = {{NULL}, {NULL}}, patchbuf = {NULL};
+	struct nbuf_diff_opt dopt = {
+		.outbuf = &patchbuf,
+	};
+	struct nbuf_obj o[2], patch;
+	nbuf_Schema schema;
+	nbuf_Kind kind;
+	unsigned type_id;
+	int i, rc = 1;
+
+	if (!nbuf_get_Schema(&schema, &ctx->ss->buf, 0)) {
+		fprintf(stderr, "error: cannot load schema\n");
+		return 1;
+	}
+	if (!nbuf_lookup_defined_type(schema, msg_type, &kind, &type_id) ||
+		kind != nbuf_Kind_MSG ||
+		!nbuf_Schema_messages(&mdef, schema, type_id)) {
+		fprintf(stderr, "error: '%s' is not a message type name\n", msg_type);
+		return 1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (!load_input(ctx, &bufs[i], files[i]))
+			goto err;
+		o[i].buf = &bufs[i];
+		o[i].offset = 0;
+		if (!nbuf_get_obj(&o[i])) {
+			fprintf(stderr, "error: cannot get root object of %s\n",
+				files[i]);
+			goto err;
+		}
+	}
+	if (!nbuf_init_ex(&patchbuf, 4096) ||
+		!nbuf_diff(&dopt, &patch, &o[0], &o[1], mdef))
+		goto err;
+	printf("--- %s\n+++ %s\n", files[0], files[1]);
+	if (nbuf_print_patch(&opt, &o[0], &patch, mdef))
+		rc = 0;
+err:
+	nbuf_clear(&patchbuf);
+	nbuf_clear(&bufs[0]);
+	nbuf_clear(&bufs[1]);
+	if (rc)
+		fprintf(stderr, "diff failed\n");
+	return rc;
+}
+
+#define MAX_ZDICT_SIZE (112 * 1024)
+
+static int
+train_zdict(const char *dict_out, char *samples[])
+{
+	struct nbuf_buf dict, *bufs;
+	size_t i, n;
+	int rc = 1;
+
+	for (n = 0; samples[n]; n++)
+		;
+	if (n == 0) {
+		fprintf(stderr, "missing samples\n");
+		return 1;
+	}
+	if (!(bufs = (struct nbuf_buf *) calloc(n, sizeof *bufs)))
+		return 1;
+	for (i = 0; i < n; i++)
+		if (!nbuf_load_file(&bufs[i], samples[i]))
+			goto err;
+	if (!nbuf_train_zdict(&dict, MAX_ZDICT_SIZE, bufs, n))
+		goto err;
+	if (nbuf_save_file(&dict, dict_out)) {
+		fprintf(stderr, "%s\n", dict_out);
+		rc = 0;
+	}
+	nbuf_clear(&dict);
+err:
+	for (i = 0; i < n; i++)
+		nbuf_clear(&bufs[i]);
+	free(bufs);
+	return rc;
+}
+
 #define ARG0(X, Y) if (strcmp(arg, X) == 0) { Y; }
 #define ARG1(X, Y) { \
 	size_t _len = strlen(X); \
@@ -209,37 +553,81 @@ int main(int argc, char *argv[])
 	struct ctx ctx[1];
 	const char *arg;
 	const char *msg_type = NULL;
-	enum {
-		NONE, C_OUT, CPP_OUT, BIN_OUT, DECODE, DECODE_RAW, ENCODE,
-	} action = NONE;
+	const char *diff_files[2];
+	enum action action = NONE;
+	struct nbuf_buf dictbuf = {NULL};
 	struct nbuf_buf outbuf;
+	struct nbuf_buf manifest;
 	struct nbuf_compile_opt opt = {
 		.outbuf = &outbuf,
 	};
+	struct batch batch = {NONE};
 	int rc = 1;
+	int nthreads = 1;
 	const char *search_path[MAXINCDIR+1];
 	size_t search_path_count = 0;
+	const char *name;
+	size_t i;
 
 	memset(ctx, 0, sizeof ctx);
 	nbuf_init_ex(&outbuf, 0);
+	nbuf_init_ex(&manifest, 0);
 	ctx->progname = *argv++;
 	while ((arg = *argv++)) {
 		if (*arg != '-')
 			goto end_of_opt;
 		if (*++arg == '-' && *++arg == '\0') {
-			arg = *argv;
+			if ((arg = *argv) != NULL)
+				argv++;
 			goto end_of_opt;
 		}
 		ARG0("c_out", action = C_OUT; break);
 		ARG0("cpp_out", action = CPP_OUT; break);
 		ARG0("bin_out", action = BIN_OUT; break);
 		ARG1("decode", action = DECODE; msg_type = arg; break);
-		ARG0("decode_raw", action = DECODE_RAW; goto skip_schema);
+		ARG0("decode_raw", goto decode_raw);
 		ARG1("encode", action = ENCODE; msg_type = arg; break);
+		ARG1("diff", {
+			action = DIFF;
+			msg_type = arg;
+			if (!argv[0] || !argv[1]) {
+				fprintf(stderr, "-diff needs two files\n");
+				goto show_usage;
+			}
+			diff_files[0] = *argv++;
+			diff_files[1] = *argv++;
+			break;
+		});
+		ARG0("z", ctx->compress = true; continue);
+		ARG1("zdict", {
+			nbuf_clear(&dictbuf);
+			if (!nbuf_load_file(&dictbuf, arg))
+				goto out;
+			ctx->zopt.dict = dictbuf.base;
+			ctx->zopt.dict_len = dictbuf.len;
+			continue;
+		});
+		ARG1("train_zdict", {
+			rc = train_zdict(arg, argv);
+			goto out;
+		});
+		ARG1("cache", opt.cache_dir = arg; continue);
+		ARG1("manifest", {
+			if (!read_manifest(&manifest, arg))
+				goto out;
+			continue;
+		});
+		ARG1("j", {
+			if ((nthreads = atoi(arg)) < 1) {
+				fprintf(stderr, "bad number of threads %s\n", arg);
+				goto show_usage;
+			}
+			continue;
+		});
 		ARG1("I", {
 			if (search_path_count >= MAXINCDIR) {
 				fprintf(stderr, "too many -I options\n");
-				return 1;
+				goto out;
 			}
 			search_path[search_path_count++] = arg;
 			continue;
@@ -251,51 +639,89 @@ missing_arg:
 		fprintf(stderr, "missing argument for option -%s\n", arg);
 		goto show_usage;
 	}
-	if (arg && (arg = *argv) && *arg == '-') {
+	/* an action ends the options */
+	if (arg && (arg = *argv++) && *arg == '-') {
 		fprintf(stderr, "extra option %s\n", arg);
 		goto show_usage;
 	}
 end_of_opt:
-	if (arg == NULL) {
+	/* the schemas are in argv[-1] ... and in manifest */
+	if (arg)
+		argv--;
+	else
+		argv = NULL;
+	batch.action = action;
+	for (i = 0; argv && argv[i]; i++)
+		batch.njobs++;
+	for (name = manifest.base; name < manifest.base + manifest.len;
+		name += strlen(name) + 1)
+		batch.njobs++;
+	if (batch.njobs == 0) {
 		fprintf(stderr, "missing schema\n");
 		goto show_usage;
 	}
+	if (batch.njobs > 1 &&
+		(action == DECODE || action == ENCODE || action == DIFF)) {
+		fprintf(stderr, "only one schema can be used with -%s\n",
+			(action == DECODE) ? "decode" :
+			(action == ENCODE) ? "encode" : "diff");
+		goto show_usage;
+	}
+	if (!(batch.jobs = (struct job *) calloc(batch.njobs, sizeof *batch.jobs)))
+		goto out;
+	for (i = 0; argv && argv[i]; i++)
+		batch.jobs[i].path = argv[i];
+	for (name = manifest.base; name < manifest.base + manifest.len;
+		name += strlen(name) + 1)
+		batch.jobs[i++].path = name;
+
 	search_path[search_path_count] = NULL;
 	opt.search_path = search_path;
-	ctx->ss = nbuf_compile(&opt, arg);
-	if (!ctx->ss) {
-		fprintf(stderr, "%s: compilation failed\n", arg);
-		goto out;
+	/* Schemas given together share one outbuf, so each import is
+	 * compiled once.  The outbuf is not shared by threads, so this
+	 * part is serial.
+	 */
+	for (i = 0; i < batch.njobs; i++) {
+		struct job *job = &batch.jobs[i];
+
+		if (is_compiled(job->path))
+			job->ss = nbuf_load_schema_set(&opt, job->path);
+		else
+			job->ss = nbuf_compile(&opt, job->path);
+		if (!job->ss) {
+			fprintf(stderr, "%s: compilation failed\n", job->path);
+			goto out;
+		}
 	}
-skip_schema:
 	switch (action) {
-	case C_OUT:
-		rc = c_out(ctx, arg);
-		break;
-	case CPP_OUT:
-		rc = cpp_out(ctx, arg);
-		break;
-	case BIN_OUT:
-		rc = bin_out(ctx, arg);
-		break;
-	case DECODE_RAW:
-#ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
-#endif
-		rc = nbufc_decode_raw(stdout, stdin);
-		break;
 	case DECODE:
+		ctx->ss = batch.jobs[0].ss;
 		rc = decode(ctx, msg_type);
 		break;
 	case ENCODE:
+		ctx->ss = batch.jobs[0].ss;
 		rc = encode(ctx, msg_type);
 		break;
+	case DIFF:
+		ctx->ss = batch.jobs[0].ss;
+		rc = diff(ctx, msg_type, diff_files);
+		break;
 	default:
-		fprintf(stderr, "no errors found.\n");
-		rc = 0;
+		rc = generate(&batch, nthreads);
+		if (action == BIN_OUT && !rc)
+			rc = save_imports(&batch);
 		break;
 	}
+	goto out;
+decode_raw:
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	rc = nbufc_decode_raw(stdout, stdin);
 out:
 	nbuf_free_compiled(&opt);
+	nbuf_clear(&dictbuf);
+	nbuf_clear(&manifest);
+	free(batch.jobs);
 	return rc;
 }
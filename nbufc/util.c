@@ -1,3 +1,4 @@
+#include "config.h"
 #include "nbuf.h"
 #include "util.h"
 #include "libnbufc.h"
@@ -6,6 +7,9 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 
 void nbufc_out_path_ident(FILE *f, const char *s)
 {
@@ -14,3 +18,97 @@ void nbufc_out_path_ident(FILE *f, const char *s)
 	while ((ch = *s++) != '\0')
 		isalnum(ch) ? putc(ch, f) : fprintf(f, "_%02x", ch);
 }
+
+FILE *nbufc_out_open(struct nbufc_out *out, const char *filename)
+{
+	out->filename = filename;
+	out->base = NULL;
+	out->len = 0;
+#if HAVE_OPEN_MEMSTREAM
+	out->f = open_memstream(&out->base, &out->len);
+#else
+	out->f = tmpfile();
+#endif
+	if (!out->f)
+		perror(filename);
+	return out->f;
+}
+
+int nbufc_out_close(struct nbufc_out *out)
+{
+	int rc = ferror(out->f);
+#if HAVE_OPEN_MEMSTREAM
+	if (fclose(out->f) != 0)
+		rc = 1;
+	if (!rc)
+		rc = nbufc_save_if_changed(out->filename, out->base, out->len);
+	free(out->base);
+#else
+	struct nbuf_buf buf = {NULL};
+
+	rewind(out->f);
+	if (!rc && (nbuf_load_fp(&buf, out->f) || !ferror(out->f)))
+		rc = nbufc_save_if_changed(out->filename, buf.base, buf.len);
+	nbuf_clear(&buf);
+	fclose(out->f);
+#endif
+	if (rc)
+		fprintf(stderr, "error generating %s\n", out->filename);
+	return rc;
+}
+
+/* The file is written to a temporary file, then renamed, so that readers
+ * never see it partly written.
+ */
+int nbufc_save_if_changed(const char *filename, const void *p, size_t len)
+{
+	struct nbuf_buf old = {NULL};
+	bool same = false;
+	char *tmp;
+	FILE *f;
+	int rc = 0;
+
+	if ((f = fopen(filename, "rb")) != NULL) {
+		same = nbuf_load_fp(&old, f) == len &&
+			(len == 0 || memcmp(old.base, p, len) == 0);
+		nbuf_clear(&old);
+		fclose(f);
+	}
+	if (same) {
+		fprintf(stderr, "%s (unchanged)\n", filename);
+		return 0;
+	}
+	if (!(tmp = (char *) malloc(strlen(filename) + 24))) {
+		perror(filename);
+		return 1;
+	}
+#if HAVE_UNISTD_H && !defined _WIN32
+	sprintf(tmp, "%s.%ld", filename, (long) getpid());
+#else
+	sprintf(tmp, "%s.tmp", filename);
+#endif
+	if (!(f = fopen(tmp, "wb"))) {
+		perror(tmp);
+		free(tmp);
+		return 1;
+	}
+	if (fwrite(p, 1, len, f) != len)
+		rc = 1;
+	if (fclose(f) != 0)
+		rc = 1;
+#ifdef _WIN32
+	/* rename does not replace an existing file */
+	if (!rc)
+		remove(filename);
+#endif
+	if (!rc && rename(tmp, filename) != 0) {
+		perror(filename);
+		rc = 1;
+	}
+	if (rc)
+		remove(tmp);
+	else
+		fprintf(stderr, "%s\n", filename);
+	free(tmp);
+	return rc;
+}
@@ -3,6 +3,24 @@
 
 #pragma GCC visibility push(hidden)
 void nbufc_out_path_ident(FILE *f, const char *s);
+
+/* Generated file.  The text is kept in memory, and written with one call
+ * when closed, unless the file has this content already, so that build
+ * tools do not see unchanged outputs as modified.
+ */
+struct nbufc_out {
+	FILE *f;
+	const char *filename;
+	char *base;  /* open_memstream output */
+	size_t len;
+};
+
+/* Returns the stream to print to, or NULL on failure. */
+FILE *nbufc_out_open(struct nbufc_out *out, const char *filename);
+/* Returns 0 on success. */
+int nbufc_out_close(struct nbufc_out *out);
+/* Same for content already in memory. */
+int nbufc_save_if_changed(const char *filename, const void *p, size_t len);
 #pragma GCC visibility pop
 
 #endif  /* NBUFC_UTIL_H_ */
@@ -1,3 +1,4 @@
+#include "config.h"
 #include "nbuf.h"
 #include "nbuf_schema.nb.h"
 #include "lex.h"
@@ -9,11 +10,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if HAVE_UNISTD_H && !defined _WIN32
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# define HAVE_FILE_ID 1
+#endif
+
 /* Local limits */
 #define MAX_DEPTH 500
 #define MAX_IMPORTS 32767
 #define MAX_UNRESOLVED 32767
 #define MAX_BUFFER 4
+#define MAX_FIXED_ARRAY 65535
 
 #define UNRESOLVED_IMPORT_ID 65535
 
@@ -72,10 +81,38 @@ nbuf_search_open(struct nbuf_buf *buf,
 	return f;
 }
 
+/* Identity of an opened file, which does not depend on the path used to
+ * open it.
+ */
+struct FileId {
+	bool valid;
+#if HAVE_FILE_ID
+	dev_t dev;
+	ino_t ino;
+#endif
+};
+
+static void
+get_file_id(struct FileId *id, FILE *f)
+{
+#if HAVE_FILE_ID
+	struct stat statbuf;
+
+	id->valid = fstat(fileno(f), &statbuf) == 0;
+	if (id->valid) {
+		id->dev = statbuf.st_dev;
+		id->ino = statbuf.st_ino;
+	}
+#else
+	id->valid = false;
+#endif
+}
+
 struct FileState {
 	const char *filename;
 	bool is_open;
 	struct nbuf_schema_set *ss;
+	struct FileId id;
 };
 
 static void dtor_FileState(struct FileState *fs)
@@ -87,11 +124,17 @@ static void dtor_FileState(struct FileState *fs)
 	}
 }
 
+/* id may be NULL to compare only the path.
+ */
 static bool
-samefile(struct FileState *fs, FILE *f, const char *path)
+samefile(struct FileState *fs, const struct FileId *id, const char *path)
 {
-	/* Without OS-specific features, we can only test for path equality.
+#if HAVE_FILE_ID
+	/* Different paths may lead to the same file.
 	 */
+	if (id && id->valid && fs->id.valid)
+		return id->dev == fs->id.dev && id->ino == fs->id.ino;
+#endif
 	return strcmp(fs->filename, path) == 0;
 }
 
@@ -100,6 +143,7 @@ struct ctx {
 	Token token;
 	struct nbuf_buf *file_states;  // struct FileState
 	const char *const *search_path;
+	const char *cache_dir;
 
 	// parsing state of current file.
 	struct nbuf_buf scratch_buf;
@@ -109,7 +153,7 @@ struct ctx {
 };
 
 static struct FileState *
-new_FileState(struct ctx *ctx, const char *path)
+new_FileState(struct ctx *ctx, const char *path, const struct FileId *id)
 {
 	struct FileState *fs;
 
@@ -118,6 +162,9 @@ new_FileState(struct ctx *ctx, const char *path)
 		fs->filename = path;
 		fs->is_open = true;
 		fs->ss = NULL;
+		fs->id.valid = false;
+		if (id)
+			fs->id = *id;
 	}
 	return fs;
 }
@@ -292,27 +339,98 @@ static bool resolve_type(struct nbuf_schema_set *ss, const char *name, nbuf_Kind
 	return true;  // will resolve later
 }
 
+struct UnionName {
+	const char *name;  // points into the lexer input
+	size_t len;
+};
+
+// Sets MsgDef.unions from the names collected by parse_field_defs().
+static bool
+set_union_defs(nbuf_MsgDef mdef, struct nbuf_buf *buf,
+	const struct nbuf_buf *unions)
+{
+	nbuf_UnionDef udef;
+	const struct UnionName *u;
+	size_t n;
+
+	if (!nbuf_alloc_multi_UnionDef(&udef, buf, LEN(struct UnionName, *unions)))
+		return false;
+	if (!nbuf_MsgDef_set_raw_unions(mdef, NBUF_OBJ(udef)))
+		return false;
+	FOR_EACH(const struct UnionName, u, n, *unions) {
+		if (!nbuf_UnionDef_set_name(udef, u->name, u->len))
+			return false;
+		nbuf_next(NBUF_OBJ(udef));
+	}
+	return true;
+}
 
+// field_def ::= [ "packed" | "delta" | "hashed" ] type [ "[" [ INT | ID ] "]" ] ID
+//               [ ":" INT ] ";"
+//             | "union" ID "{" field_def { field_def } "}"
 static bool
 parse_field_defs(struct ctx *ctx, lexState *l, nbuf_MsgDef mdef)
 {
 	size_t count = 0;
 	nbuf_FieldDef fdef;
+	struct nbuf_buf unions;  // struct UnionName
+	unsigned union_id = 0, tag = 0;
 	bool rc = false;
 
-	EXPECT(ID);
 	if (!nbuf_alloc_multi_FieldDef(&fdef, ctx->buf, 1))
 		return false;
+	nbuf_init_ex(&unions, 0);
 	++ctx->buf;
 	assert(ctx->buf < ctx->bufs + MAX_BUFFER);
+	EXPECT(ID);
 	for (;;) {
 		struct nbuf_obj o;
 		char *s, **p;
 		unsigned import_id = 0, type_id = 0;
 		nbuf_Kind kind = nbuf_Kind_VOID;
 
+		if (IS_ID("union")) {
+			struct UnionName *u;
+			size_t n;
+
+			if (union_id) {
+				nbuf_lexerror(l, "nested union");
+				goto err;
+			}
+			NEXT;
+			EXPECT(ID);
+			FOR_EACH(struct UnionName, u, n, unions) {
+				if (u->len == TOKENLEN(l) &&
+					memcmp(u->name, TOKEN(l), u->len) == 0) {
+					nbuf_lexerror(l, "duplicate union '%.*s'",
+						(int) u->len, u->name);
+					goto err;
+				}
+			}
+			if (!(u = ADD(struct UnionName, unions)))
+				goto err;
+			u->name = TOKEN(l);
+			u->len = TOKENLEN(l);
+			union_id = LEN(struct UnionName, unions);
+			tag = 0;
+			NEXT;
+			EXPECT_C('{'); NEXT;
+			EXPECT(ID);
+			continue;
+		}
+		nbuf_FieldDef_set_union_id(fdef, union_id);
+		nbuf_FieldDef_set_tag(fdef, union_id ? ++tag : 0);
 		// Record the line number, for better error reporting.
 		nbuf_FieldDef_set_offset(fdef, l->lineno);
+		nbuf_FieldDef_set_encoding(fdef, nbuf_Encoding_FIXED);
+		if (IS_ID("packed") || IS_ID("delta")) {
+			nbuf_FieldDef_set_encoding(fdef, IS_ID("packed") ?
+				nbuf_Encoding_PACKED : nbuf_Encoding_DELTA);
+			NEXT;
+		} else if (IS_ID("hashed")) {
+			nbuf_FieldDef_set_encoding(fdef, nbuf_Encoding_HASHED);
+			NEXT;
+		}
 		if (!(s = parse_fqn(ctx, l)))
 			goto err;
 		// Builtin types are resolved early.
@@ -335,10 +453,32 @@ parse_field_defs(struct ctx *ctx, lexState *l, nbuf_MsgDef mdef)
 
 		nbuf_FieldDef_set_import_id(fdef, import_id);
 		nbuf_FieldDef_set_type_id(fdef, type_id);
+		nbuf_FieldDef_set_count(fdef, 0);
+		// The buffer may be reused, so every field is set.
+		nbuf_FieldDef_set_raw_key(fdef, NULL);
 		if (IS_C('[')) {
 			NEXT;
+			if (IS(INT)) {
+				unsigned long count = strtoul(TOKEN(l), NULL, 0);
+
+				if (count == 0 || count > MAX_FIXED_ARRAY) {
+					nbuf_lexerror(l, "bad array length");
+					goto err;
+				}
+				nbuf_FieldDef_set_count(fdef, count);
+				NEXT;
+			} else {
+				if (IS(ID)) {
+					o.buf = ctx->buf;
+					if (!nbuf_alloc_str(&o, TOKEN(l), TOKENLEN(l)))
+						goto err;
+					if (!nbuf_FieldDef_set_raw_key(fdef, &o))
+						goto err;
+					NEXT;
+				}
+				kind = (nbuf_Kind) (kind | nbuf_Kind_ARR);
+			}
 			EXPECT_C(']'); NEXT;
-			kind = (nbuf_Kind) (kind | nbuf_Kind_ARR);
 		}
 		nbuf_FieldDef_set_kind(fdef, kind);
 		EXPECT(ID);
@@ -348,14 +488,37 @@ parse_field_defs(struct ctx *ctx, lexState *l, nbuf_MsgDef mdef)
 		if (!nbuf_FieldDef_set_raw_name(fdef, &o))
 			goto err;
 		NEXT;
+		nbuf_FieldDef_set_bits(fdef, 0);
+		nbuf_FieldDef_set_shift(fdef, 0);
+		if (IS_C(':')) {
+			unsigned long bits;
+
+			NEXT;
+			EXPECT(INT);
+			bits = strtoul(TOKEN(l), NULL, 0);
+			if (bits == 0 || bits > 8) {
+				nbuf_lexerror(l, "bad bitfield width");
+				goto err;
+			}
+			nbuf_FieldDef_set_bits(fdef, bits);
+			NEXT;
+		}
 		EXPECT_C(';'); NEXT;
 		++count;
 		nbuf_next(NBUF_OBJ(fdef));
+		if (union_id && IS_C('}')) {
+			NEXT;
+			union_id = 0;
+		}
 		if (!IS(ID))
 			break;
 		if (!nbuf_alloc(NBUF_OBJ(fdef)->buf, nbuf_obj_size(NBUF_OBJ(fdef))))
 			goto err;
 	}
+	if (union_id) {
+		nbuf_lexerror(l, "unterminated union");
+		goto err;
+	}
 	assert(count > 0);
 	nbuf_advance(NBUF_OBJ(fdef), -count);
 	if (!nbuf_resize_arr(NBUF_OBJ(fdef), count) ||
@@ -367,13 +530,21 @@ parse_field_defs(struct ctx *ctx, lexState *l, nbuf_MsgDef mdef)
 		assert(0 && "cannot set MsgDef.fields");
 		goto err;
 	}
+	if (unions.len > 0 &&
+		!set_union_defs(mdef, NBUF_OBJ(fdef)->buf, &unions)) {
+		fprintf(stderr, "internal error: cannot set MsgDef.unions\n");
+		goto err;
+	}
 	rc = true;
 err:
+	nbuf_clear(&unions);
 	(ctx->buf--)->len = 0;
 	return rc;
 }
 
-// message_def ::= "message" "{" { field_def } "}" ";"
+#define IS_MSG_DEF (IS_ID("message") || IS_ID("struct"))
+
+// message_def ::= ( "message" | "struct" ) "{" { field_def } "}" ";"
 static bool
 parse_message_defs(struct ctx *ctx, lexState *l, nbuf_Schema schema)
 {
@@ -381,13 +552,14 @@ parse_message_defs(struct ctx *ctx, lexState *l, nbuf_Schema schema)
 	nbuf_MsgDef mdef;
 	bool rc = false;
 
-	if (!IS_ID("message"))
+	if (!IS_MSG_DEF)
 		return true;
 	if (!nbuf_alloc_multi_MsgDef(&mdef, NBUF_OBJ(schema)->buf, 1))
 		return false;
 	for (;;) {
 		struct nbuf_obj o;
 
+		nbuf_MsgDef_set_is_struct(mdef, IS_ID("struct"));
 		NEXT;
 		EXPECT(ID);
 		o.buf = ctx->buf;
@@ -404,7 +576,7 @@ parse_message_defs(struct ctx *ctx, lexState *l, nbuf_Schema schema)
 		EXPECT_C('}'); NEXT;
 		++count;
 		nbuf_next(NBUF_OBJ(mdef));
-		if (!IS_ID("message"))
+		if (!IS_MSG_DEF)
 			break;
 		if (!nbuf_alloc(NBUF_OBJ(mdef)->buf, nbuf_obj_size(NBUF_OBJ(mdef))))
 			goto err;
@@ -546,20 +718,289 @@ err:
 	return rc;
 }
 
+enum { LAYOUT_NONE, LAYOUT_BUSY, LAYOUT_DONE };
+
+static bool
+is_pointer_field(nbuf_Kind kind, const struct nbuf_obj *typedesc)
+{
+	if (nbuf_is_repeated(kind) || kind == nbuf_Kind_STR)
+		return true;
+	return kind == nbuf_Kind_MSG &&
+		!nbuf_MsgDef_is_struct(*(const nbuf_MsgDef *) typedesc);
+}
+
+// Checks that a bitfield is a bool, a repeated bool (bitset),
+// or an enum whose values all fit in its width.
+static bool
+check_bitfield(nbuf_FieldDef fdef, nbuf_Kind kind, struct nbuf_obj *typedesc,
+	const char *src_name, unsigned lineno)
+{
+	const char *fname = nbuf_FieldDef_name(fdef, NULL);
+	unsigned bits = nbuf_FieldDef_bits(fdef);
+
+	if (nbuf_FieldDef_count(fdef)) {
+		fprintf(stderr, "error:%s:%u: bitfield '%s' "
+			"cannot be a fixed array\n", src_name, lineno, fname);
+		return false;
+	}
+	if (nbuf_base_kind(kind) == nbuf_Kind_BOOL) {
+		if (bits != 1) {
+			fprintf(stderr, "error:%s:%u: bool bitfield '%s' "
+				"must be 1 bit wide\n", src_name, lineno, fname);
+			return false;
+		}
+	} else if (kind == nbuf_Kind_ENUM) {
+		union {
+			struct nbuf_obj *o;
+			nbuf_EnumDef *edef;
+		} u = { typedesc };
+		nbuf_EnumVal val;
+		size_t n;
+
+		n = nbuf_EnumDef_values(&val, *u.edef, 0);
+		for (; n--; nbuf_next(NBUF_OBJ(val))) {
+			int v = nbuf_EnumVal_value(val);
+
+			if (v < 0 || v >= (1 << bits)) {
+				fprintf(stderr, "error:%s:%u: enum value %d "
+					"of '%s' does not fit in %u bits\n",
+					src_name, lineno, v, fname, bits);
+				return false;
+			}
+		}
+	} else if (nbuf_is_repeated(kind)) {
+		fprintf(stderr, "error:%s:%u: repeated field '%s' "
+			"cannot be a bitfield, unless a bool (bitset)\n",
+			src_name, lineno, fname);
+		return false;
+	} else {
+		fprintf(stderr, "error:%s:%u: bitfield '%s' "
+			"must be a bool or enum\n", src_name, lineno, fname);
+		return false;
+	}
+	return true;
+}
+
+// Checks that the key of a keyed field is a singular integer, enum, bool or
+// string field of the element message.
+static bool
+check_key(nbuf_FieldDef fdef, nbuf_Kind kind, struct nbuf_obj *typedesc,
+	const char *src_name, unsigned lineno)
+{
+	union {
+		struct nbuf_obj *o;
+		nbuf_MsgDef *mdef;
+	} u = { typedesc };
+	const char *fname = nbuf_FieldDef_name(fdef, NULL);
+	size_t len;
+	const char *key = nbuf_FieldDef_key(fdef, &len);
+	nbuf_FieldDef kdef;
+	nbuf_Kind key_kind;
+
+	if (kind != (nbuf_Kind_MSG|nbuf_Kind_ARR)) {
+		fprintf(stderr, "error:%s:%u: keyed field '%s' "
+			"must be a repeated message\n", src_name, lineno, fname);
+		return false;
+	}
+	if (!nbuf_lookup_field(&kdef, *u.mdef, key, len)) {
+		fprintf(stderr, "error:%s:%u: key '%s' of '%s' "
+			"is not a field of '%s'\n", src_name, lineno, key, fname,
+			nbuf_MsgDef_name(*u.mdef, NULL));
+		return false;
+	}
+	key_kind = nbuf_FieldDef_kind(kdef);
+	if (nbuf_FieldDef_union_id(kdef) || nbuf_FieldDef_count(kdef) ||
+		nbuf_FieldDef_bits(kdef) ||
+		(key_kind != nbuf_Kind_UINT && key_kind != nbuf_Kind_SINT &&
+		key_kind != nbuf_Kind_ENUM && key_kind != nbuf_Kind_BOOL &&
+		key_kind != nbuf_Kind_STR)) {
+		fprintf(stderr, "error:%s:%u: key '%s' of '%s' must be "
+			"a singular integer, enum or string\n",
+			src_name, lineno, key, fname);
+		return false;
+	}
+	if (nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_HASHED &&
+		key_kind != nbuf_Kind_STR) {
+		fprintf(stderr, "error:%s:%u: hashed field '%s' "
+			"must be keyed by a string\n", src_name, lineno, fname);
+		return false;
+	}
+	return true;
+}
+
+// Computes field offsets and object size of messages[msg_id].
+// Structs embedded by value are laid out first, as their size is needed.
+static bool
+layout_message(nbuf_Schema schema, unsigned msg_id, unsigned char *state)
+{
+	const char *src_name = nbuf_Schema_src_name(schema, NULL);
+	nbuf_MsgDef mdef;
+	nbuf_FieldDef fdef;
+	size_t m;
+	unsigned ssize = 0, psize = 0;
+	unsigned max_align = 0;
+	unsigned union_id = 0, union_ptr = 0;
+	unsigned bit_byte = 0, bit_pos = 8;
+	bool is_struct;
+
+	if (state[msg_id] == LAYOUT_DONE)
+		return true;
+	nbuf_Schema_messages(&mdef, schema, msg_id);
+	if (state[msg_id] == LAYOUT_BUSY) {
+		fprintf(stderr, "error:%s: struct '%s' contains itself\n",
+			src_name, nbuf_MsgDef_name(mdef, NULL));
+		return false;
+	}
+	state[msg_id] = LAYOUT_BUSY;
+	is_struct = nbuf_MsgDef_is_struct(mdef);
+
+	m = nbuf_MsgDef_fields(&fdef, mdef, 0);
+	for (; m--; nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+		unsigned count = nbuf_FieldDef_count(fdef);
+		// Before layout, offset holds the line number.
+		unsigned lineno = nbuf_FieldDef_offset(fdef);
+		const char *fname = nbuf_FieldDef_name(fdef, NULL);
+		unsigned bits = nbuf_FieldDef_bits(fdef);
+		bool is_ptr = is_pointer_field(kind, &u.o);
+
+		if (is_struct && is_ptr) {
+			fprintf(stderr, "error:%s:%u: struct field '%s' "
+				"must be a scalar, enum or struct\n",
+				src_name, lineno, fname);
+			return false;
+		}
+		if (count && (kind == nbuf_Kind_STR || kind == nbuf_Kind_MSG)) {
+			fprintf(stderr, "error:%s:%u: fixed array '%s' "
+				"must be of a scalar or enum type\n",
+				src_name, lineno, fname);
+			return false;
+		}
+		if (bits && !check_bitfield(fdef, kind, &u.o, src_name, lineno))
+			return false;
+		if (nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_HASHED) {
+			if (!nbuf_FieldDef_key(fdef, NULL)[0]) {
+				fprintf(stderr, "error:%s:%u: hashed field '%s' "
+					"must be keyed by a string\n",
+					src_name, lineno, fname);
+				return false;
+			}
+			if (nbuf_FieldDef_union_id(fdef)) {
+				fprintf(stderr, "error:%s:%u: hashed field '%s' "
+					"cannot be a union member\n",
+					src_name, lineno, fname);
+				return false;
+			}
+		} else if (nbuf_FieldDef_encoding(fdef) != nbuf_Encoding_FIXED &&
+			kind != (nbuf_Kind_UINT|nbuf_Kind_ARR) &&
+			kind != (nbuf_Kind_SINT|nbuf_Kind_ARR)) {
+			fprintf(stderr, "error:%s:%u: packed field '%s' "
+				"must be a repeated integer\n",
+				src_name, lineno, fname);
+			return false;
+		}
+		if (nbuf_FieldDef_key(fdef, NULL)[0] &&
+			!check_key(fdef, kind, &u.o, src_name, lineno))
+			return false;
+		if (nbuf_FieldDef_union_id(fdef)) {
+			if (bits) {
+				fprintf(stderr, "error:%s:%u: union member '%s' "
+					"cannot be a bitfield\n",
+					src_name, lineno, fname);
+				return false;
+			}
+			if (!is_ptr) {
+				fprintf(stderr, "error:%s:%u: union member '%s' "
+					"must be a message, string or repeated field\n",
+					src_name, lineno, fname);
+				return false;
+			}
+			if (union_id != nbuf_FieldDef_union_id(fdef)) {
+				nbuf_UnionDef udef;
+
+				// First member: allocate the shared pointer and the tag.
+				union_id = nbuf_FieldDef_union_id(fdef);
+				nbuf_MsgDef_unions(&udef, mdef, union_id - 1);
+				if (max_align < 2)
+					max_align = 2;
+				ssize = ((ssize + 1) &~ 1);
+				nbuf_UnionDef_set_offset(udef, ssize);
+				ssize += 2;
+				union_ptr = psize++;
+			}
+			nbuf_FieldDef_set_offset(fdef, union_ptr);
+		} else if (is_ptr) {
+			nbuf_FieldDef_set_offset(fdef, psize);
+			psize++;
+			// The hash index takes the next pointer.
+			if (nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_HASHED)
+				psize++;
+		} else if (bits) {
+			// Pack into the current byte, or start a new one.
+			if (bit_pos + bits > 8) {
+				bit_byte = ssize++;
+				bit_pos = 0;
+			}
+			nbuf_FieldDef_set_offset(fdef, bit_byte);
+			nbuf_FieldDef_set_shift(fdef, bit_pos);
+			bit_pos += bits;
+		} else {
+			unsigned sz, align;
+
+			if (kind == nbuf_Kind_MSG) {
+				if (nbuf_FieldDef_import_id(fdef) == 0 &&
+					!layout_message(schema,
+						nbuf_FieldDef_type_id(fdef), state))
+					return false;
+				// Structs are aligned by their size, as their
+				// alignment is not recorded in the schema.
+				sz = nbuf_MsgDef_ssize(u.mdef);
+				align = sz & -sz;
+			} else {
+				sz = (kind == nbuf_Kind_ENUM) ? 2 : u.o.ssize;
+				align = sz;
+			}
+			if (align > sizeof (nbuf_word_t))
+				align = sizeof (nbuf_word_t);
+			if (align > max_align)
+				max_align = align;
+			ssize = ((ssize + align - 1) &~ (align - 1));
+			nbuf_FieldDef_set_offset(fdef, ssize);
+			ssize += sz * (count ? count : 1);
+		}
+	}
+	if (psize > 0)
+		max_align = sizeof (nbuf_word_t);
+	ssize = ((ssize + max_align - 1) &~ (max_align - 1));
+	if (ssize > NBUF_SSIZE(~0U) || psize > NBUF_PSIZE(~0U)) {
+		fprintf(stderr, "error:%s: message '%s' is too large\n",
+			src_name, nbuf_MsgDef_name(mdef, NULL));
+		return false;
+	}
+	nbuf_MsgDef_set_ssize(mdef, ssize);
+	nbuf_MsgDef_set_psize(mdef, psize);
+	state[msg_id] = LAYOUT_DONE;
+	return true;
+}
+
 static bool complete_message_defs(struct ctx *ctx, nbuf_Schema schema)
 {
 	nbuf_MsgDef mdef;
-	size_t n;
+	size_t i, n;
+	unsigned char *state = NULL;
 	bool rc = false;
 	struct nbuf_schema_set *ss =
 		(struct nbuf_schema_set *) NBUF_OBJ(schema)->buf;
 
+	// Resolve all types first, so structs can be laid out on demand.
 	n = nbuf_Schema_messages(&mdef, schema, 0);
 	for (; n--; nbuf_next(NBUF_OBJ(mdef))) {
 		nbuf_FieldDef fdef;
 		size_t m;
-		unsigned ssize = 0, psize = 0;
-		unsigned max_align = 0;
 
 		m = nbuf_MsgDef_fields(&fdef, mdef, 0);
 		for (; m--; nbuf_next(NBUF_OBJ(fdef))) {
@@ -587,27 +1028,19 @@ static bool complete_message_defs(struct ctx *ctx, nbuf_Schema schema)
 				nbuf_FieldDef_set_import_id(fdef, import_id);
 				nbuf_FieldDef_set_type_id(fdef, type_id);
 			}
-			if (nbuf_is_repeated(kind) || kind == nbuf_Kind_STR || kind == nbuf_Kind_MSG) {
-				nbuf_FieldDef_set_offset(fdef, psize);
-				psize++;
-			} else {
-				unsigned sz = (kind == nbuf_Kind_ENUM) ? 2 : (1 << type_id);
-				unsigned align = (sz > sizeof (nbuf_word_t)) ? sizeof (nbuf_word_t) : sz;
-				if (align > max_align)
-					max_align = align;
-				ssize = ((ssize + align - 1) &~ (align - 1));
-				nbuf_FieldDef_set_offset(fdef, ssize);
-				ssize += sz;
-			}
 		}
-		if (psize > 0)
-			max_align = sizeof (nbuf_word_t);
-		ssize = ((ssize + max_align - 1) &~ (max_align - 1));
-		nbuf_MsgDef_set_ssize(mdef, ssize);
-		nbuf_MsgDef_set_psize(mdef, psize);
+	}
+
+	n = nbuf_Schema_messages(&mdef, schema, 0);
+	if (n > 0 && !(state = (unsigned char *) calloc(n, 1)))
+		goto err;
+	for (i = 0; i < n; i++) {
+		if (!layout_message(schema, i, state))
+			goto err;
 	}
 	rc = true;
 err:
+	free(state);
 	{
 		char **p;
 		size_t n;
@@ -620,19 +1053,136 @@ err:
 }
 
 static struct FileState *
-find_known_file(struct ctx *ctx, FILE *f, const char *path)
+find_known_file(struct ctx *ctx, const struct FileId *id, const char *path)
 {
 	struct FileState *fs;
 	size_t n;
 
 	FOR_EACH(struct FileState, fs, n, *ctx->file_states)
-		if (samefile(fs, f, path))
+		if (samefile(fs, id, path))
 			return fs;
 	return NULL;
 }
 
+/* Compile cache
+ *
+ * A compiled schema depends only on the compiler, its text, its path
+ * (stored as src_name) and its compiled imports.  Their hash names the cache
+ * entry, so a changed input misses the cache instead of reading a stale
+ * entry.
+ */
+#define CACHE_FORMAT "2"
+
+static uint64_t
+hash_bytes(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = (const unsigned char *) p;
+
+	/* FNV-1a */
+	while (len--) {
+		h ^= *s++;
+		h *= UINT64_C(0x100000001b3);
+	}
+	return h;
+}
+
+/* Returns the path of the cache entry, which the caller frees. */
+static char *
+cache_path(struct ctx *ctx, const struct nbuf_buf *textschema,
+	const char *filename, struct nbuf_buf *imports)
+{
+	static const char version[] = PACKAGE_VERSION "/" CACHE_FORMAT;
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+	struct nbuf_schema_set **import;
+	size_t n;
+	char *path;
+
+	h = hash_bytes(h, version, sizeof version);
+	h = hash_bytes(h, filename, strlen(filename) + 1);
+	h = hash_bytes(h, &textschema->len, sizeof textschema->len);
+	h = hash_bytes(h, textschema->base, textschema->len);
+	FOR_EACH(struct nbuf_schema_set *, import, n, *imports) {
+		const struct nbuf_buf *buf = &(*import)->buf;
+
+		h = hash_bytes(h, &buf->len, sizeof buf->len);
+		h = hash_bytes(h, buf->base, buf->len);
+	}
+	/* "/", 16 hex digits, ".nb" */
+	if (!(path = (char *) malloc(strlen(ctx->cache_dir) + 21)))
+		return NULL;
+	sprintf(path, "%s/%016llx.nb", ctx->cache_dir, (unsigned long long) h);
+	return path;
+}
+
+/* Loads a cache entry into buf, if it exists and matches. */
+static bool
+load_cached(const char *path, const char *filename, size_t nimports,
+	struct nbuf_buf *buf)
+{
+	nbuf_Schema schema;
+	FILE *f;
+	bool ok;
+
+	memset(buf, 0, sizeof *buf);
+	if (!(f = fopen(path, "rb")))
+		return false;
+	ok = nbuf_load_fp(buf, f) &&
+		nbuf_get_Schema(&schema, buf, 0) &&
+		strcmp(nbuf_Schema_src_name(schema, NULL), filename) == 0 &&
+		nbuf_Schema_imports_size(schema) == nimports;
+	fclose(f);
+	if (!ok)
+		nbuf_clear(buf);
+	return ok;
+}
+
+/* Concurrent compilers may write the same entry, so it is written to a
+ * temporary file, then renamed.  Failures only cost a cache miss later.
+ */
+static void
+save_cached(const char *path, struct nbuf_buf *buf)
+{
+	char *tmp;
+
+	if (!(tmp = (char *) malloc(strlen(path) + 24)))
+		return;
+#if HAVE_UNISTD_H && !defined _WIN32
+	sprintf(tmp, "%s.%ld", path, (long) getpid());
+#else
+	sprintf(tmp, "%s.tmp", path);
+#endif
+	if (!nbuf_save_file(buf, tmp) || rename(tmp, path) != 0)
+		remove(tmp);
+	free(tmp);
+}
+
+/* Records the src_name of each import, for nbuf_load_schema_set. */
+static bool
+set_imports(nbuf_Schema schema, const struct nbuf_schema_set *ss)
+{
+	size_t i;
+
+	if (ss->nimports == 0)
+		return true;
+	if (!nbuf_Schema_alloc_imports(schema, ss->nimports))
+		return false;
+	for (i = 0; i < ss->nimports; i++) {
+		nbuf_Schema import;
+		const char *src_name;
+		size_t len;
+
+		if (!nbuf_get_Schema(&import, &ss->imports[i]->buf, 0))
+			return false;
+		src_name = nbuf_Schema_src_name(import, &len);
+		if (!nbuf_Schema_set_imports(schema, i, src_name, len))
+			return false;
+	}
+	return true;
+}
+
 static struct nbuf_schema_set *
-parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema, const char *filename)
+parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema,
+	const char *filename, const struct FileId *id)
 {
 	lexState l[1];
 	nbuf_Schema schema;
@@ -641,6 +1191,8 @@ parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema, const char *file
 	bool rc = false;
 	struct nbuf_schema_set *ss = NULL;
 	struct FileState *fs = NULL;
+	char *cache = NULL;
+	bool cached = false;
 	size_t i;
 
 	nbuf_init_ex(&imports, 0);
@@ -651,7 +1203,7 @@ parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema, const char *file
 		goto err;
 	/* filename is now persistent (no longer in scratch_buf) */
 	i = LEN(struct FileState, *ctx->file_states);
-	if (!(fs = new_FileState(ctx, filename)))
+	if (!(fs = new_FileState(ctx, filename, id)))
 		goto err;
 	nbuf_lexinit(l, filename, textschema->base, textschema->len);
 	NEXT;  /* get the first token from input */
@@ -663,6 +1215,22 @@ parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema, const char *file
 	if (!rc)
 		goto err;
 	rc = false;
+	/* The imports are needed for the cache key; the rest of the file
+	 * needs not be parsed on a hit.
+	 */
+	if (ctx->cache_dir &&
+		(cache = cache_path(ctx, textschema, filename, &imports))) {
+		struct nbuf_buf cachebuf;
+
+		if ((cached = load_cached(cache, filename,
+			LEN(struct nbuf_schema_set *, imports), &cachebuf))) {
+			nbuf_clear(&binschema);
+			binschema = cachebuf;
+			/* filename was in the old binschema */
+			nbuf_get_Schema(&schema, &binschema, 0);
+			fs->filename = nbuf_Schema_src_name(schema, NULL);
+		}
+	}
 	fs->ss = ss = (struct nbuf_schema_set *)
 		malloc(offsetof(struct nbuf_schema_set, imports) +
 		sizeof (ss->imports[0]) * LEN(struct nbuf_schema_set *, imports));
@@ -675,9 +1243,15 @@ parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema, const char *file
 	if (imports.len)
 		memcpy(ss->imports, imports.base, imports.len);
 	imports.len = 0;
+	if (cached) {
+		rc = true;
+		goto err;
+	}
 
 	if (!nbuf_get_Schema(&schema, &ss->buf, 0))
 		goto err;
+	if (!set_imports(schema, ss))
+		goto err;
 	if (!parse_enum_defs(ctx, l, schema))
 		goto err;
 	if (!parse_message_defs(ctx, l, schema))
@@ -688,10 +1262,13 @@ parse_opened_file(struct ctx *ctx, struct nbuf_buf *textschema, const char *file
 	 * filling in unknown fields. */
 	if (!complete_message_defs(ctx, schema))
 		goto err;
+	if (cache)
+		save_cached(cache, &ss->buf);
 	rc = true;
 err:
 	if (fs)
 		fs->is_open = false;
+	free(cache);
 	nbuf_clear(&imports);
 	nbuf_clear(&binschema);
 	return rc ? ss : NULL;
@@ -702,6 +1279,7 @@ parse_file(struct ctx *ctx, const char *filename)
 {
 	struct nbuf_buf textschema;  // load_file
 	FILE *f = NULL;
+	struct FileId id;
 	struct FileState *fs = NULL;
 	struct nbuf_schema_set *ss = NULL;
 
@@ -709,14 +1287,19 @@ parse_file(struct ctx *ctx, const char *filename)
 		fprintf(stderr, "max import depth (%d) exceeded\n", MAX_DEPTH);
 		goto err;
 	}
-	f = nbuf_search_open(&ctx->scratch_buf, ctx->search_path, filename);
-	/* filename may be in scratch_buf, and it may have been re-allocated. */
-	filename = ctx->scratch_buf.base;
-	if (!f) {
-		fprintf(stderr, "file '%s' cannot be found.\n", filename);
-		goto err;
+	/* An import seen before by the same name needs no search. */
+	if (!(fs = find_known_file(ctx, NULL, filename))) {
+		f = nbuf_search_open(&ctx->scratch_buf, ctx->search_path, filename);
+		/* filename may be in scratch_buf, and it may have been re-allocated. */
+		filename = ctx->scratch_buf.base;
+		if (!f) {
+			fprintf(stderr, "file '%s' cannot be found.\n", filename);
+			goto err;
+		}
+		get_file_id(&id, f);
+		fs = find_known_file(ctx, &id, filename);
 	}
-	if ((fs = find_known_file(ctx, f, filename))) {
+	if (fs) {
 		struct FileState *fs_end = GET(struct FileState, *ctx->file_states,
 						LEN(struct FileState, *ctx->file_states));
 		if (fs->is_open) {
@@ -731,12 +1314,13 @@ parse_file(struct ctx *ctx, const char *filename)
 			 */
 			ss = fs->ss;
 		}
-		fclose(f);
+		if (f)
+			fclose(f);
 		goto err;
 	}
 	nbuf_load_fp(&textschema, f);
 	fclose(f);
-	ss = parse_opened_file(ctx, &textschema, filename);
+	ss = parse_opened_file(ctx, &textschema, filename, &id);
 	nbuf_clear(&textschema);
 err:
 	--ctx->depth;
@@ -756,6 +1340,7 @@ static void initctx(struct ctx *ctx, const struct nbuf_compile_opt *opt)
 	ctx->buf = ctx->bufs;
 	ctx->file_states = opt->outbuf;
 	ctx->search_path = opt->search_path;
+	ctx->cache_dir = opt->cache_dir;
 	for (i = 0; i < MAX_BUFFER; i++)
 		nbuf_init_ex(&ctx->bufs[i], 0);
 	nbuf_init_ex(&ctx->scratch_buf, 0);
@@ -798,10 +1383,191 @@ nbuf_compile_str(const struct nbuf_compile_opt *opt,
 
 	initctx(ctx, opt);
 	nbuf_init_ro(&textschema, input, len);
-	ss = parse_opened_file(ctx, &textschema, filename);
+	ss = parse_opened_file(ctx, &textschema, filename, NULL);
 	finictx(ctx);
 
 	if (!ss)
 		nbuf_free_compiled(opt);
 	return ss;
 }
+
+/* Schema loader: compiled schema (nbufc -bin_out) -> nbuf_schema_set */
+
+static struct nbuf_schema_set *
+load_file(struct ctx *ctx, const char *filename);
+
+/* Loads the import compiled from src_name, i.e. "a/b.nbuf" from "a/b.nb",
+ * unless it is loaded already.
+ */
+static struct nbuf_schema_set *
+load_import(struct ctx *ctx, const char *src_name)
+{
+	struct FileState *fs;
+	struct nbuf_schema_set *ss;
+	size_t len = nbuf_baselen(src_name);
+	char *filename;
+
+	/* an open file is reported as a circular dependency once loaded */
+	if ((fs = find_known_file(ctx, NULL, src_name)) && !fs->is_open)
+		return fs->ss;
+	if (!(filename = (char *) malloc(len + sizeof ".nb")))
+		return NULL;
+	memcpy(filename, src_name, len);
+	strcpy(filename + len, ".nb");
+	ss = load_file(ctx, filename);
+	free(filename);
+	return ss;
+}
+
+static bool
+load_imports(struct ctx *ctx, nbuf_Schema schema, struct nbuf_buf *imports)
+{
+	size_t i, n = nbuf_Schema_imports_size(schema);
+
+	for (i = 0; i < n; i++) {
+		struct nbuf_schema_set **p;
+
+		if (!(p = ADD(struct nbuf_schema_set *, *imports)))
+			return false;
+		if (!(*p = load_import(ctx, nbuf_Schema_imports(schema, i, NULL))))
+			return false;
+	}
+	return true;
+}
+
+/* Checks that every field refers to a listed import.
+ * Schemas compiled before imports were recorded fail this.
+ */
+static bool
+check_import_ids(nbuf_Schema schema)
+{
+	size_t nimports = nbuf_Schema_imports_size(schema);
+	nbuf_MsgDef mdef;
+	nbuf_FieldDef fdef;
+	size_t n, m;
+
+	for (n = nbuf_Schema_messages(&mdef, schema, 0); n--; nbuf_next(NBUF_OBJ(mdef)))
+		for (m = nbuf_MsgDef_fields(&fdef, mdef, 0); m--; nbuf_next(NBUF_OBJ(fdef)))
+			if (nbuf_FieldDef_import_id(fdef) > nimports)
+				return false;
+	return true;
+}
+
+static struct nbuf_schema_set *
+load_opened_file(struct ctx *ctx, FILE *f, const char *filename)
+{
+	nbuf_Schema schema;
+	struct nbuf_buf binschema = {NULL};
+	struct nbuf_buf imports;
+	const char *src_name;
+	bool rc = false;
+	struct nbuf_schema_set *ss = NULL;
+	struct FileState *fs = NULL;
+	size_t i;
+
+	nbuf_init_ex(&imports, 0);
+	if (!nbuf_load_fp(&binschema, f) ||
+		!nbuf_get_Schema(&schema, &binschema, 0) ||
+		!*(src_name = nbuf_Schema_src_name(schema, NULL))) {
+		fprintf(stderr, "%s: not a compiled schema\n", filename);
+		goto err;
+	}
+	if (!check_import_ids(schema)) {
+		fprintf(stderr, "%s: imports are not listed, "
+			"recompile it with nbufc -bin_out\n", filename);
+		goto err;
+	}
+	if ((fs = find_known_file(ctx, NULL, src_name))) {
+		struct FileState *fs_end = GET(struct FileState, *ctx->file_states,
+						LEN(struct FileState, *ctx->file_states));
+		if (fs->is_open) {
+			fprintf(stderr, "error: circular dependency: ");
+			do {
+				fprintf(stderr, "%s -> ", fs->filename);
+			} while (++fs < fs_end);
+			fprintf(stderr, "%s\n", src_name);
+		} else {
+			/* the same schema was loaded or compiled before */
+			ss = fs->ss;
+			rc = true;
+		}
+		fs = NULL;
+		goto err;
+	}
+	/* src_name stays in binschema, whose memory is moved to ss->buf */
+	i = LEN(struct FileState, *ctx->file_states);
+	if (!(fs = new_FileState(ctx, src_name, NULL)))
+		goto err;
+	rc = load_imports(ctx, schema, &imports);
+	/* load_imports may invalidate fs pointer */
+	fs = GET(struct FileState, *ctx->file_states, i);
+	if (!rc)
+		goto err;
+	rc = false;
+	fs->ss = ss = (struct nbuf_schema_set *)
+		malloc(offsetof(struct nbuf_schema_set, imports) +
+		sizeof (ss->imports[0]) * LEN(struct nbuf_schema_set *, imports));
+	if (!ss)
+		goto err;
+	ss->buf = binschema;
+	memset(&binschema, 0, sizeof binschema);
+	ss->nimports = LEN(struct nbuf_schema_set *, imports);
+	if (imports.len)
+		memcpy(ss->imports, imports.base, imports.len);
+	rc = true;
+err:
+	if (fs)
+		fs->is_open = false;
+	nbuf_clear(&imports);
+	nbuf_clear(&binschema);
+	return rc ? ss : NULL;
+}
+
+struct nbuf_schema_set *
+load_file(struct ctx *ctx, const char *filename)
+{
+	FILE *f;
+	struct nbuf_schema_set *ss = NULL;
+
+	if (++ctx->depth == MAX_DEPTH) {
+		fprintf(stderr, "max import depth (%d) exceeded\n", MAX_DEPTH);
+		goto err;
+	}
+	f = nbuf_search_open(&ctx->scratch_buf, ctx->search_path, filename);
+	/* filename may be in scratch_buf, and it may have been re-allocated. */
+	filename = ctx->scratch_buf.base;
+	if (!f) {
+		fprintf(stderr, "file '%s' cannot be found.\n", filename);
+		goto err;
+	}
+	/* the memory stays mapped after fclose */
+	ss = load_opened_file(ctx, f, filename);
+	fclose(f);
+err:
+	--ctx->depth;
+	return ss;
+}
+
+struct nbuf_schema_set *
+nbuf_load_schema_set(const struct nbuf_compile_opt *opt, const char *filename)
+{
+	struct ctx ctx[1];
+	struct nbuf_schema_set *ss = NULL;
+	size_t n = LEN(struct FileState, *opt->outbuf);
+
+	initctx(ctx, opt);
+	ss = load_file(ctx, filename);
+	finictx(ctx);
+
+	if (!ss) {
+		/* unlike nbuf_compile, keep what previous calls loaded */
+		struct FileState *fs;
+		size_t m;
+
+		for (fs = GET(struct FileState, *opt->outbuf, n),
+			m = LEN(struct FileState, *opt->outbuf) - n; m--; fs++)
+			dtor_FileState(fs);
+		opt->outbuf->len = n * sizeof (struct FileState);
+	}
+	return ss;
+}
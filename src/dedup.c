@@ -0,0 +1,364 @@
+#include "libnbuf.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Objects are copied bottom-up: the children of an object are copied
+ * first, so that its pointers can be compared by their targets in the
+ * output.  An object is compared in its canonical form, where each pointer
+ * holds the offset of the target's header in the output instead of a
+ * relative word, or 0 if null.  Only the root, which is copied first so
+ * that it stays at the start, may hold a pointer to offset 0.
+ */
+
+#define VISITING UINT32_MAX
+
+/* Maps the header offset of an input object to its copy */
+struct memo_slot {
+	uint32_t key;  /* input offset + 1, 0 if empty */
+	uint32_t val;  /* output offset, or VISITING */
+};
+
+/* An output object, with its canonical form */
+struct obj_slot {
+	uint32_t hash;
+	uint32_t offset;  /* output offset + 1, 0 if empty */
+	uint32_t canon, size;
+};
+
+struct ctx {
+	const struct nbuf_buf *in;
+	struct nbuf_buf *out;
+	struct nbuf_buf canon;
+	struct memo_slot *memo;
+	size_t memo_cap, memo_n;
+	struct obj_slot *objs;
+	size_t objs_cap, objs_n;
+	int depth, max_depth;
+	bool no_merge;
+};
+
+/* An object in the input */
+struct hdr {
+	size_t hdr_size, size;  /* of the header, and of the elements */
+	size_t len;
+	unsigned ssize, psize;
+};
+
+static bool
+read_hdr(struct hdr *h, const struct nbuf_buf *buf, size_t offset)
+{
+	nbuf_word_t hdr;
+	size_t esize;
+
+	if (offset % sizeof hdr || offset + sizeof hdr > buf->len)
+		return false;
+	hdr = nbuf_word(buf->base + offset);
+	h->hdr_size = sizeof hdr;
+	if (!(hdr & NBUF_HDR_MASK))
+		return false;
+	if (hdr & NBUF_BARR_MASK) {
+		h->ssize = 1;
+		h->psize = 0;
+		h->len = hdr & NBUF_BLEN_MASK;
+	} else {
+		h->ssize = NBUF_SSIZE(hdr);
+		h->psize = NBUF_PSIZE(hdr);
+		h->len = 1;
+		if (hdr & NBUF_ARR_MASK) {
+			h->hdr_size += sizeof hdr;
+			if (offset + h->hdr_size > buf->len)
+				return false;
+			h->len = nbuf_word(buf->base + offset + sizeof hdr);
+		}
+	}
+	esize = h->ssize + h->psize * sizeof hdr;
+	if (esize && h->len > (buf->len - offset - h->hdr_size) / esize)
+		return false;
+	h->size = h->len * esize;
+	return true;
+}
+
+static uint32_t
+hash_words(const char *p, size_t size)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = size * k;
+	size_t i;
+
+	for (i = 0; i < size; i += sizeof (uint32_t)) {
+		h = (h ^ nbuf_u32(p + i)) * k;
+		h ^= h >> 29;
+	}
+	return (uint32_t) (h ^ (h >> 32));
+}
+
+static struct memo_slot *
+memo_find(struct ctx *ctx, size_t offset)
+{
+	size_t i = (uint32_t) ((offset * 0x9e3779b97f4a7c15ULL) >> 32);
+
+	for (i &= ctx->memo_cap - 1; ctx->memo[i].key;
+		i = (i + 1) & (ctx->memo_cap - 1))
+		if (ctx->memo[i].key == offset + 1)
+			break;
+	return &ctx->memo[i];
+}
+
+static bool
+memo_grow(struct ctx *ctx)
+{
+	struct memo_slot *old = ctx->memo;
+	size_t cap = ctx->memo_cap, i;
+
+	ctx->memo_cap = cap ? 2 * cap : 256;
+	if (!(ctx->memo = (struct memo_slot *) calloc(ctx->memo_cap, sizeof *old))) {
+		ctx->memo = old;
+		ctx->memo_cap = cap;
+		return false;
+	}
+	for (i = 0; i < cap; i++)
+		if (old[i].key)
+			*memo_find(ctx, old[i].key - 1) = old[i];
+	free(old);
+	return true;
+}
+
+static struct obj_slot *
+obj_find(struct ctx *ctx, uint32_t hash, const char *canon, size_t size)
+{
+	size_t i;
+
+	for (i = hash & (ctx->objs_cap - 1); ctx->objs[i].offset;
+		i = (i + 1) & (ctx->objs_cap - 1)) {
+		struct obj_slot *s = &ctx->objs[i];
+
+		if (s->hash == hash && s->size == size &&
+			memcmp(ctx->canon.base + s->canon, canon, size) == 0)
+			break;
+	}
+	return &ctx->objs[i];
+}
+
+static bool
+obj_grow(struct ctx *ctx)
+{
+	struct obj_slot *old = ctx->objs;
+	size_t cap = ctx->objs_cap, i, j;
+
+	ctx->objs_cap = cap ? 2 * cap : 256;
+	if (!(ctx->objs = (struct obj_slot *) calloc(ctx->objs_cap, sizeof *old))) {
+		ctx->objs = old;
+		ctx->objs_cap = cap;
+		return false;
+	}
+	for (i = 0; i < cap; i++) {
+		if (!old[i].offset)
+			continue;
+		for (j = old[i].hash & (ctx->objs_cap - 1); ctx->objs[j].offset;
+			j = (j + 1) & (ctx->objs_cap - 1))
+			;
+		ctx->objs[j] = old[i];
+	}
+	free(old);
+	return true;
+}
+
+/* Gets the target of the pointer at offset in the input.
+ * Returns false if null.
+ */
+static bool
+ptr_target(const struct nbuf_buf *buf, size_t offset, size_t *target)
+{
+	nbuf_word_t rel_ptr = nbuf_word(buf->base + offset);
+
+	*target = (uint32_t) (offset + rel_ptr * sizeof rel_ptr);
+	return rel_ptr != 0;
+}
+
+/* Sets the pointer at offset in the output to the header at target. */
+static void
+set_ptr(struct nbuf_buf *buf, size_t offset, size_t target)
+{
+	nbuf_set_word(buf->base + offset,
+		(nbuf_word_t) ((target - offset) / sizeof (nbuf_word_t)));
+}
+
+static bool copy_obj(struct ctx *ctx, size_t offset, size_t *newp);
+
+/* Copies the children of the object at offset in the input. */
+static bool
+copy_children(struct ctx *ctx, size_t offset, const struct hdr *h)
+{
+	size_t esize = h->ssize + h->psize * sizeof (nbuf_word_t);
+	size_t i, j, p, target, t;
+
+	for (i = 0; i < h->len; i++) {
+		p = offset + h->hdr_size + i * esize;
+		for (j = 0; j < h->psize; j++, p += sizeof (nbuf_word_t)) {
+			if (ptr_target(ctx->in, p, &target) &&
+				!copy_obj(ctx, target, &t))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Points the pointers of an object copied at newoff to the copies of their
+ * targets.  If canon is not NULL, writes them to canon instead, in
+ * canonical form.
+ */
+static void
+link_children(struct ctx *ctx, size_t offset, const struct hdr *h,
+	size_t newoff, char *canon)
+{
+	size_t esize = h->ssize + h->psize * sizeof (nbuf_word_t);
+	size_t i, j, p, q, target;
+
+	for (i = 0; i < h->len; i++) {
+		q = h->hdr_size + i * esize;
+		p = offset + q;
+		for (j = 0; j < h->psize; j++) {
+			bool set = ptr_target(ctx->in, p, &target);
+
+			if (set)
+				target = memo_find(ctx, target)->val;
+			if (canon)
+				nbuf_set_word(canon + q, set ? (nbuf_word_t) target : 0);
+			else if (set)
+				set_ptr(ctx->out, newoff + q, target);
+			p += sizeof (nbuf_word_t);
+			q += sizeof (nbuf_word_t);
+		}
+	}
+}
+
+/* Copies the object whose header is at offset in the input, unless an
+ * equal object is already in the output.  Sets *newp to the offset of the
+ * header in the output.
+ */
+static bool
+copy_obj(struct ctx *ctx, size_t offset, size_t *newp)
+{
+	struct memo_slot *m;
+	struct obj_slot *s;
+	struct hdr h;
+	size_t start, size, newoff;
+	uint32_t hash;
+	char *p;
+
+	if (2 * (ctx->memo_n + 1) > ctx->memo_cap && !memo_grow(ctx))
+		return false;
+	m = memo_find(ctx, offset);
+	if (m->key) {
+		*newp = m->val;
+		return m->val != VISITING;  /* a cycle otherwise */
+	}
+	if (!read_hdr(&h, ctx->in, offset))
+		return false;
+	m->key = offset + 1;
+	m->val = VISITING;
+	ctx->memo_n++;
+	if (++ctx->depth > ctx->max_depth)
+		return false;
+	if (!copy_children(ctx, offset, &h))
+		return false;
+	ctx->depth--;
+
+	if (ctx->no_merge) {
+		size = h.hdr_size + h.size;
+		if (!(p = nbuf_alloc_aligned(ctx->out, NBUF_ALLOC_ALIGN(size),
+			sizeof (nbuf_word_t))))
+			return false;
+		newoff = p - ctx->out->base;
+		if (newoff >= UINT32_MAX)
+			return false;
+		memcpy(p, ctx->in->base + offset, size);
+		memset(p + size, 0, NBUF_ALLOC_ALIGN(size) - size);
+		link_children(ctx, offset, &h, newoff, NULL);
+		goto done;
+	}
+	start = ctx->canon.len;
+	size = h.hdr_size + h.size;
+	if (!nbuf_alloc(&ctx->canon, NBUF_ALLOC_ALIGN(size)))
+		return false;
+	p = ctx->canon.base + start;
+	memcpy(p, ctx->in->base + offset, size);
+	memset(p + size, 0, NBUF_ALLOC_ALIGN(size) - size);
+	link_children(ctx, offset, &h, 0, p);
+	size = NBUF_ALLOC_ALIGN(size);
+	hash = hash_words(p, size);
+
+	if (2 * (ctx->objs_n + 1) > ctx->objs_cap && !obj_grow(ctx))
+		return false;
+	s = obj_find(ctx, hash, p, size);
+	if (s->offset) {
+		ctx->canon.len = start;
+		newoff = s->offset - 1;
+	} else {
+		if (!(p = nbuf_alloc_aligned(ctx->out, size, sizeof (nbuf_word_t))))
+			return false;
+		newoff = p - ctx->out->base;
+		if (newoff >= UINT32_MAX)
+			return false;
+		memcpy(p, ctx->in->base + offset, h.hdr_size + h.size);
+		memset(p + h.hdr_size + h.size, 0, size - h.hdr_size - h.size);
+		link_children(ctx, offset, &h, newoff, NULL);
+		s->hash = hash;
+		s->offset = (uint32_t) newoff + 1;
+		s->canon = (uint32_t) start;
+		s->size = (uint32_t) size;
+		ctx->objs_n++;
+	}
+done:
+	/* the tables may have moved */
+	memo_find(ctx, offset)->val = (uint32_t) newoff;
+	*newp = newoff;
+	return true;
+}
+
+bool
+nbuf_dedup(const struct nbuf_dedup_opt *opt, struct nbuf_obj *o,
+	const struct nbuf_obj *root)
+{
+	struct ctx ctx = {
+		.in = root->buf,
+		.out = opt->outbuf,
+		.max_depth = (opt->max_depth > 0) ? opt->max_depth : 500,
+		.no_merge = opt->no_merge,
+	};
+	struct memo_slot *m;
+	size_t offset = nbuf_obj_hdr_offset(root), newoff;
+	struct hdr h;
+	char *p;
+	bool rc = false;
+
+	nbuf_init_ex(&ctx.canon, 0);
+	if (!read_hdr(&h, ctx.in, offset))
+		goto err;
+	/* The root is never shared; it is copied first to stay first. */
+	if (!(p = nbuf_alloc_aligned(ctx.out, h.hdr_size + h.size,
+		sizeof (nbuf_word_t))))
+		goto err;
+	newoff = p - ctx.out->base;
+	memcpy(p, ctx.in->base + offset, h.hdr_size + h.size);
+	if (!memo_grow(&ctx))
+		goto err;
+	m = memo_find(&ctx, offset);
+	m->key = offset + 1;
+	m->val = VISITING;
+	ctx.memo_n++;
+	if (!copy_children(&ctx, offset, &h))
+		goto err;
+	memo_find(&ctx, offset)->val = (uint32_t) newoff;
+	link_children(&ctx, offset, &h, newoff, NULL);
+	o->buf = ctx.out;
+	o->offset = newoff;
+	(void) nbuf_get_obj(o);
+	rc = true;
+err:
+	free(ctx.memo);
+	free(ctx.objs);
+	nbuf_clear(&ctx.canon);
+	return rc;
+}
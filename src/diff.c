@@ -0,0 +1,674 @@
+#include "libnbuf.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* A patch lists the fields whose value is replaced, with their new values
+ * in a message of its own, and patches in turn the messages held by both
+ * versions, down to the fields that changed.  Subtrees are compared by
+ * their bytes, so an unchanged one is skipped at the cost of a memcmp, or
+ * of nothing when both versions share it, as after nbuf_apply_patch.
+ *
+ * A patch is applied in place to the root.  The objects below it are
+ * copied on write, since they may be shared: the old version stays
+ * reachable, as garbage, until the buffer is compacted.
+ */
+
+struct ctx {
+	struct nbuf_buf *out;
+	int depth, max_depth;
+};
+
+/* A field patched in turn */
+struct patched {
+	unsigned field, index;
+};
+
+/* An object in the input */
+struct hdr {
+	size_t hdr_size, size;  /* of the header, and of the elements */
+	size_t len;
+	unsigned ssize, psize;
+};
+
+static bool
+read_hdr(struct hdr *h, const struct nbuf_buf *buf, size_t offset)
+{
+	nbuf_word_t hdr;
+	size_t esize;
+
+	if (offset % sizeof hdr || offset + sizeof hdr > buf->len)
+		return false;
+	hdr = nbuf_word(buf->base + offset);
+	h->hdr_size = sizeof hdr;
+	if (!(hdr & NBUF_HDR_MASK))
+		return false;
+	if (hdr & NBUF_BARR_MASK) {
+		h->ssize = 1;
+		h->psize = 0;
+		h->len = hdr & NBUF_BLEN_MASK;
+	} else {
+		h->ssize = NBUF_SSIZE(hdr);
+		h->psize = NBUF_PSIZE(hdr);
+		h->len = 1;
+		if (hdr & NBUF_ARR_MASK) {
+			h->hdr_size += sizeof hdr;
+			if (offset + h->hdr_size > buf->len)
+				return false;
+			h->len = nbuf_word(buf->base + offset + sizeof hdr);
+		}
+	}
+	esize = h->ssize + h->psize * sizeof hdr;
+	if (esize && h->len > (buf->len - offset - h->hdr_size) / esize)
+		return false;
+	h->size = h->len * esize;
+	return true;
+}
+
+/* Gets the target of the pointer at offset.  Returns false if null. */
+static bool
+ptr_target(const struct nbuf_buf *buf, size_t offset, size_t *target)
+{
+	nbuf_word_t rel_ptr = nbuf_word(buf->base + offset);
+
+	*target = (uint32_t) (offset + rel_ptr * sizeof rel_ptr);
+	return rel_ptr != 0;
+}
+
+/* Sets the pointer at offset to the header at target. */
+static void
+set_ptr(struct nbuf_buf *buf, size_t offset, size_t target)
+{
+	nbuf_set_word(buf->base + offset,
+		(nbuf_word_t) ((target - offset) / sizeof (nbuf_word_t)));
+}
+
+/* Gets the header offset of pointer index of o.  Returns false if null. */
+static bool
+ptr_at(const struct nbuf_obj *o, unsigned index, size_t *target)
+{
+	return index < o->psize && ptr_target(o->buf,
+		o->offset + index * sizeof (nbuf_word_t), target);
+}
+
+static bool same_tree(struct ctx *ctx, const struct nbuf_buf *a, size_t aoff,
+	const struct nbuf_buf *b, size_t boff);
+
+/* Compares n elements of esize bytes, psize of which are pointers. */
+static bool
+same_elems(struct ctx *ctx, const struct nbuf_buf *a, size_t aoff,
+	const struct nbuf_buf *b, size_t boff, size_t n, size_t esize,
+	unsigned psize)
+{
+	size_t pos = psize * sizeof (nbuf_word_t), i, j, ta, tb;
+
+	if (psize == 0)
+		return memcmp(a->base + aoff, b->base + boff, n * esize) == 0;
+	for (i = 0; i < n; i++, aoff += esize, boff += esize) {
+		if (memcmp(a->base + aoff + pos, b->base + boff + pos,
+			esize - pos) != 0)
+			return false;
+		for (j = 0; j < pos; j += sizeof (nbuf_word_t)) {
+			bool sa = ptr_target(a, aoff + j, &ta);
+			bool sb = ptr_target(b, boff + j, &tb);
+
+			if (sa != sb || (sa && !same_tree(ctx, a, ta, b, tb)))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Tells whether two subtrees are equal.  Malformed ones are not. */
+static bool
+same_tree(struct ctx *ctx, const struct nbuf_buf *a, size_t aoff,
+	const struct nbuf_buf *b, size_t boff)
+{
+	struct hdr ha, hb;
+	bool rc = false;
+
+	if (a == b && aoff == boff)
+		return true;
+	if (++ctx->depth > ctx->max_depth ||
+		!read_hdr(&ha, a, aoff) || !read_hdr(&hb, b, boff) ||
+		ha.len != hb.len || ha.ssize != hb.ssize || ha.psize != hb.psize)
+		goto out;
+	rc = same_elems(ctx, a, aoff + ha.hdr_size, b, boff + hb.hdr_size,
+		ha.len, ha.ssize + ha.psize * sizeof (nbuf_word_t), ha.psize);
+out:
+	ctx->depth--;
+	return rc;
+}
+
+/* Copies the subtree at offset in buf to out, with nbuf_dedup. */
+static bool
+copy_tree(struct ctx *ctx, struct nbuf_buf *out, const struct nbuf_buf *buf,
+	size_t offset, size_t *newp)
+{
+	struct nbuf_dedup_opt opt = {
+		.outbuf = out,
+		.max_depth = ctx->max_depth - ctx->depth + 1,
+		.no_merge = true,
+	};
+	struct nbuf_obj root = { (struct nbuf_buf *) buf }, o;
+	struct hdr h;
+
+	if (!read_hdr(&h, buf, offset))
+		return false;
+	root.offset = offset + h.hdr_size;
+	root.ssize = h.ssize;
+	root.psize = h.psize;
+	if (!nbuf_dedup(&opt, &o, &root))
+		return false;
+	*newp = nbuf_obj_hdr_offset(&o);
+	return true;
+}
+
+static bool
+is_ptr_field(nbuf_Kind kind, nbuf_MsgDef mdef)
+{
+	return nbuf_is_repeated(kind) || kind == nbuf_Kind_STR ||
+		(kind == nbuf_Kind_MSG && !nbuf_MsgDef_is_struct(mdef));
+}
+
+/* Gets the size of a scalar field, or 0 for a bitfield. */
+static unsigned
+scalar_size(nbuf_FieldDef fdef, nbuf_Kind kind, unsigned ssize,
+	nbuf_MsgDef mdef)
+{
+	unsigned count = nbuf_FieldDef_count(fdef);
+	unsigned size;
+
+	if (nbuf_FieldDef_bits(fdef))
+		return 0;
+	if (kind == nbuf_Kind_MSG)
+		size = nbuf_MsgDef_ssize(mdef);
+	else if (kind == nbuf_Kind_ENUM)
+		size = 2;
+	else
+		size = ssize;
+	return count ? size * count : size;
+}
+
+/* Gets a scalar field, which reads as 0 beyond the scalar part. */
+static unsigned
+get_scalar(char *val, const struct nbuf_obj *o, nbuf_FieldDef fdef,
+	unsigned size)
+{
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	const char *p;
+
+	if (!size) {
+		p = nbuf_obj_s(o, offset, 1);
+		return p ? nbuf_get_bits(p, nbuf_FieldDef_shift(fdef),
+			nbuf_FieldDef_bits(fdef)) : 0;
+	}
+	if ((p = nbuf_obj_s(o, offset, size)))
+		memcpy(val, p, size);
+	else
+		memset(val, 0, size);
+	return 0;
+}
+
+/* Copies a scalar field from src to o.  Returns false if o lacks it. */
+static bool
+set_scalar(const struct nbuf_obj *o, const struct nbuf_obj *src,
+	nbuf_FieldDef fdef, unsigned size)
+{
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	char *p = nbuf_obj_s(o, offset, size ? size : 1);
+	unsigned x;
+
+	if (!p)
+		return false;
+	x = get_scalar(p, src, fdef, size);
+	if (!size)
+		nbuf_set_bits(p, nbuf_FieldDef_shift(fdef),
+			nbuf_FieldDef_bits(fdef), x);
+	return true;
+}
+
+static bool
+same_scalar(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	nbuf_FieldDef fdef, unsigned size)
+{
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	const char *pa, *pb, *p;
+
+	if (!size)
+		return get_scalar(NULL, a, fdef, 0) == get_scalar(NULL, b, fdef, 0);
+	pa = nbuf_obj_s(a, offset, size);
+	pb = nbuf_obj_s(b, offset, size);
+	if (pa && pb)
+		return memcmp(pa, pb, size) == 0;
+	if (!(p = pa ? pa : pb))
+		return true;
+	while (size--)
+		if (*p++)
+			return false;
+	return true;
+}
+
+size_t
+nbuf_patch_value(struct nbuf_obj *v, struct nbuf_buf *vbuf, nbuf_Patch patch)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_Patch_raw_value(&o, patch);
+
+	nbuf_init_ro(vbuf, (const char *) nbuf_obj_base(&o), n);
+	v->buf = vbuf;
+	v->offset = 0;
+	return n ? nbuf_get_obj(v) : 0;
+}
+
+/* Copies the fields replaced by the patch from new to a value message. */
+static bool
+make_value(struct ctx *ctx, nbuf_Patch patch, const struct nbuf_obj *new,
+	nbuf_MsgDef mdef, const struct nbuf_buf *replaced)
+{
+	struct nbuf_buf vbuf;
+	struct nbuf_obj v = { &vbuf };
+	nbuf_FieldDef fdef;
+	char *p;
+	size_t i, j, target, t;
+	bool rc = false;
+
+	nbuf_init_ex(&vbuf, 0);
+	v.ssize = new->ssize;
+	v.psize = new->psize;
+	if (!nbuf_alloc_obj(&v))
+		goto err;
+	memset(nbuf_obj_base(&v), 0, nbuf_obj_size(&v));
+	for (i = 0; i < replaced->len / sizeof (uint16_t); i++) {
+		unsigned k = ((const uint16_t *) replaced->base)[i];
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind;
+		nbuf_UnionDef udef;
+		unsigned index;
+		bool hashed;
+
+		nbuf_MsgDef_fields(&fdef, mdef, k);
+		kind = nbuf_get_field_type(&u.o, fdef);
+		if (!is_ptr_field(kind, u.mdef)) {
+			set_scalar(&v, new, fdef, scalar_size(fdef, kind, u.o.ssize, u.mdef));
+			continue;
+		}
+		index = nbuf_FieldDef_offset(fdef);
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			unsigned offset = nbuf_UnionDef_offset(udef);
+			unsigned tag = nbuf_obj_union_tag(new, offset);
+
+			if (tag)
+				nbuf_set_u16(nbuf_obj_s(&v, offset, 2), tag);
+			if (tag != nbuf_FieldDef_tag(fdef))
+				continue;
+		}
+		/* with the hash index in the next pointer */
+		hashed = nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_HASHED;
+		for (j = index; j <= index + hashed; j++) {
+			if (!ptr_at(new, j, &target))
+				continue;
+			if (!copy_tree(ctx, &vbuf, new->buf, target, &t))
+				goto err;
+			set_ptr(&vbuf, v.offset + j * sizeof (nbuf_word_t), t);
+		}
+	}
+	if (!(p = (char *) nbuf_Patch_alloc_value(patch, vbuf.len)))
+		goto err;
+	memcpy(p, vbuf.base, vbuf.len);
+	rc = true;
+err:
+	nbuf_clear(&vbuf);
+	return rc;
+}
+
+static bool diff_msg(struct ctx *ctx, nbuf_Patch patch,
+	const struct nbuf_obj *old, const struct nbuf_obj *new, nbuf_MsgDef mdef);
+
+/* Compares pointer field fdef of old and new, each set if held. */
+static bool
+diff_ptr(struct ctx *ctx, struct nbuf_buf *replaced, struct nbuf_buf *patched,
+	const struct nbuf_obj *old, const struct nbuf_obj *new, uint16_t k,
+	nbuf_FieldDef fdef, nbuf_Kind kind)
+{
+	unsigned index = nbuf_FieldDef_offset(fdef);
+	struct nbuf_obj a, b;
+	struct nbuf_key key;
+	struct patched *p;
+	size_t ta, tb, n, i;
+	bool sa = old && ptr_at(old, index, &ta);
+	bool sb = new && ptr_at(new, index, &tb);
+
+	if (!sa && !sb)
+		return true;
+	if (sa && sb && same_tree(ctx, old->buf, ta, new->buf, tb))
+		return true;
+	/* A message held by both is patched, if its layout is the same */
+	if (sa && sb && (kind & ~nbuf_Kind_ARR) == nbuf_Kind_MSG &&
+		!nbuf_lookup_key(&key, fdef) &&
+		(n = nbuf_obj_p(&a, old, index)) == nbuf_obj_p(&b, new, index) &&
+		n > 0 && a.ssize == b.ssize && a.psize == b.psize) {
+		for (i = 0; i < n; i++) {
+			if (same_elems(ctx, a.buf, a.offset, b.buf, b.offset, 1,
+				nbuf_obj_size(&a), a.psize))
+				goto next;
+			if (!(p = (struct patched *) nbuf_alloc(patched, sizeof *p)))
+				return false;
+			p->field = k;
+			p->index = i;
+next:
+			nbuf_next(&a);
+			nbuf_next(&b);
+		}
+		return true;
+	}
+	return nbuf_add(replaced, (const char *) &k, sizeof k) != NULL;
+}
+
+/* Writes to patch the changes from old to new. */
+static bool
+diff_msg(struct ctx *ctx, nbuf_Patch patch, const struct nbuf_obj *old,
+	const struct nbuf_obj *new, nbuf_MsgDef mdef)
+{
+	struct nbuf_buf replaced, patched;
+	const struct patched *p;
+	nbuf_FieldDef fdef;
+	nbuf_FieldPatch fp;
+	nbuf_Patch sub;
+	struct nbuf_obj a, b;
+	size_t n, i;
+	unsigned k;
+	char *q;
+	bool rc = false;
+
+	nbuf_init_ex(&replaced, 0);
+	nbuf_init_ex(&patched, 0);
+	if (++ctx->depth > ctx->max_depth)
+		goto err;
+	for (k = 0, n = nbuf_MsgDef_fields(&fdef, mdef, 0); k < n;
+		k++, nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+		nbuf_UnionDef udef;
+		uint16_t k16 = k;
+
+		if (!is_ptr_field(kind, u.mdef)) {
+			if (!same_scalar(old, new, fdef,
+				scalar_size(fdef, kind, u.o.ssize, u.mdef)) &&
+				!nbuf_add(&replaced, (const char *) &k16, sizeof k16))
+				goto err;
+			continue;
+		}
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			/* A member held by old only is replaced if the
+			 * union is cleared, otherwise by the new member. */
+			unsigned offset = nbuf_UnionDef_offset(udef);
+			unsigned tag = nbuf_FieldDef_tag(fdef);
+			unsigned otag = nbuf_obj_union_tag(old, offset);
+			unsigned ntag = nbuf_obj_union_tag(new, offset);
+
+			if (otag != tag && ntag != tag)
+				continue;
+			if (ntag != tag) {
+				if (ntag == 0 &&
+					!nbuf_add(&replaced, (const char *) &k16, sizeof k16))
+					goto err;
+				continue;
+			}
+			if (otag != tag) {
+				if (!nbuf_add(&replaced, (const char *) &k16, sizeof k16))
+					goto err;
+				continue;
+			}
+		}
+		if (!diff_ptr(ctx, &replaced, &patched, old, new, k, fdef,
+			kind))
+			goto err;
+	}
+
+	if ((n = replaced.len / sizeof (uint16_t)) > 0) {
+		if (!(q = (char *) nbuf_Patch_alloc_replaced(patch, n)))
+			goto err;
+		for (i = 0; i < n; i++)
+			nbuf_set_u16(q + i * sizeof (uint16_t),
+				((const uint16_t *) replaced.base)[i]);
+		if (!make_value(ctx, patch, new, mdef, &replaced))
+			goto err;
+	}
+	if ((n = patched.len / sizeof *p) > 0 &&
+		!nbuf_Patch_alloc_patched(&fp, patch, n))
+		goto err;
+	if (n > 0)
+		memset(nbuf_obj_base(NBUF_OBJ(fp)), 0,
+			n * nbuf_obj_size(NBUF_OBJ(fp)));
+	for (i = 0, p = (const struct patched *) patched.base; i < n;
+		i++, p++, nbuf_next(NBUF_OBJ(fp))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		unsigned index;
+
+		nbuf_MsgDef_fields(&fdef, mdef, p->field);
+		nbuf_get_field_type(&u.o, fdef);
+		index = nbuf_FieldDef_offset(fdef);
+		nbuf_FieldPatch_set_field(fp, p->field);
+		nbuf_FieldPatch_set_index(fp, p->index);
+		if (!nbuf_FieldPatch_alloc_patch(&sub, fp))
+			goto err;
+		memset(nbuf_obj_base(NBUF_OBJ(sub)), 0,
+			nbuf_obj_size(NBUF_OBJ(sub)));
+		nbuf_obj_p(&a, old, index);
+		nbuf_obj_p(&b, new, index);
+		nbuf_advance(&a, p->index);
+		nbuf_advance(&b, p->index);
+		if (!diff_msg(ctx, sub, &a, &b, u.mdef))
+			goto err;
+	}
+	rc = true;
+err:
+	ctx->depth--;
+	nbuf_clear(&replaced);
+	nbuf_clear(&patched);
+	return rc;
+}
+
+bool
+nbuf_diff(const struct nbuf_diff_opt *opt, struct nbuf_obj *patch,
+	const struct nbuf_obj *from, const struct nbuf_obj *to,
+	nbuf_MsgDef mdef)
+{
+	struct ctx ctx = {
+		.out = opt->outbuf,
+		.max_depth = (opt->max_depth > 0) ? opt->max_depth : 500,
+	};
+	nbuf_Patch p;
+
+	if (!nbuf_alloc_Patch(&p, ctx.out))
+		return false;
+	memset(nbuf_obj_base(NBUF_OBJ(p)), 0, nbuf_obj_size(NBUF_OBJ(p)));
+	if (!diff_msg(&ctx, p, from, to, mdef))
+		return false;
+	*patch = *NBUF_OBJ(p);
+	return true;
+}
+
+/* Copies the object whose header is at offset in buf to the end of buf,
+ * with elements of at least ssize and psize.  Its pointers point to the
+ * same targets.
+ */
+static bool
+dup_obj(struct nbuf_obj *o, struct nbuf_buf *buf, size_t offset,
+	unsigned ssize, unsigned psize)
+{
+	struct hdr h;
+	size_t esize, i, j, src, dst, target;
+	bool is_arr;
+
+	if (!read_hdr(&h, buf, offset))
+		return false;
+	is_arr = nbuf_word(buf->base + offset) & (NBUF_ARR_MASK|NBUF_BARR_MASK);
+	o->buf = buf;
+	o->ssize = ssize > h.ssize ? ssize : h.ssize;
+	o->psize = psize > h.psize ? psize : h.psize;
+	if (!(is_arr ? nbuf_alloc_arr(o, h.len) : nbuf_alloc_obj(o)))
+		return false;
+	esize = h.ssize + h.psize * sizeof (nbuf_word_t);
+	memset(nbuf_obj_base(o), 0, h.len * nbuf_obj_size(o));
+	for (i = 0; i < h.len; i++) {
+		src = offset + h.hdr_size + i * esize;
+		dst = o->offset + i * nbuf_obj_size(o);
+		memcpy(buf->base + dst + o->psize * sizeof (nbuf_word_t),
+			buf->base + src + h.psize * sizeof (nbuf_word_t), h.ssize);
+		for (j = 0; j < h.psize; j++)
+			if (ptr_target(buf, src + j * sizeof (nbuf_word_t), &target))
+				set_ptr(buf, dst + j * sizeof (nbuf_word_t), target);
+	}
+	return true;
+}
+
+static bool apply_msg(struct ctx *ctx, struct nbuf_obj *o, nbuf_Patch patch,
+	nbuf_MsgDef mdef, bool is_elem);
+
+/* Replaces field fdef of o with that of the value v. */
+static bool
+replace_field(struct ctx *ctx, const struct nbuf_obj *o,
+	const struct nbuf_obj *v, nbuf_FieldDef fdef, nbuf_MsgDef mdef)
+{
+	union {
+		struct nbuf_obj o;
+		nbuf_MsgDef mdef;
+	} u;
+	nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+	unsigned index = nbuf_FieldDef_offset(fdef);
+	nbuf_UnionDef udef;
+	size_t target, t, j;
+	bool hashed = nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_HASHED;
+	char *p;
+
+	if (!is_ptr_field(kind, u.mdef))
+		return set_scalar(o, v, fdef, scalar_size(fdef, kind, u.o.ssize, u.mdef));
+	if (nbuf_lookup_union(&udef, mdef, fdef)) {
+		unsigned offset = nbuf_UnionDef_offset(udef);
+		unsigned tag = nbuf_obj_union_tag(v, offset);
+
+		if (!(p = nbuf_obj_s(o, offset, 2)))
+			return false;
+		nbuf_set_u16(p, tag);
+		if (tag != nbuf_FieldDef_tag(fdef) && tag != 0)
+			return true;
+	}
+	for (j = index; j <= index + hashed; j++) {
+		if (j >= o->psize)
+			return false;
+		if (!ptr_at(v, j, &target)) {
+			nbuf_set_word(o->buf->base + o->offset +
+				j * sizeof (nbuf_word_t), 0);
+			continue;
+		}
+		if (!copy_tree(ctx, o->buf, v->buf, target, &t))
+			return false;
+		set_ptr(o->buf, o->offset + j * sizeof (nbuf_word_t), t);
+	}
+	return true;
+}
+
+/* Applies patch to o.  o is copied first if the value has more fields, in
+ * which case it must not be an element of an array.
+ */
+static bool
+apply_msg(struct ctx *ctx, struct nbuf_obj *o, nbuf_Patch patch,
+	nbuf_MsgDef mdef, bool is_elem)
+{
+	struct nbuf_buf vbuf;
+	struct nbuf_obj v, arr, elem;
+	nbuf_FieldDef fdef;
+	nbuf_FieldPatch fp;
+	nbuf_Patch sub;
+	size_t n, nfields, i, target;
+	unsigned k, prev = UINT32_MAX;
+	bool rc = false;
+
+	if (++ctx->depth > ctx->max_depth)
+		goto err;
+	nfields = nbuf_MsgDef_fields(&fdef, mdef, 0);
+	if ((n = nbuf_Patch_replaced_size(patch)) > 0) {
+		if (!nbuf_patch_value(&v, &vbuf, patch))
+			goto err;
+		if (v.ssize > o->ssize || v.psize > o->psize) {
+			if (is_elem || !dup_obj(o, o->buf, nbuf_obj_hdr_offset(o),
+				v.ssize, v.psize))
+				goto err;
+		}
+		for (i = 0; i < n; i++) {
+			if ((k = nbuf_Patch_replaced(patch, i)) >= nfields)
+				goto err;
+			nbuf_MsgDef_fields(&fdef, mdef, k);
+			if (!replace_field(ctx, o, &v, fdef, mdef))
+				goto err;
+		}
+	}
+	for (i = 0, n = nbuf_Patch_patched(&fp, patch, 0); i < n;
+		i++, nbuf_next(NBUF_OBJ(fp))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind;
+		unsigned index;
+		size_t len;
+
+		if ((k = nbuf_FieldPatch_field(fp)) >= nfields)
+			goto err;
+		nbuf_MsgDef_fields(&fdef, mdef, k);
+		kind = nbuf_get_field_type(&u.o, fdef);
+		if ((kind & ~nbuf_Kind_ARR) != nbuf_Kind_MSG ||
+			nbuf_MsgDef_is_struct(u.mdef) ||
+			!nbuf_FieldPatch_patch(&sub, fp))
+			goto err;
+		index = nbuf_FieldDef_offset(fdef);
+		/* copied once for all the elements patched */
+		if (k != prev) {
+			if (!ptr_at(o, index, &target) ||
+				!dup_obj(&arr, o->buf, target, 0, 0))
+				goto err;
+			set_ptr(o->buf, o->offset + index * sizeof (nbuf_word_t),
+				nbuf_obj_hdr_offset(&arr));
+			prev = k;
+		}
+		len = nbuf_obj_p(&elem, o, index);
+		if (nbuf_FieldPatch_index(fp) >= len)
+			goto err;
+		nbuf_advance(&elem, nbuf_FieldPatch_index(fp));
+		if (!apply_msg(ctx, &elem, sub, u.mdef, nbuf_is_repeated(kind)))
+			goto err;
+		/* a message may have moved to grow */
+		if (!nbuf_is_repeated(kind))
+			set_ptr(o->buf, o->offset + index * sizeof (nbuf_word_t),
+				nbuf_obj_hdr_offset(&elem));
+	}
+	rc = true;
+err:
+	ctx->depth--;
+	return rc;
+}
+
+bool
+nbuf_apply_patch(struct nbuf_obj *o, const struct nbuf_obj *patch,
+	nbuf_MsgDef mdef)
+{
+	struct ctx ctx = {
+		.out = o->buf,
+		.max_depth = 500,
+	};
+	nbuf_Patch p;
+
+	*NBUF_OBJ(p) = *patch;
+	return apply_msg(&ctx, o, p, mdef, false);
+}
@@ -0,0 +1,407 @@
+#include "libnbuf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The free map is an array of extents sorted by offset, with adjacent
+ * extents merged.  Extents are word-aligned, as every object starts at a
+ * word boundary, and an extent reaching the end of the buffer shrinks the
+ * buffer instead.
+ */
+
+void
+nbuf_edit_init(struct nbuf_edit *ed, struct nbuf_buf *buf)
+{
+	ed->buf = buf;
+	ed->free = NULL;
+	ed->nfree = ed->cap = 0;
+	ed->free_bytes = 0;
+}
+
+void
+nbuf_edit_clear(struct nbuf_edit *ed)
+{
+	free(ed->free);
+	ed->free = NULL;
+	ed->nfree = ed->cap = 0;
+	ed->free_bytes = 0;
+}
+
+/* Loads the object whose header is at offset, and returns the aligned size
+ * of its extent, or 0 if malformed.
+ */
+static size_t
+load_obj(const struct nbuf_buf *buf, size_t offset, struct nbuf_obj *o,
+	size_t *lenp)
+{
+	nbuf_word_t hdr;
+
+	if (offset % sizeof hdr || offset + sizeof hdr > buf->len)
+		return 0;
+	hdr = nbuf_word(buf->base + offset);
+	o->buf = (struct nbuf_buf *) buf;
+	o->offset = offset;
+	*lenp = nbuf_get_obj(o);
+	/* an empty message has no scalars or pointers either */
+	if (o->ssize == 0 && o->psize == 0 &&
+		(!(hdr & NBUF_HDR_MASK) || (hdr & NBUF_BARR_MASK) ||
+		NBUF_SSIZE(hdr) || NBUF_PSIZE(hdr)))
+		return 0;
+	return NBUF_ALLOC_ALIGN(o->offset - offset + *lenp * nbuf_obj_size(o));
+}
+
+static void
+release(struct nbuf_edit *ed, size_t offset, size_t size)
+{
+	struct nbuf_extent *e;
+	size_t i, n = ed->nfree;
+
+	if (size == 0)
+		return;
+	for (i = n; i > 0 && ed->free[i - 1].offset > offset; i--)
+		;
+	if (i > 0 && ed->free[i - 1].offset + ed->free[i - 1].size == offset) {
+		e = &ed->free[--i];
+		e->size += size;
+	} else {
+		if (n == ed->cap) {
+			size_t cap = n ? 2 * n : 16;
+
+			e = (struct nbuf_extent *) realloc(ed->free, cap * sizeof *e);
+			if (!e)
+				return;  /* lost until nbuf_gc */
+			ed->free = e;
+			ed->cap = cap;
+		}
+		memmove(&ed->free[i + 1], &ed->free[i], (n - i) * sizeof *e);
+		e = &ed->free[i];
+		e->offset = (uint32_t) offset;
+		e->size = (uint32_t) size;
+		ed->nfree = ++n;
+	}
+	ed->free_bytes += size;
+	if (i + 1 < n && e->offset + e->size == ed->free[i + 1].offset) {
+		e->size += ed->free[i + 1].size;
+		memmove(&ed->free[i + 1], &ed->free[i + 2], (n - i - 2) * sizeof *e);
+		ed->nfree = --n;
+	}
+	if (i + 1 == n && e->offset + e->size >= ed->buf->len) {
+		ed->buf->len = e->offset;
+		ed->free_bytes -= e->size;
+		ed->nfree--;
+	}
+}
+
+/* Takes size bytes from the free extent starting at offset.
+ * Returns false if there is none, or if it is too small.
+ */
+static bool
+take_at(struct nbuf_edit *ed, size_t offset, size_t size)
+{
+	struct nbuf_extent *e;
+	size_t i;
+
+	for (i = 0; i < ed->nfree && ed->free[i].offset < offset; i++)
+		;
+	e = &ed->free[i];
+	if (i == ed->nfree || e->offset != offset || e->size < size)
+		return false;
+	e->offset += size;
+	e->size -= size;
+	ed->free_bytes -= size;
+	if (e->size == 0) {
+		memmove(e, e + 1, (ed->nfree - i - 1) * sizeof *e);
+		ed->nfree--;
+	}
+	return true;
+}
+
+/* Allocates size zeroed bytes from the first free extent large enough, or
+ * at the end of the buffer.
+ */
+static bool
+alloc_extent(struct nbuf_edit *ed, size_t size, size_t *offset)
+{
+	size_t i;
+	char *p;
+
+	size = NBUF_ALLOC_ALIGN(size);
+	for (i = 0; i < ed->nfree; i++) {
+		if (ed->free[i].size >= size) {
+			*offset = ed->free[i].offset;
+			take_at(ed, *offset, size);
+			memset(ed->buf->base + *offset, 0, size);
+			return true;
+		}
+	}
+	if (!(p = nbuf_alloc_aligned(ed->buf, size, sizeof (nbuf_word_t))))
+		return false;
+	memset(p, 0, size);
+	*offset = p - ed->buf->base;
+	return true;
+}
+
+size_t
+nbuf_edit_alloc_obj(struct nbuf_edit *ed, struct nbuf_obj *o)
+{
+	size_t size = sizeof (nbuf_word_t) + nbuf_obj_size(o), offset;
+
+	o->buf = ed->buf;
+	if (!alloc_extent(ed, size, &offset)) {
+		o->offset = 0;
+		o->ssize = o->psize = 0;
+		return 0;
+	}
+	nbuf_set_word(ed->buf->base + offset, NBUF_HDR(o->ssize, o->psize));
+	o->offset = offset + sizeof (nbuf_word_t);
+	return size;
+}
+
+static bool
+is_byte_arr(const struct nbuf_obj *o)
+{
+	return o->psize == 0 && o->ssize == 1;
+}
+
+/* Writes an array header at offset, and sets o->offset to the first
+ * element.
+ */
+static void
+set_arr_hdr(struct nbuf_obj *o, size_t offset, nbuf_word_t len)
+{
+	char *p = o->buf->base + offset;
+
+	if (is_byte_arr(o)) {
+		nbuf_set_word(p, len | NBUF_BARR_MASK | NBUF_HDR_MASK);
+		o->offset = offset + sizeof len;
+	} else {
+		nbuf_set_word(p, NBUF_HDR(o->ssize, o->psize) | NBUF_ARR_MASK);
+		nbuf_set_word(p + sizeof len, len);
+		o->offset = offset + 2 * sizeof len;
+	}
+}
+
+size_t
+nbuf_edit_alloc_arr(struct nbuf_edit *ed, struct nbuf_obj *o, nbuf_word_t len)
+{
+	size_t size = len * nbuf_obj_size(o), offset;
+
+	size += sizeof len + (is_byte_arr(o) ? 0 : sizeof len);
+	o->buf = ed->buf;
+	if (!alloc_extent(ed, size, &offset)) {
+		o->offset = 0;
+		o->ssize = o->psize = 0;
+		return 0;
+	}
+	set_arr_hdr(o, offset, len);
+	return size;
+}
+
+char *
+nbuf_edit_alloc_str(struct nbuf_edit *ed, struct nbuf_obj *o,
+	const char *str, size_t len)
+{
+	char *p;
+
+	if (len + 1 == 0)
+		len = strlen(str);
+	o->ssize = 1;
+	o->psize = 0;
+	if (!nbuf_edit_alloc_arr(ed, o, len + 1))
+		return NULL;
+	p = ed->buf->base + o->offset;
+	if (str != NULL)
+		memcpy(p, str, len);
+	return p;
+}
+
+/* Gets the header offset of the target of pointer index of o.
+ * Returns false if null.
+ */
+static bool
+ptr_target(const struct nbuf_obj *o, size_t index, size_t *target)
+{
+	size_t p = o->offset + index * sizeof (nbuf_word_t);
+	nbuf_word_t rel_ptr = nbuf_word(o->buf->base + p);
+
+	*target = (uint32_t) (p + rel_ptr * sizeof rel_ptr);
+	return rel_ptr != 0;
+}
+
+/* Frees the object whose header is at offset, and the objects it points
+ * to.  The root, at offset 0, is never freed.
+ */
+static bool
+release_tree(struct nbuf_edit *ed, size_t offset, int depth)
+{
+	struct nbuf_obj o, e;
+	size_t len, size = load_obj(ed->buf, offset, &o, &len), i, j, target;
+
+	if (size == 0 || depth > 500)
+		return false;
+	e = o;
+	for (i = 0; i < len; i++) {
+		e.offset = o.offset + i * nbuf_obj_size(&o);
+		for (j = 0; j < o.psize; j++) {
+			if (ptr_target(&e, j, &target) &&
+				!release_tree(ed, target, depth + 1))
+				return false;
+		}
+	}
+	if (offset > 0)
+		release(ed, offset, size);
+	return true;
+}
+
+bool
+nbuf_edit_free(struct nbuf_edit *ed, const struct nbuf_obj *o, size_t index)
+{
+	size_t target;
+
+	if (index >= o->psize)
+		return false;
+	if (ptr_target(o, index, &target) && !release_tree(ed, target, 0))
+		return false;
+	return nbuf_obj_set_p(o, index, NULL) != 0;
+}
+
+bool
+nbuf_edit_set_p(struct nbuf_edit *ed, const struct nbuf_obj *o, size_t index,
+	const struct nbuf_obj *rhs)
+{
+	size_t target;
+
+	if (index >= o->psize)
+		return false;
+	if (ptr_target(o, index, &target) &&
+		(rhs == NULL || target != nbuf_obj_hdr_offset(rhs)) &&
+		!release_tree(ed, target, 0))
+		return false;
+	return nbuf_obj_set_p(o, index, rhs) != 0;
+}
+
+char *
+nbuf_edit_set_str(struct nbuf_edit *ed, const struct nbuf_obj *o, size_t index,
+	const char *str, size_t len)
+{
+	struct nbuf_obj s;
+	size_t target, oldlen, size, newsize;
+	char *p;
+
+	if (len + 1 == 0)
+		len = strlen(str);
+	if (index >= o->psize)
+		return NULL;
+	newsize = NBUF_ALLOC_ALIGN(sizeof (nbuf_word_t) + len + 1);
+	if (ptr_target(o, index, &target) &&
+		(size = load_obj(ed->buf, target, &s, &oldlen)) >= newsize &&
+		is_byte_arr(&s)) {
+		/* rewrite in place, and free the rest */
+		set_arr_hdr(&s, target, len + 1);
+		p = ed->buf->base + s.offset;
+		memmove(p, str, len);
+		memset(p + len, 0, newsize - sizeof (nbuf_word_t) - len);
+		release(ed, target + newsize, size - newsize);
+		return p;
+	}
+	if (!nbuf_edit_alloc_str(ed, &s, str, len) ||
+		!nbuf_edit_set_p(ed, o, index, &s))
+		return NULL;
+	return ed->buf->base + s.offset;
+}
+
+bool
+nbuf_edit_resize_arr(struct nbuf_edit *ed, struct nbuf_obj *arr,
+	const struct nbuf_obj *o, size_t index, nbuf_word_t len)
+{
+	size_t target, oldlen, size, newsize, hdr_size, esize, i, j, p, offset;
+	struct nbuf_obj a, e;
+	nbuf_word_t hdr, rel_ptr;
+
+	if (index >= o->psize)
+		return false;
+	if (!ptr_target(o, index, &target)) {
+		return nbuf_edit_alloc_arr(ed, arr, len) &&
+			nbuf_obj_set_p(o, index, arr);
+	}
+	if (!(size = load_obj(ed->buf, target, &a, &oldlen)))
+		return false;
+	hdr = nbuf_word(ed->buf->base + target);
+	if (!(hdr & (NBUF_BARR_MASK | NBUF_ARR_MASK)))
+		return false;  /* not an array */
+	hdr_size = a.offset - target;
+	esize = nbuf_obj_size(&a);
+	newsize = NBUF_ALLOC_ALIGN(hdr_size + len * esize);
+
+	/* Free what the elements cut off point to. */
+	for (e = a, i = len; i < oldlen; i++) {
+		e.offset = a.offset + i * esize;
+		for (j = 0; j < a.psize; j++)
+			if (!nbuf_edit_free(ed, &e, j))
+				return false;
+	}
+	if (newsize <= size) {
+		set_arr_hdr(&a, target, len);
+		if (len > oldlen)
+			memset(ed->buf->base + a.offset + oldlen * esize, 0,
+				(len - oldlen) * esize);
+		release(ed, target + newsize, size - newsize);
+		*arr = a;
+		return true;
+	}
+
+	/* Grow in place at the end of the buffer, or into free space. */
+	if (target + size >= ed->buf->len) {
+		if (!nbuf_alloc(ed->buf, target + newsize - ed->buf->len))
+			return false;
+	} else if (!take_at(ed, target + size, newsize - size)) {
+		/* Relocate: the pointers in the elements move the other way. */
+		if (!alloc_extent(ed, newsize, &offset))
+			return false;
+		memcpy(ed->buf->base + offset, ed->buf->base + target,
+			hdr_size + oldlen * esize);
+		for (i = 0; i < oldlen; i++) {
+			p = offset + hdr_size + i * esize;
+			for (j = 0; j < a.psize; j++, p += sizeof rel_ptr) {
+				if (!(rel_ptr = nbuf_word(ed->buf->base + p)))
+					continue;
+				rel_ptr += (nbuf_word_t) (((ptrdiff_t) target -
+					(ptrdiff_t) offset) / (ptrdiff_t) sizeof rel_ptr);
+				nbuf_set_word(ed->buf->base + p, rel_ptr);
+			}
+		}
+		release(ed, target, size);
+		target = offset;
+		set_arr_hdr(&a, target, oldlen);
+		nbuf_obj_set_p(o, index, &a);
+	}
+	set_arr_hdr(&a, target, len);
+	memset(ed->buf->base + a.offset + oldlen * esize, 0,
+		newsize - hdr_size - oldlen * esize);
+	*arr = a;
+	return true;
+}
+
+bool
+nbuf_gc(struct nbuf_edit *ed, struct nbuf_obj *root)
+{
+	struct nbuf_buf newbuf;
+	struct nbuf_dedup_opt opt = {
+		.outbuf = &newbuf,
+		.no_merge = true,
+	};
+	struct nbuf_obj o;
+
+	nbuf_init_ex(&newbuf, ed->buf->len - ed->free_bytes);
+	if (!nbuf_dedup(&opt, &o, root)) {
+		nbuf_clear(&newbuf);
+		return false;
+	}
+	nbuf_clear(ed->buf);
+	*ed->buf = newbuf;
+	nbuf_edit_clear(ed);
+	*root = o;
+	root->buf = ed->buf;
+	return true;
+}
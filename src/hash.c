@@ -0,0 +1,1082 @@
+#include "libnbuf.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Messages are compared and hashed by what reads through the schema, in a
+ * canonical form that does not depend on how they were written:
+ *
+ * - the scalar part is taken as mdef lays it out, with the bytes of the
+ *   fields and union tags only, so padding, unused bits and scalars beyond
+ *   the end of an older message read as 0;
+ * - pointers are followed field by field, and a null pointer is the same as
+ *   an empty string, array or message, which reads the same;
+ * - fields unknown to mdef, the hash index of hashed fields, and the members
+ *   of a union other than the one set are left out.
+ *
+ * Packed arrays are compared by their bytes, as their varints are as short
+ * as they can be.  Floats are compared by their bits.
+ *
+ * The hash is XXH64 over a stream of the canonical bytes: each message hashes
+ * its scalar part and its non-empty pointer fields, preceded by their index.
+ * Arrays of scalars or structs go into the stream in bulk, and sub-messages
+ * by their own hash, so a nested message hashes the same wherever it is.
+ * Integers are written in little endian, so the hash is stable across
+ * platforms.
+ *
+ * A scalar part is made canonical by masking it with the bits its fields
+ * hold, which takes one pass over the schema for each message type, whose
+ * mask is kept for the other messages of that type.  Large ones are masked
+ * through a window, so no memory is allocated.
+ *
+ * The hasher and the reading of each kind of pointer field are in nbuf.h,
+ * shared with the code nbufc generates for each message type, which must
+ * give the same results.
+ */
+
+#define MAX_LAYOUTS 8
+#define MAX_PTR_FIELDS 128
+
+/* A pointer field of a message type, with its type looked up */
+struct ptr_field {
+	nbuf_FieldDef fdef;
+	nbuf_Kind kind;
+	struct nbuf_obj type;
+	unsigned k;  /* number of the field in the message */
+	unsigned index;  /* of the pointer */
+	nbuf_Encoding enc;
+	bool bits;
+	bool member;  /* of a union, with this tag */
+	unsigned tag_offset, tag;
+	bool hashed;  /* has a hash index, on this key */
+	unsigned key_offset;
+};
+
+/* The mask of the scalar part of a message type, and its pointer fields */
+struct layout {
+	/* the MsgDef */
+	const struct nbuf_buf *buf;
+	uint32_t offset;
+	unsigned char *mask;
+	bool dense;  /* all bits are set: no padding or unused bits */
+	const struct ptr_field *fields;
+	unsigned nfields;
+};
+
+struct ctx {
+	int depth;
+	uint64_t seed;
+	struct layout layouts[MAX_LAYOUTS];
+	unsigned nlayouts;
+	size_t masks_len;
+	unsigned char masks[2048];
+	unsigned nfields;
+	struct ptr_field fields[MAX_PTR_FIELDS];
+	unsigned char window[512], mask_window[512];
+	/* the canonical layout being written, or where its next object
+	 * starts when checked */
+	struct nbuf_buf *buf;
+	size_t next;
+};
+
+/* Tells whether a field of this kind may be a pointer, before looking up
+ * its type.
+ */
+static bool
+has_ptr(nbuf_Kind kind)
+{
+	return nbuf_is_repeated(kind) || kind == nbuf_Kind_STR ||
+		kind == nbuf_Kind_MSG;
+}
+
+static bool
+is_ptr_field(nbuf_Kind kind, nbuf_MsgDef mdef)
+{
+	return nbuf_is_repeated(kind) || kind == nbuf_Kind_STR ||
+		(kind == nbuf_Kind_MSG && !nbuf_MsgDef_is_struct(mdef));
+}
+
+/* Looks up field fdef of mdef, the k-th, into f.  Returns false unless it
+ * is a pointer field.
+ */
+static bool
+get_ptr_field(struct ptr_field *f, nbuf_FieldDef fdef, unsigned k,
+	nbuf_MsgDef mdef)
+{
+	nbuf_UnionDef udef;
+	nbuf_MsgDef type;
+	struct nbuf_key key;
+
+	if (!has_ptr(nbuf_FieldDef_kind(fdef)))
+		return false;
+	f->kind = nbuf_get_field_type(&f->type, fdef);
+	type.o = f->type;
+	if (!is_ptr_field(f->kind, type))
+		return false;
+	f->fdef = fdef;
+	f->k = k;
+	f->index = nbuf_FieldDef_offset(fdef);
+	f->enc = nbuf_FieldDef_encoding(fdef);
+	f->bits = nbuf_FieldDef_bits(fdef) != 0;
+	f->hashed = f->enc == nbuf_Encoding_HASHED &&
+		nbuf_lookup_key(&key, fdef);
+	if (f->hashed)
+		f->key_offset = key.offset;
+	f->member = nbuf_lookup_union(&udef, mdef, fdef);
+	if (f->member) {
+		f->tag_offset = nbuf_UnionDef_offset(udef);
+		f->tag = nbuf_FieldDef_tag(fdef);
+	}
+	return true;
+}
+
+/* Tells whether field f of o is the union member that is set, or not a
+ * union member at all.
+ */
+static bool
+is_set_field(const struct nbuf_obj *o, const struct ptr_field *f)
+{
+	return !f->member || nbuf_obj_union_tag(o, f->tag_offset) == f->tag;
+}
+
+static void
+ctx_init(struct ctx *ctx, uint64_t seed)
+{
+	ctx->depth = 0;
+	ctx->seed = seed;
+	ctx->nlayouts = 0;
+	ctx->masks_len = 0;
+	ctx->nfields = 0;
+	ctx->buf = NULL;
+	ctx->next = 0;
+}
+
+/* Tells whether the n bytes at p are all c. */
+static bool
+all_bytes(const unsigned char *p, size_t n, unsigned char c)
+{
+	return n == 0 || (p[0] == c && memcmp(p, p + 1, n - 1) == 0);
+}
+
+/* Sets the bytes [offset, offset + size) of a scalar part in m, if they
+ * fall in the window [lo, lo + n) that m holds.
+ */
+static void
+mask_in(unsigned char *m, size_t lo, size_t n, size_t offset, size_t size)
+{
+	size_t b = offset > lo ? offset : lo;
+	size_t e = offset + size < lo + n ? offset + size : lo + n;
+
+	if (b < e)
+		memset(m + (b - lo), 0xff, e - b);
+}
+
+/* Sets in m, which holds bytes [lo, lo + n) of the scalar part of mdef, the
+ * bits of its fields and union tags.
+ */
+static void
+mask_scalars(unsigned char *m, size_t lo, size_t n, nbuf_MsgDef mdef)
+{
+	nbuf_FieldDef fdef;
+	nbuf_UnionDef udef;
+	size_t i;
+
+	for (i = nbuf_MsgDef_fields(&fdef, mdef, 0); i--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind = nbuf_FieldDef_kind(fdef);
+		size_t offset = nbuf_FieldDef_offset(fdef);
+		unsigned bits, count;
+		size_t size, b, e;
+
+		/* only messages need their type looked up */
+		if (nbuf_is_repeated(kind) || kind == nbuf_Kind_STR ||
+			(kind != nbuf_Kind_ENUM &&
+			is_ptr_field(nbuf_get_field_type(&u.o, fdef), u.mdef)))
+			continue;
+		if ((bits = nbuf_FieldDef_bits(fdef))) {
+			if (offset >= lo && offset < lo + n)
+				m[offset - lo] |= ((1u << bits) - 1) <<
+					nbuf_FieldDef_shift(fdef);
+			continue;
+		}
+		if (kind == nbuf_Kind_MSG) {
+			/* a struct, through the part of the window it covers */
+			size = nbuf_MsgDef_ssize(u.mdef);
+			b = offset > lo ? offset : lo;
+			e = offset + size < lo + n ? offset + size : lo + n;
+			if (b < e)
+				mask_scalars(m + (b - lo), b - offset, e - b,
+					u.mdef);
+			continue;
+		}
+		size = (kind == nbuf_Kind_ENUM) ? 2 : u.o.ssize;
+		if ((count = nbuf_FieldDef_count(fdef)))
+			size *= count;
+		mask_in(m, lo, n, offset, size);
+	}
+	for (i = nbuf_MsgDef_unions(&udef, mdef, 0); i--;
+		nbuf_next(NBUF_OBJ(udef)))
+		mask_in(m, lo, n, nbuf_UnionDef_offset(udef), 2);
+}
+
+/* Gets the layout of mdef, which is made once.  Returns NULL if there is
+ * no room left for it.
+ */
+static const struct layout *
+get_layout(struct ctx *ctx, nbuf_MsgDef mdef)
+{
+	const struct nbuf_obj *o = NBUF_OBJ(mdef);
+	size_t ssize = nbuf_MsgDef_ssize(mdef);
+	struct ptr_field *f = ctx->fields + ctx->nfields;
+	nbuf_FieldDef fdef;
+	struct layout *l;
+	unsigned i, k, n;
+
+	for (i = 0; i < ctx->nlayouts; i++) {
+		l = &ctx->layouts[i];
+		if (l->buf == o->buf && l->offset == o->offset)
+			return l;
+	}
+	if (i == MAX_LAYOUTS || ssize > sizeof ctx->masks - ctx->masks_len)
+		return NULL;
+	for (k = 0, n = nbuf_MsgDef_fields(&fdef, mdef, 0); k < n;
+		k++, nbuf_next(NBUF_OBJ(fdef))) {
+		if (f == ctx->fields + MAX_PTR_FIELDS)
+			return NULL;
+		if (get_ptr_field(f, fdef, k, mdef))
+			f++;
+	}
+	l = &ctx->layouts[ctx->nlayouts++];
+	l->fields = ctx->fields + ctx->nfields;
+	l->nfields = f - l->fields;
+	ctx->nfields += l->nfields;
+	l->buf = o->buf;
+	l->offset = o->offset;
+	l->mask = ctx->masks + ctx->masks_len;
+	ctx->masks_len += ssize;
+	memset(l->mask, 0, ssize);
+	mask_scalars(l->mask, 0, ssize, mdef);
+	l->dense = all_bytes(l->mask, ssize, 0xff);
+	return l;
+}
+
+/* Gets to p the canonical bytes [lo, lo + n) of the scalar part of o, with
+ * the mask l of mdef, or a mask made for the window if l is NULL.  Returns
+ * true if any bit is set.
+ */
+static bool
+canon_scalars(struct ctx *ctx, unsigned char *p, size_t lo, size_t n,
+	const struct nbuf_obj *o, nbuf_MsgDef mdef, const struct layout *l)
+{
+	const unsigned char *q = (const unsigned char *) nbuf_obj_s(o, 0, 0);
+	const unsigned char *m = ctx->mask_window;
+	size_t end = o->ssize > lo ? o->ssize - lo : 0, i;
+	unsigned char any = 0;
+
+	if (l) {
+		m = l->mask + lo;
+	} else {
+		memset(ctx->mask_window, 0, n);
+		mask_scalars(ctx->mask_window, lo, n, mdef);
+	}
+	if (end > n)
+		end = n;
+	/* a word at a time, then the rest */
+	for (i = 0; i + 8 <= end; i += 8) {
+		uint64_t x, y;
+
+		memcpy(&x, q + lo + i, 8);
+		memcpy(&y, m + i, 8);
+		x &= y;
+		memcpy(p + i, &x, 8);
+		any |= x != 0;
+	}
+	for (; i < end; i++) {
+		p[i] = q[lo + i] & m[i];
+		any |= p[i];
+	}
+	memset(p + end, 0, n - end);
+	return any != 0;
+}
+
+/* Tells whether field fdef of o is the union member that is set, or not a
+ * union member at all.
+ */
+static bool
+is_set_member(const struct nbuf_obj *o, nbuf_FieldDef fdef, nbuf_MsgDef mdef)
+{
+	nbuf_UnionDef udef;
+
+	return !nbuf_lookup_union(&udef, mdef, fdef) ||
+		nbuf_obj_union_tag(o, nbuf_UnionDef_offset(udef)) ==
+		nbuf_FieldDef_tag(fdef);
+}
+
+/* Gets the number of bits of a bitset, and the mask of its last byte. */
+static size_t
+bitset_len(const struct nbuf_obj *o, size_t len, unsigned *last_mask)
+{
+	size_t nbits = nbuf_bitset_size(o, len);
+
+	*last_mask = (1u << (nbits % 8)) - 1;
+	return nbits;
+}
+
+static bool same_msg(struct ctx *ctx, const struct nbuf_obj *a,
+	const struct nbuf_obj *b, nbuf_MsgDef mdef);
+
+static bool
+same_scalars(struct ctx *ctx, const struct nbuf_obj *a,
+	const struct nbuf_obj *b, nbuf_MsgDef mdef)
+{
+	size_t ssize = nbuf_MsgDef_ssize(mdef), half = sizeof ctx->window / 2;
+	const struct layout *l;
+	unsigned char *p = ctx->window;
+	size_t lo, n;
+
+	if (a->ssize == b->ssize && memcmp(nbuf_obj_s(a, 0, 0),
+		nbuf_obj_s(b, 0, 0), a->ssize) == 0)
+		return true;
+	l = get_layout(ctx, mdef);
+	for (lo = 0; lo < ssize; lo += n) {
+		n = ssize - lo < half ? ssize - lo : half;
+		canon_scalars(ctx, p, lo, n, a, mdef, l);
+		canon_scalars(ctx, p + half, lo, n, b, mdef, l);
+		if (memcmp(p, p + half, n) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Compares pointer field fdef of a and b. */
+static bool
+same_field(struct ctx *ctx, const struct nbuf_obj *a,
+	const struct nbuf_obj *b, nbuf_FieldDef fdef, nbuf_Kind kind,
+	const struct nbuf_obj *type)
+{
+	unsigned index = nbuf_FieldDef_offset(fdef);
+	nbuf_Encoding enc = nbuf_FieldDef_encoding(fdef);
+	nbuf_MsgDef mdef = { *type };
+	struct nbuf_obj aa, bb;
+	size_t na = nbuf_obj_p(&aa, a, index);
+	size_t nb = nbuf_obj_p(&bb, b, index);
+	size_t i;
+
+	if (na == 0 && nb == 0)
+		return true;
+	if (na && nb && aa.buf == bb.buf && aa.offset == bb.offset)
+		return true;
+	if (nbuf_FieldDef_bits(fdef))
+		return nbuf_same_bitset_field(a, b, index);
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA)
+		return nbuf_same_packed_field(a, b, index);
+	if (kind == nbuf_Kind_STR)
+		return nbuf_same_str_field(a, b, index);
+	if (kind == nbuf_Kind_MSG)
+		return same_msg(ctx, &aa, &bb, mdef);
+	if (na != nb)
+		return false;
+	switch ((int) kind) {
+	case nbuf_Kind_STR|nbuf_Kind_ARR:
+		return nbuf_same_str_arr_field(a, b, index);
+	case nbuf_Kind_MSG|nbuf_Kind_ARR:
+		if (nbuf_MsgDef_psize(mdef) == 0 && nbuf_same_bytes(&aa, &bb, na))
+			return true;
+		for (i = 0; i < na; i++, nbuf_next(&aa), nbuf_next(&bb))
+			if (!same_msg(ctx, &aa, &bb, mdef))
+				return false;
+		return true;
+	default:
+		/* scalars, compared as wide as the schema has them */
+		return nbuf_same_scalar_arr_field(a, b, index,
+			(kind & ~nbuf_Kind_ARR) == nbuf_Kind_ENUM ? 2 : type->ssize);
+	}
+}
+
+static bool
+same_msg(struct ctx *ctx, const struct nbuf_obj *a, const struct nbuf_obj *b,
+	nbuf_MsgDef mdef)
+{
+	nbuf_FieldDef fdef;
+	size_t n;
+	bool rc = false;
+
+	if (a->buf == b->buf && a->offset == b->offset &&
+		a->ssize == b->ssize && a->psize == b->psize)
+		return true;
+	if (++ctx->depth > NBUF_MAX_DEPTH || !same_scalars(ctx, a, b, mdef))
+		goto out;
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind = nbuf_FieldDef_kind(fdef);
+
+		if (!has_ptr(kind))
+			continue;
+		kind = nbuf_get_field_type(&u.o, fdef);
+		if (!is_ptr_field(kind, u.mdef) || !is_set_member(a, fdef, mdef))
+			continue;
+		if (!same_field(ctx, a, b, fdef, kind, &u.o))
+			goto out;
+	}
+	rc = true;
+out:
+	ctx->depth--;
+	return rc;
+}
+
+bool
+nbuf_equal(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	nbuf_MsgDef mdef)
+{
+	struct ctx ctx;
+
+	ctx_init(&ctx, 0);
+	return same_msg(&ctx, a, b, mdef);
+}
+
+static bool hash_msg(struct ctx *ctx, uint64_t *h, const struct nbuf_obj *o,
+	nbuf_MsgDef mdef);
+
+/* Writes the canonical scalar part of o to s.  Returns false if it is all
+ * zero.
+ */
+static bool
+hash_scalars(struct ctx *ctx, struct nbuf_hasher *s, const struct nbuf_obj *o,
+	nbuf_MsgDef mdef, const struct layout *l)
+{
+	size_t ssize = nbuf_MsgDef_ssize(mdef), lo, n;
+	const unsigned char *p;
+	bool set = false;
+
+	/* already canonical */
+	if (l && l->dense && o->ssize == ssize) {
+		p = (const unsigned char *) nbuf_obj_s(o, 0, 0);
+		nbuf_hasher_update(s, p, ssize);
+		return !all_bytes(p, ssize, 0);
+	}
+	for (lo = 0; lo < ssize; lo += n) {
+		n = ssize - lo < sizeof ctx->window ?
+			ssize - lo : sizeof ctx->window;
+		if (canon_scalars(ctx, ctx->window, lo, n, o, mdef, l))
+			set = true;
+		nbuf_hasher_update(s, ctx->window, n);
+	}
+	return set;
+}
+
+/* Writes pointer field f of o to s, preceded by its number, unless it is
+ * empty.  Returns false if it is.
+ */
+static bool
+hash_field(struct ctx *ctx, struct nbuf_hasher *s, const struct nbuf_obj *o,
+	const struct ptr_field *f)
+{
+	nbuf_Kind kind = f->kind;
+	nbuf_Encoding enc = f->enc;
+	const struct nbuf_obj *type = &f->type;
+	nbuf_MsgDef mdef = { *type };
+	unsigned k = f->k;
+	struct nbuf_obj oo;
+	size_t n, size, i;
+	const struct layout *l;
+	uint64_t h;
+
+	if (f->bits)
+		return nbuf_hash_bitset_field(s, o, f->index, k);
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA)
+		return nbuf_hash_packed_field(s, o, f->index, k);
+	switch ((int) kind) {
+	case nbuf_Kind_STR:
+		return nbuf_hash_str_field(s, o, f->index, k);
+	case nbuf_Kind_STR|nbuf_Kind_ARR:
+		return nbuf_hash_str_arr_field(s, o, f->index, k);
+	case nbuf_Kind_MSG:
+		if (!nbuf_obj_p(&oo, o, f->index) || !hash_msg(ctx, &h, &oo, mdef))
+			return false;
+		nbuf_hasher_update_u64(s, k);
+		nbuf_hasher_update_u64(s, h);
+		return true;
+	case nbuf_Kind_MSG|nbuf_Kind_ARR:
+		break;
+	default:
+		return nbuf_hash_scalar_arr_field(s, o, f->index, k,
+			(kind & ~nbuf_Kind_ARR) == nbuf_Kind_ENUM ? 2 : type->ssize);
+	}
+	if (!(n = nbuf_obj_p(&oo, o, f->index)))
+		return false;
+	nbuf_hasher_update_u64(s, k);
+	nbuf_hasher_update_u64(s, n);
+	if (nbuf_MsgDef_psize(mdef) > 0) {
+		for (i = 0; i < n; i++, nbuf_next(&oo)) {
+			hash_msg(ctx, &h, &oo, mdef);
+			nbuf_hasher_update_u64(s, h);
+		}
+		return true;
+	}
+	/* Elements without pointers go into the stream as they are if they
+	 * have no padding, or one by one. */
+	size = nbuf_MsgDef_ssize(mdef);
+	l = get_layout(ctx, mdef);
+	if (oo.ssize == size && oo.psize == 0 && l && l->dense) {
+		nbuf_hasher_update(s, nbuf_obj_base(&oo), n * size);
+		return true;
+	}
+	for (i = 0; i < n; i++, nbuf_next(&oo))
+		hash_scalars(ctx, s, &oo, mdef, l);
+	return true;
+}
+
+/* Sets *h to the hash of o.  Returns false if o is empty, reading as a null
+ * message.
+ */
+static bool
+hash_msg(struct ctx *ctx, uint64_t *h, const struct nbuf_obj *o,
+	nbuf_MsgDef mdef)
+{
+	const struct layout *l = get_layout(ctx, mdef);
+	struct nbuf_hasher s;
+	struct ptr_field f;
+	nbuf_FieldDef fdef;
+	unsigned k, i;
+	size_t n;
+	bool set;
+
+	nbuf_hasher_init(&s, ctx->seed);
+	set = hash_scalars(ctx, &s, o, mdef, l);
+	if (++ctx->depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (l) {
+		for (i = 0; i < l->nfields; i++)
+			if (is_set_field(o, &l->fields[i]) &&
+				hash_field(ctx, &s, o, &l->fields[i]))
+				set = true;
+	} else {
+		for (k = 0, n = nbuf_MsgDef_fields(&fdef, mdef, 0); k < n;
+			k++, nbuf_next(NBUF_OBJ(fdef)))
+			if (get_ptr_field(&f, fdef, k, mdef) &&
+				is_set_field(o, &f) && hash_field(ctx, &s, o, &f))
+				set = true;
+	}
+out:
+	ctx->depth--;
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+void
+nbuf_scalar_mask(unsigned char *m, nbuf_MsgDef mdef)
+{
+	size_t ssize = nbuf_MsgDef_ssize(mdef);
+
+	memset(m, 0, ssize);
+	mask_scalars(m, 0, ssize, mdef);
+}
+
+uint64_t
+nbuf_hash(const struct nbuf_obj *o, nbuf_MsgDef mdef, uint64_t seed)
+{
+	struct ctx ctx;
+	uint64_t h;
+
+	ctx_init(&ctx, seed);
+	hash_msg(&ctx, &h, o, mdef);
+	return h;
+}
+
+/* Canonical layout
+ *
+ * A message is written in its canonical form, laid out in a fixed order:
+ * each object is followed by the objects it points to, depth first, in the
+ * order of the fields of mdef, and the elements of an array by what they
+ * point to, one after the other.  Messages have the sizes mdef gives them,
+ * empty strings, arrays and messages are null pointers, nothing is shared,
+ * and padding is zeroed.  The hash index of a hashed field follows it, made
+ * anew.  Messages that read the same are thus written with the same bytes.
+ *
+ * The check walks a buffer in the same order, expecting each object where
+ * the writer would have put it, with the same header and bytes.
+ */
+
+/* Pads buf with zeros to a word boundary. */
+static bool
+pad_out(struct nbuf_buf *buf)
+{
+	size_t n = NBUF_ALLOC_ALIGN(buf->len) - buf->len;
+	char *p;
+
+	if (n == 0)
+		return true;
+	if (!(p = nbuf_alloc(buf, n)))
+		return false;
+	memset(p, 0, n);
+	return true;
+}
+
+/* Allocates a zeroed message of type mdef in ctx->buf. */
+static bool
+out_msg(struct ctx *ctx, struct nbuf_obj *o, nbuf_MsgDef mdef)
+{
+	o->buf = ctx->buf;
+	o->ssize = nbuf_MsgDef_ssize(mdef);
+	o->psize = nbuf_MsgDef_psize(mdef);
+	if (!pad_out(ctx->buf) || !nbuf_alloc_obj(o))
+		return false;
+	memset(nbuf_obj_base(o), 0, nbuf_obj_size(o));
+	return true;
+}
+
+/* Allocates a zeroed array of n elements in ctx->buf. */
+static bool
+out_arr(struct ctx *ctx, struct nbuf_obj *o, unsigned ssize, unsigned psize,
+	size_t n)
+{
+	o->buf = ctx->buf;
+	o->ssize = ssize;
+	o->psize = psize;
+	if (!pad_out(ctx->buf) || !nbuf_alloc_arr(o, (nbuf_word_t) n))
+		return false;
+	memset(nbuf_obj_base(o), 0, n * nbuf_obj_size(o));
+	return true;
+}
+
+static bool write_msg(struct ctx *ctx, const struct nbuf_obj *o,
+	const struct nbuf_obj *v, nbuf_MsgDef mdef, bool *set);
+
+/* Writes pointer field fdef of v to o, and what it points to.  Sets *set
+ * unless the field is empty, and left null.
+ */
+static bool
+write_field(struct ctx *ctx, const struct nbuf_obj *o,
+	const struct nbuf_obj *v, nbuf_FieldDef fdef, nbuf_Kind kind,
+	const struct nbuf_obj *type, bool *set)
+{
+	unsigned index = nbuf_FieldDef_offset(fdef);
+	nbuf_Encoding enc = nbuf_FieldDef_encoding(fdef);
+	nbuf_MsgDef mdef = { *type };
+	struct nbuf_obj vv, oo, ve, oe, sv, so, idx;
+	size_t n = nbuf_obj_p(&vv, v, index);
+	size_t start = ctx->buf->len, size, i, len;
+	struct nbuf_key key;
+	unsigned mask;
+	unsigned char *p;
+	bool eset;
+
+	*set = false;
+	if (kind == nbuf_Kind_MSG) {
+		if (!n)
+			return true;
+		if (!out_msg(ctx, &oo, mdef) ||
+			!write_msg(ctx, &oo, &vv, mdef, set))
+			return false;
+		if (!*set) {
+			ctx->buf->len = start;
+			return true;
+		}
+		goto done;
+	}
+	if (nbuf_FieldDef_bits(fdef)) {
+		if (!(len = bitset_len(&vv, n, &mask)))
+			return true;
+		if (!out_arr(ctx, &oo, 1, 0, n))
+			return false;
+		p = (unsigned char *) nbuf_obj_base(&oo);
+		memcpy(p, nbuf_obj_base(&vv), n);
+		if (mask)
+			p[len / 8] &= mask;
+		goto done;
+	}
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA) {
+		if (!nbuf_packed_size(&vv, n))
+			return true;
+		if (!out_arr(ctx, &oo, 1, 0, n))
+			return false;
+		memcpy(nbuf_obj_base(&oo), nbuf_obj_base(&vv), n);
+		goto done;
+	}
+	if (kind == nbuf_Kind_STR) {
+		nbuf_obj2str(&vv, n, &len);
+		if (!len)
+			return true;
+		if (!out_arr(ctx, &oo, 1, 0, len + 1))
+			return false;
+		memcpy(nbuf_obj_base(&oo), nbuf_obj_base(&vv), len);
+		goto done;
+	}
+	if (!n)
+		return true;
+	switch ((int) kind) {
+	case nbuf_Kind_STR|nbuf_Kind_ARR:
+		if (!out_arr(ctx, &oo, 0, 1, n))
+			return false;
+		for (i = 0, ve = vv, oe = oo; i < n;
+			i++, nbuf_next(&ve), nbuf_next(&oe)) {
+			len = nbuf_obj_p(&sv, &ve, 0);
+			nbuf_obj2str(&sv, len, &len);
+			if (!len)
+				continue;
+			if (!out_arr(ctx, &so, 1, 0, len + 1))
+				return false;
+			memcpy(nbuf_obj_base(&so), nbuf_obj_base(&sv), len);
+			nbuf_obj_set_p(&oe, 0, &so);
+		}
+		break;
+	case nbuf_Kind_MSG|nbuf_Kind_ARR:
+		if (!out_arr(ctx, &oo, nbuf_MsgDef_ssize(mdef),
+			nbuf_MsgDef_psize(mdef), n))
+			return false;
+		for (i = 0, ve = vv, oe = oo; i < n;
+			i++, nbuf_next(&ve), nbuf_next(&oe))
+			if (!write_msg(ctx, &oe, &ve, mdef, &eset))
+				return false;
+		break;
+	default:
+		size = (kind & ~nbuf_Kind_ARR) == nbuf_Kind_ENUM ? 2 : type->ssize;
+		if (!out_arr(ctx, &oo, size, 0, n))
+			return false;
+		p = (unsigned char *) nbuf_obj_base(&oo);
+		if (vv.ssize == size) {
+			memcpy(p, nbuf_obj_base(&vv), n * size);
+			break;
+		}
+		len = vv.ssize < size ? vv.ssize : size;
+		for (i = 0; i < n; i++, nbuf_next(&vv))
+			memcpy(p + i * size, nbuf_obj_base(&vv), len);
+		break;
+	}
+done:
+	*set = true;
+	nbuf_obj_set_p(o, index, &oo);
+	if (enc == nbuf_Encoding_HASHED && index + 1 < o->psize &&
+		nbuf_lookup_key(&key, fdef)) {
+		if (!pad_out(ctx->buf) ||
+			!nbuf_alloc_hash_index(&idx, &oo, n, key.offset))
+			return false;
+		nbuf_obj_set_p(o, index + 1, &idx);
+	}
+	return true;
+}
+
+/* Writes v, a message of type mdef, to o, allocated for it in ctx->buf,
+ * and what it points to.  Sets *set unless it is empty.
+ */
+static bool
+write_msg(struct ctx *ctx, const struct nbuf_obj *o, const struct nbuf_obj *v,
+	nbuf_MsgDef mdef, bool *set)
+{
+	size_t ssize = nbuf_MsgDef_ssize(mdef), lo, n;
+	const struct layout *l = get_layout(ctx, mdef);
+	nbuf_FieldDef fdef;
+	bool rc = false, fset;
+
+	*set = false;
+	for (lo = 0; lo < ssize; lo += n) {
+		n = ssize - lo < sizeof ctx->window ?
+			ssize - lo : sizeof ctx->window;
+		if (canon_scalars(ctx, (unsigned char *) nbuf_obj_s(o, lo, n),
+			lo, n, v, mdef, l))
+			*set = true;
+	}
+	if (++ctx->depth > NBUF_MAX_DEPTH)
+		goto out;
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind = nbuf_FieldDef_kind(fdef);
+
+		if (!has_ptr(kind))
+			continue;
+		kind = nbuf_get_field_type(&u.o, fdef);
+		if (!is_ptr_field(kind, u.mdef) || !is_set_member(v, fdef, mdef))
+			continue;
+		if (!write_field(ctx, o, v, fdef, kind, &u.o, &fset))
+			goto out;
+		if (fset)
+			*set = true;
+	}
+	rc = true;
+out:
+	ctx->depth--;
+	return rc;
+}
+
+bool
+nbuf_canonicalize(struct nbuf_buf *outbuf, struct nbuf_obj *o,
+	const struct nbuf_obj *root, nbuf_MsgDef mdef)
+{
+	struct ctx ctx;
+	size_t start = outbuf->len;
+	bool set;
+
+	ctx_init(&ctx, 0);
+	ctx.buf = outbuf;
+	if (!out_msg(&ctx, o, mdef) || !write_msg(&ctx, o, root, mdef, &set) ||
+		!pad_out(outbuf)) {
+		outbuf->len = start;
+		return false;
+	}
+	return true;
+}
+
+/* Tells whether the n bytes at p have no bit outside of mask m. */
+static bool
+check_mask(const unsigned char *p, const unsigned char *m, size_t n)
+{
+	uint64_t x, y, bad = 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&x, p + i, 8);
+		memcpy(&y, m + i, 8);
+		bad |= x & ~y;
+	}
+	for (; i < n; i++)
+		bad |= p[i] & ~m[i];
+	return bad == 0;
+}
+
+static bool
+is_zero(const char *p, size_t n)
+{
+	while (n--)
+		if (*p++)
+			return false;
+	return true;
+}
+
+/* Checks that pointer index of o is null, or points to the next object in
+ * canonical order, of elements of ssize and psize, with the header that
+ * nbuf_alloc_arr, or nbuf_alloc_obj unless arr, would give it.  Sets oo to
+ * the object, and *n to its length.
+ */
+static bool
+check_obj(struct ctx *ctx, struct nbuf_obj *oo, const struct nbuf_obj *o,
+	size_t index, unsigned ssize, unsigned psize, bool arr, size_t *n)
+{
+	const struct nbuf_buf *buf = o->buf;
+	size_t start = NBUF_ALLOC_ALIGN(ctx->next), hdr_size = sizeof (nbuf_word_t);
+	size_t ptr_offset = o->offset + index * sizeof (nbuf_word_t);
+	nbuf_word_t hdr, rel_ptr;
+
+	*n = 0;
+	if (index >= o->psize ||
+		(rel_ptr = nbuf_word(buf->base + ptr_offset)) == 0)
+		return true;
+	/* offsets wrap around in readers, so other words may point there
+	 * too; only the exact one is canonical */
+	if (ptr_offset + (size_t) rel_ptr * sizeof rel_ptr != start ||
+		!(*n = nbuf_obj_p(oo, o, index)))
+		return false;
+	if (!arr) {
+		hdr = NBUF_HDR(ssize, psize);
+	} else if (ssize == 1 && psize == 0) {
+		hdr = (nbuf_word_t) *n | NBUF_BARR_MASK | NBUF_HDR_MASK;
+	} else {
+		hdr = NBUF_HDR(ssize, psize) | NBUF_ARR_MASK;
+		hdr_size += sizeof hdr;
+	}
+	if (oo->offset != start + hdr_size || nbuf_word(buf->base + start) != hdr ||
+		(hdr_size > sizeof hdr && nbuf_word(buf->base + start + sizeof hdr) != *n) ||
+		!is_zero(buf->base + ctx->next, start - ctx->next))
+		return false;
+	ctx->next = oo->offset + *n * nbuf_obj_size(oo);
+	return true;
+}
+
+/* Checks the hash index idx of m slots, of the array o of n elements, by
+ * probing for each element in order, as nbuf_alloc_hash_index inserts
+ * them: the slots before the one of an element must hold earlier ones.
+ */
+static bool
+check_hash_index(const struct nbuf_obj *idx, size_t m,
+	const struct nbuf_obj *o, size_t n, unsigned index)
+{
+	const char *slots = (const char *) nbuf_obj_base(idx);
+	size_t want = 2, used = 0, i, slot, e, len;
+	const char *s;
+
+	while (want < 2 * n)
+		want *= 2;
+	if (m != want)
+		return false;
+	for (i = 0; i < m; i++)
+		if (nbuf_u32(slots + i * sizeof (uint32_t)) != 0)
+			used++;
+	if (used != n)
+		return false;
+	for (i = 0; i < n; i++) {
+		s = nbuf_key_str_at(o, i, index, &len);
+		slot = nbuf_hash_str(s, len) & (m - 1);
+		/* stops at an empty slot, as there are more slots than elements */
+		while ((e = nbuf_u32(slots + slot * sizeof (uint32_t))) != i + 1) {
+			if (e == 0 || e > i)
+				return false;
+			slot = (slot + 1) & (m - 1);
+		}
+	}
+	return true;
+}
+
+static bool check_msg(struct ctx *ctx, const struct nbuf_obj *o,
+	nbuf_MsgDef mdef, bool *set);
+
+/* Checks pointer field f of o, and what it points to.  Adds to *nptrs the
+ * number of pointers it sets.
+ */
+static bool
+check_field(struct ctx *ctx, const struct nbuf_obj *o,
+	const struct ptr_field *f, size_t *nptrs)
+{
+	nbuf_Kind kind = f->kind;
+	unsigned index = f->index;
+	nbuf_Encoding enc = f->enc;
+	const struct nbuf_obj *type = &f->type;
+	nbuf_MsgDef mdef = { *type };
+	struct nbuf_obj oo, e, so, idx;
+	unsigned ssize = 1, psize = 0, mask;
+	size_t n, i, len, m;
+	const unsigned char *p;
+	bool set;
+
+	if (kind == nbuf_Kind_MSG || kind == (nbuf_Kind_MSG|nbuf_Kind_ARR)) {
+		ssize = nbuf_MsgDef_ssize(mdef);
+		psize = nbuf_MsgDef_psize(mdef);
+	} else if (kind == (nbuf_Kind_STR|nbuf_Kind_ARR)) {
+		ssize = 0;
+		psize = 1;
+	} else if (!f->bits && kind != nbuf_Kind_STR &&
+		enc != nbuf_Encoding_PACKED && enc != nbuf_Encoding_DELTA) {
+		ssize = (kind & ~nbuf_Kind_ARR) == nbuf_Kind_ENUM ? 2 : type->ssize;
+	}
+	if (!check_obj(ctx, &oo, o, index, ssize, psize,
+		kind != nbuf_Kind_MSG, &n))
+		return false;
+	if (!n)
+		return true;
+	(*nptrs)++;
+	p = (const unsigned char *) nbuf_obj_base(&oo);
+	if (kind == nbuf_Kind_MSG)
+		return check_msg(ctx, &oo, mdef, &set) && set;
+	if (f->bits)
+		return (len = bitset_len(&oo, n, &mask)) &&
+			(!mask || (p[len / 8] & ~mask) == 0);
+	if (enc == nbuf_Encoding_PACKED || enc == nbuf_Encoding_DELTA)
+		return nbuf_packed_size(&oo, n) != 0;
+	if (kind == nbuf_Kind_STR)
+		return n > 1 && p[n - 1] == '\0';
+	switch ((int) kind) {
+	case nbuf_Kind_STR|nbuf_Kind_ARR:
+		for (i = 0, e = oo; i < n; i++, nbuf_next(&e)) {
+			if (!check_obj(ctx, &so, &e, 0, 1, 0, true, &len))
+				return false;
+			p = (const unsigned char *) nbuf_obj_base(&so);
+			if (len && (len < 2 || p[len - 1] != '\0'))
+				return false;
+		}
+		break;
+	case nbuf_Kind_MSG|nbuf_Kind_ARR:
+		for (i = 0, e = oo; i < n; i++, nbuf_next(&e))
+			if (!check_msg(ctx, &e, mdef, &set))
+				return false;
+		if (f->hashed && index + 1 < o->psize) {
+			if (!check_obj(ctx, &idx, o, index + 1, sizeof (uint32_t),
+				0, true, &m) || !m ||
+				!check_hash_index(&idx, m, &oo, n, f->key_offset))
+				return false;
+			(*nptrs)++;
+		}
+		break;
+	}
+	return true;
+}
+
+/* Checks o, a message of type mdef, with the sizes mdef gives it, and what
+ * it points to.  Sets *set unless it is empty.
+ */
+static bool
+check_msg(struct ctx *ctx, const struct nbuf_obj *o, nbuf_MsgDef mdef,
+	bool *set)
+{
+	size_t ssize = nbuf_MsgDef_ssize(mdef), nptrs = 0, lo, n, i;
+	const struct layout *l = get_layout(ctx, mdef);
+	const unsigned char *q = (const unsigned char *) nbuf_obj_s(o, 0, 0);
+	struct ptr_field f;
+	nbuf_FieldDef fdef;
+	unsigned k;
+	bool rc = false;
+
+	*set = false;
+	if (l && o->ssize == ssize) {
+		/* no bit outside of the mask */
+		if (!l->dense && !check_mask(q, l->mask, ssize))
+			return false;
+		*set = !all_bytes(q, ssize, 0);
+	} else {
+		for (lo = 0; lo < ssize; lo += n) {
+			n = ssize - lo < sizeof ctx->window ?
+				ssize - lo : sizeof ctx->window;
+			if (canon_scalars(ctx, ctx->window, lo, n, o, mdef, l))
+				*set = true;
+			if (memcmp(ctx->window, nbuf_obj_s(o, lo, n), n) != 0)
+				return false;
+		}
+	}
+	if (++ctx->depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (l) {
+		for (i = 0; i < l->nfields; i++)
+			if (is_set_field(o, &l->fields[i]) &&
+				!check_field(ctx, o, &l->fields[i], &nptrs))
+				goto out;
+	} else {
+		for (k = 0, n = nbuf_MsgDef_fields(&fdef, mdef, 0); k < n;
+			k++, nbuf_next(NBUF_OBJ(fdef)))
+			if (get_ptr_field(&f, fdef, k, mdef) &&
+				is_set_field(o, &f) &&
+				!check_field(ctx, o, &f, &nptrs))
+				goto out;
+	}
+	if (nptrs)
+		*set = true;
+	/* no other pointer may be set */
+	for (i = 0; i < o->psize; i++)
+		if (nbuf_word((const char *) nbuf_obj_base(o) +
+			i * sizeof (nbuf_word_t)) != 0)
+			nptrs--;
+	rc = nptrs == 0;
+out:
+	ctx->depth--;
+	return rc;
+}
+
+bool
+nbuf_is_canonical(const struct nbuf_obj *root, nbuf_MsgDef mdef)
+{
+	const struct nbuf_buf *buf = root->buf;
+	unsigned ssize = nbuf_MsgDef_ssize(mdef);
+	unsigned psize = nbuf_MsgDef_psize(mdef);
+	struct ctx ctx;
+	size_t end;
+	bool set;
+
+	if (root->offset != sizeof (nbuf_word_t) || root->ssize != ssize ||
+		root->psize != psize ||
+		nbuf_word(buf->base) != NBUF_HDR(ssize, psize))
+		return false;
+	ctx_init(&ctx, 0);
+	ctx.next = root->offset + nbuf_obj_size(root);
+	if (!check_msg(&ctx, root, mdef, &set))
+		return false;
+	end = NBUF_ALLOC_ALIGN(ctx.next);
+	return end == buf->len && is_zero(buf->base + ctx.next, end - ctx.next);
+}
@@ -31,7 +31,57 @@ size_t nbuf_save_fp(struct nbuf_buf *buf, FILE *f);
 size_t nbuf_save_fd(struct nbuf_buf *buf, int fd);
 size_t nbuf_save_file(struct nbuf_buf *buf, const char *filename);
 
-/* Reflection */
+/* Compressed files
+ *
+ * The buffer is split into blocks, which are compressed separately with
+ * zstd, so a range can be loaded without decompressing the whole file.
+ * These functions fail if the library was built without zstd.
+ */
+struct nbuf_zopt {
+	/* Uncompressed size of each block.
+	 * If set to 0, the default value will be used.
+	 */
+	size_t block_size;
+	/* zstd compression level.  If set to 0, zstd's default is used. */
+	int level;
+	/* Optional dictionary, as trained by nbuf_train_zdict.
+	 * The same dictionary must be used to save and load a file.
+	 */
+	const void *dict;
+	size_t dict_len;
+};
+
+/* Returns true if the first bytes of a file look like a compressed file. */
+bool nbuf_is_zfile(const void *p, size_t len);
+
+/* opt may be NULL for default options.
+ * Returns the uncompressed length, or 0 on failure.
+ */
+size_t nbuf_save_zfp(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f);
+/* Loads the whole file, decompressing block by block into buf. */
+size_t nbuf_load_zfp(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f);
+/* Loads uncompressed bytes [offset, offset + len) into buf.
+ * Only the blocks covering the range are decompressed; the others are
+ * skipped with fseek.
+ */
+size_t nbuf_load_zrange(const struct nbuf_zopt *opt, struct nbuf_buf *buf,
+	FILE *f, size_t offset, size_t len);
+
+/* Trains a dictionary of up to dict_cap bytes from samples, which are
+ * typically encoded messages of the same type.
+ * Returns the dictionary length, or 0 on failure.
+ */
+size_t nbuf_train_zdict(struct nbuf_buf *dict, size_t dict_cap,
+	const struct nbuf_buf *samples, size_t nsamples);
+
+/* Reflection
+ *
+ * A schema set, from generated code or from nbuf_compile, is never modified
+ * after it is created.  Reflection, nbuf_print and nbuf_parse only read it
+ * and keep no global state, so one schema set can be shared by any number
+ * of threads without locking.  Each thread needs its own output buffer and
+ * scratch (see below).
+ */
 
 #ifndef NBUF_SS_IMPORTS
 # define NBUF_SS_IMPORTS 1
@@ -89,6 +139,52 @@ bool nbuf_lookup_defined_type(nbuf_Schema schema, const char *name, nbuf_Kind *k
 bool nbuf_lookup_builtin_type(const char *name, nbuf_Kind *kind, unsigned *type_id);
 bool nbuf_lookup_field(nbuf_FieldDef *fdef, nbuf_MsgDef mdef,
 	const char *name, size_t len);
+/* Gets the union that fdef belongs to.
+ * Returns false if fdef is not a union member.
+ */
+bool nbuf_lookup_union(nbuf_UnionDef *udef, nbuf_MsgDef mdef,
+	nbuf_FieldDef fdef);
+
+/* Key of a keyed repeated message field, as passed to nbuf_find_key and
+ * nbuf_sort_by_key.  fdef is the key field in the element type.
+ */
+struct nbuf_key {
+	nbuf_FieldDef fdef;
+	unsigned offset, width, flags;
+};
+
+/* Looks up the key of a repeated message field.
+ * Returns false if the field has no key, or the key is not valid.
+ */
+bool nbuf_lookup_key(struct nbuf_key *key, nbuf_FieldDef fdef);
+
+/* Scratch memory
+ *
+ * The text format printer and parser need temporary buffers.  Unless a
+ * scratch is given, they allocate and free them on every call.  A scratch
+ * keeps the buffers between calls instead, so a thread that reuses its own
+ * scratch stops allocating once the buffers are large enough.
+ *
+ * A scratch must not be used by two calls at the same time.
+ */
+struct nbuf_scratch_buf;
+struct nbuf_scratch {
+	struct nbuf_scratch_buf *free;
+};
+
+static inline void nbuf_scratch_init(struct nbuf_scratch *scratch)
+{
+	scratch->free = NULL;
+}
+
+/* Frees all the buffers kept by scratch. */
+void nbuf_scratch_clear(struct nbuf_scratch *scratch);
+/* Gets an empty buffer, whose memory is zeroed.
+ * Returns NULL if out of memory.
+ */
+struct nbuf_buf *nbuf_scratch_get(struct nbuf_scratch *scratch);
+/* Gives back a buffer from nbuf_scratch_get. */
+void nbuf_scratch_put(struct nbuf_scratch *scratch, struct nbuf_buf *buf);
 
 /* Text format printer */
 struct nbuf_print_opt {
@@ -110,6 +206,8 @@ struct nbuf_print_opt {
 	 * May be useful if the string contains non-ASCII printable characters.
 	 */
 	bool loose_escape;
+	/* Optional scratch memory */
+	struct nbuf_scratch *scratch;
 };
 
 /* Prints an object whose type is specified by mdef.
@@ -124,6 +222,8 @@ struct nbuf_parse_opt {
 	struct nbuf_buf *outbuf;
 	int max_depth;
 	const char *filename;
+	/* Optional scratch memory */
+	struct nbuf_scratch *scratch;
 };
 
 /* Parses an objet whose type is specified by mdef.
@@ -138,6 +238,226 @@ size_t nbuf_unescape(struct nbuf_buf *buf, const char *s, size_t len);
 #define NBUF_PRINT_LOOSE_ESCAPE 0x80000000U
 void nbuf_print_escaped(FILE *f, const char *s, size_t len, unsigned flags);
 
+/* Deduplication */
+struct nbuf_dedup_opt {
+	struct nbuf_buf *outbuf;
+	/* Max number of nested objects; 500 if set to 0. */
+	int max_depth;
+	/* Only share the objects already shared in the input, to copy it. */
+	bool no_merge;
+};
+
+/* Copies the objects reachable from root to opt->outbuf, storing equal
+ * objects once: two objects are equal if they have the same bytes and
+ * their pointers point to equal objects.  Such objects are shared by
+ * pointing to the same copy, which every reader accepts, as pointers are
+ * relative.  Unreachable space in root's buffer is dropped.
+ *
+ * root must be a message or the first of repeated ones, whose pointers
+ * are in its buffer (see nbuf_fix_arr), and outbuf must be another buffer.
+ * The root is copied first, so it is at offset 0 if outbuf is empty.  On
+ * success, o is set to the copy of the root.  Returns false if out of
+ * memory, if the input is malformed, or if its pointers form a cycle.
+ */
+bool nbuf_dedup(const struct nbuf_dedup_opt *opt, struct nbuf_obj *o,
+	const struct nbuf_obj *root);
+
+/* Equality, hashing and canonical form */
+
+/* Tells whether a and b, both messages of type mdef, read the same through
+ * the schema, however they are laid out: padding, fields unknown to mdef
+ * and the hash index of hashed fields are ignored, and a null pointer is
+ * equal to an empty string, array or message.  Shared objects are not
+ * compared twice.  Returns false for messages nested over 500 deep.
+ */
+bool nbuf_equal(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	nbuf_MsgDef mdef);
+
+/* Returns a 64-bit hash of o, a message of type mdef, which is equal for
+ * messages for which nbuf_equal is true.  The hash is XXH64 of a canonical
+ * form of the message, and does not change across platforms or releases
+ * given the same seed.  Hashes with two seeds make a 128-bit one.
+ * Messages nested over 500 deep are not hashed.
+ */
+uint64_t nbuf_hash(const struct nbuf_obj *o, nbuf_MsgDef mdef, uint64_t seed);
+
+/* Sets in m, of nbuf_MsgDef_ssize(mdef) bytes, the bits of the scalar part
+ * of mdef that its fields and union tags use, as nbuf_equal and nbuf_hash
+ * read them.
+ */
+void nbuf_scalar_mask(unsigned char *m, nbuf_MsgDef mdef);
+
+/* Writes root, a message of type mdef, to outbuf in canonical form, so that
+ * messages for which nbuf_equal is true are written with the same bytes,
+ * however they were built.  Objects are laid out depth first, each followed
+ * by what it points to in the order of the fields, with the sizes of mdef
+ * and zeroed padding; empty strings, arrays and messages are left out,
+ * shared objects are copied for each pointer, and hash indexes are made
+ * anew.  Fields unknown to mdef are dropped.
+ *
+ * outbuf must be another buffer than root's.  The root is written first, so
+ * the buffer is canonical as a whole if it was empty.  On success, o is set
+ * to the copy of the root.  Returns false if out of memory, or for messages
+ * nested over 500 deep, leaving outbuf as it was.
+ */
+bool nbuf_canonicalize(struct nbuf_buf *outbuf, struct nbuf_obj *o,
+	const struct nbuf_obj *root, nbuf_MsgDef mdef);
+
+/* Tells whether the buffer of root, a message of type mdef at its start, is
+ * byte for byte what nbuf_canonicalize writes for it.  It is checked in a
+ * single pass, without copying: buffers for which it is true can then be
+ * compared or hashed as bytes.
+ */
+bool nbuf_is_canonical(const struct nbuf_obj *root, nbuf_MsgDef mdef);
+
+/* Merging */
+struct nbuf_merge_opt {
+	struct nbuf_buf *outbuf;
+	/* Max number of nested objects; 500 if set to 0. */
+	int max_depth;
+	/* Repeated fields set in the overlay replace those of the base,
+	 * instead of being appended to them. */
+	bool replace_repeated;
+};
+
+/* Merges overlay into base, both messages of type mdef, writing the result
+ * to opt->outbuf, as in protobuf's MergeFrom:
+ *  - a scalar field set in the overlay, that is non-zero, overrides the
+ *    base; the elements of fixed arrays and the fields of inline structs
+ *    are merged one by one;
+ *  - a string set in the overlay overrides the base unless empty;
+ *  - messages set on both sides are merged recursively;
+ *  - repeated fields are appended, or replaced as specified by opt, except
+ *    packed, delta and bitset fields, which are always replaced.  Keyed
+ *    fields are appended as maps: an element of the overlay replaces those
+ *    of the base with the same key.  They are sorted again, and their hash
+ *    index rebuilt;
+ *  - the member held by a union in the overlay replaces that of the base.
+ * Anything set on one side only is copied as is, with a single memcpy when
+ * its objects are contiguous.  Fields unknown to mdef are kept, those of
+ * the overlay winning.
+ *
+ * outbuf must be another buffer than those of base and overlay.  The
+ * result is allocated first, so it is at offset 0 if outbuf is empty.  On
+ * success, o is set to it.  Returns false if out of memory, or if the
+ * input is malformed or too deep.
+ */
+bool nbuf_merge(const struct nbuf_merge_opt *opt, struct nbuf_obj *o,
+	const struct nbuf_obj *base, const struct nbuf_obj *overlay,
+	nbuf_MsgDef mdef);
+
+/* Diff and patch */
+struct nbuf_diff_opt {
+	struct nbuf_buf *outbuf;
+	/* Max number of nested objects; 500 if set to 0. */
+	int max_depth;
+};
+
+/* Writes to opt->outbuf a patch turning from into to, both messages of
+ * type mdef, as a nbuf.Patch message.  The fields that differ are
+ * replaced, except for messages held by both versions, which are patched
+ * in turn, as are the elements that differ in repeated messages of the
+ * same length.  Unchanged subtrees are skipped with a memcmp, and without
+ * looking at them at all when both versions share them.  Fields unknown
+ * to mdef are not compared.
+ *
+ * The patch is allocated first, so it is at offset 0 if outbuf is empty.
+ * On success, patch is set to it; it has no fields set if from and to are
+ * equal.  Returns false if out of memory, or if the input is malformed or
+ * too deep.
+ */
+bool nbuf_diff(const struct nbuf_diff_opt *opt, struct nbuf_obj *patch,
+	const struct nbuf_obj *from, const struct nbuf_obj *to,
+	nbuf_MsgDef mdef);
+
+/* Applies a patch from nbuf_diff to o, a message of type mdef, which
+ * becomes the new version.  o is modified in place, and what lies below it
+ * is copied on write to the end of its buffer, so shared objects are left
+ * alone.  The replaced objects are garbage, dropped by nbuf_dedup.  o
+ * moves only if the patch adds fields unknown to its writer.
+ *
+ * The patch must be in another buffer.  Returns false if out of memory or
+ * if the patch does not apply, leaving o partially patched.
+ */
+bool nbuf_apply_patch(struct nbuf_obj *o, const struct nbuf_obj *patch,
+	nbuf_MsgDef mdef);
+
+/* Gets the message holding the values of the fields replaced by a patch.
+ * vbuf is set to read it.  Returns 0 if there is none.
+ */
+size_t nbuf_patch_value(struct nbuf_obj *v, struct nbuf_buf *vbuf,
+	nbuf_Patch patch);
+
+/* Prints the changes made by patch to old, in text format, with the
+ * replaced fields as lines starting with "-" for old and "+" for new.
+ */
+bool nbuf_print_patch(const struct nbuf_print_opt *opt,
+	const struct nbuf_obj *old, const struct nbuf_obj *patch,
+	nbuf_MsgDef mdef);
+
+/* In-place editing
+ *
+ * An editor allocates objects in a buffer that is changed over time,
+ * reusing the space of the objects it frees instead of growing the buffer
+ * for each change.  Freed space is kept in a map of free extents, merged
+ * when adjacent, and given back to the buffer when at its end.
+ *
+ * Objects are freed with what they point to, so they must not be shared:
+ * an editor does not mix with interning or nbuf_dedup.  The buffer must be
+ * a growable one, from nbuf_init_ex, whose pointers are all in the buffer.
+ * Allocations return zeroed memory, like nbuf_alloc_ex does for new space.
+ * As the buffer may move, pointers into it are invalidated by allocations;
+ * objects, which hold offsets, are not.
+ */
+struct nbuf_extent {
+	uint32_t offset, size;
+};
+
+struct nbuf_edit {
+	struct nbuf_buf *buf;
+	struct nbuf_extent *free;  /* sorted by offset */
+	size_t nfree, cap;
+	size_t free_bytes;
+};
+
+void nbuf_edit_init(struct nbuf_edit *ed, struct nbuf_buf *buf);
+/* Forgets the free space; the buffer is left as is. */
+void nbuf_edit_clear(struct nbuf_edit *ed);
+
+/* Same as nbuf_alloc_obj, nbuf_alloc_arr and nbuf_alloc_str, taking free
+ * space first. */
+size_t nbuf_edit_alloc_obj(struct nbuf_edit *ed, struct nbuf_obj *o);
+size_t nbuf_edit_alloc_arr(struct nbuf_edit *ed, struct nbuf_obj *o,
+	nbuf_word_t len);
+char *nbuf_edit_alloc_str(struct nbuf_edit *ed, struct nbuf_obj *o,
+	const char *str, size_t len);
+
+/* Frees the object pointed to by pointer index of o, with everything it
+ * points to, and clears the pointer. */
+bool nbuf_edit_free(struct nbuf_edit *ed, const struct nbuf_obj *o,
+	size_t index);
+/* Same as nbuf_obj_set_p, freeing the object pointed to before. */
+bool nbuf_edit_set_p(struct nbuf_edit *ed, const struct nbuf_obj *o,
+	size_t index, const struct nbuf_obj *rhs);
+/* Sets a string field, rewriting the old string in place if the new one
+ * fits.  If len is (size_t) -1, str is NUL-terminated.  Returns the new
+ * string, or NULL if out of memory. */
+char *nbuf_edit_set_str(struct nbuf_edit *ed, const struct nbuf_obj *o,
+	size_t index, const char *str, size_t len);
+/* Resizes the array pointed to by pointer index of o to len elements, and
+ * sets arr to it.  New elements are zeroed, and what removed ones point to
+ * is freed.  The array grows in place if the space after it is free, and
+ * is moved otherwise.  If the pointer is null, a new array of elements of
+ * arr->ssize and arr->psize is allocated. */
+bool nbuf_edit_resize_arr(struct nbuf_edit *ed, struct nbuf_obj *arr,
+	const struct nbuf_obj *o, size_t index, nbuf_word_t len);
+
+/* Compacts the buffer, by copying the objects reachable from root to a new
+ * buffer which replaces it, root first.  Updates root, and empties the
+ * free map.  Returns false if out of memory or malformed, leaving the
+ * buffer as is. */
+bool nbuf_gc(struct nbuf_edit *ed, struct nbuf_obj *root);
+
 /* Schema compiler: compile a text schema into a nbuf.Schema object
  * in the buffer. */
 struct nbuf_compile_opt {
@@ -154,15 +474,41 @@ struct nbuf_compile_opt {
 	 * Set this to NULL will disable import statements.
 	 */
 	const char *const *search_path;
+	/* Optional directory, which must exist, for caching compiled
+	 * schemas across runs.  An entry is named by a hash of the schema
+	 * text, its path and its compiled imports; on a hit, the compiled
+	 * schema is loaded instead of parsing the file past its imports.
+	 * Entries are never removed.
+	 */
+	const char *cache_dir;
 };
+/* Several files may be compiled with the same outbuf.  A file imported
+ * again, by the same path or through another path to the same file, is
+ * reused instead of compiled again.  If compilation fails, the whole outbuf
+ * is freed.
+ */
 struct nbuf_schema_set *
 nbuf_compile(const struct nbuf_compile_opt *opt, const char *filename);
 struct nbuf_schema_set *
 nbuf_compile_str(const struct nbuf_compile_opt *opt,
 	const char *input, size_t input_len, const char *filename);
-/* Frees memory for the schema set returned from compiler. */
+/* Frees memory for the schema sets returned from compiler and loader. */
 void nbuf_free_compiled(const struct nbuf_compile_opt *opt);
 
+/* Schema loader: load a schema compiled by "nbufc -bin_out" (a ".nb" file)
+ * without parsing the text schema.  The file is mapped into memory if
+ * possible.
+ *
+ * The source path of each import, e.g. "a/b.nbuf", is stored in the
+ * compiled schema; the import is loaded from the same path with a ".nb"
+ * extension, e.g. "a/b.nb", looked up in opt->search_path like nbuf_compile
+ * does.  Schemas already in opt->outbuf, loaded or compiled, are reused by
+ * their source path, so keeping one outbuf as a cache loads shared imports
+ * only once.  On failure, the schemas loaded by previous calls are kept.
+ */
+struct nbuf_schema_set *
+nbuf_load_schema_set(const struct nbuf_compile_opt *opt, const char *filename);
+
 size_t nbuf_baselen(const char *p);
 
 #ifdef __cplusplus
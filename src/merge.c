@@ -0,0 +1,478 @@
+#include "libnbuf.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* The output is built top-down: a merged message is allocated before the
+ * messages it points to, so that the root stays first.  A subtree set on
+ * one side only is copied as is: in a single memcpy when its objects are
+ * laid out contiguously, which is the case for anything written in one go
+ * by a builder or the parser, or by nbuf_dedup otherwise.
+ */
+
+struct ctx {
+	struct nbuf_buf *out;
+	int depth, max_depth;
+	bool replace_repeated;
+};
+
+/* An object in the input */
+struct hdr {
+	size_t hdr_size, size;  /* of the header, and of the elements */
+	size_t len;
+	unsigned ssize, psize;
+};
+
+static bool
+read_hdr(struct hdr *h, const struct nbuf_buf *buf, size_t offset)
+{
+	nbuf_word_t hdr;
+	size_t esize;
+
+	if (offset % sizeof hdr || offset + sizeof hdr > buf->len)
+		return false;
+	hdr = nbuf_word(buf->base + offset);
+	h->hdr_size = sizeof hdr;
+	if (!(hdr & NBUF_HDR_MASK))
+		return false;
+	if (hdr & NBUF_BARR_MASK) {
+		h->ssize = 1;
+		h->psize = 0;
+		h->len = hdr & NBUF_BLEN_MASK;
+	} else {
+		h->ssize = NBUF_SSIZE(hdr);
+		h->psize = NBUF_PSIZE(hdr);
+		h->len = 1;
+		if (hdr & NBUF_ARR_MASK) {
+			h->hdr_size += sizeof hdr;
+			if (offset + h->hdr_size > buf->len)
+				return false;
+			h->len = nbuf_word(buf->base + offset + sizeof hdr);
+		}
+	}
+	esize = h->ssize + h->psize * sizeof hdr;
+	if (esize && h->len > (buf->len - offset - h->hdr_size) / esize)
+		return false;
+	h->size = h->len * esize;
+	return true;
+}
+
+/* Gets the target of the pointer at offset.  Returns false if null. */
+static bool
+ptr_target(const struct nbuf_buf *buf, size_t offset, size_t *target)
+{
+	nbuf_word_t rel_ptr = nbuf_word(buf->base + offset);
+
+	*target = (uint32_t) (offset + rel_ptr * sizeof rel_ptr);
+	return rel_ptr != 0;
+}
+
+/* Sets the pointer at offset in the output to the header at target. */
+static void
+set_ptr(struct nbuf_buf *buf, size_t offset, size_t target)
+{
+	nbuf_set_word(buf->base + offset,
+		(nbuf_word_t) ((target - offset) / sizeof (nbuf_word_t)));
+}
+
+/* Finds the range [*lo, *hi) spanned by the objects reachable from the
+ * header at offset, and adds up their sizes in *sum.
+ */
+static bool
+measure(struct ctx *ctx, const struct nbuf_buf *buf, size_t offset,
+	size_t *lo, size_t *hi, size_t *sum)
+{
+	struct hdr h;
+	size_t esize, end, i, j, p, target;
+	bool rc = false;
+
+	if (++ctx->depth > ctx->max_depth || !read_hdr(&h, buf, offset))
+		goto err;
+	end = offset + NBUF_ALLOC_ALIGN(h.hdr_size + h.size);
+	if (offset < *lo)
+		*lo = offset;
+	if (end > *hi)
+		*hi = end;
+	/* Shared objects are counted each time: give up on a blowup */
+	if ((*sum += end - offset) > buf->len)
+		goto err;
+	esize = h.ssize + h.psize * sizeof (nbuf_word_t);
+	for (i = 0; i < h.len; i++) {
+		p = offset + h.hdr_size + i * esize;
+		for (j = 0; j < h.psize; j++, p += sizeof (nbuf_word_t)) {
+			if (ptr_target(buf, p, &target) &&
+				!measure(ctx, buf, target, lo, hi, sum))
+				goto err;
+		}
+	}
+	rc = true;
+err:
+	ctx->depth--;
+	return rc;
+}
+
+/* Copies the object whose header is at offset in buf, with everything it
+ * points to.  Sets *newp to the offset of the copied header.
+ */
+static bool
+copy_tree(struct ctx *ctx, const struct nbuf_buf *buf, size_t offset,
+	size_t *newp)
+{
+	size_t lo = SIZE_MAX, hi = 0, sum = 0;
+	struct hdr h;
+	char *p;
+
+	if (measure(ctx, buf, offset, &lo, &hi, &sum) && hi - lo <= sum) {
+		/* Pointers are relative: the range can be moved as a whole. */
+		if (!(p = nbuf_alloc_aligned(ctx->out, hi - lo,
+			sizeof (nbuf_word_t))))
+			return false;
+		memcpy(p, buf->base + lo, hi - lo);
+		*newp = (p - ctx->out->base) + (offset - lo);
+	} else {
+		struct nbuf_dedup_opt opt = {
+			.outbuf = ctx->out,
+			.max_depth = ctx->max_depth - ctx->depth + 1,
+			.no_merge = true,
+		};
+		struct nbuf_obj root = { (struct nbuf_buf *) buf }, o;
+
+		if (!read_hdr(&h, buf, offset))
+			return false;
+		root.offset = offset + h.hdr_size;
+		root.ssize = h.ssize;
+		root.psize = h.psize;
+		if (!nbuf_dedup(&opt, &o, &root))
+			return false;
+		*newp = nbuf_obj_hdr_offset(&o);
+	}
+	return *newp < UINT32_MAX;
+}
+
+static bool
+is_zero(const char *p, size_t size)
+{
+	while (size--)
+		if (*p++)
+			return false;
+	return true;
+}
+
+static bool
+is_ptr_field(nbuf_Kind kind, nbuf_MsgDef mdef)
+{
+	return nbuf_is_repeated(kind) || kind == nbuf_Kind_STR ||
+		(kind == nbuf_Kind_MSG && !nbuf_MsgDef_is_struct(mdef));
+}
+
+/* Overrides the scalar fields of o with those set in v. */
+static void
+merge_scalars(const struct nbuf_obj *o, const struct nbuf_obj *v,
+	nbuf_MsgDef mdef)
+{
+	nbuf_FieldDef fdef;
+	size_t n, i, count;
+
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		struct nbuf_obj oo, vv;
+		nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+		unsigned offset = nbuf_FieldDef_offset(fdef);
+		unsigned bits = nbuf_FieldDef_bits(fdef);
+		unsigned shift = nbuf_FieldDef_shift(fdef);
+		unsigned size;
+		const char *p;
+		unsigned x;
+
+		if (is_ptr_field(kind, u.mdef))
+			continue;
+		if (bits) {
+			if ((p = nbuf_obj_s(v, offset, 1)) &&
+				(x = nbuf_get_bits(p, shift, bits)))
+				nbuf_set_bits(nbuf_obj_s(o, offset, 1), shift, bits, x);
+			continue;
+		}
+		switch (kind) {
+		case nbuf_Kind_MSG:
+			/* an inline struct: merged field by field */
+			size = nbuf_MsgDef_ssize(u.mdef);
+			if (nbuf_obj_inline(&vv, v, offset, size) &&
+				nbuf_obj_inline(&oo, o, offset, size))
+				merge_scalars(&oo, &vv, u.mdef);
+			continue;
+		case nbuf_Kind_ENUM:
+			size = 2;
+			break;
+		case nbuf_Kind_UINT:
+		case nbuf_Kind_SINT:
+		case nbuf_Kind_FLT:
+		case nbuf_Kind_BOOL:
+			size = u.o.ssize;
+			break;
+		default:
+			continue;
+		}
+		/* the elements of a fixed array are merged one by one */
+		count = nbuf_FieldDef_count(fdef);
+		for (i = 0; i < (count ? count : 1); i++) {
+			p = nbuf_obj_s(v, offset + i * size, size);
+			if (p && !is_zero(p, size))
+				memcpy(nbuf_obj_s(o, offset + i * size, size), p, size);
+		}
+	}
+}
+
+static bool merge_msg(struct ctx *ctx, const struct nbuf_obj *b,
+	const struct nbuf_obj *v, nbuf_MsgDef mdef, size_t *newp);
+
+/* Copies the n elements of a to the output, starting at element i of o. */
+static bool
+copy_elems(struct ctx *ctx, const struct nbuf_obj *o, size_t i,
+	const struct nbuf_obj *a, size_t n)
+{
+	struct nbuf_obj it = *a;
+	size_t esize = nbuf_obj_size(o), p, j, target, t;
+
+	if (o->psize == 0 && it.psize == 0 && it.ssize == o->ssize) {
+		memcpy(nbuf_obj_base(o) + i * esize, nbuf_obj_base(&it), n * esize);
+		return true;
+	}
+	for (; n--; i++, nbuf_next(&it)) {
+		p = o->offset + i * esize;
+		memcpy(ctx->out->base + p + o->psize * sizeof (nbuf_word_t),
+			it.buf->base + it.offset + it.psize * sizeof (nbuf_word_t),
+			it.ssize);
+		for (j = 0; j < it.psize; j++, p += sizeof (nbuf_word_t)) {
+			if (!ptr_target(it.buf, it.offset + j * sizeof (nbuf_word_t),
+				&target))
+				continue;
+			if (!copy_tree(ctx, it.buf, target, &t))
+				return false;
+			set_ptr(ctx->out, p, t);
+		}
+	}
+	return true;
+}
+
+/* Tells whether the key of element i of b is that of an element of v,
+ * whose n elements are sorted by key.
+ */
+static bool
+has_key(const struct nbuf_obj *v, size_t n, const struct nbuf_obj *b,
+	size_t i, const struct nbuf_key *key)
+{
+	struct nbuf_obj it = *v;
+	const char *s;
+	size_t len;
+	uint64_t k;
+
+	if (key->flags & NBUF_KEY_STRING) {
+		s = nbuf_key_str_at(b, i, key->offset, &len);
+		return nbuf_find_str_key(&it, n, key->offset, s, len);
+	}
+	k = nbuf_key_at(b, i, key->offset, key->width, key->flags);
+	if (key->flags & NBUF_KEY_SIGNED)
+		k ^= (uint64_t) 1 << 63;
+	return nbuf_find_key(&it, n, key->offset, key->width, key->flags, k);
+}
+
+/* Appends the elements of v to those of b in a new array.  If key is not
+ * NULL, the elements of b with the key of an element of v are left out.
+ */
+static bool
+append_arr(struct ctx *ctx, const struct nbuf_obj *b, size_t nb,
+	const struct nbuf_obj *v, size_t nv, const struct nbuf_key *key,
+	size_t *newp)
+{
+	struct nbuf_obj o = { ctx->out }, it;
+	size_t i, j, n = 0;
+
+	for (i = 0; i < nb; i++)
+		if (!key || !has_key(v, nv, b, i, key))
+			n++;
+	o.ssize = b->ssize > v->ssize ? b->ssize : v->ssize;
+	o.psize = b->psize > v->psize ? b->psize : v->psize;
+	if (n + nv > NBUF_BLEN_MASK || !nbuf_alloc_arr(&o, n + nv))
+		return false;
+	memset(nbuf_obj_base(&o), 0, (n + nv) * nbuf_obj_size(&o));
+	/* the elements of b that are kept, a run at a time */
+	for (i = n = 0; i < nb; i = j + 1) {
+		for (j = i; j < nb && (!key || !has_key(v, nv, b, j, key)); j++)
+			;
+		it = *b;
+		nbuf_advance(&it, i);
+		if (!copy_elems(ctx, &o, n, &it, j - i))
+			return false;
+		n += j - i;
+	}
+	if (!copy_elems(ctx, &o, n, v, nv))
+		return false;
+	*newp = nbuf_obj_hdr_offset(&o);
+	return true;
+}
+
+/* Merges the pointer field fdef of b and v, which are NULL if the field is
+ * not set on their side, into o.
+ */
+static bool
+merge_field(struct ctx *ctx, const struct nbuf_obj *o,
+	const struct nbuf_obj *b, const struct nbuf_obj *v,
+	nbuf_FieldDef fdef, nbuf_Kind kind, nbuf_MsgDef mdef)
+{
+	unsigned index = nbuf_FieldDef_offset(fdef);
+	nbuf_Encoding enc = nbuf_FieldDef_encoding(fdef);
+	struct nbuf_obj bb, vv, arr;
+	size_t nb = b ? nbuf_obj_p(&bb, b, index) : 0;
+	size_t nv = v ? nbuf_obj_p(&vv, v, index) : 0;
+	size_t newoff;
+	struct nbuf_key key;
+	bool keyed = nbuf_lookup_key(&key, fdef);
+	bool appended = false;
+
+	if (kind == nbuf_Kind_STR && nv <= 1) {
+		/* an empty string does not override */
+		if (nb <= 1 && nv == 1)
+			nb = 0;
+		else
+			nv = 0;
+	}
+	if (!nb && !nv)
+		return true;
+	if (nb && nv && kind == nbuf_Kind_MSG) {
+		if (!merge_msg(ctx, &bb, &vv, mdef, &newoff))
+			return false;
+	} else if (nb && nv && nbuf_is_repeated(kind) &&
+		!ctx->replace_repeated && !nbuf_FieldDef_bits(fdef) &&
+		(enc == nbuf_Encoding_FIXED || enc == nbuf_Encoding_HASHED)) {
+		if (!append_arr(ctx, &bb, nb, &vv, nv, keyed ? &key : NULL,
+			&newoff))
+			return false;
+		appended = true;
+	} else {
+		if (nv)
+			bb = vv;
+		if (!copy_tree(ctx, bb.buf, nbuf_obj_hdr_offset(&bb), &newoff))
+			return false;
+	}
+	set_ptr(ctx->out, o->offset + index * sizeof (nbuf_word_t), newoff);
+	if (!keyed)
+		return true;
+
+	/* A keyed field stays sorted, and its hash index follows it */
+	arr.buf = ctx->out;
+	arr.offset = newoff;
+	nb = nbuf_get_obj(&arr);
+	if (appended &&
+		!nbuf_sort_by_key(&arr, nb, key.offset, key.width, key.flags))
+		return false;
+	if (enc == nbuf_Encoding_HASHED && index + 1 < o->psize) {
+		struct nbuf_obj idx;
+
+		if (!nbuf_alloc_hash_index(&idx, &arr, nb, key.offset) ||
+			!nbuf_obj_set_p(o, index + 1, &idx))
+			return false;
+	}
+	return true;
+}
+
+/* Merges v into b, both being messages of type mdef. */
+static bool
+merge_msg(struct ctx *ctx, const struct nbuf_obj *b,
+	const struct nbuf_obj *v, nbuf_MsgDef mdef, size_t *newp)
+{
+	struct nbuf_obj o = { ctx->out }, bb;
+	nbuf_FieldDef fdef;
+	size_t n, i, target, t, known;
+	bool rc = false;
+
+	if (++ctx->depth > ctx->max_depth)
+		goto err;
+	o.ssize = b->ssize > v->ssize ? b->ssize : v->ssize;
+	o.psize = b->psize > v->psize ? b->psize : v->psize;
+	if (!nbuf_alloc_obj(&o))
+		goto err;
+	memset(nbuf_obj_base(&o), 0, nbuf_obj_size(&o));
+	memcpy(nbuf_obj_s(&o, 0, v->ssize), nbuf_obj_s(v, 0, v->ssize),
+		v->ssize);
+	memcpy(nbuf_obj_s(&o, 0, b->ssize), nbuf_obj_s(b, 0, b->ssize),
+		b->ssize);
+	/* Scalars unknown to the schema are taken from both sides, those of
+	 * v winning, as for pointers below
+	 */
+	known = nbuf_MsgDef_ssize(mdef);
+	if (v->ssize > known)
+		memcpy(nbuf_obj_s(&o, known, v->ssize - known),
+			nbuf_obj_s(v, known, v->ssize - known), v->ssize - known);
+	merge_scalars(&o, v, mdef);
+
+	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
+		nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+		nbuf_UnionDef udef;
+		bool in_b = true, in_v = true;
+
+		if (!is_ptr_field(kind, u.mdef))
+			continue;
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			/* The member held by v wins over the one held by b */
+			unsigned tag = nbuf_FieldDef_tag(fdef);
+			unsigned offset = nbuf_UnionDef_offset(udef);
+			unsigned vtag = nbuf_obj_union_tag(v, offset);
+
+			in_b = nbuf_obj_union_tag(b, offset) == tag &&
+				(vtag == 0 || vtag == tag);
+			in_v = vtag == tag;
+			if (!in_b && !in_v)
+				continue;
+			nbuf_set_u16(nbuf_obj_s(&o, offset, 2), tag);
+		}
+		if (!merge_field(ctx, &o, in_b ? b : NULL, in_v ? v : NULL,
+			fdef, kind, u.mdef))
+			goto err;
+	}
+
+	/* Pointers unknown to the schema: those of v win */
+	for (i = nbuf_MsgDef_psize(mdef); i < o.psize; i++) {
+		bb = (i < v->psize && nbuf_word(v->buf->base + v->offset +
+			i * sizeof (nbuf_word_t))) ? *v : *b;
+		if (i >= bb.psize || !ptr_target(bb.buf,
+			bb.offset + i * sizeof (nbuf_word_t), &target))
+			continue;
+		if (!copy_tree(ctx, bb.buf, target, &t))
+			goto err;
+		set_ptr(ctx->out, o.offset + i * sizeof (nbuf_word_t), t);
+	}
+	*newp = nbuf_obj_hdr_offset(&o);
+	rc = true;
+err:
+	ctx->depth--;
+	return rc;
+}
+
+bool
+nbuf_merge(const struct nbuf_merge_opt *opt, struct nbuf_obj *o,
+	const struct nbuf_obj *base, const struct nbuf_obj *overlay,
+	nbuf_MsgDef mdef)
+{
+	struct ctx ctx = {
+		.out = opt->outbuf,
+		.max_depth = (opt->max_depth > 0) ? opt->max_depth : 500,
+		.replace_repeated = opt->replace_repeated,
+	};
+	size_t newoff;
+
+	if (!merge_msg(&ctx, base, overlay, mdef, &newoff))
+		return false;
+	o->buf = ctx.out;
+	o->offset = newoff;
+	(void) nbuf_get_obj(o);
+	return true;
+}
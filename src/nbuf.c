@@ -40,6 +40,7 @@ nbuf_init_ex(struct nbuf_buf *buf, size_t cap)
 	buf->len = 0;
 	buf->cap = 0;
 	buf->realloc = nbuf_alloc_ex;
+	buf->intern = NULL;
 	if (cap > 0 && (buf->base = (char *) malloc(cap))) {
 		memset(buf->base, 0, cap);
 		buf->cap = cap;
@@ -47,6 +48,131 @@ nbuf_init_ex(struct nbuf_buf *buf, size_t cap)
 	return buf->cap;
 }
 
+static char *intern_str(struct nbuf_obj *o, const char *str, size_t len);
+
+void
+nbuf_intern_init(struct nbuf_intern *t)
+{
+	t->slots = NULL;
+	t->cap = t->n = 0;
+	t->alloc_str = intern_str;
+}
+
+void
+nbuf_intern_reset(struct nbuf_intern *t)
+{
+	if (t->slots)
+		memset(t->slots, 0, t->cap * sizeof *t->slots);
+	t->n = 0;
+}
+
+void
+nbuf_intern_free(struct nbuf_intern *t)
+{
+	free(t->slots);
+	nbuf_intern_init(t);
+}
+
+static size_t
+intern_grow(struct nbuf_intern *t)
+{
+	size_t cap = t->cap ? 2 * t->cap : 64, i, j;
+	struct nbuf_intern_slot *slots;
+
+	if (!(slots = (struct nbuf_intern_slot *) calloc(cap, sizeof *slots)))
+		return 0;
+	for (i = 0; i < t->cap; i++) {
+		if (!t->slots[i].offset)
+			continue;
+		for (j = t->slots[i].hash & (cap - 1); slots[j].offset;
+			j = (j + 1) & (cap - 1))
+			;
+		slots[j] = t->slots[i];
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->cap = cap;
+	return cap;
+}
+
+/* Hashes a word at a time: the table is not stored, so unlike the hash
+ * index, the hash need not be portable.
+ */
+static uint32_t
+intern_hash(const char *s, size_t len)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = len * k, w = 0;
+	size_t i;
+
+	if (len < sizeof w) {
+		for (i = 0; i < len; i++)
+			w |= (uint64_t) (unsigned char) s[i] << (8 * i);
+		h = (h ^ w) * k;
+		return (uint32_t) (h ^ (h >> 32));
+	}
+	for (i = 0; i + sizeof w < len; i += sizeof w) {
+		memcpy(&w, s + i, sizeof w);
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+	}
+	/* the last word may overlap the previous one */
+	memcpy(&w, s + len - sizeof w, sizeof w);
+	h = (h ^ w) * k;
+	return (uint32_t) (h ^ (h >> 32));
+}
+
+/* Returns whether a string equal to str is at offset.  The header is
+ * checked too, as the buffer may have been reused since.
+ */
+static int
+intern_match(const struct nbuf_buf *buf, size_t offset, const char *str, size_t len)
+{
+	nbuf_word_t hdr = (nbuf_word_t) (len + 1) | NBUF_BARR_MASK | NBUF_HDR_MASK;
+
+	return offset >= sizeof hdr && offset + len < buf->len &&
+		nbuf_word(buf->base + offset - sizeof hdr) == hdr &&
+		memcmp(buf->base + offset, str, len) == 0 &&
+		buf->base[offset + len] == '\0';
+}
+
+static char *
+intern_str(struct nbuf_obj *o, const char *str, size_t len)
+{
+	struct nbuf_intern *t = o->buf->intern;
+	uint32_t hash = intern_hash(str, len);
+	size_t i = 0, offset;
+	char *p;
+
+	if (2 * (t->n + 1) > t->cap && !intern_grow(t) && t->n + 1 >= t->cap)
+		t = NULL;
+	if (t) {
+		for (i = hash & (t->cap - 1); (offset = t->slots[i].offset) != 0;
+			i = (i + 1) & (t->cap - 1)) {
+			if (t->slots[i].hash != hash ||
+				!intern_match(o->buf, offset, str, len))
+				continue;
+			o->offset = offset;
+			o->ssize = 1;
+			o->psize = 0;
+			return o->buf->base + offset;
+		}
+	}
+	o->ssize = 1;
+	o->psize = 0;
+	if (!nbuf_alloc_arr(o, len + 1))
+		return NULL;
+	p = o->buf->base + o->offset;
+	memcpy(p, str, len);
+	p[len] = '\0';
+	if (t && o->offset <= UINT32_MAX) {
+		t->slots[i].hash = hash;
+		t->slots[i].offset = o->offset;
+		t->n++;
+	}
+	return p;
+}
+
 size_t
 nbuf_fix_arr(struct nbuf_obj *o, nbuf_word_t len,
 	const struct nbuf_buf *newbuf)
@@ -104,3 +230,366 @@ nbuf_resize_arr(struct nbuf_obj *o, nbuf_word_t len)
 	}
 	return len;
 }
+
+/* Sets the length in the header of the array whose first element is o. */
+static void
+set_arr_len(const struct nbuf_obj *o, nbuf_word_t len)
+{
+	size_t hdr_offset = nbuf_obj_hdr_offset(o);
+	nbuf_word_t hdr = nbuf_word(o->buf->base + hdr_offset);
+
+	if (hdr & NBUF_BARR_MASK)
+		nbuf_set_word(o->buf->base + hdr_offset, (hdr &~ NBUF_BLEN_MASK) | len);
+	else
+		nbuf_set_word(o->buf->base + hdr_offset + sizeof hdr, len);
+}
+
+size_t
+nbuf_append(struct nbuf_appender *ap, struct nbuf_obj *elem)
+{
+	struct nbuf_obj o = ap->arr;
+	size_t esize = nbuf_obj_size(&o), i, j;
+	nbuf_word_t cap = ap->cap ? 2 * ap->cap : 4;
+
+	if (ap->len < ap->cap)
+		goto done;
+	if (cap < ap->cap || (o.psize == 0 && o.ssize == 1 &&
+		(cap & NBUF_BLEN_MASK) != cap))
+		return 0;
+	if (ap->cap && o.offset + ap->cap * esize == o.buf->len) {
+		/* at the end of the buffer, grow in place */
+		if (!nbuf_alloc(o.buf, (cap - ap->cap) * esize))
+			return 0;
+	} else {
+		if (!nbuf_alloc_arr(&o, cap))
+			return 0;
+		memcpy(o.buf->base + o.offset, o.buf->base + ap->arr.offset,
+			ap->len * esize);
+		for (i = 0; i < ap->len; i++) {
+			nbuf_word_t *pptr = (nbuf_word_t *)
+				(o.buf->base + o.offset + i * esize);
+
+			/* Pointers are relative, so they move the other way. */
+			for (j = 0; j < o.psize; j++, pptr++) {
+				nbuf_word_t rel_ptr = nbuf_word(pptr);
+
+				if (rel_ptr == 0)
+					continue;
+				rel_ptr += (nbuf_word_t) (((ptrdiff_t) ap->arr.offset -
+					(ptrdiff_t) o.offset) / (ptrdiff_t) sizeof rel_ptr);
+				*pptr = nbuf_word(&rel_ptr);
+			}
+		}
+	}
+	memset(o.buf->base + o.offset + ap->len * esize, 0,
+		(cap - ap->len) * esize);
+	ap->arr = o;
+	ap->cap = cap;
+done:
+	*elem = ap->arr;
+	elem->offset += ap->len++ * esize;
+	return 1;
+}
+
+size_t
+nbuf_appender_finish(struct nbuf_appender *ap, struct nbuf_obj *arr)
+{
+	size_t esize = nbuf_obj_size(&ap->arr);
+
+	*arr = ap->arr;
+	if (ap->len == 0)
+		return 0;
+	set_arr_len(arr, ap->len);
+	if (arr->offset + ap->cap * esize == arr->buf->len)
+		arr->buf->len = arr->offset + ap->len * esize;
+	return ap->len;
+}
+
+/* Packed integer arrays */
+
+static uint64_t
+load_int(const void *src, size_t i, unsigned width, unsigned flags)
+{
+	bool is_signed = (flags & NBUF_PACK_SIGNED) != 0;
+
+	switch (width) {
+	case 1:
+		return is_signed ? (uint64_t) ((const int8_t *) src)[i] :
+			((const uint8_t *) src)[i];
+	case 2:
+		return is_signed ? (uint64_t) ((const int16_t *) src)[i] :
+			((const uint16_t *) src)[i];
+	case 4:
+		return is_signed ? (uint64_t) ((const int32_t *) src)[i] :
+			((const uint32_t *) src)[i];
+	default:
+		assert(width == 8);
+		return ((const uint64_t *) src)[i];
+	}
+}
+
+static void
+store_int(void *dst, size_t i, unsigned width, uint64_t v)
+{
+	switch (width) {
+	case 1: ((uint8_t *) dst)[i] = (uint8_t) v; break;
+	case 2: ((uint16_t *) dst)[i] = (uint16_t) v; break;
+	case 4: ((uint32_t *) dst)[i] = (uint32_t) v; break;
+	default:
+		assert(width == 8);
+		((uint64_t *) dst)[i] = v;
+		break;
+	}
+}
+
+/* Maps a value to what is stored as a varint. */
+static uint64_t
+pack_value(uint64_t v, uint64_t *prev, unsigned flags)
+{
+	if (flags & NBUF_PACK_DELTA) {
+		uint64_t d = v - *prev;
+
+		*prev = v;
+		v = d;
+	} else if (!(flags & NBUF_PACK_SIGNED)) {
+		return v;
+	}
+	/* zigzag */
+	return (v << 1) ^ (0 - (v >> 63));
+}
+
+static uint64_t
+unpack_value(uint64_t v, uint64_t *prev, unsigned flags)
+{
+	if (flags & (NBUF_PACK_DELTA|NBUF_PACK_SIGNED))
+		v = (v >> 1) ^ (0 - (v & 1));
+	if (flags & NBUF_PACK_DELTA)
+		v = (*prev += v);
+	return v;
+}
+
+static size_t
+varint_len(uint64_t v)
+{
+	size_t n = 1;
+
+	for (; v >= 0x80; v >>= 7)
+		n++;
+	return n;
+}
+
+static size_t
+put_varint(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = (unsigned char) v | 0x80;
+	p[n++] = (unsigned char) v;
+	return n;
+}
+
+/* Returns the number of bytes read, or 0 if the varint is truncated
+ * or too long.
+ */
+static size_t
+get_varint(uint64_t *v, const unsigned char *p, size_t len)
+{
+	uint64_t x = 0;
+	size_t i;
+
+	/* fast path: most elements of a packed array fit in one byte */
+	if (len > 0 && p[0] < 0x80) {
+		*v = p[0];
+		return 1;
+	}
+	for (i = 0; i < len && i < 10; i++) {
+		x |= (uint64_t) (p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)) {
+			*v = x;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+size_t
+nbuf_alloc_packed(struct nbuf_obj *o, const void *src, size_t n,
+	unsigned width, unsigned flags)
+{
+	unsigned char *p;
+	uint64_t prev = 0;
+	size_t i, total = varint_len(n);
+
+	for (i = 0; i < n; i++)
+		total += varint_len(pack_value(load_int(src, i, width, flags),
+			&prev, flags));
+	if ((total & NBUF_BLEN_MASK) != total)
+		goto err;
+	o->ssize = 1;
+	o->psize = 0;
+	if (!nbuf_alloc_arr(o, total))
+		goto err;
+	p = (unsigned char *) nbuf_obj_base(o);
+	p += put_varint(p, n);
+	prev = 0;
+	for (i = 0; i < n; i++)
+		p += put_varint(p, pack_value(load_int(src, i, width, flags),
+			&prev, flags));
+	return total;
+err:
+	o->offset = 0;
+	o->ssize = o->psize = 0;
+	return 0;
+}
+
+size_t
+nbuf_packed_size(const struct nbuf_obj *o, size_t len)
+{
+	uint64_t n;
+	size_t hlen;
+
+	if (o->ssize != 1 || o->psize != 0)
+		return 0;
+	hlen = get_varint(&n, (const unsigned char *) nbuf_obj_base(o), len);
+	/* every element takes at least one byte */
+	if (hlen == 0 || n > len - hlen)
+		return 0;
+	return n;
+}
+
+size_t
+nbuf_unpack(void *dst, size_t n, unsigned width, unsigned flags,
+	const struct nbuf_obj *o, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) nbuf_obj_base(o);
+	size_t count = nbuf_packed_size(o, len);
+	uint64_t v, prev = 0;
+	size_t i, vlen;
+
+	if (n > count)
+		n = count;
+	if (n == 0)
+		return 0;
+	vlen = get_varint(&v, p, len);
+	p += vlen;
+	len -= vlen;
+	for (i = 0; i < n; i++) {
+		if (!(vlen = get_varint(&v, p, len)))
+			break;
+		p += vlen;
+		len -= vlen;
+		store_int(dst, i, width, unpack_value(v, &prev, flags));
+	}
+	return i;
+}
+
+/* Keyed arrays */
+
+struct key_rec {
+	uint64_t u;
+	const char *s;
+	size_t len;
+	size_t index;
+};
+
+static int
+key_rec_cmp(const void *a, const void *b)
+{
+	const struct key_rec *x = (const struct key_rec *) a;
+	const struct key_rec *y = (const struct key_rec *) b;
+	int c;
+
+	if (x->u != y->u)
+		return (x->u > y->u) ? 1 : -1;
+	if ((c = nbuf_key_strcmp(x->s, x->len, y->s, y->len)) != 0)
+		return c;
+	/* qsort is not stable */
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+size_t
+nbuf_sort_by_key(const struct nbuf_obj *o, size_t n, unsigned offset,
+	unsigned width, unsigned flags)
+{
+	size_t sz = nbuf_obj_size(o);
+	struct key_rec *recs;
+	char *base, *tmp;
+	size_t i, j;
+
+	if (n < 2)
+		return 1;
+	recs = (struct key_rec *) malloc(n * sizeof *recs);
+	tmp = (char *) malloc(n * sz);
+	if (!recs || !tmp) {
+		free(recs);
+		free(tmp);
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		recs[i].index = i;
+		if (flags & NBUF_KEY_STRING) {
+			recs[i].u = 0;
+			recs[i].s = nbuf_key_str_at(o, i, offset, &recs[i].len);
+		} else {
+			recs[i].u = nbuf_key_at(o, i, offset, width, flags);
+			recs[i].s = "";
+			recs[i].len = 0;
+		}
+	}
+	qsort(recs, n, sizeof *recs, key_rec_cmp);
+
+	base = (char *) nbuf_obj_base(o);
+	memcpy(tmp, base, n * sz);
+	for (i = 0; i < n; i++) {
+		size_t src = recs[i].index;
+		nbuf_word_t *pptr = (nbuf_word_t *) (base + i * sz);
+
+		memcpy(pptr, tmp + src * sz, sz);
+		/* Pointers are relative, so they move the other way. */
+		for (j = 0; j < o->psize; j++, pptr++) {
+			nbuf_word_t rel_ptr = nbuf_word(pptr);
+
+			if (rel_ptr == 0)
+				continue;
+			rel_ptr += (nbuf_word_t) (((ptrdiff_t) src - (ptrdiff_t) i) *
+				(ptrdiff_t) (sz / sizeof (nbuf_word_t)));
+			*pptr = nbuf_word(&rel_ptr);
+		}
+	}
+	free(tmp);
+	free(recs);
+	return 1;
+}
+
+size_t
+nbuf_alloc_hash_index(struct nbuf_obj *idx, const struct nbuf_obj *o,
+	size_t n, unsigned index)
+{
+	size_t m = 2, i, slot, len;
+	const char *s;
+	char *slots;
+
+	while (m < 2 * n) {
+		/* the array length and its size must fit in a word */
+		if (m >= (size_t) 1 << 29)
+			return 0;
+		m *= 2;
+	}
+	idx->buf = o->buf;
+	idx->ssize = sizeof (uint32_t);
+	idx->psize = 0;
+	if (!nbuf_alloc_arr(idx, m))
+		return 0;
+	/* the buffer may have moved, so the keys are read after allocation */
+	slots = (char *) nbuf_obj_base(idx);
+	memset(slots, 0, m * sizeof (uint32_t));
+	for (i = 0; i < n; i++) {
+		s = nbuf_key_str_at(o, i, index, &len);
+		slot = nbuf_hash_str(s, len) & (m - 1);
+		while (nbuf_u32(slots + slot * sizeof (uint32_t)) != 0)
+			slot = (slot + 1) & (m - 1);
+		nbuf_set_u32(slots + slot * sizeof (uint32_t), (uint32_t) (i + 1));
+	}
+	return m;
+}
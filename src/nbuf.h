@@ -144,10 +144,13 @@ typedef uint32_t nbuf_word_off_t;
 
 
 /** Buffer API */
+struct nbuf_intern;
+
 struct nbuf_buf {
 	char *base;
 	size_t len, cap;
 	char *(*realloc)(struct nbuf_buf *buf, size_t newlen);
+	struct nbuf_intern *intern;  /* optional, see nbuf_alloc_str */
 };
 
 /* Initializes a read-only buffer.
@@ -160,6 +163,7 @@ static inline void nbuf_init_ro(struct nbuf_buf *buf, const char *base, size_t l
 	buf->len = len;
 	buf->cap = 0;
 	buf->realloc = NULL;
+	buf->intern = NULL;
 }
 
 /* Initializes a read-write buffer.
@@ -175,6 +179,7 @@ static inline void nbuf_init_rw(struct nbuf_buf *buf, char *base, size_t cap)
 	buf->len = 0;
 	buf->cap = cap;
 	buf->realloc = NULL;
+	buf->intern = NULL;
 }
 
 /* Clears a read-write buffer.
@@ -488,6 +493,95 @@ nbuf_resize_arr(struct nbuf_obj *o, nbuf_word_t len);
 size_t
 nbuf_fix_arr(struct nbuf_obj *o, nbuf_word_t len, const struct nbuf_buf *newbuf);
 
+/* Appenders
+ *
+ * An appender builds an array whose length is not known beforehand,
+ * without the constraints of nbuf_resize_arr.  Elements are appended to an
+ * array with spare room, which is doubled when full: in place if it is at
+ * the end of the buffer, otherwise by moving it to the end.  Sub-objects of
+ * the elements may thus be allocated in the same buffer between appends,
+ * at the cost of leaving moved-from arrays unused.
+ *
+ *	struct nbuf_appender ap;
+ *	struct nbuf_obj elem, arr;
+ *
+ *	nbuf_appender_init(&ap, buf, ssize, psize);
+ *	while (...) {
+ *		if (!nbuf_append(&ap, &elem))
+ *			goto err;
+ *		...  // set elem, which is zeroed
+ *	}
+ *	n = nbuf_appender_finish(&ap, &arr);
+ *
+ * An element is valid until the next append, as the array may move.
+ */
+struct nbuf_appender {
+	struct nbuf_obj arr;  /* the first element */
+	nbuf_word_t len, cap;
+};
+
+static inline void
+nbuf_appender_init(struct nbuf_appender *ap, struct nbuf_buf *buf,
+	unsigned ssize, unsigned psize)
+{
+	ap->arr.buf = buf;
+	ap->arr.offset = 0;
+	ap->arr.ssize = ssize;
+	ap->arr.psize = psize;
+	ap->len = ap->cap = 0;
+}
+
+/* Appends a zeroed element, and loads it into elem.
+ * Returns 1 on success, 0 if out of memory.
+ */
+size_t
+nbuf_append(struct nbuf_appender *ap, struct nbuf_obj *elem);
+
+/* Gives back the spare room if possible, and loads the array into arr.
+ * Returns its length, or 0 if nothing was appended; then arr is not
+ * allocated.
+ */
+size_t
+nbuf_appender_finish(struct nbuf_appender *ap, struct nbuf_obj *arr);
+
+/* String interning
+ *
+ * A buffer may have an interning table, which maps the contents of the
+ * strings allocated in it to their offsets.  Allocating a string equal to
+ * an earlier one then returns the earlier one instead of a copy: pointers
+ * are relative, so any number of them may point to the same object.  This
+ * saves space and copying when values repeat, like host names in logs.
+ *
+ * To enable it, point buf->intern to a table set up by nbuf_intern_init.
+ * The buffer does not own the table.  Strings allocated while interning
+ * may be shared, so they must not be modified.  Strings allocated without
+ * contents (str == NULL) are never shared.  The table keeps offsets, so it
+ * must be reset by nbuf_intern_reset when the buffer is reused from the
+ * start.
+ */
+struct nbuf_intern_slot {
+	uint32_t hash, offset;  /* offset == 0 if empty */
+};
+
+struct nbuf_intern {
+	struct nbuf_intern_slot *slots;
+	size_t cap, n;
+	/* Same as nbuf_alloc_str with str != NULL, but returns an equal
+	 * string already in the table if any, and adds the new string
+	 * otherwise.  If the table cannot grow, the string is allocated
+	 * without interning.
+	 */
+	char *(*alloc_str)(struct nbuf_obj *o, const char *str, size_t len);
+};
+
+void nbuf_intern_init(struct nbuf_intern *t);
+
+/* Forgets all strings, but keeps the memory. */
+void nbuf_intern_reset(struct nbuf_intern *t);
+
+/* Frees the memory owned by the table. */
+void nbuf_intern_free(struct nbuf_intern *t);
+
 /* Allocates a string.
  *
  * This is a specialized version of nbuf_alloc_arr.  It takes care of length
@@ -495,7 +589,8 @@ nbuf_fix_arr(struct nbuf_obj *o, nbuf_word_t len, const struct nbuf_buf *newbuf)
  * The array length will be the string length + 1, to include an extra
  * trailing '\0'.
  * If len == -1, strlen() will be called to determine the length.
- * If str != NULL, its content will be copied into the buffer.
+ * If str != NULL, its content will be copied into the buffer, or an equal
+ * string is reused if the buffer has an interning table.
  * Returns the pointer to the newly-allocated string, or NULL if allocation
  * failed.
  */
@@ -506,6 +601,8 @@ nbuf_alloc_str(struct nbuf_obj *o, const char *str, size_t len)
 
 	if (len + 1 == 0)
 		len = strlen(str);
+	if (str != NULL && o->buf->intern)
+		return o->buf->intern->alloc_str(o, str, len);
 	o->ssize = 1;
 	o->psize = 0;
 	if (!nbuf_alloc_arr(o, len + 1))
@@ -549,6 +646,32 @@ nbuf_obj_s(const struct nbuf_obj *o, size_t byte_offset, size_t sz)
 	return o->buf->base + offset;
 }
 
+/* Gets a struct stored inline in the scalar part.
+ *
+ * The struct is returned as an object without pointers, sharing memory
+ * with `o`.  Fixed arrays are accessed the same way, with ssize being the
+ * size of the whole array.
+ * Returns 0 if the struct would overrun the scalar part, in which case
+ * `oo` is a null object.
+ */
+static inline size_t
+nbuf_obj_inline(struct nbuf_obj *oo, const struct nbuf_obj *o,
+	size_t byte_offset, size_t ssize)
+{
+	const char *p = nbuf_obj_s(o, byte_offset, ssize);
+
+	oo->buf = o->buf;
+	oo->psize = 0;
+	if (!p) {
+		oo->offset = 0;
+		oo->ssize = 0;
+		return 0;
+	}
+	oo->offset = p - o->buf->base;
+	oo->ssize = ssize;
+	return 1;
+}
+
 /* Gets a pointer field.
  *
  * See nbuf_get_obj for return code.
@@ -610,6 +733,179 @@ nbuf_obj_set_p(const struct nbuf_obj *o, size_t index, const struct nbuf_obj *rh
 	return 1;
 }
 
+/* Unions
+ *
+ * Members of a union share a single pointer field.  A 16-bit tag in the
+ * scalar part, at `tag_offset`, tells which member the pointer holds.
+ * Tags are numbered from 1 in declaration order; a tag of 0 means no
+ * member is set.
+ */
+
+/* Returns the tag of a union */
+static inline unsigned
+nbuf_obj_union_tag(const struct nbuf_obj *o, size_t tag_offset)
+{
+	const char *p = nbuf_obj_s(o, tag_offset, 2);
+
+	return p ? nbuf_u16(p) : 0;
+}
+
+/* Gets a pointer field that is a union member.
+ *
+ * If the union holds another member, this behaves as a null pointer.
+ * See nbuf_get_obj for return code.
+ */
+static inline size_t
+nbuf_obj_union_p(struct nbuf_obj *oo, const struct nbuf_obj *o,
+	size_t index, size_t tag_offset, unsigned tag)
+{
+	if (nbuf_obj_union_tag(o, tag_offset) != tag) {
+		oo->buf = o->buf;
+		oo->offset = 0;
+		oo->ssize = oo->psize = 0;
+		return 0;
+	}
+	return nbuf_obj_p(oo, o, index);
+}
+
+/* Sets a pointer field that is a union member, and the union tag.
+ *
+ * If rhs == NULL, clears the union if it holds this member.  Otherwise
+ * the union is left as is.
+ */
+static inline size_t
+nbuf_obj_set_union_p(const struct nbuf_obj *o, size_t index,
+	size_t tag_offset, unsigned tag, const struct nbuf_obj *rhs)
+{
+	char *p = nbuf_obj_s(o, tag_offset, 2);
+
+	if (!p)
+		return 0;
+	if (rhs == NULL && nbuf_u16(p) != tag)
+		return 1;
+	if (!nbuf_obj_set_p(o, index, rhs))
+		return 0;
+	nbuf_set_u16(p, rhs ? tag : 0);
+	return 1;
+}
+
+/* Bitfields
+ *
+ * A bitfield of `bits` bits is stored from bit `shift` of a byte in the
+ * scalar part.  Bitfields never straddle a byte.
+ */
+
+static inline unsigned
+nbuf_get_bits(const void *p, unsigned shift, unsigned bits)
+{
+	return (nbuf_u8(p) >> shift) & ((1u << bits) - 1);
+}
+
+static inline void
+nbuf_set_bits(void *p, unsigned shift, unsigned bits, unsigned v)
+{
+	unsigned mask = ((1u << bits) - 1) << shift;
+
+	nbuf_set_u8(p, (nbuf_u8(p) & ~mask) | ((v << shift) & mask));
+}
+
+/* Bitsets
+ *
+ * A repeated bool bitfield is stored as a byte array.  Bit i is bit (i % 8)
+ * of byte (i / 8).  An extra byte at the end holds the number of unused bits
+ * in the byte before it.
+ *
+ * `len` is the byte array length, as returned by nbuf_obj_p.
+ */
+
+/* Returns the number of bits, or 0 if the bitset is malformed. */
+static inline size_t
+nbuf_bitset_size(const struct nbuf_obj *o, size_t len)
+{
+	unsigned unused;
+
+	if (len < 2 || o->ssize != 1 || o->psize != 0)
+		return 0;
+	unused = nbuf_u8(o->buf->base + o->offset + len - 1);
+	if (unused > 7)
+		return 0;
+	return (len - 1) * 8 - unused;
+}
+
+/* Gets bit i.  The caller must check i against nbuf_bitset_size. */
+static inline int
+nbuf_bitset_get(const struct nbuf_obj *o, size_t i)
+{
+	return (nbuf_u8(o->buf->base + o->offset + i / 8) >> (i % 8)) & 1;
+}
+
+/* Sets bit i.  The caller must check i against nbuf_bitset_size. */
+static inline void
+nbuf_bitset_set(const struct nbuf_obj *o, size_t i, int v)
+{
+	nbuf_set_bits(o->buf->base + o->offset + i / 8, i % 8, 1, !!v);
+}
+
+/* Allocates a bitset of n bits, all cleared.
+ * Caller must initialize buf.
+ *
+ * Returns the byte array length, or 0 iff allocation fails.
+ */
+static inline size_t
+nbuf_alloc_bitset(struct nbuf_obj *o, size_t n)
+{
+	size_t nbytes = (n + 7) / 8;
+	char *p;
+
+	o->ssize = 1;
+	o->psize = 0;
+	if (!nbuf_alloc_arr(o, nbytes + 1))
+		return 0;
+	p = o->buf->base + o->offset;
+	memset(p, 0, nbytes);
+	nbuf_set_u8(p + nbytes, nbytes * 8 - n);
+	return nbytes + 1;
+}
+
+/* Packed integer arrays
+ *
+ * A packed field stores a repeated integer as a byte array of LEB128
+ * varints: the number of elements, followed by the elements.  With
+ * NBUF_PACK_SIGNED, elements are zigzag-encoded so small negative values
+ * stay short.  With NBUF_PACK_DELTA, each element is stored as the
+ * zigzag-encoded difference from the previous one.
+ *
+ * Elements in memory are native integers of `width` bytes (1, 2, 4 or 8).
+ * Packed arrays are not randomly accessible; they are encoded and decoded
+ * as a whole.
+ */
+#define NBUF_PACK_SIGNED 1
+#define NBUF_PACK_DELTA 2
+
+/* Allocates a packed array of n elements from src.
+ * Caller must initialize buf.
+ *
+ * Returns the byte array length, or 0 iff allocation fails.
+ */
+size_t
+nbuf_alloc_packed(struct nbuf_obj *o, const void *src, size_t n,
+	unsigned width, unsigned flags);
+
+/* Returns the number of elements, or 0 if the packed array is malformed.
+ * `len` is the byte array length, as returned by nbuf_obj_p.
+ */
+size_t
+nbuf_packed_size(const struct nbuf_obj *o, size_t len);
+
+/* Decodes up to n elements into dst.
+ *
+ * Returns the number of elements decoded, which is less than the packed
+ * array size if n is smaller, or if the packed array is malformed.
+ */
+size_t
+nbuf_unpack(void *dst, size_t n, unsigned width, unsigned flags,
+	const struct nbuf_obj *o, size_t len);
+
 /* Moves n elements after the current element in an array.
  *
  * Since nbuf_obj does not track array length, the caller must ensure
@@ -648,6 +944,649 @@ nbuf_obj_ptrdiff(const struct nbuf_obj *lhs, const struct nbuf_obj *rhs)
 	return d;
 }
 
+/* Keyed arrays
+ *
+ * A repeated message field may be keyed by a field of its elements, an
+ * integer, enum or string.  Elements sorted by key can be looked up by
+ * binary search.
+ *
+ * A scalar key is `width` bytes at `offset` in the scalar part, signed if
+ * flags has NBUF_KEY_SIGNED.  With NBUF_KEY_STRING, the key is the string
+ * at pointer index `offset`; strings compare as bytes.  Elements too short
+ * to hold the key, as written with an older schema, have a key of 0 or "".
+ */
+#define NBUF_KEY_SIGNED 1
+#define NBUF_KEY_STRING 2
+
+/* Returns the scalar key of element i, mapped to an unsigned integer
+ * that compares in the same order.
+ */
+static inline uint64_t
+nbuf_key_at(const struct nbuf_obj *o, size_t i, unsigned offset,
+	unsigned width, unsigned flags)
+{
+	const char *p = o->buf->base + o->offset + nbuf_obj_size(o) * i +
+		o->psize * sizeof (nbuf_word_t) + offset;
+	int is_signed = flags & NBUF_KEY_SIGNED;
+	uint64_t v;
+
+	if (offset + width > o->ssize)
+		v = 0;
+	else if (width == 1)
+		v = is_signed ? (uint64_t) (int8_t) nbuf_u8(p) : nbuf_u8(p);
+	else if (width == 2)
+		v = is_signed ? (uint64_t) (int16_t) nbuf_u16(p) : nbuf_u16(p);
+	else if (width == 4)
+		v = is_signed ? (uint64_t) (int32_t) nbuf_u32(p) : nbuf_u32(p);
+	else
+		v = nbuf_u64(p);
+	return is_signed ? v ^ ((uint64_t) 1 << 63) : v;
+}
+
+/* Returns the string key of element i, and its length in *lenp */
+static inline const char *
+nbuf_key_str_at(const struct nbuf_obj *o, size_t i, unsigned index, size_t *lenp)
+{
+	struct nbuf_obj elem = *o, s;
+
+	elem.offset += nbuf_obj_size(o) * i;
+	return nbuf_obj2str(&s, nbuf_obj_p(&s, &elem, index), lenp);
+}
+
+static inline int
+nbuf_key_strcmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+
+	return c ? c : (alen > blen) - (alen < blen);
+}
+
+/* Finds the element with a scalar key in an array of n elements sorted
+ * by key.  `key` is the value converted to uint64_t, as by a cast.
+ * The search is branchless, so that its cost does not depend on the
+ * keys: it always takes log2(n) probes.
+ *
+ * On success, moves o to the element and returns 1.  Otherwise, returns 0.
+ */
+static inline size_t
+nbuf_find_key(struct nbuf_obj *o, size_t n, unsigned offset, unsigned width,
+	unsigned flags, uint64_t key)
+{
+	size_t lo = 0, half;
+
+	if (flags & NBUF_KEY_SIGNED)
+		key ^= (uint64_t) 1 << 63;
+	if (n == 0)
+		return 0;
+	while ((half = n / 2) > 0) {
+		lo = (nbuf_key_at(o, lo + half - 1, offset, width, flags) < key) ?
+			lo + half : lo;
+		n -= half;
+	}
+	if (nbuf_key_at(o, lo, offset, width, flags) != key)
+		return 0;
+	nbuf_advance(o, lo);
+	return 1;
+}
+
+/* Same as nbuf_find_key, for a string key of len bytes. */
+static inline size_t
+nbuf_find_str_key(struct nbuf_obj *o, size_t n, unsigned index,
+	const char *key, size_t len)
+{
+	size_t lo = 0, half, slen;
+	const char *s;
+
+	if (n == 0)
+		return 0;
+	while ((half = n / 2) > 0) {
+		s = nbuf_key_str_at(o, lo + half - 1, index, &slen);
+		lo = (nbuf_key_strcmp(s, slen, key, len) < 0) ? lo + half : lo;
+		n -= half;
+	}
+	s = nbuf_key_str_at(o, lo, index, &slen);
+	if (nbuf_key_strcmp(s, slen, key, len) != 0)
+		return 0;
+	nbuf_advance(o, lo);
+	return 1;
+}
+
+/* Sorts the n elements of an array by key.  Elements with the same key
+ * keep their order.  Pointers in the elements are adjusted as they move, so
+ * they must point into the same buffer, as after nbuf_fix_arr.
+ *
+ * Returns 0 iff memory allocation fails.
+ */
+size_t
+nbuf_sort_by_key(const struct nbuf_obj *o, size_t n, unsigned offset,
+	unsigned width, unsigned flags);
+
+/* Hash index
+ *
+ * A repeated message field keyed by a string may also have a hash index,
+ * stored in the pointer after the field as an array of m uint32, where m is
+ * a power of 2.  Each slot holds an element index plus 1, or 0 if empty.
+ * The key is hashed with nbuf_hash_str, and collisions are resolved by
+ * linear probing.  The hash is part of the wire format: it has a fixed seed,
+ * so that an index built by one process can be used by another.
+ */
+
+/* FNV-1a */
+static inline uint32_t
+nbuf_hash_str(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* Finds the element with a string key in an array of n elements, using the
+ * hash index idx of m slots.  If there is no index (m == 0), the array is
+ * searched linearly.  An element index out of range in the index is treated
+ * as a miss, so a corrupt index cannot cause an invalid access.
+ *
+ * On success, moves o to the element and returns 1.  Otherwise, returns 0.
+ */
+static inline size_t
+nbuf_find_hashed(struct nbuf_obj *o, size_t n, unsigned index,
+	const struct nbuf_obj *idx, size_t m, const char *key, size_t len)
+{
+	const char *slots = m ? (const char *) nbuf_obj_base(idx) : NULL;
+	size_t i, slot, e, slen;
+	const char *s;
+
+	if (m == 0 || (m & (m - 1)) != 0 || idx->ssize != sizeof (uint32_t)) {
+		for (e = 0; e < n; e++) {
+			s = nbuf_key_str_at(o, e, index, &slen);
+			if (nbuf_key_strcmp(s, slen, key, len) == 0)
+				goto found;
+		}
+		return 0;
+	}
+	slot = nbuf_hash_str(key, len);
+	for (i = 0; i < m; i++, slot++) {
+		e = nbuf_u32(slots + (slot & (m - 1)) * sizeof (uint32_t));
+		if (e == 0)
+			return 0;
+		if (--e >= n)
+			continue;
+		s = nbuf_key_str_at(o, e, index, &slen);
+		if (nbuf_key_strcmp(s, slen, key, len) == 0)
+			goto found;
+	}
+	return 0;
+found:
+	nbuf_advance(o, e);
+	return 1;
+}
+
+/* Allocates the hash index of an array of n elements in o->buf, into idx.
+ * The index has twice as many slots as elements, rounded up to a power of 2.
+ * Elements with the same key are found in their order.
+ *
+ * Returns the number of slots, or 0 on failure.
+ */
+size_t
+nbuf_alloc_hash_index(struct nbuf_obj *idx, const struct nbuf_obj *o,
+	size_t n, unsigned index);
+
+/* Deep equality and hashing
+ *
+ * The code generated for each message type compares and hashes messages
+ * with the functions below, which read them the way nbuf_equal and
+ * nbuf_hash in libnbuf.h do, so that both give the same results: `mask`
+ * holds the bits of the `ssize` bytes of the scalar part that fields and
+ * union tags use, or is NULL if they use all of them, and a pointer field
+ * goes into the hash preceded by its number `k` in the message, unless it
+ * is empty.  The hash functions return false if the field or scalar part
+ * is empty.
+ */
+#define NBUF_MAX_DEPTH 500
+
+#define NBUF_XXH_P1 UINT64_C(0x9E3779B185EBCA87)
+#define NBUF_XXH_P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define NBUF_XXH_P3 UINT64_C(0x165667B19E3779F9)
+#define NBUF_XXH_P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define NBUF_XXH_P5 UINT64_C(0x27D4EB2F165667C5)
+
+/* XXH64 state */
+struct nbuf_hasher {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char buf[32];
+	unsigned n;
+};
+
+static inline uint64_t
+nbuf_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+nbuf_xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * NBUF_XXH_P2;
+	return nbuf_rotl64(acc, 31) * NBUF_XXH_P1;
+}
+
+static inline void
+nbuf_hasher_init(struct nbuf_hasher *s, uint64_t seed)
+{
+	s->v[0] = seed + NBUF_XXH_P1 + NBUF_XXH_P2;
+	s->v[1] = seed + NBUF_XXH_P2;
+	s->v[2] = seed;
+	s->v[3] = seed - NBUF_XXH_P1;
+	s->total = 0;
+	s->n = 0;
+}
+
+/* Consumes 32-byte stripes from p, in four independent lanes. */
+static inline void
+nbuf_hasher_stripes(struct nbuf_hasher *s, const unsigned char *p,
+	size_t nstripes)
+{
+	uint64_t v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+
+	for (; nstripes--; p += 32) {
+		v0 = nbuf_xxh_round(v0, nbuf_u64(p));
+		v1 = nbuf_xxh_round(v1, nbuf_u64(p + 8));
+		v2 = nbuf_xxh_round(v2, nbuf_u64(p + 16));
+		v3 = nbuf_xxh_round(v3, nbuf_u64(p + 24));
+	}
+	s->v[0] = v0;
+	s->v[1] = v1;
+	s->v[2] = v2;
+	s->v[3] = v3;
+}
+
+static inline void
+nbuf_hasher_update(struct nbuf_hasher *s, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	size_t k;
+
+	if (!len)
+		return;
+	s->total += len;
+	if (s->n) {
+		k = sizeof s->buf - s->n;
+		if (len < k) {
+			memcpy(s->buf + s->n, p, len);
+			s->n += len;
+			return;
+		}
+		memcpy(s->buf + s->n, p, k);
+		nbuf_hasher_stripes(s, s->buf, 1);
+		p += k;
+		len -= k;
+		s->n = 0;
+	}
+	nbuf_hasher_stripes(s, p, len / 32);
+	p += len / 32 * 32;
+	len %= 32;
+	memcpy(s->buf, p, len);
+	s->n = len;
+}
+
+static inline void
+nbuf_hasher_update_u64(struct nbuf_hasher *s, uint64_t x)
+{
+	unsigned char b[8];
+
+	if (s->n + 8 > sizeof s->buf) {
+		nbuf_set_u64(b, x);
+		nbuf_hasher_update(s, b, sizeof b);
+		return;
+	}
+	/* straight into the buffer, hashed once full */
+	nbuf_set_u64(s->buf + s->n, x);
+	s->total += 8;
+	if ((s->n += 8) == sizeof s->buf) {
+		nbuf_hasher_stripes(s, s->buf, 1);
+		s->n = 0;
+	}
+}
+
+static inline uint64_t
+nbuf_hasher_digest(const struct nbuf_hasher *s)
+{
+	const unsigned char *p = s->buf;
+	unsigned n = s->n, i;
+	uint64_t h;
+
+	if (s->total >= 32) {
+		h = nbuf_rotl64(s->v[0], 1) + nbuf_rotl64(s->v[1], 7) +
+			nbuf_rotl64(s->v[2], 12) + nbuf_rotl64(s->v[3], 18);
+		for (i = 0; i < 4; i++)
+			h = (h ^ nbuf_xxh_round(0, s->v[i])) * NBUF_XXH_P1 +
+				NBUF_XXH_P4;
+	} else {
+		h = s->v[2] + NBUF_XXH_P5;
+	}
+	h += s->total;
+	for (; n >= 8; n -= 8, p += 8)
+		h = nbuf_rotl64(h ^ nbuf_xxh_round(0, nbuf_u64(p)), 27) *
+			NBUF_XXH_P1 + NBUF_XXH_P4;
+	if (n >= 4) {
+		h = nbuf_rotl64(h ^ (uint64_t) nbuf_u32(p) * NBUF_XXH_P1, 23) *
+			NBUF_XXH_P2 + NBUF_XXH_P3;
+		n -= 4;
+		p += 4;
+	}
+	for (; n--; p++)
+		h = nbuf_rotl64(h ^ *p * NBUF_XXH_P5, 11) * NBUF_XXH_P1;
+	h ^= h >> 33;
+	h *= NBUF_XXH_P2;
+	h ^= h >> 29;
+	h *= NBUF_XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* Tells whether a and b are the same object. */
+static inline bool
+nbuf_obj_is(const struct nbuf_obj *a, const struct nbuf_obj *b)
+{
+	return a->buf == b->buf && a->offset == b->offset &&
+		a->ssize == b->ssize && a->psize == b->psize;
+}
+
+/* Gets the bytes of the scalar part of o, which must not be empty. */
+static inline const unsigned char *
+nbuf_obj_scalars(const struct nbuf_obj *o)
+{
+	return (const unsigned char *) o->buf->base + o->offset +
+		o->psize * sizeof (nbuf_word_t);
+}
+
+static inline bool
+nbuf_same_scalars(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	const unsigned char *mask, size_t ssize)
+{
+	const unsigned char *p, *q;
+	size_t na = a->ssize < ssize ? a->ssize : ssize;
+	size_t nb = b->ssize < ssize ? b->ssize : ssize;
+	size_t i, n = na < nb ? na : nb;
+	uint64_t x, y, m = ~(uint64_t) 0;
+
+	if (!ssize)
+		return true;
+	p = a->ssize ? nbuf_obj_scalars(a) : NULL;
+	q = b->ssize ? nbuf_obj_scalars(b) : NULL;
+	if (a->ssize == b->ssize && (!a->ssize ||
+		memcmp(p, q, a->ssize) == 0))
+		return true;
+	if (!mask && n == ssize)
+		return memcmp(p, q, ssize) == 0;
+	/* a word at a time, then the rest, reading past the end as 0 */
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&x, p + i, 8);
+		memcpy(&y, q + i, 8);
+		if (mask)
+			memcpy(&m, mask + i, 8);
+		if ((x ^ y) & m)
+			return false;
+	}
+	for (; i < ssize; i++)
+		if (((i < na ? p[i] : 0) ^ (i < nb ? q[i] : 0)) &
+			(mask ? mask[i] : 0xff))
+			return false;
+	return true;
+}
+
+static inline bool
+nbuf_hash_scalars(struct nbuf_hasher *s, const struct nbuf_obj *o,
+	const unsigned char *mask, size_t ssize)
+{
+	const unsigned char *p;
+	unsigned char w[8];
+	size_t n = o->ssize < ssize ? o->ssize : ssize, i, j;
+	uint64_t x, any = 0;
+
+	if (!ssize)
+		return false;
+	p = o->ssize ? nbuf_obj_scalars(o) : NULL;
+	if (!mask && n == ssize) {
+		nbuf_hasher_update(s, p, ssize);
+		for (i = 0; i + 8 <= ssize; i += 8)
+			any |= nbuf_u64(p + i);
+		for (; i < ssize; i++)
+			any |= p[i];
+		return any != 0;
+	}
+	/* masked a word at a time, reading past the end as 0 */
+	for (i = 0; i + 8 <= ssize; i += 8) {
+		if (i + 8 <= n) {
+			x = nbuf_u64(p + i);
+		} else {
+			memset(w, 0, sizeof w);
+			if (i < n)
+				memcpy(w, p + i, n - i);
+			x = nbuf_u64(w);
+		}
+		if (mask)
+			x &= nbuf_u64(mask + i);
+		any |= x;
+		nbuf_hasher_update_u64(s, x);
+	}
+	for (j = 0; i + j < ssize; j++) {
+		w[j] = i + j < n ? p[i + j] & (mask ? mask[i + j] : 0xff) : 0;
+		any |= w[j];
+	}
+	nbuf_hasher_update(s, w, j);
+	return any != 0;
+}
+
+/* Tells whether arrays a and b of n elements have the same layout and
+ * bytes.
+ */
+static inline bool
+nbuf_same_bytes(const struct nbuf_obj *a, const struct nbuf_obj *b, size_t n)
+{
+	return a->ssize == b->ssize && a->psize == b->psize &&
+		memcmp(nbuf_obj_base(a), nbuf_obj_base(b),
+		n * nbuf_obj_size(a)) == 0;
+}
+
+static inline bool
+nbuf_same_str_field(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	size_t index)
+{
+	struct nbuf_obj x, y;
+	size_t nx = nbuf_obj_p(&x, a, index), ny = nbuf_obj_p(&y, b, index);
+
+	nbuf_obj2str(&x, nx, &nx);
+	nbuf_obj2str(&y, ny, &ny);
+	return nx == ny && (!nx || memcmp(nbuf_obj_base(&x),
+		nbuf_obj_base(&y), nx) == 0);
+}
+
+static inline bool
+nbuf_hash_str_field(struct nbuf_hasher *s, const struct nbuf_obj *o,
+	size_t index, unsigned k)
+{
+	struct nbuf_obj x;
+	size_t len = nbuf_obj_p(&x, o, index);
+
+	nbuf_obj2str(&x, len, &len);
+	if (!len)
+		return false;
+	nbuf_hasher_update_u64(s, k);
+	nbuf_hasher_update_u64(s, len);
+	nbuf_hasher_update(s, nbuf_obj_base(&x), len);
+	return true;
+}
+
+static inline bool
+nbuf_same_bitset_field(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	size_t index)
+{
+	struct nbuf_obj x, y;
+	size_t nx = nbuf_bitset_size(&x, nbuf_obj_p(&x, a, index));
+	size_t ny = nbuf_bitset_size(&y, nbuf_obj_p(&y, b, index));
+	const unsigned char *p, *q;
+	unsigned last = (1u << (nx % 8)) - 1;
+
+	if (nx != ny)
+		return false;
+	if (!nx)
+		return true;
+	p = (const unsigned char *) nbuf_obj_base(&x);
+	q = (const unsigned char *) nbuf_obj_base(&y);
+	return memcmp(p, q, nx / 8) == 0 &&
+		(!last || ((p[nx / 8] ^ q[nx / 8]) & last) == 0);
+}
+
+static inline bool
+nbuf_hash_bitset_field(struct nbuf_hasher *s, const struct nbuf_obj *o,
+	size_t index, unsigned k)
+{
+	struct nbuf_obj x;
+	size_t n = nbuf_bitset_size(&x, nbuf_obj_p(&x, o, index));
+	unsigned last = (1u << (n % 8)) - 1;
+	unsigned char c;
+
+	if (!n)
+		return false;
+	nbuf_hasher_update_u64(s, k);
+	nbuf_hasher_update_u64(s, n);
+	nbuf_hasher_update(s, nbuf_obj_base(&x), n / 8);
+	if (last) {
+		c = ((const unsigned char *) nbuf_obj_base(&x))[n / 8] & last;
+		nbuf_hasher_update(s, &c, 1);
+	}
+	return true;
+}
+
+static inline bool
+nbuf_same_packed_field(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	size_t index)
+{
+	struct nbuf_obj x, y;
+	size_t nx = nbuf_obj_p(&x, a, index), ny = nbuf_obj_p(&y, b, index);
+
+	if (nx && !nbuf_packed_size(&x, nx))
+		nx = 0;
+	if (ny && !nbuf_packed_size(&y, ny))
+		ny = 0;
+	return nx == ny && (!nx || memcmp(nbuf_obj_base(&x),
+		nbuf_obj_base(&y), nx) == 0);
+}
+
+static inline bool
+nbuf_hash_packed_field(struct nbuf_hasher *s, const struct nbuf_obj *o,
+	size_t index, unsigned k)
+{
+	struct nbuf_obj x;
+	size_t n = nbuf_obj_p(&x, o, index);
+
+	if (!n || !nbuf_packed_size(&x, n))
+		return false;
+	nbuf_hasher_update_u64(s, k);
+	nbuf_hasher_update_u64(s, n);
+	nbuf_hasher_update(s, nbuf_obj_base(&x), n);
+	return true;
+}
+
+/* For arrays of integers, floats and enums, of `size` bytes in the schema */
+static inline bool
+nbuf_same_scalar_arr_field(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	size_t index, size_t size)
+{
+	struct nbuf_obj x, y;
+	size_t n = nbuf_obj_p(&x, a, index), i, j, lx, ly;
+	const unsigned char *p, *q;
+
+	if (n != nbuf_obj_p(&y, b, index))
+		return false;
+	if (!n)
+		return true;
+	if (x.ssize == size && y.ssize == size)
+		return memcmp(nbuf_obj_base(&x), nbuf_obj_base(&y),
+			n * size) == 0;
+	/* elements of another width read as 0 past their end */
+	lx = x.ssize < size ? x.ssize : size;
+	ly = y.ssize < size ? y.ssize : size;
+	for (i = 0; i < n; i++, nbuf_next(&x), nbuf_next(&y)) {
+		p = (const unsigned char *) nbuf_obj_base(&x);
+		q = (const unsigned char *) nbuf_obj_base(&y);
+		if (memcmp(p, q, lx < ly ? lx : ly) != 0)
+			return false;
+		for (j = lx; j < ly; j++)
+			if (q[j])
+				return false;
+		for (j = ly; j < lx; j++)
+			if (p[j])
+				return false;
+	}
+	return true;
+}
+
+static inline bool
+nbuf_hash_scalar_arr_field(struct nbuf_hasher *s, const struct nbuf_obj *o,
+	size_t index, unsigned k, size_t size)
+{
+	struct nbuf_obj x;
+	size_t n = nbuf_obj_p(&x, o, index), i;
+	size_t len = x.ssize < size ? x.ssize : size;
+	unsigned char w[8] = { 0 };
+
+	if (!n)
+		return false;
+	nbuf_hasher_update_u64(s, k);
+	nbuf_hasher_update_u64(s, n);
+	if (x.ssize == size) {
+		nbuf_hasher_update(s, nbuf_obj_base(&x), n * size);
+		return true;
+	}
+	for (i = 0; i < n; i++, nbuf_next(&x)) {
+		memcpy(w, nbuf_obj_base(&x), len);
+		nbuf_hasher_update(s, w, size);
+	}
+	return true;
+}
+
+static inline bool
+nbuf_same_str_arr_field(const struct nbuf_obj *a, const struct nbuf_obj *b,
+	size_t index)
+{
+	struct nbuf_obj x, y;
+	size_t n = nbuf_obj_p(&x, a, index), i;
+
+	if (n != nbuf_obj_p(&y, b, index))
+		return false;
+	for (i = 0; i < n; i++, nbuf_next(&x), nbuf_next(&y))
+		if (!nbuf_same_str_field(&x, &y, 0))
+			return false;
+	return true;
+}
+
+static inline bool
+nbuf_hash_str_arr_field(struct nbuf_hasher *s, const struct nbuf_obj *o,
+	size_t index, unsigned k)
+{
+	struct nbuf_obj x, e;
+	size_t n = nbuf_obj_p(&x, o, index), i, len;
+
+	if (!n)
+		return false;
+	nbuf_hasher_update_u64(s, k);
+	nbuf_hasher_update_u64(s, n);
+	for (i = 0; i < n; i++, nbuf_next(&x)) {
+		len = nbuf_obj_p(&e, &x, 0);
+		nbuf_obj2str(&e, len, &len);
+		nbuf_hasher_update_u64(s, len);
+		nbuf_hasher_update(s, nbuf_obj_base(&e), len);
+	}
+	return true;
+}
+
 /* Generated code defines wrappers a nbuf_obj.  To defeat C's typing system
  * and pass those values into a function expecting a nbuf_obj, use the
  * following macro.
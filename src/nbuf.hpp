@@ -4,8 +4,11 @@
 #include "nbuf.h"
 
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#if __cpp_lib_string_view
+#include <iterator>
+#if __cplusplus >= 201703L
 # include <string_view>
 #endif
 #include <type_traits>
@@ -96,15 +99,41 @@ struct object : ::nbuf_obj {
 	scalar<U> *scalar_field(size_t offset) const {
 		return reinterpret_cast<scalar<U> *>(::nbuf_obj_s(this, offset, sizeof (U)));
 	}
+	unsigned bit_field(size_t offset, unsigned shift, unsigned bits) const {
+		const void *p = ::nbuf_obj_s(this, offset, 1);
+		return p ? ::nbuf_get_bits(p, shift, bits) : 0;
+	}
+	bool set_bit_field(size_t offset, unsigned shift, unsigned bits, unsigned v) const {
+		void *p = ::nbuf_obj_s(this, offset, 1);
+		if (p) ::nbuf_set_bits(p, shift, bits, v);
+		return p != NULL;
+	}
 	size_t pointer_field(object *o, size_t index) const {
 		return ::nbuf_obj_p(o, this, index);
 	}
 	size_t set_pointer_field(size_t index, const object &o) const {
 		return ::nbuf_obj_set_p(this, index, &o);
 	}
+	size_t inline_field(object *o, size_t offset, size_t ssize, size_t n = 1) const {
+		if (!::nbuf_obj_inline(o, this, offset, ssize * n))
+			return 0;
+		o->ssize = ssize;
+		return n;
+	}
 	inline string string_field(size_t index) const;
 	template <typename U>
 	inline string set_string_field(size_t index, const U &s) const;
+	unsigned union_tag(size_t tag_offset) const {
+		return ::nbuf_obj_union_tag(this, tag_offset);
+	}
+	size_t union_field(object *o, size_t index, size_t tag_offset, unsigned tag) const {
+		return ::nbuf_obj_union_p(o, this, index, tag_offset, tag);
+	}
+	size_t set_union_field(size_t index, size_t tag_offset, unsigned tag, const object &o) const {
+		return ::nbuf_obj_set_union_p(this, index, tag_offset, tag, &o);
+	}
+	template <typename U>
+	inline string set_union_string_field(size_t index, size_t tag_offset, unsigned tag, const U &s) const;
 	size_t alloc(buffer *buf, size_t ssize, size_t psize) {
 		this->buf = buf;
 		this->ssize = ssize;
@@ -119,93 +148,142 @@ struct object : ::nbuf_obj {
 	}
 };
 
+/* Random-access iterator over the elements of an array.
+ * Derived defines operator* and operator[], which return its reference
+ * type.  Iterators compare by offset, so only
+ * iterators of the same buffer can be compared.
+ */
+template <typename Derived>
+struct array_iterator {
+	using difference_type = std::ptrdiff_t;
+	using iterator_category = std::random_access_iterator_tag;
+
+	array_iterator() : o_() {}
+	explicit array_iterator(const object &o) : o_(o) {}
+
+	Derived &operator++() { return *this += 1; }
+	Derived &operator--() { return *this -= 1; }
+	Derived operator++(int) { Derived it = self(); ++*this; return it; }
+	Derived operator--(int) { Derived it = self(); --*this; return it; }
+	Derived &operator+=(difference_type n) { ::nbuf_advance(&o_, n); return self(); }
+	Derived &operator-=(difference_type n) { ::nbuf_advance(&o_, -n); return self(); }
+	Derived operator+(difference_type n) const { Derived it = self(); return it += n; }
+	Derived operator-(difference_type n) const { Derived it = self(); return it -= n; }
+	friend Derived operator+(difference_type n, const Derived &it) { return it + n; }
+	friend difference_type operator-(const Derived &a, const Derived &b) {
+		difference_type sz = ::nbuf_obj_size(&a.o_);
+		return sz ? (static_cast<difference_type>(a.o_.offset) -
+			static_cast<difference_type>(b.o_.offset)) / sz : 0;
+	}
+
+	friend bool operator==(const Derived &a, const Derived &b) { return a.o_.offset == b.o_.offset; }
+	friend bool operator!=(const Derived &a, const Derived &b) { return a.o_.offset != b.o_.offset; }
+	friend bool operator<(const Derived &a, const Derived &b) { return a.o_.offset < b.o_.offset; }
+	friend bool operator>(const Derived &a, const Derived &b) { return a.o_.offset > b.o_.offset; }
+	friend bool operator<=(const Derived &a, const Derived &b) { return a.o_.offset <= b.o_.offset; }
+	friend bool operator>=(const Derived &a, const Derived &b) { return a.o_.offset >= b.o_.offset; }
+
+protected:
+	Derived &self() { return static_cast<Derived &>(*this); }
+	const Derived &self() const { return static_cast<const Derived &>(*this); }
+	object o_;
+};
+
 struct basic_array : object {
-	struct iterator {
-		iterator (const object &o) : o_(o) {}
-		iterator (const iterator &other) = default;
-		iterator &operator =(const iterator &other) = default;
-		bool operator ==(const iterator &other) { return o_.buf->base + o_.offset == other.o_.buf->base + other.o_.offset; }
-		bool operator !=(const iterator &other) { return !(*this == other); }
-		void advance(size_t n) { ::nbuf_advance(&o_, n); }
-	protected:
-		object o_;
-	};
 	operator bool () const { return size_ != 0; }
+	basic_array() : size_(0) {}
 	basic_array(const object &o, size_t size) : object(o), size_(size) {}
 	size_t size() const { return size_; }
-	iterator begin() const { return iterator(*this); }
-	iterator end() const { iterator it = begin(); it.advance(size_); return it; }
 protected:
 	size_t size_;
 };
 
+/* Elements are contiguous, so a scalar array is also a contiguous range
+ * of T, which is a (const) scalar<U>.
+ */
 template <typename T>
 struct scalar_array : basic_array {
 	using basic_array::basic_array;
-	struct iterator : basic_array::iterator {
-		iterator(const basic_array::iterator &it) : basic_array::iterator(it) {}
-		iterator (const iterator &other) = default;
-		iterator &operator =(const iterator &other) = default;
-		iterator &operator ++() { return *this += 1; }
-		iterator &operator --() { return *this -= 1; }
-		iterator &operator +=(size_t n) { advance(n); return *this; }
-		iterator &operator -=(size_t n) { advance(-n); return *this; }
-		T &operator*() const {
-			return *reinterpret_cast<T *>(::nbuf_obj_s(&o_, 0, sizeof (T)));
+	struct iterator : array_iterator<iterator> {
+		using value_type = typename std::remove_cv<T>::type;
+		using reference = T &;
+		using pointer = T *;
+#if __cplusplus >= 202002L
+		using iterator_concept = std::contiguous_iterator_tag;
+#endif
+		using array_iterator<iterator>::array_iterator;
+		reference operator*() const { return *operator->(); }
+		pointer operator->() const {
+			return reinterpret_cast<T *>(this->o_.buf->base + this->o_.offset);
 		}
+		reference operator[](std::ptrdiff_t n) const { return *(*this + n); }
 	};
-	iterator begin() const {
-		return basic_array::begin();
-	}
-	iterator end() const {
-		return basic_array::end();
-	}
+	iterator begin() const { return iterator(*this); }
+	iterator end() const { return begin() + size_; }
 	T &operator[](size_t i) const {
-		iterator it = begin();
-		it.advance(i);
-		return *it;
+		return begin()[i];
 	}
 	static scalar_array alloc(buffer *buf, size_t n) {
 		object o;
 		o.buf = buf;
 		o.ssize = sizeof (T);
 		o.psize = 0;
-		n = ::nbuf_alloc_arr(&o, n);
+		if (!::nbuf_alloc_arr(&o, n))
+			n = 0;
 		return scalar_array(o, n);
 	}
 };
 
+/* Elements are returned by value, as readers or writers: the iterator is
+ * random access, but does not yield references.
+ */
 template <typename T>
 struct pointer_array : basic_array {
 	using basic_array::basic_array;
-	struct iterator : public basic_array::iterator {
-		iterator(const basic_array::iterator &it) : basic_array::iterator(it) {}
-		iterator (const iterator &other) = default;
-		iterator &operator =(const iterator &other) = default;
-		iterator &operator ++() { return *this += 1; }
-		iterator &operator --() { return *this -= 1; }
-		iterator &operator +=(size_t n) { advance(n); return *this; }
-		iterator &operator -=(size_t n) { advance(-n); return *this; }
-		T operator*() const {
+	struct iterator : array_iterator<iterator> {
+		using value_type = T;
+		using reference = T;
+		using pointer = void;
+		using array_iterator<iterator>::array_iterator;
+		reference operator*() const {
 			T o;
-			o.buf = o_.buf;
-			o.offset = o_.offset;
-			o.ssize = o_.ssize;
-			o.psize = o_.psize;
+			o.buf = this->o_.buf;
+			o.offset = this->o_.offset;
+			o.ssize = this->o_.ssize;
+			o.psize = this->o_.psize;
 			return o;
 		}
+		reference operator[](std::ptrdiff_t n) const { return *(*this + n); }
 	};
-	iterator begin() const {
-		return basic_array::begin();
+	iterator begin() const { return iterator(*this); }
+	iterator end() const { return begin() + size_; }
+	T operator[](size_t i) const {
+		return begin()[i];
+	}
+};
+
+struct bitset : object {
+	bitset() : size_(0) {}
+	bitset(const object &o, size_t len) : object(o), size_(::nbuf_bitset_size(&o, len)) {}
+	operator bool () const { return size_ != 0; }
+	size_t size() const { return size_; }
+	bool operator[](size_t i) const {
+		return i < size_ && ::nbuf_bitset_get(this, i);
 	}
-	iterator end() const {
-		return basic_array::end();
+	bool set(size_t i, bool v) const {
+		if (i >= size_)
+			return false;
+		::nbuf_bitset_set(this, i, v);
+		return true;
 	}
-	T operator[](size_t i) const {
-		iterator it = begin();
-		it.advance(i);
-		return *it;
+	static bitset alloc(buffer *buf, size_t n) {
+		object o;
+		o.buf = buf;
+		size_t len = ::nbuf_alloc_bitset(&o, n);
+		return bitset(o, len);
 	}
+private:
+	size_t size_;
 };
 
 struct string : basic_array {
@@ -249,6 +327,7 @@ struct string : basic_array {
 };
 
 struct string_proxy : string {
+	string_proxy(const string_proxy &) = default;
 	template <typename U>
 	string operator =(const U &s) {
 		string o = string::alloc(&o, buf, s);
@@ -258,43 +337,35 @@ struct string_proxy : string {
 	}
 private:
 	using string::string;
-	string_proxy(const string_proxy &) = default;
 	friend struct string_array;
 };
 
 struct string_array : basic_array {
 	using basic_array::basic_array;
-	struct iterator : public basic_array::iterator {
-		iterator(const basic_array::iterator &it) : basic_array::iterator(it) {}
-		iterator (const iterator &other) = default;
-		iterator &operator =(const iterator &other) = default;
-		iterator &operator ++() { return *this += 1; }
-		iterator &operator --() { return *this -= 1; }
-		iterator &operator +=(size_t n) { advance(n); return *this; }
-		iterator &operator -=(size_t n) { advance(-n); return *this; }
-		string_proxy operator*() const {
+	struct iterator : array_iterator<iterator> {
+		using value_type = string_proxy;
+		using reference = string_proxy;
+		using pointer = void;
+		using array_iterator<iterator>::array_iterator;
+		reference operator*() const {
 			object o;
-			size_t len = ::nbuf_obj_p(&o, &o_, 0);
+			size_t len = ::nbuf_obj_p(&o, &this->o_, 0);
 			return string_proxy(o, len);
 		}
+		reference operator[](std::ptrdiff_t n) const { return *(*this + n); }
 	};
-	iterator begin() const {
-		return basic_array::begin();
-	}
-	iterator end() const {
-		return basic_array::end();
-	}
-	string_proxy operator[](size_t i) {
-		iterator it = begin();
-		it.advance(i);
-		return *it;
+	iterator begin() const { return iterator(*this); }
+	iterator end() const { return begin() + size_; }
+	string_proxy operator[](size_t i) const {
+		return begin()[i];
 	}
 	static string_array alloc(buffer *buf, size_t n) {
 		object o;
 		o.buf = buf;
 		o.ssize = 0;
 		o.psize = 1;
-		n = ::nbuf_alloc_arr(&o, n);
+		if (!::nbuf_alloc_arr(&o, n))
+			n = 0;
 		return string_array(o, n);
 	}
 };
@@ -315,6 +386,696 @@ string object::set_string_field(size_t index, const U &s) const {
 	return string(object(), 0);
 }
 
+template <typename U>
+string object::set_union_string_field(size_t index, size_t tag_offset, unsigned tag, const U &s) const {
+	if (index < psize) {
+		string o = string::alloc(buf, s);
+		if (o && nbuf_obj_set_union_p(this, index, tag_offset, tag, &o))
+			return o;
+	}
+	return string(object(), 0);
+}
+
+/* Builders
+ *
+ * The writers above keep a buffer and an offset, and resolve them again
+ * after every allocation, since an allocation may move the buffer.
+ * Builders instead write through raw pointers: space for the message is
+ * reserved up front with arena::reserve, and allocations are carved out
+ * of the reserved capacity without ever growing the buffer.  Field writes
+ * are plain stores at constant offsets.
+ *
+ * An allocation that does not fit fails with status::no_space.  The arena
+ * keeps the first error and fails every later allocation, so a deep
+ * message can be built without checking each call; builders returned by
+ * failed allocations, arrays included, have the requested size but write
+ * to scratch memory owned by the arena.  Check arena::error() before
+ * using the message.
+ *
+ * Nothing else may allocate from the buffer while builders are alive.
+ */
+#if __cplusplus >= 201703L
+#define NBUF_HAVE_BUILDER 1
+
+enum class [[nodiscard]] status : uint8_t {
+	ok = 0,
+	no_space,   // allocation exceeds the reserved capacity
+	no_memory,  // reserve could not grow the buffer
+};
+
+/* Space taken by allocations, for arena::reserve */
+template <typename B>
+constexpr size_t message_size() {
+	return NBUF_ALLOC_ALIGN(sizeof (nbuf_word_t) + B::ssize + B::psize * sizeof (nbuf_word_t));
+}
+
+template <typename B>
+constexpr size_t array_size(size_t n) {
+	return NBUF_ALLOC_ALIGN(2 * sizeof (nbuf_word_t) + n * (B::ssize + B::psize * sizeof (nbuf_word_t)));
+}
+
+template <typename T>
+constexpr size_t scalar_array_size(size_t n) {
+	return NBUF_ALLOC_ALIGN(2 * sizeof (nbuf_word_t) + n * sizeof (T));
+}
+
+constexpr size_t string_size(size_t len) {
+	return NBUF_ALLOC_ALIGN(sizeof (nbuf_word_t) + len + 1);
+}
+
+class arena {
+public:
+	explicit arena(buffer *buf) : buf_(buf), err_(status::ok), sink_(nullptr), sink_size_(0) {}
+	arena(const arena &) = delete;
+	arena &operator=(const arena &) = delete;
+	~arena() {
+		while (sink_) {
+			char *prev;
+			std::memcpy(&prev, sink_, sizeof prev);
+			std::free(sink_);
+			sink_ = prev;
+		}
+	}
+	buffer *buf() const { return buf_; }
+	status error() const { return err_; }
+
+	/* Makes sure that n more bytes can be allocated.  This may move the
+	 * buffer, so it must not be called while builders are alive.
+	 */
+	status reserve(size_t n) {
+		n += -buf_->len & (sizeof (nbuf_word_t) - 1);
+		if (buf_->cap - buf_->len >= n)
+			return status::ok;
+		if (!::nbuf_alloc(buf_, n))
+			return fail(status::no_memory);
+		buf_->len -= n;
+		return status::ok;
+	}
+
+	/* Allocates size bytes, zeroed and word-aligned.
+	 * Returns NULL and records the error if they do not fit.
+	 */
+	char *alloc(size_t size) {
+		size_t len = buf_->len, pad = -len & (sizeof (nbuf_word_t) - 1);
+		char *p;
+
+		size = NBUF_ALLOC_ALIGN(size);
+		if (err_ != status::ok)
+			return nullptr;
+		if (buf_->cap - len < pad + size) {
+			(void) fail(status::no_space);
+			return nullptr;
+		}
+		p = buf_->base + len;
+		std::memset(p, 0, pad + size);
+		buf_->len = len + pad + size;
+		return p + pad;
+	}
+
+	/* Returns scratch memory for the builder of a failed allocation. */
+	char *sink(size_t size) {
+		if (!sink_ || size > sink_size_) {
+			char *p = static_cast<char *>(std::malloc(sizeof sink_ + size));
+
+			// Builders still point into the old scratch, keep it.
+			if (!p)
+				std::abort();
+			std::memcpy(p, &sink_, sizeof sink_);
+			sink_ = p;
+			sink_size_ = size;
+		}
+		return sink_ + sizeof sink_;
+	}
+
+	status fail(status err) {
+		if (err_ == status::ok)
+			err_ = err;
+		return err;
+	}
+
+private:
+	buffer *buf_;
+	status err_;
+	char *sink_;  // scratch, each block starts with the previous one
+	size_t sink_size_;
+};
+
+/* Builders of the n messages of an array */
+template <typename B>
+class array_builder {
+public:
+	array_builder() : a_(nullptr), p_(nullptr), n_(0) {}
+	array_builder(arena *a, char *p, size_t n) : a_(a), p_(p), n_(n) {}
+	size_t size() const { return n_; }
+	B operator[](size_t i) const {
+		return B(a_, p_ + i * (B::ssize + B::psize * sizeof (nbuf_word_t)));
+	}
+	struct iterator {
+		const array_builder *arr;
+		size_t i;
+		B operator*() const { return (*arr)[i]; }
+		iterator &operator++() { ++i; return *this; }
+		bool operator!=(const iterator &other) const { return i != other.i; }
+	};
+	iterator begin() const { return iterator{this, 0}; }
+	iterator end() const { return iterator{this, n_}; }
+private:
+	arena *a_;
+	char *p_;
+	size_t n_;
+};
+
+template <typename T>
+class scalar_array_builder {
+public:
+	scalar_array_builder() : p_(nullptr), n_(0) {}
+	scalar_array_builder(char *p, size_t n) : p_(p), n_(n) {}
+	size_t size() const { return n_; }
+	scalar<T> &operator[](size_t i) const {
+		return reinterpret_cast<scalar<T> *>(p_)[i];
+	}
+	scalar<T> *begin() const { return &(*this)[0]; }
+	scalar<T> *end() const { return &(*this)[n_]; }
+private:
+	char *p_;
+	size_t n_;
+};
+
+class bitset_builder {
+public:
+	bitset_builder() : p_(nullptr), n_(0) {}
+	bitset_builder(char *p, size_t n) : p_(p), n_(n) {}
+	size_t size() const { return n_; }
+	void set(size_t i, bool v) const {
+		::nbuf_set_bits(p_ + i / 8, i % 8, 1, v);
+	}
+private:
+	char *p_;
+	size_t n_;
+};
+
+class string_array_builder;
+template <typename B> class message_appender;
+template <typename T> class scalar_appender;
+class string_appender;
+
+class builder_base {
+public:
+	builder_base() : a_(nullptr), p_(nullptr) {}
+	builder_base(arena *a, char *p) : a_(a), p_(p) {}
+
+	/* Offset of the object header, as taken by get().
+	 * Only meaningful for a message from build(), if the arena has no error.
+	 */
+	size_t offset() const {
+		return p_ - sizeof (nbuf_word_t) - a_->buf()->base;
+	}
+
+protected:
+	/* Points the pointer field at index to the object with header hdr.
+	 * For a union member, tag_at is the offset of the tag from p_.
+	 */
+	void link(size_t index, const char *hdr, size_t tag_at, unsigned tag) const {
+		char *ptr = p_ + index * sizeof (nbuf_word_t);
+
+		::nbuf_set_word(ptr, static_cast<nbuf_word_t>((hdr - ptr) / sizeof (nbuf_word_t)));
+		if (tag)
+			::nbuf_set_u16(p_ + tag_at, tag);
+	}
+
+	template <typename T>
+	void put(size_t offset, T v) const {
+		*reinterpret_cast<scalar<T> *>(p_ + offset) = v;
+	}
+
+	void put_bits(size_t offset, unsigned shift, unsigned bits, unsigned v) const {
+		::nbuf_set_bits(p_ + offset, shift, bits, v);
+	}
+
+	/* Allocates an array; returns the first element, or NULL. */
+	char *alloc_array(size_t n, size_t elem_size, nbuf_word_t hdr,
+		size_t index, size_t tag_at, unsigned tag) const {
+		char *p = a_->alloc(2 * sizeof (nbuf_word_t) + n * elem_size);
+
+		if (!p)
+			return nullptr;
+		::nbuf_set_word(p, hdr | NBUF_ARR_MASK);
+		::nbuf_set_word(p + sizeof (nbuf_word_t), static_cast<nbuf_word_t>(n));
+		link(index, p, tag_at, tag);
+		return p + 2 * sizeof (nbuf_word_t);
+	}
+
+	/* Allocates a byte array; returns its bytes, or NULL. */
+	char *alloc_bytes(size_t len, size_t index, size_t tag_at, unsigned tag) const {
+		char *p;
+
+		if ((len & NBUF_BLEN_MASK) != len) {
+			(void) a_->fail(status::no_space);
+			return nullptr;
+		}
+		if (!(p = a_->alloc(sizeof (nbuf_word_t) + len)))
+			return nullptr;
+		::nbuf_set_word(p, static_cast<nbuf_word_t>(len) | NBUF_BARR_MASK | NBUF_HDR_MASK);
+		link(index, p, tag_at, tag);
+		return p + sizeof (nbuf_word_t);
+	}
+
+	template <typename B>
+	B alloc_message(size_t index, size_t tag_at = 0, unsigned tag = 0) const {
+		size_t size = B::ssize + B::psize * sizeof (nbuf_word_t);
+		char *p = a_->alloc(sizeof (nbuf_word_t) + size);
+
+		if (!p)
+			return B(a_, a_->sink(size));
+		::nbuf_set_word(p, NBUF_HDR(B::ssize, B::psize));
+		link(index, p, tag_at, tag);
+		return B(a_, p + sizeof (nbuf_word_t));
+	}
+
+	template <typename B>
+	array_builder<B> alloc_messages(size_t n, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const {
+		char *p = alloc_array(n, B::ssize + B::psize * sizeof (nbuf_word_t),
+			NBUF_HDR(B::ssize, B::psize), index, tag_at, tag);
+
+		if (!p)
+			p = a_->sink(n * (B::ssize + B::psize * sizeof (nbuf_word_t)));
+		return array_builder<B>(a_, p, n);
+	}
+
+	template <typename T>
+	scalar_array_builder<T> alloc_scalars(size_t n, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const {
+		char *p = alloc_array(n, sizeof (T), NBUF_HDR(sizeof (T), 0),
+			index, tag_at, tag);
+
+		if (!p)
+			p = a_->sink(n * sizeof (T));
+		return scalar_array_builder<T>(p, n);
+	}
+
+	bitset_builder alloc_bitset(size_t n, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const {
+		size_t nbytes = (n + 7) / 8;
+		char *p = alloc_bytes(nbytes + 1, index, tag_at, tag);
+
+		if (!p)
+			return bitset_builder(a_->sink(nbytes), n);
+		::nbuf_set_u8(p + nbytes, nbytes * 8 - n);
+		return bitset_builder(p, n);
+	}
+
+	status put_string(std::string_view s, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const {
+		char *p;
+
+		if (a_->buf()->intern)
+			return put_interned(s, index, tag_at, tag);
+		if (!(p = alloc_bytes(s.size() + 1, index, tag_at, tag)))
+			return a_->error();
+		std::memcpy(p, s.data(), s.size());
+		return status::ok;
+	}
+
+	/* Same as put_string, but shares an equal string if the buffer has
+	 * an interning table; see nbuf_alloc_str.
+	 */
+	status put_interned(std::string_view s, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const {
+		buffer *buf = a_->buf();
+		buffer fixed = { buf->base, buf->len, buf->cap, nullptr, buf->intern };
+		::nbuf_obj o = { &fixed, 0, 0, 0 };
+
+		if (a_->error() != status::ok)
+			return a_->error();
+		if (!::nbuf_alloc_str(&o, s.data(), s.size()))
+			return a_->fail(status::no_space);
+		buf->len = fixed.len;
+		link(index, buf->base + ::nbuf_obj_hdr_offset(&o), tag_at, tag);
+		return status::ok;
+	}
+
+	inline string_array_builder alloc_strings(size_t n, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const;
+
+	template <typename B>
+	inline message_appender<B> append_messages(size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const;
+
+	template <typename T>
+	inline scalar_appender<T> append_scalars(size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const;
+
+	inline string_appender append_strings(size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const;
+
+	template <typename T>
+	status put_packed(const T *src, size_t n, unsigned flags, size_t index,
+		size_t tag_at = 0, unsigned tag = 0) const {
+		// A view of the buffer that cannot grow: the packed size is
+		// only known once encoded.
+		buffer *buf = a_->buf();
+		buffer fixed = { buf->base, buf->len, buf->cap, nullptr, nullptr };
+		::nbuf_obj o = { &fixed, 0, 0, 0 };
+
+		if (a_->error() != status::ok)
+			return a_->error();
+		if (!::nbuf_alloc_packed(&o, src, n, sizeof *src, flags))
+			return a_->fail(status::no_space);
+		buf->len = fixed.len;
+		link(index, buf->base + ::nbuf_obj_hdr_offset(&o), tag_at, tag);
+		return status::ok;
+	}
+
+	/* Gets the array at pointer index, in buf; returns its length. */
+	size_t array_at(::nbuf_obj *o, buffer *buf, size_t index) const {
+		::nbuf_obj msg = { buf, static_cast<uint32_t>(p_ - buf->base), 0,
+			static_cast<uint16_t>(index + 1) };
+
+		return ::nbuf_obj_p(o, &msg, index);
+	}
+
+	/* Sorts the keyed array at pointer index; see nbuf_sort_by_key. */
+	status sort_by_key(size_t index, unsigned offset, unsigned width,
+		unsigned flags, size_t tag_at = 0, unsigned tag = 0) const {
+		::nbuf_obj o;
+		size_t n;
+
+		if (a_->error() != status::ok)
+			return a_->error();
+		if (tag && ::nbuf_u16(p_ + tag_at) != tag)
+			return status::ok;
+		n = array_at(&o, a_->buf(), index);
+		if (!::nbuf_sort_by_key(&o, n, offset, width, flags))
+			return a_->fail(status::no_memory);
+		return status::ok;
+	}
+
+	/* Builds the hash index of the array at pointer index, into the
+	 * next pointer; see nbuf_alloc_hash_index.
+	 */
+	status hash_index(size_t index, unsigned key_index) const {
+		buffer *buf = a_->buf();
+		buffer fixed = { buf->base, buf->len, buf->cap, nullptr, nullptr };
+		::nbuf_obj o, idx;
+		size_t n;
+
+		if (a_->error() != status::ok)
+			return a_->error();
+		n = array_at(&o, &fixed, index);
+		if (!::nbuf_alloc_hash_index(&idx, &o, n, key_index))
+			return a_->fail(status::no_space);
+		buf->len = fixed.len;
+		link(index + 1, buf->base + ::nbuf_obj_hdr_offset(&idx), 0, 0);
+		return status::ok;
+	}
+
+	arena *a_;
+	char *p_;  // first pointer, or scalar part if there is none
+};
+
+class string_array_builder : builder_base {
+public:
+	string_array_builder() : n_(0) {}
+	string_array_builder(arena *a, char *p, size_t n) : builder_base(a, p), n_(n) {}
+	size_t size() const { return n_; }
+	status set(size_t i, std::string_view s) const {
+		return put_string(s, i);
+	}
+private:
+	size_t n_;
+};
+
+string_array_builder builder_base::alloc_strings(size_t n, size_t index,
+	size_t tag_at, unsigned tag) const {
+	char *p = alloc_array(n, sizeof (nbuf_word_t), NBUF_HDR(0, 1),
+		index, tag_at, tag);
+
+	if (!p)
+		p = a_->sink(n * sizeof (nbuf_word_t));
+	return string_array_builder(a_, p, n);
+}
+
+/* Appends to a repeated field of unknown length, as nbuf_append does.
+ * The array has spare room, which is doubled when full: in place if
+ * nothing was allocated after it, otherwise by moving it, so an element
+ * is valid until the next add().  finish() links the array to the field.
+ */
+class basic_appender : protected builder_base {
+public:
+	size_t size() const { return len_; }
+
+	status finish() {
+		buffer *buf = a_->buf();
+
+		if (a_->error() != status::ok)
+			return a_->error();
+		if (len_ == 0)
+			return status::ok;
+		::nbuf_set_word(arr_ - sizeof (nbuf_word_t), static_cast<nbuf_word_t>(len_));
+		if (end(cap_) == buf->base + buf->len)
+			buf->len = end(len_) - buf->base;
+		link(index_, arr_ - 2 * sizeof (nbuf_word_t), tag_at_, tag_);
+		return status::ok;
+	}
+
+protected:
+	basic_appender(arena *a, char *p, size_t index, size_t tag_at, unsigned tag,
+		size_t esize, nbuf_word_t hdr)
+		: builder_base(a, p), index_(index), tag_at_(tag_at), tag_(tag),
+		esize_(esize), hdr_(hdr), arr_(nullptr), len_(0), cap_(0) {}
+
+	/* Returns the next element, zeroed, or NULL. */
+	char *grow() {
+		size_t cap = cap_ ? 2 * cap_ : 4;
+		buffer *buf = a_->buf();
+		char *p;
+
+		if (len_ < cap_)
+			return arr_ + len_++ * esize_;
+		if (cap_ && end(cap_) == buf->base + buf->len) {
+			if (!a_->alloc(end(cap) - end(cap_)))
+				return nullptr;
+		} else {
+			if (!(p = a_->alloc(2 * sizeof (nbuf_word_t) + cap * esize_)))
+				return nullptr;
+			p += 2 * sizeof (nbuf_word_t);
+			if (len_)
+				std::memcpy(p, arr_, len_ * esize_);
+			// Pointers are relative, so they move the other way.
+			for (size_t i = 0; i < len_; i++) {
+				char *pptr = p + i * esize_;
+
+				for (size_t j = 0; j < NBUF_PSIZE(hdr_); j++, pptr += sizeof (nbuf_word_t)) {
+					nbuf_word_t rel_ptr = ::nbuf_word(pptr);
+
+					if (rel_ptr)
+						::nbuf_set_word(pptr, rel_ptr + static_cast<nbuf_word_t>(
+							(arr_ - p) / static_cast<ptrdiff_t>(sizeof (nbuf_word_t))));
+				}
+			}
+			arr_ = p;
+			::nbuf_set_word(arr_ - 2 * sizeof (nbuf_word_t), hdr_ | NBUF_ARR_MASK);
+		}
+		cap_ = cap;
+		return arr_ + len_++ * esize_;
+	}
+
+private:
+	/* End of the array with room for n elements */
+	char *end(size_t n) const {
+		return arr_ - 2 * sizeof (nbuf_word_t) +
+			NBUF_ALLOC_ALIGN(2 * sizeof (nbuf_word_t) + n * esize_);
+	}
+
+	size_t index_, tag_at_;
+	unsigned tag_;
+	size_t esize_;
+	nbuf_word_t hdr_;
+	char *arr_;  // first element
+	size_t len_, cap_;
+};
+
+template <typename B>
+class message_appender : public basic_appender {
+public:
+	message_appender(arena *a, char *p, size_t index, size_t tag_at, unsigned tag)
+		: basic_appender(a, p, index, tag_at, tag,
+			B::ssize + B::psize * sizeof (nbuf_word_t), NBUF_HDR(B::ssize, B::psize)) {}
+	B add() {
+		char *p = grow();
+
+		return B(a_, p ? p : a_->sink(B::ssize + B::psize * sizeof (nbuf_word_t)));
+	}
+};
+
+template <typename T>
+class scalar_appender : public basic_appender {
+public:
+	scalar_appender(arena *a, char *p, size_t index, size_t tag_at, unsigned tag)
+		: basic_appender(a, p, index, tag_at, tag, sizeof (T), NBUF_HDR(sizeof (T), 0)) {}
+	status add(T v) {
+		char *p = grow();
+
+		if (!p)
+			return a_->error();
+		*reinterpret_cast<scalar<T> *>(p) = v;
+		return status::ok;
+	}
+};
+
+class string_appender : public basic_appender {
+public:
+	string_appender(arena *a, char *p, size_t index, size_t tag_at, unsigned tag)
+		: basic_appender(a, p, index, tag_at, tag, sizeof (nbuf_word_t), NBUF_HDR(0, 1)) {}
+	status add(std::string_view s) {
+		char *p = grow();
+
+		if (!p)
+			return a_->error();
+		return string_array_builder(a_, p, 1).set(0, s);
+	}
+};
+
+template <typename B>
+message_appender<B> builder_base::append_messages(size_t index,
+	size_t tag_at, unsigned tag) const {
+	return message_appender<B>(a_, p_, index, tag_at, tag);
+}
+
+template <typename T>
+scalar_appender<T> builder_base::append_scalars(size_t index,
+	size_t tag_at, unsigned tag) const {
+	return scalar_appender<T>(a_, p_, index, tag_at, tag);
+}
+
+string_appender builder_base::append_strings(size_t index,
+	size_t tag_at, unsigned tag) const {
+	return string_appender(a_, p_, index, tag_at, tag);
+}
+
+/* Allocates a root message */
+template <typename B>
+B build(arena &a) {
+	size_t size = B::ssize + B::psize * sizeof (nbuf_word_t);
+	char *p = a.alloc(sizeof (nbuf_word_t) + size);
+
+	if (!p)
+		return B(&a, a.sink(size));
+	::nbuf_set_word(p, NBUF_HDR(B::ssize, B::psize));
+	return B(&a, p + sizeof (nbuf_word_t));
+}
+
+#endif  // __cplusplus >= 201703L
+
+/* Field metadata
+ *
+ * Each generated message has a nested struct `fields` with one descriptor
+ * per field, named f_<field>, and the list of all of them in `all_fields`.
+ * Descriptors only hold constants: the name (field_name()), the offset in
+ * the scalar part (or the pointer index) and, for scalars, the C++ type.
+ *
+ * A view (Msg::view) reads the scalar part.  Its constructor resolves the
+ * start of the scalars and checks their size once; if the message was
+ * written with an older, shorter schema, the view reads from a zero-padded
+ * copy.  Reads through a view are then loads at constant offsets; only the
+ * index into a fixed array is checked, and reads past its end return 0, as
+ * with the readers.
+ */
+#if __cplusplus >= 201703L
+#define NBUF_HAVE_FIELDS 1
+
+template <typename T, size_t Offset>
+struct scalar_field_info {
+	using type = T;
+	static constexpr bool is_pointer = false;
+	static constexpr size_t offset = Offset;
+	static T load(const char *s) {
+		return *reinterpret_cast<const scalar<T> *>(s + Offset);
+	}
+};
+
+template <typename T, size_t Offset, unsigned Shift, unsigned Bits>
+struct bit_field_info {
+	using type = T;
+	static constexpr bool is_pointer = false;
+	static constexpr size_t offset = Offset;
+	static constexpr unsigned shift = Shift, bits = Bits;
+	static T load(const char *s) {
+		return static_cast<T>(::nbuf_get_bits(s + Offset, Shift, Bits));
+	}
+};
+
+/* A fixed array of Count elements */
+template <typename T, size_t Offset, size_t Count>
+struct array_field_info {
+	using type = T;
+	static constexpr bool is_pointer = false;
+	static constexpr size_t offset = Offset, count = Count;
+	static T load(const char *s, size_t i) {
+		return i < Count ? T(reinterpret_cast<const scalar<T> *>(s + Offset)[i]) : T();
+	}
+};
+
+/* A struct stored inline */
+template <size_t Offset, size_t Size>
+struct inline_field_info {
+	static constexpr bool is_pointer = false;
+	static constexpr size_t offset = Offset, size = Size;
+};
+
+/* Strings, messages and repeated fields */
+template <size_t Index>
+struct pointer_field_info {
+	static constexpr bool is_pointer = true;
+	static constexpr size_t index = Index;
+};
+
+template <typename... F>
+struct field_list {
+	static constexpr size_t size = sizeof... (F);
+	template <typename Fn>
+	static constexpr void for_each(Fn &&fn) {
+		(fn(F{}), ...);
+	}
+};
+
+/* Calls fn with the descriptor of each field of message M, in order */
+template <typename M, typename Fn>
+constexpr void for_each_field(Fn &&fn) {
+	M::all_fields::for_each(fn);
+}
+
+/* Scalar part of a message of SSize bytes */
+template <size_t SSize>
+class basic_view {
+public:
+	explicit basic_view(const object &o) {
+		if (o.ssize >= SSize) {
+			s_ = o.buf->base + o.offset + o.psize * sizeof (nbuf_word_t);
+			return;
+		}
+		std::memset(pad_, 0, sizeof pad_);
+		if (o.ssize)
+			std::memcpy(pad_, o.buf->base + o.offset + o.psize * sizeof (nbuf_word_t), o.ssize);
+		s_ = pad_;
+	}
+	// s_ may point to pad_
+	basic_view(const basic_view &) = delete;
+	basic_view &operator=(const basic_view &) = delete;
+
+	template <typename F>
+	typename F::type get() const { return F::load(s_); }
+	template <typename F>
+	typename F::type get(size_t i) const { return F::load(s_, i); }
+
+private:
+	const char *s_;
+	char pad_[SSize ? SSize : 1];
+};
+
+#endif  // __cplusplus >= 201703L
+
 }  // namespace nbuf
 
 #endif  // NBUF_HPP_
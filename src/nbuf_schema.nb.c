@@ -8,53 +8,103 @@
 #include "libnbuf.h"
 
 static const char buffer_[] =
-"\4\0\0\200\n\0\0\0\3\0\0\0\v\0\0\0<\0\0\0\21\0\0\300nbuf_schema.nbuf\0\0\0"
-"\0\5\0\0\300nbuf\0\0\0\0\2\0\0\240\1\0\0\0\2\0\0\0\4\0\0\0\5\0\0\300Kind\0"
-"\0\0\0\1\0\1\240\t\0\0\0\22\0\0\0\0\0\0\0\23\0\0\0\1\0\0\0\24\0\0\0\2\0\0"
-"\0\25\0\0\0\3\0\0\0\26\0\0\0\4\0\0\0\27\0\0\0\5\0\0\0\27\0\0\0\6\0\0\0\27"
-"\0\0\0\a\0\0\0\27\0\0\0\b\0\0\0\5\0\0\300VOID\0\0\0\0\5\0\0\300BOOL\0\0\0"
-"\0\5\0\0\300ENUM\0\0\0\0\5\0\0\300UINT\0\0\0\0\5\0\0\300SINT\0\0\0\0\4\0\0"
-"\300FLT\0\4\0\0\300MSG\0\4\0\0\300STR\0\4\0\0\300ARR\0\2\0\1\240\5\0\0\0\17"
-"\0\0\0\21\0\0\0\0\0\4\0,\0\0\0.\0\0\0\0\0\2\0:\0\0\0<\0\0\0\4\0\1\0H\0\0\0"
-"J\0\0\0\4\0\2\0b\0\0\0e\0\0\0\b\0\1\0\a\0\0\300Schema\0\0\1\0\2\240\4\0\0"
-"\0\f\0\0\0\a\0\0\0\0\0\0\0\r\0\0\0\a\0\0\0\0\0\1\0\16\0\0\0\16\0\0\0\1\0\2"
-"\0\16\0\0\0\16\0\0\0\3\0\3\0\t\0\0\300pkg_name\0\0\0\300\t\0\0\300src_nam"
-"e\0NUM\6\0\0\300enums\0NT\t\0\0\300messages\0\0\0\0\b\0\0\300EnumDef\0\1\0"
-"\2\240\2\0\0\0\6\0\0\0\a\0\0\0\0\0\0\0\6\0\0\0\16\0\0\0\2\0\1\0\5\0\0\300"
-"name\0ame\a\0\0\300values\0\0\b\0\0\300EnumVal\0\1\0\2\240\2\0\0\0\6\0\0\0"
-"\a\0\0\0\0\0\0\0\6\0\0\0\4\0\0\0\1\0\0\0\a\0\0\300symbol\0e\6\0\0\300valu"
-"e\0\0\0\a\0\0\300MsgDef\0\0\1\0\2\240\4\0\0\0\f\0\0\0\a\0\0\0\0\0\0\0\f\0"
-"\0\0\16\0\0\0\4\0\1\0\f\0\0\0\3\0\0\0\1\0\0\0\f\0\0\0\3\0\0\0\1\0\2\0\5\0"
-"\0\300name\0l\0e\a\0\0\300fields\0_\6\0\0\300ssize\0\0\300\6\0\0\300psize"
-"\0\0\0\t\0\0\300FieldDef\0\0\0\0\1\0\2\240\5\0\0\0\17\0\0\0\a\0\0\0\0\0\0"
-"\0\17\0\0\0\2\0\0\0\0\0\0\0\17\0\0\0\3\0\0\0\1\0\2\0\20\0\0\0\3\0\0\0\1\0"
-"\4\0\20\0\0\0\3\0\0\0\1\0\6\0\5\0\0\300name\0l\0e\5\0\0\300kind\0s\0_\n\0"
-"\0\300import_id\0\0\300\b\0\0\300type_id\0\a\0\0\300offset";
+"\5\0\0\200\v\0\0\0\4\0\0\0\f\0\0\0Y\0\0\0\0\0\0\0\21\0\0\300nbuf_schema.n"
+"buf\0\0\0\0\5\0\0\300nbuf\0\0\0\0\2\0\0\240\2\0\0\0\4\0\0\0\6\0\0\0000\0\0"
+"\0003\0\0\0\5\0\0\300Kind\0\0\0\0\1\0\1\240\t\0\0\0\22\0\0\0\0\0\0\0\23\0"
+"\0\0\1\0\0\0\24\0\0\0\2\0\0\0\25\0\0\0\3\0\0\0\26\0\0\0\4\0\0\0\27\0\0\0\5"
+"\0\0\0\27\0\0\0\6\0\0\0\27\0\0\0\a\0\0\0\27\0\0\0\b\0\0\0\5\0\0\300VOID\0"
+"\0\0\0\5\0\0\300BOOL\0\0\0\0\5\0\0\300ENUM\0\0\0\0\5\0\0\300UINT\0\0\0\0\5"
+"\0\0\300SINT\0\0\0\0\4\0\0\300FLT\0\4\0\0\300MSG\0\4\0\0\300STR\0\4\0\0\300"
+"ARR\0\t\0\0\300Encoding\0\0\0\0\1\0\1\240\4\0\0\0\b\0\0\0\0\0\0\0\t\0\0\0"
+"\1\0\0\0\n\0\0\0\2\0\0\0\v\0\0\0\3\0\0\0\6\0\0\300FIXED\0\0\0\a\0\0\300PA"
+"CKED\0\0\6\0\0\300DELTA\0\0\0\a\0\0\300HASHED\0\0\3\0\2\240\b\0\0\0(\0\0\0"
+"*\0\0\0\0\0\0\0\0\0\5\0\0\0\0\0]\0\0\0_\0\0\0\0\0\0\0\0\0\2\0\0\0\0\0q\0\0"
+"\0s\0\0\0\0\0\0\0\4\0\1\0\0\0\0\0\205\0\0\0\207\0\0\0\0\0\0\0\b\0\3\0\0\0"
+"\0\0\302\0\0\0\305\0\0\0\0\0\0\0\24\0\2\0\0\0\0\0<\1\0\0?\1\0\0\0\0\0\0\4"
+"\0\1\0\0\0\0\0Q\1\0\0S\1\0\0\0\0\0\0\0\0\3\0\0\0\0\0p\1\0\0s\1\0\0\0\0\0\0"
+"\b\0\1\0\0\0\0\0\a\0\0\300Schema\0\0\2\0\5\240\5\0\0\0#\0\0\0\0\0\0\0\a\0"
+"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0 \0\0\0\0\0\0\0\a\0\0\0\0\0\1\0\0\0\0"
+"\0\0\0\0\0\0\0\0\0\35\0\0\0\0\0\0\0\16\0\0\0\1\0\2\0\0\0\0\0\0\0\0\0\0\0\0"
+"\0\31\0\0\0\0\0\0\0\16\0\0\0\3\0\3\0\0\0\0\0\0\0\0\0\0\0\0\300\26\0\0\0\0"
+"\0\0\0\17\0\0\0\0\0\4\0\0\0\0\0\0\0\0\0\0\0T\0\t\0\0\300pkg_name\0\0\0\300"
+"\t\0\0\300src_name\0ELT\6\0\0\300enums\0SH\t\0\0\300messages\0\0\0\0\b\0\0"
+"\300imports\0\b\0\0\300EnumDef\0\2\0\5\240\2\0\0\0\16\0\0\0\0\0\0\0\a\0\0"
+"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\300\n\0\0\0\0\0\0\0\16\0\0\0\2\0\1\0\0\0"
+"\0\0\0\0\0\0\0\0\0\0\5\0\0\300name\0ame\a\0\0\300values\0\0\b\0\0\300Enum"
+"Val\0\2\0\5\240\2\0\0\0\16\0\0\0\0\0\0\0\a\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+"\0\0\0\n\0\0\0\0\0\0\0\4\0\0\0\1\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\a\0\0\300s"
+"ymbol\0e\6\0\0\300value\0\0\0\a\0\0\300MsgDef\0\0\2\0\5\240\6\0\0\0*\0\0\0"
+"\0\0\0\0\a\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0&\0\0\0\0\0\0\0\16\0\0\0\4"
+"\0\1\0\0\0\0\0\0\0\0\0\0\0\0\0\"\0\0\0\0\0\0\0\3\0\0\0\1\0\0\0\0\0\0\0\0\0"
+"\0\0\0\0\0\0\36\0\0\0\0\0\0\0\3\0\0\0\1\0\2\0\0\0\0\0\0\0\0\0\0\0\0\0\32\0"
+"\0\0\0\0\0\0\16\0\0\0\5\0\2\0\0\0\0\0\0\0\0\0\0\0\0\0\26\0\0\0\0\0\0\0\1\0"
+"\0\0\0\0\4\0\0\0\0\0\0\0\0\0\0\0\0\0\5\0\0\300name\0l\0e\a\0\0\300fields\0"
+"_\6\0\0\300ssize\0\0\300\6\0\0\300psize\0\0\300\a\0\0\300unions\0\0\n\0\0"
+"\300is_struct\0\0\0\t\0\0\300FieldDef\0\0\0\0\2\0\5\240\f\0\0\0T\0\0\0\0\0"
+"\0\0\a\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0P\0\0\0\0\0\0\0\2\0\0\0\0\0\0"
+"\0\0\0\0\0\0\0\0\0\0\0\0\0L\0\0\0\0\0\0\0\3\0\0\0\1\0\2\0\0\0\0\0\0\0\0\0"
+"\0\0\0\0I\0\0\0\0\0\0\0\3\0\0\0\1\0\4\0\0\0\0\0\0\0\0\0\0\0\0\0E\0\0\0\0\0"
+"\0\0\3\0\0\0\1\0\6\0\0\0\0\0\0\0\0\0\0\0\0\0A\0\0\0\0\0\0\0\3\0\0\0\1\0\b"
+"\0\0\0\0\0\0\0\0\0\0\0\0\0>\0\0\0\0\0\0\0\3\0\0\0\1\0\n\0\0\0\0\0\0\0\0\0"
+"\0\0\0\0009\0\0\0\0\0\0\0\3\0\0\0\1\0\f\0\0\0\0\0\0\0\0\0\0\0\0\0005\0\0\0"
+"\0\0\0\0\3\0\0\0\0\0\16\0\0\0\0\0\0\0\0\0\0\0\0\0001\0\0\0\0\0\0\0\3\0\0\0"
+"\0\0\17\0\0\0\0\0\0\0\0\0\0\0\0\0-\0\0\0\0\0\0\0\2\0\0\0\1\0\20\0\0\0\0\0"
+"\0\0\0\0\0\0\0\0*\0\0\0\0\0\0\0\a\0\0\0\0\0\1\0\0\0\0\0\0\0\0\0\0\0\0\0\5"
+"\0\0\300name\0l\0e\5\0\0\300kind\0s\0_\n\0\0\300import_id\0\0\300\b\0\0\300"
+"type_id\0\a\0\0\300offset\0\300\t\0\0\300union_id\0\0\0\300\4\0\0\300tag\0"
+"\6\0\0\300count\0\0\0\5\0\0\300bits\0\0\0\0\6\0\0\300shift\0\0\0\t\0\0\300"
+"encoding\0\0\0\0\4\0\0\300key\0\t\0\0\300UnionDef\0\0\0\0\2\0\5\240\2\0\0"
+"\0\16\0\0\0\0\0\0\0\a\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\n\0\0\0\0\0\0"
+"\0\3\0\0\0\1\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\5\0\0\300name\0l\0e\a\0\0\300o"
+"ffset\0\0\6\0\0\300Patch\0\0\0\2\0\5\240\3\0\0\0\25\0\0\0\0\0\0\0\v\0\0\0"
+"\1\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\22\0\0\0\0\0\0\0\v\0\0\0\0\0\1\0\0\0\0\0"
+"\0\0\0\0\0\0\0\0\16\0\0\0\0\0\0\0\16\0\0\0\a\0\2\0\0\0\0\0\0\0\0\0\0\0\0\0"
+"\t\0\0\300replaced\0\0\0\300\6\0\0\300value\0\0\300\b\0\0\300patched\0\v\0"
+"\0\300FieldPatch\0\0\2\0\5\240\3\0\0\0\25\0\0\0\0\0\0\0\3\0\0\0\1\0\0\0\0"
+"\0\0\0\0\0\0\0\0\0\0\0\21\0\0\0\0\0\0\0\3\0\0\0\2\0\4\0\0\0\0\0\0\0\0\0\0"
+"\0\0\0\r\0\0\0\0\0\0\0\6\0\0\0\6\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\6\0\0\300f"
+"ield\0ed\6\0\0\300index\0lu\6\0\0\300patch";
 
 const struct nbuf_schema_set NBUF_SS_NAME = {
-	{ (char *) buffer_, 851, 0 }, 0,
+	{ (char *) buffer_, 2134, 0 }, 0,
 };
 
-const nbuf_EnumDef nbuf_refl_Kind = {{(struct nbuf_buf *) &NBUF_SS_NAME, 64, 0, 2}};
+const nbuf_EnumDef nbuf_refl_Kind = {{(struct nbuf_buf *) &NBUF_SS_NAME, 68, 0, 2}};
 
 const char *nbuf_Kind_to_string(int value)
 {
 	switch (value) {
-	case nbuf_Kind_VOID: return buffer_ + 168;
-	case nbuf_Kind_BOOL: return buffer_ + 180;
-	case nbuf_Kind_ENUM: return buffer_ + 192;
-	case nbuf_Kind_UINT: return buffer_ + 204;
-	case nbuf_Kind_SINT: return buffer_ + 216;
-	case nbuf_Kind_FLT: return buffer_ + 228;
-	case nbuf_Kind_MSG: return buffer_ + 236;
-	case nbuf_Kind_STR: return buffer_ + 244;
-	case nbuf_Kind_ARR: return buffer_ + 252;
+	case nbuf_Kind_VOID: return buffer_ + 180;
+	case nbuf_Kind_BOOL: return buffer_ + 192;
+	case nbuf_Kind_ENUM: return buffer_ + 204;
+	case nbuf_Kind_UINT: return buffer_ + 216;
+	case nbuf_Kind_SINT: return buffer_ + 228;
+	case nbuf_Kind_FLT: return buffer_ + 240;
+	case nbuf_Kind_MSG: return buffer_ + 248;
+	case nbuf_Kind_STR: return buffer_ + 256;
+	case nbuf_Kind_ARR: return buffer_ + 264;
 	}
 	return NULL;
 }
 
-const nbuf_MsgDef nbuf_refl_Schema = {{(struct nbuf_buf *) &NBUF_SS_NAME, 264, 4, 2}};
-const nbuf_MsgDef nbuf_refl_EnumDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 276, 4, 2}};
-const nbuf_MsgDef nbuf_refl_EnumVal = {{(struct nbuf_buf *) &NBUF_SS_NAME, 288, 4, 2}};
-const nbuf_MsgDef nbuf_refl_MsgDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 300, 4, 2}};
-const nbuf_MsgDef nbuf_refl_FieldDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 312, 4, 2}};
+const nbuf_EnumDef nbuf_refl_Encoding = {{(struct nbuf_buf *) &NBUF_SS_NAME, 76, 0, 2}};
+
+const char *nbuf_Encoding_to_string(int value)
+{
+	switch (value) {
+	case nbuf_Encoding_FIXED: return buffer_ + 328;
+	case nbuf_Encoding_PACKED: return buffer_ + 340;
+	case nbuf_Encoding_DELTA: return buffer_ + 352;
+	case nbuf_Encoding_HASHED: return buffer_ + 364;
+	}
+	return NULL;
+}
+
+const nbuf_MsgDef nbuf_refl_Schema = {{(struct nbuf_buf *) &NBUF_SS_NAME, 380, 8, 3}};
+const nbuf_MsgDef nbuf_refl_EnumDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 400, 8, 3}};
+const nbuf_MsgDef nbuf_refl_EnumVal = {{(struct nbuf_buf *) &NBUF_SS_NAME, 420, 8, 3}};
+const nbuf_MsgDef nbuf_refl_MsgDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 440, 8, 3}};
+const nbuf_MsgDef nbuf_refl_FieldDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 460, 8, 3}};
+const nbuf_MsgDef nbuf_refl_UnionDef = {{(struct nbuf_buf *) &NBUF_SS_NAME, 480, 8, 3}};
+const nbuf_MsgDef nbuf_refl_Patch = {{(struct nbuf_buf *) &NBUF_SS_NAME, 500, 8, 3}};
+const nbuf_MsgDef nbuf_refl_FieldPatch = {{(struct nbuf_buf *) &NBUF_SS_NAME, 520, 8, 3}};
@@ -22,6 +22,16 @@ extern const struct nbuf_EnumDef_ nbuf_refl_Kind;
 
 const char *nbuf_Kind_to_string(int);
 
+typedef enum {
+	nbuf_Encoding_FIXED = 0,
+	nbuf_Encoding_PACKED = 1,
+	nbuf_Encoding_DELTA = 2,
+	nbuf_Encoding_HASHED = 3,
+} nbuf_Encoding;
+extern const struct nbuf_EnumDef_ nbuf_refl_Encoding;
+
+const char *nbuf_Encoding_to_string(int);
+
 typedef struct nbuf_Schema_ {
 	struct nbuf_obj o;
 } nbuf_Schema;
@@ -42,7 +52,7 @@ nbuf_alloc_Schema(nbuf_Schema *msg, struct nbuf_buf *buf)
 	struct nbuf_obj *o = NBUF_OBJ(*msg);
 	o->buf = buf;
 	o->ssize = 0;
-	o->psize = 4;
+	o->psize = 5;
 	return nbuf_alloc_obj(o);
 }
 
@@ -52,7 +62,7 @@ nbuf_alloc_multi_Schema(nbuf_Schema *msg, struct nbuf_buf *buf, size_t n)
 	struct nbuf_obj *o = NBUF_OBJ(*msg);
 	o->buf = buf;
 	o->ssize = 0;
-	o->psize = 4;
+	o->psize = 5;
 	return nbuf_alloc_arr(o, n);
 }
 
@@ -143,8 +153,8 @@ nbuf_alloc_MsgDef(nbuf_MsgDef *msg, struct nbuf_buf *buf)
 {
 	struct nbuf_obj *o = NBUF_OBJ(*msg);
 	o->buf = buf;
-	o->ssize = 4;
-	o->psize = 2;
+	o->ssize = 8;
+	o->psize = 3;
 	return nbuf_alloc_obj(o);
 }
 
@@ -153,8 +163,8 @@ nbuf_alloc_multi_MsgDef(nbuf_MsgDef *msg, struct nbuf_buf *buf, size_t n)
 {
 	struct nbuf_obj *o = NBUF_OBJ(*msg);
 	o->buf = buf;
-	o->ssize = 4;
-	o->psize = 2;
+	o->ssize = 8;
+	o->psize = 3;
 	return nbuf_alloc_arr(o, n);
 }
 
@@ -174,6 +184,108 @@ nbuf_get_FieldDef(nbuf_FieldDef *msg, struct nbuf_buf *buf, size_t offset)
 
 static inline size_t
 nbuf_alloc_FieldDef(nbuf_FieldDef *msg, struct nbuf_buf *buf)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->ssize = 20;
+	o->psize = 2;
+	return nbuf_alloc_obj(o);
+}
+
+static inline size_t
+nbuf_alloc_multi_FieldDef(nbuf_FieldDef *msg, struct nbuf_buf *buf, size_t n)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->ssize = 20;
+	o->psize = 2;
+	return nbuf_alloc_arr(o, n);
+}
+
+typedef struct nbuf_UnionDef_ {
+	struct nbuf_obj o;
+} nbuf_UnionDef;
+extern const struct nbuf_MsgDef_ nbuf_refl_UnionDef;
+
+static inline size_t
+nbuf_get_UnionDef(nbuf_UnionDef *msg, struct nbuf_buf *buf, size_t offset)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->offset = offset;
+	return nbuf_get_obj(o);
+}
+
+static inline size_t
+nbuf_alloc_UnionDef(nbuf_UnionDef *msg, struct nbuf_buf *buf)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->ssize = 4;
+	o->psize = 1;
+	return nbuf_alloc_obj(o);
+}
+
+static inline size_t
+nbuf_alloc_multi_UnionDef(nbuf_UnionDef *msg, struct nbuf_buf *buf, size_t n)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->ssize = 4;
+	o->psize = 1;
+	return nbuf_alloc_arr(o, n);
+}
+
+typedef struct nbuf_Patch_ {
+	struct nbuf_obj o;
+} nbuf_Patch;
+extern const struct nbuf_MsgDef_ nbuf_refl_Patch;
+
+static inline size_t
+nbuf_get_Patch(nbuf_Patch *msg, struct nbuf_buf *buf, size_t offset)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->offset = offset;
+	return nbuf_get_obj(o);
+}
+
+static inline size_t
+nbuf_alloc_Patch(nbuf_Patch *msg, struct nbuf_buf *buf)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->ssize = 0;
+	o->psize = 3;
+	return nbuf_alloc_obj(o);
+}
+
+static inline size_t
+nbuf_alloc_multi_Patch(nbuf_Patch *msg, struct nbuf_buf *buf, size_t n)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->ssize = 0;
+	o->psize = 3;
+	return nbuf_alloc_arr(o, n);
+}
+
+typedef struct nbuf_FieldPatch_ {
+	struct nbuf_obj o;
+} nbuf_FieldPatch;
+extern const struct nbuf_MsgDef_ nbuf_refl_FieldPatch;
+
+static inline size_t
+nbuf_get_FieldPatch(nbuf_FieldPatch *msg, struct nbuf_buf *buf, size_t offset)
+{
+	struct nbuf_obj *o = NBUF_OBJ(*msg);
+	o->buf = buf;
+	o->offset = offset;
+	return nbuf_get_obj(o);
+}
+
+static inline size_t
+nbuf_alloc_FieldPatch(nbuf_FieldPatch *msg, struct nbuf_buf *buf)
 {
 	struct nbuf_obj *o = NBUF_OBJ(*msg);
 	o->buf = buf;
@@ -183,7 +295,7 @@ nbuf_alloc_FieldDef(nbuf_FieldDef *msg, struct nbuf_buf *buf)
 }
 
 static inline size_t
-nbuf_alloc_multi_FieldDef(nbuf_FieldDef *msg, struct nbuf_buf *buf, size_t n)
+nbuf_alloc_multi_FieldPatch(nbuf_FieldPatch *msg, struct nbuf_buf *buf, size_t n)
 {
 	struct nbuf_obj *o = NBUF_OBJ(*msg);
 	o->buf = buf;
@@ -290,6 +402,26 @@ nbuf_Schema_alloc_enums(nbuf_EnumDef *field, nbuf_Schema msg, size_t n)
 		nbuf_Schema_set_raw_enums(msg, (struct nbuf_obj *) field) : 0;
 }
 
+static inline void
+nbuf_Schema_begin_enums(struct nbuf_appender *ap, nbuf_Schema msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 0, 2);
+}
+
+static inline size_t
+nbuf_Schema_end_enums(nbuf_Schema msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_Schema_set_raw_enums(msg, &o)) ? 0 : n;
+}
+
+static inline size_t
+nbuf_Schema_add_enums(nbuf_EnumDef *field, struct nbuf_appender *ap)
+{
+	return nbuf_append(ap, (struct nbuf_obj *) field);
+}
+
 static inline size_t
 nbuf_Schema_raw_messages(struct nbuf_obj *o, nbuf_Schema msg)
 {
@@ -324,6 +456,104 @@ nbuf_Schema_alloc_messages(nbuf_MsgDef *field, nbuf_Schema msg, size_t n)
 		nbuf_Schema_set_raw_messages(msg, (struct nbuf_obj *) field) : 0;
 }
 
+static inline void
+nbuf_Schema_begin_messages(struct nbuf_appender *ap, nbuf_Schema msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 8, 3);
+}
+
+static inline size_t
+nbuf_Schema_end_messages(nbuf_Schema msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_Schema_set_raw_messages(msg, &o)) ? 0 : n;
+}
+
+static inline size_t
+nbuf_Schema_add_messages(nbuf_MsgDef *field, struct nbuf_appender *ap)
+{
+	return nbuf_append(ap, (struct nbuf_obj *) field);
+}
+
+static inline size_t
+nbuf_Schema_raw_imports(struct nbuf_obj *o, nbuf_Schema msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 4);
+}
+
+static inline size_t
+nbuf_Schema_set_raw_imports(nbuf_Schema msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 4, o);
+}
+
+static inline const char *
+nbuf_Schema_imports(nbuf_Schema msg, size_t i, size_t *lenp)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_Schema_raw_imports(&o, msg);
+	n = (i >= n) ? 0 : (nbuf_advance(&o, i), nbuf_obj_p(&o, &o, 0));
+	return nbuf_obj2str(&o, n, lenp);
+}
+
+static inline size_t
+nbuf_Schema_imports_size(nbuf_Schema msg)
+{
+	struct nbuf_obj o;
+	return nbuf_Schema_raw_imports(&o, msg);
+}
+
+static inline char *
+nbuf_Schema_set_imports(nbuf_Schema msg, size_t i, const char *str, size_t len)
+{
+	struct nbuf_obj o = {NBUF_OBJ(msg)->buf}, oo;
+	char *p;
+	if (nbuf_Schema_raw_imports(&oo, msg) <= i)
+		return 0;
+	nbuf_advance(&oo, i);
+	if (!(p = nbuf_alloc_str(&o, str, len)))
+		return NULL;
+	if (!nbuf_obj_set_p(&oo, 0, &o))
+		return NULL;
+	return p;
+}
+
+static inline size_t
+nbuf_Schema_alloc_imports(nbuf_Schema msg, size_t n)
+{
+	struct nbuf_obj o = {NBUF_OBJ(msg)->buf, 0, 0, 1};
+	if (!nbuf_alloc_arr(&o, n))
+		return 0;
+	return nbuf_Schema_set_raw_imports(msg, &o);
+}
+
+static inline void
+nbuf_Schema_begin_imports(struct nbuf_appender *ap, nbuf_Schema msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 0, 1);
+}
+
+static inline size_t
+nbuf_Schema_end_imports(nbuf_Schema msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_Schema_set_raw_imports(msg, &o)) ? 0 : n;
+}
+
+static inline char *
+nbuf_Schema_add_imports(struct nbuf_appender *ap, const char *str, size_t len)
+{
+	struct nbuf_obj o = {ap->arr.buf}, oo;
+	char *p;
+	if (!nbuf_append(ap, &oo) ||
+			!(p = nbuf_alloc_str(&o, str, len)) ||
+			!nbuf_obj_set_p(&oo, 0, &o))
+		return NULL;
+	return p;
+}
+
 static inline size_t
 nbuf_EnumDef_raw_name(struct nbuf_obj *o, nbuf_EnumDef msg)
 {
@@ -390,6 +620,26 @@ nbuf_EnumDef_alloc_values(nbuf_EnumVal *field, nbuf_EnumDef msg, size_t n)
 		nbuf_EnumDef_set_raw_values(msg, (struct nbuf_obj *) field) : 0;
 }
 
+static inline void
+nbuf_EnumDef_begin_values(struct nbuf_appender *ap, nbuf_EnumDef msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 4, 1);
+}
+
+static inline size_t
+nbuf_EnumDef_end_values(nbuf_EnumDef msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_EnumDef_set_raw_values(msg, &o)) ? 0 : n;
+}
+
+static inline size_t
+nbuf_EnumDef_add_values(nbuf_EnumVal *field, struct nbuf_appender *ap)
+{
+	return nbuf_append(ap, (struct nbuf_obj *) field);
+}
+
 static inline size_t
 nbuf_EnumVal_raw_symbol(struct nbuf_obj *o, nbuf_EnumVal msg)
 {
@@ -503,6 +753,26 @@ nbuf_MsgDef_alloc_fields(nbuf_FieldDef *field, nbuf_MsgDef msg, size_t n)
 		nbuf_MsgDef_set_raw_fields(msg, (struct nbuf_obj *) field) : 0;
 }
 
+static inline void
+nbuf_MsgDef_begin_fields(struct nbuf_appender *ap, nbuf_MsgDef msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 20, 2);
+}
+
+static inline size_t
+nbuf_MsgDef_end_fields(nbuf_MsgDef msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_MsgDef_set_raw_fields(msg, &o)) ? 0 : n;
+}
+
+static inline size_t
+nbuf_MsgDef_add_fields(nbuf_FieldDef *field, struct nbuf_appender *ap)
+{
+	return nbuf_append(ap, (struct nbuf_obj *) field);
+}
+
 static inline uint16_t
 nbuf_MsgDef_ssize(nbuf_MsgDef msg)
 {
@@ -533,6 +803,75 @@ nbuf_MsgDef_set_psize(nbuf_MsgDef msg, uint16_t val)
 	return p;
 }
 
+static inline size_t
+nbuf_MsgDef_raw_unions(struct nbuf_obj *o, nbuf_MsgDef msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 2);
+}
+
+static inline size_t
+nbuf_MsgDef_set_raw_unions(nbuf_MsgDef msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 2, o);
+}
+
+static inline size_t
+nbuf_MsgDef_unions(nbuf_UnionDef *field, nbuf_MsgDef msg, size_t i)
+{
+	struct nbuf_obj *o = (struct nbuf_obj *) field;
+	size_t n = nbuf_MsgDef_raw_unions(o, msg);
+	return (i >= n) ? 0 : (nbuf_advance(o, i), n - i);
+}
+
+static inline size_t
+nbuf_MsgDef_unions_size(nbuf_MsgDef msg)
+{
+	struct nbuf_obj o;
+	return nbuf_MsgDef_raw_unions(&o, msg);
+}
+
+static inline size_t
+nbuf_MsgDef_alloc_unions(nbuf_UnionDef *field, nbuf_MsgDef msg, size_t n)
+{
+	return nbuf_alloc_multi_UnionDef(field, NBUF_OBJ(msg)->buf, n) ? 
+		nbuf_MsgDef_set_raw_unions(msg, (struct nbuf_obj *) field) : 0;
+}
+
+static inline void
+nbuf_MsgDef_begin_unions(struct nbuf_appender *ap, nbuf_MsgDef msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 4, 1);
+}
+
+static inline size_t
+nbuf_MsgDef_end_unions(nbuf_MsgDef msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_MsgDef_set_raw_unions(msg, &o)) ? 0 : n;
+}
+
+static inline size_t
+nbuf_MsgDef_add_unions(nbuf_UnionDef *field, struct nbuf_appender *ap)
+{
+	return nbuf_append(ap, (struct nbuf_obj *) field);
+}
+
+static inline bool
+nbuf_MsgDef_is_struct(nbuf_MsgDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 4, 1);
+	return (bool) (p ? nbuf_u8(p) : 0);
+}
+
+static inline void *
+nbuf_MsgDef_set_is_struct(nbuf_MsgDef msg, bool val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 4, 1);
+	if (p) nbuf_set_u8(p, !!val);
+	return p;
+}
+
 static inline size_t
 nbuf_FieldDef_raw_name(struct nbuf_obj *o, nbuf_FieldDef msg)
 {
@@ -625,5 +964,1062 @@ nbuf_FieldDef_set_offset(nbuf_FieldDef msg, uint16_t val)
 	return p;
 }
 
+static inline uint16_t
+nbuf_FieldDef_union_id(nbuf_FieldDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 8, 2);
+	return (uint16_t) (p ? nbuf_u16(p) : 0);
+}
+
+static inline void *
+nbuf_FieldDef_set_union_id(nbuf_FieldDef msg, uint16_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 8, 2);
+	if (p) nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline uint16_t
+nbuf_FieldDef_tag(nbuf_FieldDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 10, 2);
+	return (uint16_t) (p ? nbuf_u16(p) : 0);
+}
+
+static inline void *
+nbuf_FieldDef_set_tag(nbuf_FieldDef msg, uint16_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 10, 2);
+	if (p) nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline uint16_t
+nbuf_FieldDef_count(nbuf_FieldDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 12, 2);
+	return (uint16_t) (p ? nbuf_u16(p) : 0);
+}
+
+static inline void *
+nbuf_FieldDef_set_count(nbuf_FieldDef msg, uint16_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 12, 2);
+	if (p) nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline uint8_t
+nbuf_FieldDef_bits(nbuf_FieldDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 14, 1);
+	return (uint8_t) (p ? nbuf_u8(p) : 0);
+}
+
+static inline void *
+nbuf_FieldDef_set_bits(nbuf_FieldDef msg, uint8_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 14, 1);
+	if (p) nbuf_set_u8(p, val);
+	return p;
+}
+
+static inline uint8_t
+nbuf_FieldDef_shift(nbuf_FieldDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 15, 1);
+	return (uint8_t) (p ? nbuf_u8(p) : 0);
+}
+
+static inline void *
+nbuf_FieldDef_set_shift(nbuf_FieldDef msg, uint8_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 15, 1);
+	if (p) nbuf_set_u8(p, val);
+	return p;
+}
+
+static inline nbuf_Encoding
+nbuf_FieldDef_encoding(nbuf_FieldDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 16, 2);
+	return (nbuf_Encoding) (p ? nbuf_i16(p) : 0);
+}
+
+static inline void *
+nbuf_FieldDef_set_encoding(nbuf_FieldDef msg, nbuf_Encoding val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 16, 2);
+	if (p) nbuf_set_i16(p, (int16_t) val);
+	return p;
+}
+
+static inline size_t
+nbuf_FieldDef_raw_key(struct nbuf_obj *o, nbuf_FieldDef msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 1);
+}
+
+static inline size_t
+nbuf_FieldDef_set_raw_key(nbuf_FieldDef msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 1, o);
+}
+
+static inline const char *
+nbuf_FieldDef_key(nbuf_FieldDef msg, size_t *lenp)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_FieldDef_raw_key(&o, msg);
+	return nbuf_obj2str(&o, n, lenp);
+}
+
+static inline char *
+nbuf_FieldDef_set_key(nbuf_FieldDef msg, const char *str, size_t len)
+{
+	struct nbuf_obj o = {NBUF_OBJ(msg)->buf};
+	char *p;
+	if (!(p = nbuf_alloc_str(&o, str, len)))
+		return NULL;
+	if (!nbuf_FieldDef_set_raw_key(msg, &o))
+		return NULL;
+	return p;
+}
+
+static inline size_t
+nbuf_UnionDef_raw_name(struct nbuf_obj *o, nbuf_UnionDef msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 0);
+}
+
+static inline size_t
+nbuf_UnionDef_set_raw_name(nbuf_UnionDef msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 0, o);
+}
+
+static inline const char *
+nbuf_UnionDef_name(nbuf_UnionDef msg, size_t *lenp)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_UnionDef_raw_name(&o, msg);
+	return nbuf_obj2str(&o, n, lenp);
+}
+
+static inline char *
+nbuf_UnionDef_set_name(nbuf_UnionDef msg, const char *str, size_t len)
+{
+	struct nbuf_obj o = {NBUF_OBJ(msg)->buf};
+	char *p;
+	if (!(p = nbuf_alloc_str(&o, str, len)))
+		return NULL;
+	if (!nbuf_UnionDef_set_raw_name(msg, &o))
+		return NULL;
+	return p;
+}
+
+static inline uint16_t
+nbuf_UnionDef_offset(nbuf_UnionDef msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 0, 2);
+	return (uint16_t) (p ? nbuf_u16(p) : 0);
+}
+
+static inline void *
+nbuf_UnionDef_set_offset(nbuf_UnionDef msg, uint16_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 0, 2);
+	if (p) nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline size_t
+nbuf_Patch_raw_replaced(struct nbuf_obj *o, nbuf_Patch msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 0);
+}
+
+static inline size_t
+nbuf_Patch_set_raw_replaced(nbuf_Patch msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 0, o);
+}
+
+static inline size_t
+nbuf_Patch_replaced_size(nbuf_Patch msg)
+{
+	struct nbuf_obj o;
+	return nbuf_Patch_raw_replaced(&o, msg);
+}
+
+static inline void *
+nbuf_Patch_alloc_replaced(nbuf_Patch msg, size_t n)
+{
+	struct nbuf_obj o = {NBUF_OBJ(msg)->buf, 0, 2, 0};
+	if (NBUF_OBJ(msg)->psize <= 0 || !(n = nbuf_alloc_arr(&o, n)) ||
+			!nbuf_Patch_set_raw_replaced(msg, &o))
+		return NULL;
+	return nbuf_obj_base(&o);
+}
+
+static inline void
+nbuf_Patch_begin_replaced(struct nbuf_appender *ap, nbuf_Patch msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 2, 0);
+}
+
+static inline size_t
+nbuf_Patch_end_replaced(nbuf_Patch msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_Patch_set_raw_replaced(msg, &o)) ? 0 : n;
+}
+
+static inline void *
+nbuf_Patch_add_replaced(struct nbuf_appender *ap, uint16_t val)
+{
+	struct nbuf_obj o;
+	void *p;
+	if (!nbuf_append(ap, &o))
+		return NULL;
+	p = nbuf_obj_base(&o);
+	nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline uint16_t
+nbuf_Patch_replaced(nbuf_Patch msg, size_t i)
+{
+	struct nbuf_obj o;
+	const void *p = (i >= nbuf_Patch_raw_replaced(&o, msg) ?
+		NULL : (nbuf_advance(&o, i), nbuf_obj_base(&o)));
+	return (uint16_t) (p ? nbuf_u16(p) : 0);
+}
+
+static inline void *
+nbuf_Patch_set_replaced(nbuf_Patch msg, size_t i, uint16_t val)
+{
+	struct nbuf_obj o;
+	void *p = (i >= nbuf_Patch_raw_replaced(&o, msg) ?
+		NULL : (nbuf_advance(&o, i), nbuf_obj_base(&o)));
+	if (p) nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline size_t
+nbuf_Patch_raw_value(struct nbuf_obj *o, nbuf_Patch msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 1);
+}
+
+static inline size_t
+nbuf_Patch_set_raw_value(nbuf_Patch msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 1, o);
+}
+
+static inline size_t
+nbuf_Patch_value_size(nbuf_Patch msg)
+{
+	struct nbuf_obj o;
+	return nbuf_Patch_raw_value(&o, msg);
+}
+
+static inline void *
+nbuf_Patch_alloc_value(nbuf_Patch msg, size_t n)
+{
+	struct nbuf_obj o = {NBUF_OBJ(msg)->buf, 0, 1, 0};
+	if (NBUF_OBJ(msg)->psize <= 1 || !(n = nbuf_alloc_arr(&o, n)) ||
+			!nbuf_Patch_set_raw_value(msg, &o))
+		return NULL;
+	return nbuf_obj_base(&o);
+}
+
+static inline void
+nbuf_Patch_begin_value(struct nbuf_appender *ap, nbuf_Patch msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 1, 0);
+}
+
+static inline size_t
+nbuf_Patch_end_value(nbuf_Patch msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_Patch_set_raw_value(msg, &o)) ? 0 : n;
+}
+
+static inline void *
+nbuf_Patch_add_value(struct nbuf_appender *ap, uint8_t val)
+{
+	struct nbuf_obj o;
+	void *p;
+	if (!nbuf_append(ap, &o))
+		return NULL;
+	p = nbuf_obj_base(&o);
+	nbuf_set_u8(p, val);
+	return p;
+}
+
+static inline uint8_t
+nbuf_Patch_value(nbuf_Patch msg, size_t i)
+{
+	struct nbuf_obj o;
+	const void *p = (i >= nbuf_Patch_raw_value(&o, msg) ?
+		NULL : (nbuf_advance(&o, i), nbuf_obj_base(&o)));
+	return (uint8_t) (p ? nbuf_u8(p) : 0);
+}
+
+static inline void *
+nbuf_Patch_set_value(nbuf_Patch msg, size_t i, uint8_t val)
+{
+	struct nbuf_obj o;
+	void *p = (i >= nbuf_Patch_raw_value(&o, msg) ?
+		NULL : (nbuf_advance(&o, i), nbuf_obj_base(&o)));
+	if (p) nbuf_set_u8(p, val);
+	return p;
+}
+
+static inline size_t
+nbuf_Patch_raw_patched(struct nbuf_obj *o, nbuf_Patch msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 2);
+}
+
+static inline size_t
+nbuf_Patch_set_raw_patched(nbuf_Patch msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 2, o);
+}
+
+static inline size_t
+nbuf_Patch_patched(nbuf_FieldPatch *field, nbuf_Patch msg, size_t i)
+{
+	struct nbuf_obj *o = (struct nbuf_obj *) field;
+	size_t n = nbuf_Patch_raw_patched(o, msg);
+	return (i >= n) ? 0 : (nbuf_advance(o, i), n - i);
+}
+
+static inline size_t
+nbuf_Patch_patched_size(nbuf_Patch msg)
+{
+	struct nbuf_obj o;
+	return nbuf_Patch_raw_patched(&o, msg);
+}
+
+static inline size_t
+nbuf_Patch_alloc_patched(nbuf_FieldPatch *field, nbuf_Patch msg, size_t n)
+{
+	return nbuf_alloc_multi_FieldPatch(field, NBUF_OBJ(msg)->buf, n) ? 
+		nbuf_Patch_set_raw_patched(msg, (struct nbuf_obj *) field) : 0;
+}
+
+static inline void
+nbuf_Patch_begin_patched(struct nbuf_appender *ap, nbuf_Patch msg)
+{
+	nbuf_appender_init(ap, NBUF_OBJ(msg)->buf, 8, 1);
+}
+
+static inline size_t
+nbuf_Patch_end_patched(nbuf_Patch msg, struct nbuf_appender *ap)
+{
+	struct nbuf_obj o;
+	size_t n = nbuf_appender_finish(ap, &o);
+	return (n && !nbuf_Patch_set_raw_patched(msg, &o)) ? 0 : n;
+}
+
+static inline size_t
+nbuf_Patch_add_patched(nbuf_FieldPatch *field, struct nbuf_appender *ap)
+{
+	return nbuf_append(ap, (struct nbuf_obj *) field);
+}
+
+static inline uint16_t
+nbuf_FieldPatch_field(nbuf_FieldPatch msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 0, 2);
+	return (uint16_t) (p ? nbuf_u16(p) : 0);
+}
+
+static inline void *
+nbuf_FieldPatch_set_field(nbuf_FieldPatch msg, uint16_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 0, 2);
+	if (p) nbuf_set_u16(p, val);
+	return p;
+}
+
+static inline uint32_t
+nbuf_FieldPatch_index(nbuf_FieldPatch msg)
+{
+	const void *p = nbuf_obj_s(NBUF_OBJ(msg), 4, 4);
+	return (uint32_t) (p ? nbuf_u32(p) : 0);
+}
+
+static inline void *
+nbuf_FieldPatch_set_index(nbuf_FieldPatch msg, uint32_t val)
+{
+	void *p = nbuf_obj_s(NBUF_OBJ(msg), 4, 4);
+	if (p) nbuf_set_u32(p, val);
+	return p;
+}
+
+static inline size_t
+nbuf_FieldPatch_raw_patch(struct nbuf_obj *o, nbuf_FieldPatch msg)
+{
+	return nbuf_obj_p(o, NBUF_OBJ(msg), 0);
+}
+
+static inline size_t
+nbuf_FieldPatch_set_raw_patch(nbuf_FieldPatch msg, const struct nbuf_obj *o)
+{
+	return nbuf_obj_set_p(NBUF_OBJ(msg), 0, o);
+}
+
+static inline size_t
+nbuf_FieldPatch_patch(nbuf_Patch *field, nbuf_FieldPatch msg)
+{
+	struct nbuf_obj *o = (struct nbuf_obj *) field;
+	size_t n = nbuf_FieldPatch_raw_patch(o, msg);
+	return n;
+}
+
+static inline size_t
+nbuf_FieldPatch_alloc_patch(nbuf_Patch *field, nbuf_FieldPatch msg)
+{
+	return nbuf_alloc_Patch(field, NBUF_OBJ(msg)->buf) ? 
+		nbuf_FieldPatch_set_raw_patch(msg, (struct nbuf_obj *) field) : 0;
+}
+
+static inline bool
+nbuf_equal_Schema_(nbuf_Schema a, nbuf_Schema b, int depth);
+static inline bool
+nbuf_hash_Schema_(uint64_t *h, nbuf_Schema msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_EnumDef_(nbuf_EnumDef a, nbuf_EnumDef b, int depth);
+static inline bool
+nbuf_hash_EnumDef_(uint64_t *h, nbuf_EnumDef msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_EnumVal_(nbuf_EnumVal a, nbuf_EnumVal b, int depth);
+static inline bool
+nbuf_hash_EnumVal_(uint64_t *h, nbuf_EnumVal msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_MsgDef_(nbuf_MsgDef a, nbuf_MsgDef b, int depth);
+static inline bool
+nbuf_hash_MsgDef_(uint64_t *h, nbuf_MsgDef msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_FieldDef_(nbuf_FieldDef a, nbuf_FieldDef b, int depth);
+static inline bool
+nbuf_hash_FieldDef_(uint64_t *h, nbuf_FieldDef msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_UnionDef_(nbuf_UnionDef a, nbuf_UnionDef b, int depth);
+static inline bool
+nbuf_hash_UnionDef_(uint64_t *h, nbuf_UnionDef msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_Patch_(nbuf_Patch a, nbuf_Patch b, int depth);
+static inline bool
+nbuf_hash_Patch_(uint64_t *h, nbuf_Patch msg, uint64_t seed, int depth);
+static inline bool
+nbuf_equal_FieldPatch_(nbuf_FieldPatch a, nbuf_FieldPatch b, int depth);
+static inline bool
+nbuf_hash_FieldPatch_(uint64_t *h, nbuf_FieldPatch msg, uint64_t seed, int depth);
+
+static inline bool
+nbuf_equal_Schema_(nbuf_Schema a, nbuf_Schema b, int depth)
+{
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH)
+		return false;
+	if (!nbuf_same_str_field(x, y, 0))
+		return false;
+	if (!nbuf_same_str_field(x, y, 1))
+		return false;
+	{
+		nbuf_EnumDef u, v;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), x, 2), i;
+
+		if (n != nbuf_obj_p(NBUF_OBJ(v), y, 2))
+			return false;
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), nbuf_next(NBUF_OBJ(v)))
+			if (!nbuf_equal_EnumDef_(u, v, depth))
+				return false;
+	}
+	{
+		nbuf_MsgDef u, v;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), x, 3), i;
+
+		if (n != nbuf_obj_p(NBUF_OBJ(v), y, 3))
+			return false;
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), nbuf_next(NBUF_OBJ(v)))
+			if (!nbuf_equal_MsgDef_(u, v, depth))
+				return false;
+	}
+	if (!nbuf_same_str_arr_field(x, y, 4))
+		return false;
+	return true;
+}
+
+static inline bool
+nbuf_hash_Schema_(uint64_t *h, nbuf_Schema msg, uint64_t seed, int depth)
+{
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = false;
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_str_field(&s, o, 0, 0))
+		set = true;
+	if (nbuf_hash_str_field(&s, o, 1, 1))
+		set = true;
+	{
+		nbuf_EnumDef u;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), o, 2), i;
+		uint64_t hu;
+
+		if (n) {
+			nbuf_hasher_update_u64(&s, 2);
+			nbuf_hasher_update_u64(&s, n);
+			set = true;
+		}
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {
+			nbuf_hash_EnumDef_(&hu, u, seed, depth);
+			nbuf_hasher_update_u64(&s, hu);
+		}
+	}
+	{
+		nbuf_MsgDef u;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), o, 3), i;
+		uint64_t hu;
+
+		if (n) {
+			nbuf_hasher_update_u64(&s, 3);
+			nbuf_hasher_update_u64(&s, n);
+			set = true;
+		}
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {
+			nbuf_hash_MsgDef_(&hu, u, seed, depth);
+			nbuf_hasher_update_u64(&s, hu);
+		}
+	}
+	if (nbuf_hash_str_arr_field(&s, o, 4, 4))
+		set = true;
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_Schema(nbuf_Schema a, nbuf_Schema b)
+{
+	return nbuf_equal_Schema_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_Schema(nbuf_Schema msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_Schema_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_EnumDef_(nbuf_EnumDef a, nbuf_EnumDef b, int depth)
+{
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH)
+		return false;
+	if (!nbuf_same_str_field(x, y, 0))
+		return false;
+	{
+		nbuf_EnumVal u, v;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), x, 1), i;
+
+		if (n != nbuf_obj_p(NBUF_OBJ(v), y, 1))
+			return false;
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), nbuf_next(NBUF_OBJ(v)))
+			if (!nbuf_equal_EnumVal_(u, v, depth))
+				return false;
+	}
+	return true;
+}
+
+static inline bool
+nbuf_hash_EnumDef_(uint64_t *h, nbuf_EnumDef msg, uint64_t seed, int depth)
+{
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = false;
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_str_field(&s, o, 0, 0))
+		set = true;
+	{
+		nbuf_EnumVal u;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), o, 1), i;
+		uint64_t hu;
+
+		if (n) {
+			nbuf_hasher_update_u64(&s, 1);
+			nbuf_hasher_update_u64(&s, n);
+			set = true;
+		}
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {
+			nbuf_hash_EnumVal_(&hu, u, seed, depth);
+			nbuf_hasher_update_u64(&s, hu);
+		}
+	}
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_EnumDef(nbuf_EnumDef a, nbuf_EnumDef b)
+{
+	return nbuf_equal_EnumDef_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_EnumDef(nbuf_EnumDef msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_EnumDef_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_EnumVal_(nbuf_EnumVal a, nbuf_EnumVal b, int depth)
+{
+	static const unsigned char mask[4] = {
+		0xff, 0xff, 0x00, 0x00, 
+	};
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH ||
+		!nbuf_same_scalars(x, y, mask, 4))
+		return false;
+	if (!nbuf_same_str_field(x, y, 0))
+		return false;
+	return true;
+}
+
+static inline bool
+nbuf_hash_EnumVal_(uint64_t *h, nbuf_EnumVal msg, uint64_t seed, int depth)
+{
+	static const unsigned char mask[4] = {
+		0xff, 0xff, 0x00, 0x00, 
+	};
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = nbuf_hash_scalars(&s, o, mask, 4);
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_str_field(&s, o, 0, 0))
+		set = true;
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_EnumVal(nbuf_EnumVal a, nbuf_EnumVal b)
+{
+	return nbuf_equal_EnumVal_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_EnumVal(nbuf_EnumVal msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_EnumVal_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_MsgDef_(nbuf_MsgDef a, nbuf_MsgDef b, int depth)
+{
+	static const unsigned char mask[8] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00,
+	};
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH ||
+		!nbuf_same_scalars(x, y, mask, 8))
+		return false;
+	if (!nbuf_same_str_field(x, y, 0))
+		return false;
+	{
+		nbuf_FieldDef u, v;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), x, 1), i;
+
+		if (n != nbuf_obj_p(NBUF_OBJ(v), y, 1))
+			return false;
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), nbuf_next(NBUF_OBJ(v)))
+			if (!nbuf_equal_FieldDef_(u, v, depth))
+				return false;
+	}
+	{
+		nbuf_UnionDef u, v;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), x, 2), i;
+
+		if (n != nbuf_obj_p(NBUF_OBJ(v), y, 2))
+			return false;
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), nbuf_next(NBUF_OBJ(v)))
+			if (!nbuf_equal_UnionDef_(u, v, depth))
+				return false;
+	}
+	return true;
+}
+
+static inline bool
+nbuf_hash_MsgDef_(uint64_t *h, nbuf_MsgDef msg, uint64_t seed, int depth)
+{
+	static const unsigned char mask[8] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00,
+	};
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = nbuf_hash_scalars(&s, o, mask, 8);
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_str_field(&s, o, 0, 0))
+		set = true;
+	{
+		nbuf_FieldDef u;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), o, 1), i;
+		uint64_t hu;
+
+		if (n) {
+			nbuf_hasher_update_u64(&s, 1);
+			nbuf_hasher_update_u64(&s, n);
+			set = true;
+		}
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {
+			nbuf_hash_FieldDef_(&hu, u, seed, depth);
+			nbuf_hasher_update_u64(&s, hu);
+		}
+	}
+	{
+		nbuf_UnionDef u;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), o, 2), i;
+		uint64_t hu;
+
+		if (n) {
+			nbuf_hasher_update_u64(&s, 4);
+			nbuf_hasher_update_u64(&s, n);
+			set = true;
+		}
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {
+			nbuf_hash_UnionDef_(&hu, u, seed, depth);
+			nbuf_hasher_update_u64(&s, hu);
+		}
+	}
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_MsgDef(nbuf_MsgDef a, nbuf_MsgDef b)
+{
+	return nbuf_equal_MsgDef_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_MsgDef(nbuf_MsgDef msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_MsgDef_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_FieldDef_(nbuf_FieldDef a, nbuf_FieldDef b, int depth)
+{
+	static const unsigned char mask[20] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0x00, 0x00, 
+	};
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH ||
+		!nbuf_same_scalars(x, y, mask, 20))
+		return false;
+	if (!nbuf_same_str_field(x, y, 0))
+		return false;
+	if (!nbuf_same_str_field(x, y, 1))
+		return false;
+	return true;
+}
+
+static inline bool
+nbuf_hash_FieldDef_(uint64_t *h, nbuf_FieldDef msg, uint64_t seed, int depth)
+{
+	static const unsigned char mask[20] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0x00, 0x00, 
+	};
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = nbuf_hash_scalars(&s, o, mask, 20);
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_str_field(&s, o, 0, 0))
+		set = true;
+	if (nbuf_hash_str_field(&s, o, 1, 11))
+		set = true;
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_FieldDef(nbuf_FieldDef a, nbuf_FieldDef b)
+{
+	return nbuf_equal_FieldDef_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_FieldDef(nbuf_FieldDef msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_FieldDef_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_UnionDef_(nbuf_UnionDef a, nbuf_UnionDef b, int depth)
+{
+	static const unsigned char mask[4] = {
+		0xff, 0xff, 0x00, 0x00, 
+	};
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH ||
+		!nbuf_same_scalars(x, y, mask, 4))
+		return false;
+	if (!nbuf_same_str_field(x, y, 0))
+		return false;
+	return true;
+}
+
+static inline bool
+nbuf_hash_UnionDef_(uint64_t *h, nbuf_UnionDef msg, uint64_t seed, int depth)
+{
+	static const unsigned char mask[4] = {
+		0xff, 0xff, 0x00, 0x00, 
+	};
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = nbuf_hash_scalars(&s, o, mask, 4);
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_str_field(&s, o, 0, 0))
+		set = true;
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_UnionDef(nbuf_UnionDef a, nbuf_UnionDef b)
+{
+	return nbuf_equal_UnionDef_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_UnionDef(nbuf_UnionDef msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_UnionDef_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_Patch_(nbuf_Patch a, nbuf_Patch b, int depth)
+{
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH)
+		return false;
+	if (!nbuf_same_scalar_arr_field(x, y, 0, 2))
+		return false;
+	if (!nbuf_same_scalar_arr_field(x, y, 1, 1))
+		return false;
+	{
+		nbuf_FieldPatch u, v;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), x, 2), i;
+
+		if (n != nbuf_obj_p(NBUF_OBJ(v), y, 2))
+			return false;
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u)), nbuf_next(NBUF_OBJ(v)))
+			if (!nbuf_equal_FieldPatch_(u, v, depth))
+				return false;
+	}
+	return true;
+}
+
+static inline bool
+nbuf_hash_Patch_(uint64_t *h, nbuf_Patch msg, uint64_t seed, int depth)
+{
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = false;
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	if (nbuf_hash_scalar_arr_field(&s, o, 0, 0, 2))
+		set = true;
+	if (nbuf_hash_scalar_arr_field(&s, o, 1, 1, 1))
+		set = true;
+	{
+		nbuf_FieldPatch u;
+		size_t n = nbuf_obj_p(NBUF_OBJ(u), o, 2), i;
+		uint64_t hu;
+
+		if (n) {
+			nbuf_hasher_update_u64(&s, 2);
+			nbuf_hasher_update_u64(&s, n);
+			set = true;
+		}
+		for (i = 0; i < n; i++, nbuf_next(NBUF_OBJ(u))) {
+			nbuf_hash_FieldPatch_(&hu, u, seed, depth);
+			nbuf_hasher_update_u64(&s, hu);
+		}
+	}
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_Patch(nbuf_Patch a, nbuf_Patch b)
+{
+	return nbuf_equal_Patch_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_Patch(nbuf_Patch msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_Patch_(&h, msg, seed, 0);
+	return h;
+}
+
+static inline bool
+nbuf_equal_FieldPatch_(nbuf_FieldPatch a, nbuf_FieldPatch b, int depth)
+{
+	static const unsigned char mask[8] = {
+		0xff, 0xff, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+	};
+	const struct nbuf_obj *x = NBUF_OBJ(a), *y = NBUF_OBJ(b);
+
+	if (nbuf_obj_is(x, y))
+		return true;
+	if (++depth > NBUF_MAX_DEPTH ||
+		!nbuf_same_scalars(x, y, mask, 8))
+		return false;
+	{
+		nbuf_Patch u, v;
+
+		if ((nbuf_obj_p(NBUF_OBJ(u), x, 0) |
+			nbuf_obj_p(NBUF_OBJ(v), y, 0)) &&
+			!nbuf_equal_Patch_(u, v, depth))
+			return false;
+	}
+	return true;
+}
+
+static inline bool
+nbuf_hash_FieldPatch_(uint64_t *h, nbuf_FieldPatch msg, uint64_t seed, int depth)
+{
+	static const unsigned char mask[8] = {
+		0xff, 0xff, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+	};
+	const struct nbuf_obj *o = NBUF_OBJ(msg);
+	struct nbuf_hasher s;
+	bool set;
+
+	nbuf_hasher_init(&s, seed);
+	set = nbuf_hash_scalars(&s, o, mask, 8);
+	if (++depth > NBUF_MAX_DEPTH)
+		goto out;
+	{
+		nbuf_Patch u;
+		uint64_t hu;
+
+		if (nbuf_obj_p(NBUF_OBJ(u), o, 0) &&
+			nbuf_hash_Patch_(&hu, u, seed, depth)) {
+			nbuf_hasher_update_u64(&s, 2);
+			nbuf_hasher_update_u64(&s, hu);
+			set = true;
+		}
+	}
+out:
+	*h = nbuf_hasher_digest(&s);
+	return set;
+}
+
+static inline bool
+nbuf_equal_FieldPatch(nbuf_FieldPatch a, nbuf_FieldPatch b)
+{
+	return nbuf_equal_FieldPatch_(a, b, 0);
+}
+
+static inline uint64_t
+nbuf_hash_FieldPatch(nbuf_FieldPatch msg, uint64_t seed)
+{
+	uint64_t h;
+
+	nbuf_hash_FieldPatch_(&h, msg, seed, 0);
+	return h;
+}
+
 extern const struct nbuf_schema_set nbuf_schema_file_nbuf_5fschema_2enbuf;
 #endif  /* NBUF_SCHEMA_NB_H_ */
@@ -6,7 +6,8 @@
 
 struct ctx {
 	struct nbuf_buf *buf;
-	struct nbuf_buf strbuf;
+	struct nbuf_buf *strbuf;
+	struct nbuf_scratch *scratch;
 	lexState l[1];
 	Token token;
 	int depth, max_depth;
@@ -88,24 +89,24 @@ parse_scalar(struct ctx *ctx, void *ptr, nbuf_Kind kind, unsigned size)
 		 * it is not guaranteed to end with '\0', so
 		 * we need a temporary buffer to avoid buffer
 		 * overrun. */
-		ctx->strbuf.len = 0;
-		if (!(nbuf_add(&ctx->strbuf, TOKEN(ctx->l), TOKENLEN(ctx->l))))
+		ctx->strbuf->len = 0;
+		if (!(nbuf_add(ctx->strbuf, TOKEN(ctx->l), TOKENLEN(ctx->l))))
 			goto err;
-		if (!(nbuf_add1(&ctx->strbuf, '\0')))
+		if (!(nbuf_add1(ctx->strbuf, '\0')))
 			goto err;
 		if (kind == nbuf_Kind_FLT) {
 			if (!IS(INT))
 				EXPECT(FLT);
 			if (size == 4)
-				u.f = strtof(ctx->strbuf.base, NULL);
+				u.f = strtof(ctx->strbuf->base, NULL);
 			else if (size == 8)
-				u.d = strtod(ctx->strbuf.base, NULL);
+				u.d = strtod(ctx->strbuf->base, NULL);
 			else
 				goto bad_scalar;
 		} else if (kind == nbuf_Kind_SINT) {
-			u.i = strtoll(ctx->strbuf.base, NULL, 0);
+			u.i = strtoll(ctx->strbuf->base, NULL, 0);
 		} else {
-			u.u = strtoull(ctx->strbuf.base, NULL, 0);
+			u.u = strtoull(ctx->strbuf->base, NULL, 0);
 		}
 		switch (size) {
 		case 1: nbuf_set_u8(ptr, u.u); break;
@@ -168,6 +169,14 @@ parse_single_field(struct ctx *ctx, struct nbuf_obj *o, const char *fname, nbuf_
 		/* if len == 1, string is empty. */
 		if (len > 1 && !nbuf_obj_set_p(o, offset, &oo))
 			goto err;
+	} else if (kind == nbuf_Kind_MSG && nbuf_MsgDef_is_struct(*u.mdef)) {
+		struct nbuf_obj oo;
+
+		EXPECT_C('{'); NEXT;
+		if (!nbuf_obj_inline(&oo, o, offset, nbuf_MsgDef_ssize(*u.mdef)) ||
+			!parse_alloced_msg(ctx, &oo, *u.mdef))
+			goto err;
+		EXPECT_C('}'); NEXT;
 	} else if (kind == nbuf_Kind_MSG) {
 		struct nbuf_obj oo;
 
@@ -199,16 +208,172 @@ err:
 }
 
 static bool
-parse_repeated_field(struct ctx *ctx, struct nbuf_obj *o, const char *fname,
-	nbuf_Kind kind, unsigned offset, const struct nbuf_obj *typespec)
+parse_fixed_array_field(struct ctx *ctx, struct nbuf_obj *o, const char *fname,
+	nbuf_Kind kind, unsigned offset, unsigned count,
+	const struct nbuf_obj *typespec)
+{
+	unsigned size = (kind == nbuf_Kind_ENUM) ? 2 : typespec->ssize;
+	unsigned i;
+	bool ok;
+
+	for (i = 0;; i++) {
+		void *ptr;
+
+		if (i == count) {
+			nbuf_lexerror(ctx->l,
+				"too many elements for '%s[%u]'", fname, count);
+			goto err;
+		}
+		ptr = nbuf_obj_s(o, offset + i * size, size);
+		assert(ptr != NULL);
+		EXPECT_C(':'); NEXT;
+		ok = (kind == nbuf_Kind_ENUM) ?
+			parse_enum(ctx, ptr, *(const nbuf_EnumDef *) typespec) :
+			parse_scalar(ctx, ptr, kind, size);
+		if (!ok)
+			goto err;
+		if (!IS_ID(fname))
+			break;
+		NEXT;
+	}
+	return true;
+err:
+	return false;
+}
+
+static bool
+parse_bitfield(struct ctx *ctx, struct nbuf_obj *o, nbuf_FieldDef fdef,
+	nbuf_Kind kind, const struct nbuf_obj *typespec)
+{
+	const char *fname = nbuf_FieldDef_name(fdef, NULL);
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	unsigned bits = nbuf_FieldDef_bits(fdef);
+	unsigned char tmp[2];
+	struct nbuf_obj oo = {ctx->buf};
+	size_t i, n;
+	int v;
+
+	if (!nbuf_is_repeated(kind)) {
+		EXPECT_C(':'); NEXT;
+		if (nbuf_base_kind(kind) == nbuf_Kind_ENUM) {
+			if (!parse_enum(ctx, tmp, *(const nbuf_EnumDef *) typespec))
+				goto err;
+			v = nbuf_i16(tmp);
+		} else {
+			if (!parse_scalar(ctx, tmp, nbuf_Kind_BOOL, 1))
+				goto err;
+			v = nbuf_u8(tmp);
+		}
+		if (v < 0 || v >= (1 << bits)) {
+			nbuf_lexerror(ctx->l,
+				"value %d does not fit in bitfield '%s'", v, fname);
+			goto err;
+		}
+		nbuf_set_bits(nbuf_obj_s(o, offset, 1),
+			nbuf_FieldDef_shift(fdef), bits, v);
+		if (IS_C(';')) NEXT;
+		return true;
+	}
+
+	/* bitset: collect the bools in strbuf, then pack them */
+	if (nbuf_obj_p(&oo, o, offset)) {
+		nbuf_lexerror(ctx->l,
+			"repeated field '%s' is scattered", fname);
+		return false;
+	}
+	ctx->strbuf->len = 0;
+	for (;;) {
+		EXPECT_C(':'); NEXT;
+		if (!parse_scalar(ctx, tmp, nbuf_Kind_BOOL, 1) ||
+			!nbuf_add1(ctx->strbuf, tmp[0]))
+			goto err;
+		if (!IS_ID(fname))
+			break;
+		NEXT;
+	}
+	n = ctx->strbuf->len;
+	oo.buf = ctx->buf;
+	if (!nbuf_alloc_bitset(&oo, n))
+		goto err;
+	for (i = 0; i < n; i++)
+		nbuf_bitset_set(&oo, i, ctx->strbuf->base[i]);
+	if (!nbuf_obj_set_p(o, offset, &oo))
+		goto err;
+	return true;
+err:
+	return false;
+}
+
+static bool
+parse_packed_field(struct ctx *ctx, struct nbuf_obj *o, nbuf_FieldDef fdef,
+	nbuf_Kind kind, const struct nbuf_obj *typespec)
+{
+	const char *fname = nbuf_FieldDef_name(fdef, NULL);
+	unsigned offset = nbuf_FieldDef_offset(fdef);
+	unsigned bits = typespec->ssize * 8;
+	unsigned flags = nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_DELTA ?
+		NBUF_PACK_DELTA : 0;
+	struct nbuf_buf *vals;  // uint64_t
+	struct nbuf_obj oo = {ctx->buf};
+	unsigned char tmp[8];
+	bool rc = false;
+
+	if (kind == nbuf_Kind_SINT)
+		flags |= NBUF_PACK_SIGNED;
+	if (nbuf_obj_p(&oo, o, offset)) {
+		nbuf_lexerror(ctx->l,
+			"repeated field '%s' is scattered", fname);
+		return false;
+	}
+	if (!(vals = nbuf_scratch_get(ctx->scratch)))
+		return false;
+	for (;;) {
+		uint64_t v, *p;
+
+		EXPECT_C(':'); NEXT;
+		if (!parse_scalar(ctx, tmp, kind, sizeof tmp))
+			goto err;
+		/* truncate to the field width, as a fixed-width field does */
+		v = nbuf_u64(tmp);
+		if (bits < 64) {
+			uint64_t mask = (UINT64_C(1) << bits) - 1;
+
+			v &= mask;
+			if ((flags & NBUF_PACK_SIGNED) && (v >> (bits - 1)))
+				v |= ~mask;
+		}
+		if (!(p = (uint64_t *) nbuf_alloc(vals, sizeof v)))
+			goto err;
+		*p = v;
+		if (!IS_ID(fname))
+			break;
+		NEXT;
+	}
+	oo.buf = ctx->buf;
+	if (!nbuf_alloc_packed(&oo, vals->base, vals->len / sizeof (uint64_t),
+			sizeof (uint64_t), flags) ||
+		!nbuf_obj_set_p(o, offset, &oo))
+		goto err;
+	rc = true;
+err:
+	nbuf_scratch_put(ctx->scratch, vals);
+	return rc;
+}
+
+static bool
+parse_repeated_field(struct ctx *ctx, struct nbuf_obj *o, nbuf_FieldDef fdef,
+	nbuf_Kind kind, const struct nbuf_obj *typespec)
 {
+	const char *fname = nbuf_FieldDef_name(fdef, NULL);
+	unsigned offset = nbuf_FieldDef_offset(fdef);
 	union {
 		const struct nbuf_obj *o;
 		const nbuf_MsgDef *mdef;
 		const nbuf_EnumDef *edef;
 	} u = { typespec };
-	struct nbuf_buf newbuf, *oldbuf = ctx->buf;
+	struct nbuf_buf *newbuf = NULL, *oldbuf = ctx->buf;
 	struct nbuf_obj oo, it = {ctx->buf};
+	struct nbuf_key key;
 	size_t count = 0;
 	bool rc = false;
 
@@ -236,8 +401,9 @@ parse_repeated_field(struct ctx *ctx, struct nbuf_obj *o, const char *fname,
 		/* elements may allocate; they need to be created
 		 * on a new buffer so the array can grow on the old buffer.
 		 */
-		ctx->buf = &newbuf;
-		nbuf_init_ex(&newbuf, 0);
+		if (!(newbuf = nbuf_scratch_get(ctx->scratch)))
+			return false;
+		ctx->buf = newbuf;
 	}
 	for (;;) {
 		++count;
@@ -280,14 +446,24 @@ parse_repeated_field(struct ctx *ctx, struct nbuf_obj *o, const char *fname,
 		fprintf(stderr, "internal error: cannot resize arr\n");
 		goto err;
 	}
-	if (it.psize > 0 && !nbuf_fix_arr(&it, count, &newbuf))
+	if (it.psize > 0 && !nbuf_fix_arr(&it, count, newbuf))
 		goto err;
 	if (!nbuf_obj_set_p(o, offset, &it))
 		goto err;
+	if (kind == nbuf_Kind_MSG && nbuf_lookup_key(&key, fdef)) {
+		struct nbuf_obj idx;
+
+		if (!nbuf_sort_by_key(&it, count, key.offset, key.width, key.flags))
+			goto err;
+		if (nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_HASHED &&
+			(!nbuf_alloc_hash_index(&idx, &it, count, key.offset) ||
+			!nbuf_obj_set_p(o, offset + 1, &idx)))
+			goto err;
+	}
 	rc = true;
 err:
-	if (it.psize > 0)
-		nbuf_clear(&newbuf);
+	if (newbuf)
+		nbuf_scratch_put(ctx->scratch, newbuf);
 	ctx->buf = oldbuf;
 	return rc;
 }
@@ -308,8 +484,9 @@ parse_alloced_msg(struct ctx *ctx, struct nbuf_obj *o, nbuf_MsgDef mdef)
 		const char *fname = TOKEN(ctx->l);
 		size_t len = TOKENLEN(ctx->l);
 		nbuf_FieldDef fdef;
+		nbuf_UnionDef udef;
 		nbuf_Kind kind;
-		unsigned offset;
+		unsigned offset, count, tag = 0;
 		union {
 			struct nbuf_obj o;
 			nbuf_EnumDef edef;
@@ -329,12 +506,33 @@ parse_alloced_msg(struct ctx *ctx, struct nbuf_obj *o, nbuf_MsgDef mdef)
 				"cannot determine type for field '%s'", fname);
 			goto err;
 		}
+		if (nbuf_lookup_union(&udef, mdef, fdef)) {
+			unsigned curr_tag;
+
+			tag = nbuf_FieldDef_tag(fdef);
+			curr_tag = nbuf_obj_union_tag(o, nbuf_UnionDef_offset(udef));
+			if (curr_tag != 0 && curr_tag != tag) {
+				nbuf_lexerror(ctx->l,
+					"field '%s' conflicts with another member of union '%s'",
+					fname, nbuf_UnionDef_name(udef, NULL));
+				goto err;
+			}
+		}
 		NEXT;
-		ok = nbuf_is_repeated(kind) ? 
-			parse_repeated_field(ctx, o, fname, nbuf_base_kind(kind), offset, &u.o) :
+		count = nbuf_FieldDef_count(fdef);
+		ok = nbuf_FieldDef_bits(fdef) ?
+			parse_bitfield(ctx, o, fdef, kind, &u.o) :
+			(nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_PACKED ||
+			nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_DELTA) ?
+			parse_packed_field(ctx, o, fdef, nbuf_base_kind(kind), &u.o) :
+			nbuf_is_repeated(kind) ? 
+			parse_repeated_field(ctx, o, fdef, nbuf_base_kind(kind), &u.o) :
+			count ? parse_fixed_array_field(ctx, o, fname, kind, offset, count, &u.o) :
 			parse_single_field(ctx, o, fname, kind, offset, &u.o);
 		if (!ok)
 			goto err;
+		if (tag)
+			nbuf_set_u16(nbuf_obj_s(o, nbuf_UnionDef_offset(udef), 2), tag);
 	}
 	rc = true;
 err:
@@ -356,15 +554,19 @@ parse_msg(struct ctx *ctx, struct nbuf_obj *o, nbuf_MsgDef mdef)
 bool nbuf_parse(struct nbuf_parse_opt *opt, struct nbuf_obj *o,
 	const char *input, size_t input_len, nbuf_MsgDef mdef)
 {
+	struct nbuf_scratch scratch;
 	struct ctx ctx[1] = {{
 		.buf = opt->outbuf,
+		.scratch = opt->scratch ? opt->scratch : &scratch,
 		.depth = 0,
 		.max_depth = (opt->max_depth > 0) ? opt->max_depth : 500,
 	}};
 	bool rc = false;
 	size_t oldlen = ctx->buf->len;
 
-	nbuf_init_ex(&ctx->strbuf, 0);
+	nbuf_scratch_init(&scratch);
+	if (!(ctx->strbuf = nbuf_scratch_get(ctx->scratch)))
+		return false;
 	nbuf_lexinit(ctx->l,
 		opt->filename ? opt->filename : "<string>",
 		input, input_len);
@@ -378,6 +580,7 @@ err:
 		/* restore buffer state as if nothing happened. */
 		ctx->buf->len = oldlen;
 	}
-	nbuf_clear(&ctx->strbuf);
+	nbuf_scratch_put(ctx->scratch, ctx->strbuf);
+	nbuf_scratch_clear(&scratch);
 	return rc;
 }
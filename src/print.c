@@ -11,6 +11,8 @@ struct ctx {
 	int depth, max_depth;
 	char nl;
 	unsigned print_flags;
+	struct nbuf_scratch *scratch;
+	const char *mark;  /* starts each line of a patch */
 };
 
 static bool
@@ -21,6 +23,8 @@ indent(struct ctx *ctx)
 {
 	int curr_indent = ctx->curr_indent;
 
+	if (ctx->mark)
+		fputs(ctx->mark, ctx->f);
 	while (curr_indent-- > 0)
 		putc(' ', ctx->f);
 }
@@ -99,15 +103,81 @@ print_field(struct ctx *ctx, const struct nbuf_obj *o, nbuf_FieldDef fdef)
 	} u;
 	size_t fname_len;
 	const char *fname = nbuf_FieldDef_name(fdef, &fname_len);
-	size_t len, slen;
+	static const unsigned char zero[8];
+	size_t len, slen, avail = 0;
 	const void *ptr;
 	bool ok;
 	bool rc = false;
 
 	unsigned offset = nbuf_FieldDef_offset(fdef);
+	unsigned count = nbuf_FieldDef_count(fdef);
+	unsigned size;
+	unsigned bits = nbuf_FieldDef_bits(fdef);
+	unsigned char tmp[2], tmp8[8];
 	nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
 	nbuf_Kind base_kind = nbuf_base_kind(kind);
 
+	if (bits) {
+		/* bitfield: unpack into tmp and print as a scalar */
+		size_t i;
+
+		len = nbuf_is_repeated(kind) ?
+			nbuf_bitset_size(&oo, nbuf_obj_p(&oo, o, offset)) :
+			(nbuf_obj_s(o, offset, 1) != NULL);
+		for (i = 0; i < len; i++) {
+			unsigned v = nbuf_is_repeated(kind) ?
+				(unsigned) nbuf_bitset_get(&oo, i) :
+				nbuf_get_bits(nbuf_obj_s(o, offset, 1),
+					nbuf_FieldDef_shift(fdef), bits);
+
+			indent_fname(ctx, fname, fname_len);
+			fprintf(ctx->f, ": ");
+			if (base_kind == nbuf_Kind_ENUM) {
+				nbuf_set_i16(tmp, v);
+				ok = print_enum(ctx, tmp, u.edef);
+			} else {
+				nbuf_set_u8(tmp, v);
+				ok = print_scalar(ctx, tmp, base_kind, 1);
+			}
+			if (!ok)
+				goto err;
+			putc(ctx->nl, ctx->f);
+		}
+		return true;
+	}
+
+	if (nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_PACKED ||
+		nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_DELTA) {
+		/* packed: decode as 64-bit integers, then print as scalars */
+		unsigned flags = nbuf_FieldDef_encoding(fdef) == nbuf_Encoding_DELTA ?
+			NBUF_PACK_DELTA : 0;
+		struct nbuf_buf *valbuf;
+		uint64_t *vals;
+		size_t i;
+
+		if (base_kind == nbuf_Kind_SINT)
+			flags |= NBUF_PACK_SIGNED;
+		slen = nbuf_obj_p(&oo, o, offset);
+		if (!(len = nbuf_packed_size(&oo, slen)))
+			return true;
+		if (!(valbuf = nbuf_scratch_get(ctx->scratch)))
+			return false;
+		if (!(vals = (uint64_t *) nbuf_alloc(valbuf, len * sizeof *vals))) {
+			nbuf_scratch_put(ctx->scratch, valbuf);
+			return false;
+		}
+		len = nbuf_unpack(vals, len, sizeof *vals, flags, &oo, slen);
+		for (i = 0; i < len; i++) {
+			nbuf_set_u64(tmp8, vals[i]);
+			indent_fname(ctx, fname, fname_len);
+			fprintf(ctx->f, ": ");
+			print_scalar(ctx, tmp8, base_kind, sizeof tmp8);
+			putc(ctx->nl, ctx->f);
+		}
+		nbuf_scratch_put(ctx->scratch, valbuf);
+		return true;
+	}
+
 	switch ((int) kind) {
 	case nbuf_Kind_UINT|nbuf_Kind_ARR:
 	case nbuf_Kind_SINT|nbuf_Kind_ARR:
@@ -116,8 +186,12 @@ print_field(struct ctx *ctx, const struct nbuf_obj *o, nbuf_FieldDef fdef)
 	case nbuf_Kind_BOOL|nbuf_Kind_ARR:
 		if (!(len = nbuf_obj_p(&oo, o, offset)))
 			break;
+		avail = len;
+print_scalars:
 		for (;;) {
-			ptr = nbuf_obj_base(&oo);
+			ptr = avail ? nbuf_obj_base(&oo) : zero;
+			if (avail)
+				avail--;
 print_one_scalar:
 			indent_fname(ctx, fname, fname_len);
 			fprintf(ctx->f, ": ");
@@ -133,21 +207,32 @@ print_one_scalar:
 		}
 		break;
 	case nbuf_Kind_ENUM:
-		if (!(ptr = nbuf_obj_s(o, offset, 2)))
-			break;
-		len = 1;
-		goto print_one_scalar;
 	case nbuf_Kind_UINT:
 	case nbuf_Kind_SINT:
 	case nbuf_Kind_FLT:
 	case nbuf_Kind_BOOL:
-		if (!(ptr = nbuf_obj_s(o, u.o.offset, u.o.ssize)))
+		size = (kind == nbuf_Kind_ENUM) ? 2 : u.o.ssize;
+		if (count > 0) {
+			/* fixed array: print as a repeated field, with the
+			 * elements beyond the end of an older message as 0 */
+			if (!nbuf_obj_inline(&oo, o, offset, size))
+				break;
+			avail = (o->ssize - offset) / size;
+			if (avail > count)
+				avail = count;
+			len = count;
+			goto print_scalars;
+		}
+		if (!(ptr = nbuf_obj_s(o, offset, size)))
 			break;
 		len = 1;
 		goto print_one_scalar;
 	case nbuf_Kind_MSG:
 	case nbuf_Kind_MSG|nbuf_Kind_ARR:
-		if (!(len = nbuf_obj_p(&oo, o, offset)))
+		len = (kind == nbuf_Kind_MSG && nbuf_MsgDef_is_struct(u.mdef)) ?
+			nbuf_obj_inline(&oo, o, offset, nbuf_MsgDef_ssize(u.mdef)) :
+			nbuf_obj_p(&oo, o, offset);
+		if (!len)
 			break;
 		for (;;) {
 			indent_fname(ctx, fname, fname_len);
@@ -214,6 +299,13 @@ print_msg(struct ctx *ctx, const struct nbuf_obj *o, nbuf_MsgDef mdef)
 
 	for (n = nbuf_MsgDef_fields(&fdef, mdef, 0); n--;
 		nbuf_next(NBUF_OBJ(fdef))) {
+		nbuf_UnionDef udef;
+
+		/* Only the member held by a union is printed */
+		if (nbuf_lookup_union(&udef, mdef, fdef) &&
+			nbuf_obj_union_tag(o, nbuf_UnionDef_offset(udef)) !=
+				nbuf_FieldDef_tag(fdef))
+			continue;
 		if (!print_field(ctx, o, fdef))
 			goto err;
 	}
@@ -223,9 +315,94 @@ err:
 	return rc;
 }
 
+/* Prints a field of o, if it holds it. */
+static bool
+print_marked_field(struct ctx *ctx, const char *mark,
+	const struct nbuf_obj *o, nbuf_MsgDef mdef, nbuf_FieldDef fdef)
+{
+	nbuf_UnionDef udef;
+	bool rc;
+
+	if (nbuf_lookup_union(&udef, mdef, fdef) &&
+		nbuf_obj_union_tag(o, nbuf_UnionDef_offset(udef)) !=
+			nbuf_FieldDef_tag(fdef))
+		return true;
+	ctx->mark = mark;
+	rc = print_field(ctx, o, fdef);
+	ctx->mark = "  ";
+	return rc;
+}
+
+static bool
+print_patch(struct ctx *ctx, const struct nbuf_obj *o, nbuf_Patch patch,
+	nbuf_MsgDef mdef)
+{
+	struct nbuf_buf vbuf;
+	struct nbuf_obj v, oo;
+	nbuf_FieldDef fdef;
+	nbuf_FieldPatch fp;
+	nbuf_Patch sub;
+	size_t nr = nbuf_Patch_replaced_size(patch);
+	size_t np = nbuf_Patch_patched(&fp, patch, 0);
+	size_t n, i, r;
+	bool rc = false;
+
+	if (ctx->depth >= ctx->max_depth)
+		return false;
+	++ctx->depth;
+	if (nr && !nbuf_patch_value(&v, &vbuf, patch))
+		goto err;
+	/* replaced and patched fields are in order */
+	for (i = r = 0, n = nbuf_MsgDef_fields(&fdef, mdef, 0); i < n;
+		i++, nbuf_next(NBUF_OBJ(fdef))) {
+		union {
+			struct nbuf_obj o;
+			nbuf_MsgDef mdef;
+		} u;
+		size_t fname_len;
+		const char *fname = nbuf_FieldDef_name(fdef, &fname_len);
+
+		if (r < nr && nbuf_Patch_replaced(patch, r) == i) {
+			r++;
+			if (!print_marked_field(ctx, "- ", o, mdef, fdef) ||
+				!print_marked_field(ctx, "+ ", &v, mdef, fdef))
+				goto err;
+		}
+		for (; np && nbuf_FieldPatch_field(fp) == i;
+			np--, nbuf_next(NBUF_OBJ(fp))) {
+			size_t index = nbuf_FieldPatch_index(fp);
+			nbuf_Kind kind = nbuf_get_field_type(&u.o, fdef);
+
+			if (!nbuf_FieldPatch_patch(&sub, fp) ||
+				nbuf_obj_p(&oo, o, nbuf_FieldDef_offset(fdef)) <= index)
+				goto err;
+			nbuf_advance(&oo, index);
+			indent_fname(ctx, fname, fname_len);
+			if (nbuf_is_repeated(kind))
+				fprintf(ctx->f, " {  # [%zu]", index);
+			else
+				fprintf(ctx->f, " {");
+			putc(ctx->nl, ctx->f);
+			ctx->curr_indent += ctx->indent;
+			if (!print_patch(ctx, &oo, sub, u.mdef))
+				goto err;
+			ctx->curr_indent -= ctx->indent;
+			indent(ctx);
+			putc('}', ctx->f);
+			putc(ctx->nl, ctx->f);
+		}
+	}
+	rc = r == nr && np == 0;
+err:
+	--ctx->depth;
+	return rc;
+}
+
 bool nbuf_print(const struct nbuf_print_opt *opt,
 	const struct nbuf_obj *o, nbuf_MsgDef mdef)
 {
+	struct nbuf_scratch scratch;
+	bool rc;
 	struct ctx ctx = {
 		.f = opt->f,
 		.indent = (opt->indent < 0) ? 0 : opt->indent,
@@ -234,6 +411,7 @@ bool nbuf_print(const struct nbuf_print_opt *opt,
 		.max_depth = (opt->max_depth > 0) ? opt->max_depth : 500,
 		.nl = (opt->indent < 0) ? ' ' : '\n',
 		.print_flags = (opt->loose_escape) ? NBUF_PRINT_LOOSE_ESCAPE : 0,
+		.scratch = opt->scratch ? opt->scratch : &scratch,
 	};
 
 	if (opt->msg_type_hdr) {
@@ -245,5 +423,32 @@ bool nbuf_print(const struct nbuf_print_opt *opt,
 			*pkg_name ? "." : "", nbuf_MsgDef_name(mdef, NULL));
 	}
 
-	return print_msg(&ctx, o, mdef);
+	nbuf_scratch_init(&scratch);
+	rc = print_msg(&ctx, o, mdef);
+	nbuf_scratch_clear(&scratch);
+	return rc;
+}
+
+bool nbuf_print_patch(const struct nbuf_print_opt *opt,
+	const struct nbuf_obj *old, const struct nbuf_obj *patch,
+	nbuf_MsgDef mdef)
+{
+	struct nbuf_scratch scratch;
+	bool rc;
+	struct ctx ctx = {
+		.f = opt->f,
+		.indent = (opt->indent < 0) ? 0 : opt->indent,
+		.max_depth = (opt->max_depth > 0) ? opt->max_depth : 500,
+		.nl = (opt->indent < 0) ? ' ' : '\n',
+		.print_flags = (opt->loose_escape) ? NBUF_PRINT_LOOSE_ESCAPE : 0,
+		.scratch = opt->scratch ? opt->scratch : &scratch,
+		.mark = "  ",
+	};
+	nbuf_Patch p;
+
+	*NBUF_OBJ(p) = *patch;
+	nbuf_scratch_init(&scratch);
+	rc = print_patch(&ctx, old, p, mdef);
+	nbuf_scratch_clear(&scratch);
+	return rc;
 }
@@ -30,8 +30,8 @@ size_t nbuf_EnumVal_from_value(nbuf_EnumVal *eval, nbuf_EnumDef edef, int value)
 	return 0;
 }
 
-static struct nbuf_schema_set *
-get_schema_set(struct nbuf_schema_set *ss, unsigned import_id)
+static const struct nbuf_schema_set *
+get_schema_set(const struct nbuf_schema_set *ss, unsigned import_id)
 {
 	if (import_id > 0) {
 		assert(import_id-1 < ss->nimports);
@@ -50,9 +50,10 @@ nbuf_Kind nbuf_get_field_type(struct nbuf_obj *o, nbuf_FieldDef fdef)
 	case nbuf_Kind_ENUM:
 	case nbuf_Kind_MSG: {
 		unsigned import_id = nbuf_FieldDef_import_id(fdef);
-		struct nbuf_buf *buf = NBUF_OBJ(fdef)->buf;
-		struct nbuf_schema_set *ss =
-			get_schema_set((struct nbuf_schema_set *) buf,
+		/* the schema set is only read, so it can be shared */
+		const struct nbuf_buf *buf = NBUF_OBJ(fdef)->buf;
+		const struct nbuf_schema_set *ss =
+			get_schema_set((const struct nbuf_schema_set *) buf,
 			import_id);
 		nbuf_Schema schema;
 		union {
@@ -61,7 +62,7 @@ nbuf_Kind nbuf_get_field_type(struct nbuf_obj *o, nbuf_FieldDef fdef)
 			nbuf_MsgDef *mdef;
 		} u = { o };
 
-		if (!nbuf_get_Schema(&schema, &ss->buf, 0))
+		if (!nbuf_get_Schema(&schema, (struct nbuf_buf *) &ss->buf, 0))
 			goto err;
 		if (!((base_kind == nbuf_Kind_ENUM) ?
 				nbuf_Schema_enums(u.edef, schema, type_id) :
@@ -190,3 +191,56 @@ bool nbuf_lookup_field(nbuf_FieldDef *fdef, nbuf_MsgDef mdef,
 	}
 	return false;
 }
+
+bool nbuf_lookup_union(nbuf_UnionDef *udef, nbuf_MsgDef mdef,
+	nbuf_FieldDef fdef)
+{
+	unsigned union_id = nbuf_FieldDef_union_id(fdef);
+
+	if (union_id == 0)
+		return false;
+	return nbuf_MsgDef_unions(udef, mdef, union_id - 1) != 0;
+}
+
+bool nbuf_lookup_key(struct nbuf_key *key, nbuf_FieldDef fdef)
+{
+	union {
+		struct nbuf_obj o;
+		nbuf_MsgDef mdef;
+	} u;
+	size_t len;
+	const char *name = nbuf_FieldDef_key(fdef, &len);
+	nbuf_Kind kind;
+
+	if (len == 0 ||
+		nbuf_get_field_type(&u.o, fdef) != (nbuf_Kind_MSG|nbuf_Kind_ARR) ||
+		!nbuf_lookup_field(&key->fdef, u.mdef, name, len))
+		return false;
+	kind = nbuf_get_field_type(&u.o, key->fdef);
+	if (nbuf_FieldDef_union_id(key->fdef) || nbuf_FieldDef_count(key->fdef) ||
+		nbuf_FieldDef_bits(key->fdef))
+		return false;
+	key->offset = nbuf_FieldDef_offset(key->fdef);
+	switch (kind) {
+	case nbuf_Kind_UINT:
+	case nbuf_Kind_BOOL:
+		key->width = u.o.ssize;
+		key->flags = 0;
+		break;
+	case nbuf_Kind_SINT:
+		key->width = u.o.ssize;
+		key->flags = NBUF_KEY_SIGNED;
+		break;
+	case nbuf_Kind_ENUM:
+		key->width = 2;
+		key->flags = NBUF_KEY_SIGNED;
+		break;
+	case nbuf_Kind_STR:
+		key->width = 0;
+		key->flags = NBUF_KEY_STRING;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
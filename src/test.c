@@ -1,3 +1,4 @@
+#include "config.h"
 #include "nbuf_schema.nb.h"
 #include "libnbuf.h"
 
@@ -8,6 +9,7 @@ static const char textschema[] =
 "enum TriState {"
 "  UNKNOWN = -1, FALSE, TRUE # some comments\n"
 "}"
+"enum Dir { N = 0, E, S, W }"
 "message Msg { // some comments\n"
 "  TriState a;"
 "  TriState[] b;"
@@ -25,11 +27,27 @@ static const char textschema[] =
 "  string[] n;"
 "  SubMsg o;"
 "  SubMsg[] p;"
+"  Vec q;"
+"  int16[2] r;"
+"  packed uint32[] s;"
+"  delta int64[] t;"
 "}"
 "message SubMsg {"
 "  bool a;"
 "  bool[] b;"
 "  Msg c;"
+"  union u {"
+"    string s;"
+"    Msg[] t;"
+"  }"
+"  bool v : 1;"
+"  bool w : 1;"
+"  bool[] x : 1;"
+"  Dir y : 2;"
+"}"
+"struct Vec {"
+"  float[3] v;"
+"  TriState t;"
 "}";
 
 static const char test_input[] =
@@ -57,8 +75,12 @@ static const char test_input[] =
 "n:\"escape\\000d\\x07\\b\\f\\r\t\\v\""
 "n:\"\""
 "o{}"
-"p{a: true b: false b: true}"
-"p{c{a:TRUE}}";
+"p{a: true b: false b: true s: \"one of\" v: true x: true x: false x: true y: W}"
+"p{c{a:TRUE}}"
+"q{v: 1 v: 2.5 t: TRUE}"
+"r: -1 r: 7 "
+"s: 1 s: 300 s: 0xffffffff "
+"t: -5 t: 1000000 t: 999999 t: -9223372036854775808";
 
 static const char test_output[] =
 "# test.Msg\n"
@@ -86,9 +108,21 @@ static const char test_output[] =
 "n: \"multi\\nline\" "
 "n: \"escape\\0d\\a\\b\\f\\r\\t\\v\" "
 "n: \"\" "
-"o { a: false } "
-"p { a: true b: false b: true } "
-"p { a: false c { a: TRUE c: 0 e: 0 g: 0 i: 0 k: 0 m: \"\" } } ";
+"o { a: false v: false w: false y: N } "
+"p { a: true b: false b: true s: \"one of\" "
+"v: true w: false x: true x: false x: true y: W } "
+"p { a: false c { a: TRUE c: 0 e: 0 g: 0 i: 0 k: 0 m: \"\" "
+"q { v: 0 v: 0 v: 0 t: FALSE } r: 0 r: 0 } v: false w: false y: N } "
+"q { v: 1 v: 2.5 v: 0 t: TRUE } "
+"r: -1 "
+"r: 7 "
+"s: 1 "
+"s: 300 "
+"s: 4294967295 "
+"t: -5 "
+"t: 1000000 "
+"t: 999999 "
+"t: -9223372036854775808 ";
 
 static struct nbuf_buf compilebuf;
 static struct nbuf_compile_opt copt = {
@@ -138,6 +172,56 @@ void test_bad_compile(void)
 	bad_compile_case("unresolved type", "message T { U x; }");
 	bad_compile_case("empty enum", "enum T {}");
 	bad_compile_case("empty message", "message T {}");
+	bad_compile_case("empty union", "message T { union U {} }");
+	bad_compile_case("nested union",
+		"message T { union U { union V { string x; } } }");
+	bad_compile_case("duplicate union",
+		"message T { union U { string x; } union U { string y; } }");
+	bad_compile_case("scalar in union",
+		"message T { union U { int32 x; string y; } }");
+	bad_compile_case("pointer in struct", "struct S { string x; }");
+	bad_compile_case("recursive struct", "struct S { uint8 x; S y; }");
+	bad_compile_case("fixed array of strings", "message T { string[2] x; }");
+	bad_compile_case("empty fixed array", "message T { uint8[0] x; }");
+	bad_compile_case("wide bool bitfield", "message T { bool x : 2; }");
+	bad_compile_case("int bitfield", "message T { int32 x : 4; }");
+	bad_compile_case("repeated enum bitfield",
+		"enum E { A, B } message T { E[] x : 1; }");
+	bad_compile_case("negative enum bitfield",
+		"enum E { A = -1, B } message T { E x : 4; }");
+	bad_compile_case("narrow enum bitfield",
+		"enum E { A, B, C } message T { E x : 1; }");
+	bad_compile_case("too wide bitfield", "message T { bool x : 9; }");
+	bad_compile_case("packed singular field", "message T { packed uint32 x; }");
+	bad_compile_case("packed float", "message T { delta float[] x; }");
+	bad_compile_case("key of scalar array", "message T { int32[x] x; }");
+	bad_compile_case("unknown key",
+		"message E { int32 id; } message T { E[name] x; }");
+	bad_compile_case("float key",
+		"message E { float id; } message T { E[id] x; }");
+	bad_compile_case("repeated key",
+		"message E { int32[] id; } message T { E[id] x; }");
+	bad_compile_case("hashed without key",
+		"message E { string id; } message T { hashed E[] x; }");
+	bad_compile_case("hashed int key",
+		"message E { int32 id; } message T { hashed E[id] x; }");
+	bad_compile_case("hashed union member",
+		"message E { string id; } message T { union u { int32 a; hashed E[id] x; } }");
+}
+
+/* Prints o in text format to a string in out. */
+static void print_to_buf(struct nbuf_buf *out, const struct nbuf_obj *o, nbuf_MsgDef mdef)
+{
+	struct nbuf_print_opt opt = {
+		.f = tmpfile(),
+		.indent = -1,
+	};
+
+	TEST_ASSERT(opt.f != NULL);
+	TEST_CHECK(nbuf_print(&opt, o, mdef));
+	rewind(opt.f);
+	TEST_CHECK(nbuf_load_fp(out, opt.f));
+	fclose(opt.f);
 }
 
 void test_parse_print(void)
@@ -171,6 +255,27 @@ void test_parse_print(void)
 	fclose(f);
 	check_str_leq(textbuf.base, textbuf.len, test_output, sizeof test_output - 1);
 	nbuf_clear(&textbuf);
+
+	TEST_CASE("short fixed array");
+	{
+		struct nbuf_buf text1, text2;
+		nbuf_FieldDef fdef;
+
+		/* an older message, ending in the middle of r */
+		TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "r", -1));
+		nbuf_init_ex(&parsebuf, 0);
+		TEST_ASSERT(nbuf_parse(&paopt, &o, "r: 3", 4, mdef));
+		print_to_buf(&text1, &o, mdef);
+		nbuf_clear(&parsebuf);
+		nbuf_init_ex(&parsebuf, 0);
+		TEST_ASSERT(nbuf_parse(&paopt, &o, "r: 3 r: 4", 9, mdef));
+		o.ssize = nbuf_FieldDef_offset(fdef) + 2;
+		print_to_buf(&text2, &o, mdef);
+		check_str_leq(text2.base, text2.len, text1.base, text1.len);
+		nbuf_clear(&parsebuf);
+		nbuf_clear(&text1);
+		nbuf_clear(&text2);
+	}
 }
 
 static void bad_parse_case(struct nbuf_buf *parsebuf, nbuf_MsgDef mdef, const char *case_name, const char *input)
@@ -206,10 +311,930 @@ void test_bad_parse(void)
 	bad_parse_case(&parsebuf, mdef, "nonterminating string", "m: \"bad string...");
 	bad_parse_case(&parsebuf, mdef, "nonterminating comment", "m: /*bad comment...");
 	bad_parse_case(&parsebuf, mdef, "scattered repeated field", "d: 0 c: 1 d: 2");
+	bad_parse_case(&parsebuf, mdef, "union conflict", "o { s: \"x\" t {} }");
+	bad_parse_case(&parsebuf, mdef, "fixed array overflow", "r: 1 r: 2 r: 3");
+	bad_parse_case(&parsebuf, mdef, "bitfield overflow", "o { y: 4 }");
+	bad_parse_case(&parsebuf, mdef, "scattered bitset", "o { x: true a: true x: false }");
+
+	nbuf_clear(&parsebuf);
+}
+
+void test_dedup(void)
+{
+	static const char input[] =
+		"m: \"dup\" n: \"dup\" n: \"dup\" n: \"x\" "
+		"o { c { m: \"dup\" h: 1 } } "
+		"p { c { m: \"dup\" h: 1 } } p { c { m: \"dup\" h: 2 } }";
+	struct nbuf_buf parsebuf, outbuf, text1, text2;
+	struct nbuf_parse_opt paopt = {
+		.outbuf = &parsebuf,
+		.filename = "<test input>",
+	};
+	struct nbuf_dedup_opt opt = {
+		.outbuf = &outbuf,
+	};
+	nbuf_MsgDef mdef;
+	nbuf_FieldDef fdef;
+	struct nbuf_obj o, oo, a, b;
+
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, schema, 0));
+	nbuf_init_ex(&parsebuf, 0);
+	nbuf_init_ex(&outbuf, 0);
+
+	TEST_CASE("same contents");
+	TEST_ASSERT(nbuf_parse(&paopt, &o, test_input, sizeof test_input - 1, mdef));
+	TEST_ASSERT(nbuf_dedup(&opt, &oo, &o));
+	TEST_CHECK(oo.offset == sizeof (nbuf_word_t) && outbuf.len <= parsebuf.len);
+	print_to_buf(&text1, &o, mdef);
+	print_to_buf(&text2, &oo, mdef);
+	check_str_leq(text2.base, text2.len, text1.base, text1.len);
+	nbuf_clear(&text1);
+	nbuf_clear(&text2);
+
+	TEST_CASE("shared");
+	nbuf_clear(&parsebuf);
+	nbuf_clear(&outbuf);
+	nbuf_init_ex(&parsebuf, 0);
+	nbuf_init_ex(&outbuf, 0);
+	TEST_ASSERT(nbuf_parse(&paopt, &o, input, sizeof input - 1, mdef));
+	TEST_ASSERT(nbuf_dedup(&opt, &oo, &o));
+	TEST_CHECK(outbuf.len < parsebuf.len);
+	print_to_buf(&text1, &o, mdef);
+	print_to_buf(&text2, &oo, mdef);
+	check_str_leq(text2.base, text2.len, text1.base, text1.len);
+	nbuf_clear(&text1);
+	nbuf_clear(&text2);
+	/* m and n[0] are the same object */
+	o.buf = &outbuf;
+	o.offset = 0;
+	TEST_ASSERT(nbuf_get_obj(&o) == 1);
+	TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "m", -1));
+	TEST_CHECK(nbuf_obj_p(&a, &o, nbuf_FieldDef_offset(fdef)) == 4);
+	TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "n", -1));
+	TEST_CHECK(nbuf_obj_p(&b, &o, nbuf_FieldDef_offset(fdef)) == 3);
+	TEST_CHECK(nbuf_obj_p(&b, &b, 0) == 4 && b.offset == a.offset);
+
+	TEST_CASE("cycle");
+	nbuf_clear(&parsebuf);
+	nbuf_clear(&outbuf);
+	nbuf_init_ex(&parsebuf, 0);
+	nbuf_init_ex(&outbuf, 0);
+	o.buf = &parsebuf;
+	o.ssize = 0;
+	o.psize = 1;
+	TEST_ASSERT(nbuf_alloc_obj(&o));
+	oo = o;
+	TEST_ASSERT(nbuf_alloc_obj(&oo));
+	TEST_ASSERT(nbuf_obj_set_p(&o, 0, &oo));
+	TEST_CHECK(nbuf_dedup(&opt, &a, &o));
+	TEST_ASSERT(nbuf_obj_set_p(&oo, 0, &oo));
+	TEST_CHECK(!nbuf_dedup(&opt, &a, &o));
+	TEST_ASSERT(nbuf_obj_set_p(&oo, 0, &o));
+	TEST_CHECK(!nbuf_dedup(&opt, &a, &o));
+
+	TEST_CASE("bad pointer");
+	nbuf_set_word(parsebuf.base + o.offset, 1000);
+	TEST_CHECK(!nbuf_dedup(&opt, &a, &o));
+
+	nbuf_clear(&outbuf);
+	nbuf_clear(&parsebuf);
+}
+
+void test_edit(void)
+{
+	static const char input[] =
+		"m: \"abc\" n: \"x\" n: \"y\" n: \"z\" "
+		"p { c { m: \"inner\" h: 1 } } p { c { m: \"inner\" h: 2 } }";
+	struct nbuf_buf parsebuf, text1, text2;
+	struct nbuf_parse_opt paopt = {
+		.outbuf = &parsebuf,
+		.filename = "<test input>",
+	};
+	struct nbuf_edit ed;
+	nbuf_MsgDef mdef;
+	nbuf_FieldDef fdef;
+	struct nbuf_obj o, a, s;
+	size_t m, n, len, old;
+	char str[64];
+	int i;
+
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, schema, 0));
+	TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "m", -1));
+	m = nbuf_FieldDef_offset(fdef);
+	TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "n", -1));
+	n = nbuf_FieldDef_offset(fdef);
+	nbuf_init_ex(&parsebuf, 0);
+	TEST_ASSERT(nbuf_parse(&paopt, &o, input, sizeof input - 1, mdef));
+	nbuf_edit_init(&ed, &parsebuf);
+
+	TEST_CASE("reuse");
+	len = parsebuf.len;
+	for (i = 0; i < 100; i++) {
+		snprintf(str, sizeof str, "%.*s", 1 + i % 40,
+			"0123456789012345678901234567890123456789");
+		TEST_ASSERT(nbuf_edit_alloc_str(&ed, &s, str, -1) != NULL);
+		TEST_ASSERT(nbuf_edit_set_p(&ed, &o, m, &s));
+		TEST_ASSERT(nbuf_edit_set_str(&ed, &o, m, str + i % 7, -1) != NULL);
+	}
+	TEST_CHECK(nbuf_obj_p(&s, &o, m) == strlen(str + 99 % 7) + 1);
+	TEST_CHECK(strcmp(parsebuf.base + s.offset, str + 99 % 7) == 0);
+	TEST_CHECK_(parsebuf.len <= len + 64, "length %zu", parsebuf.len);
+
+	TEST_CASE("relocate");
+	print_to_buf(&text1, &o, mdef);
+	TEST_ASSERT(nbuf_obj_p(&a, &o, n) == 3);
+	old = a.offset;
+	TEST_ASSERT(nbuf_edit_resize_arr(&ed, &a, &o, n, 100));
+	TEST_CHECK(a.offset != old && nbuf_obj_p(&a, &o, n) == 100);
+	TEST_CHECK(nbuf_obj_p(&s, &a, 0) == 2 && parsebuf.base[s.offset] == 'x');
+	a.offset += 99 * nbuf_obj_size(&a);
+	TEST_CHECK(nbuf_obj_p(&s, &a, 0) == 0);
+	TEST_ASSERT(nbuf_edit_resize_arr(&ed, &a, &o, n, 3));
+	print_to_buf(&text2, &o, mdef);
+	check_str_leq(text2.base, text2.len, text1.base, text1.len);
+	nbuf_clear(&text2);
 
+	TEST_CASE("gc");
+	len = parsebuf.len;
+	TEST_ASSERT(nbuf_gc(&ed, &o));
+	TEST_CHECK(o.offset == sizeof (nbuf_word_t) && parsebuf.len < len);
+	print_to_buf(&text2, &o, mdef);
+	check_str_leq(text2.base, text2.len, text1.base, text1.len);
+	nbuf_clear(&text1);
+	nbuf_clear(&text2);
+
+	nbuf_edit_clear(&ed);
 	nbuf_clear(&parsebuf);
 }
 
+void test_merge(void)
+{
+	static const char base[] =
+		"c: 1 e: 2 m: \"base\" n: \"a\" o { a: true c { g: 7 } s: \"x\" } "
+		"p { a: true } q { v: 1 v: 2 t: TRUE } r: 3 s: 1 s: 2";
+	static const char overlay[] =
+		"e: 5 g: 4 m: \"\" n: \"b\" o { v: true y: S c { h: 3 } t { c: 9 } } "
+		"p { b: true } q { v: 0 v: 0 v: 9 } r: 0 r: 8 s: 9";
+	static const char appended[] =
+		"c: 1 e: 5 g: 4 m: \"base\" n: \"a\" n: \"b\" "
+		"o { a: true v: true y: S c { g: 7 h: 3 } t { c: 9 } } "
+		"p { a: true } p { b: true } q { v: 1 v: 2 v: 9 t: TRUE } "
+		"r: 3 r: 8 s: 9";
+	static const char replaced[] =
+		"c: 1 e: 5 g: 4 m: \"base\" n: \"b\" "
+		"o { a: true v: true y: S c { g: 7 h: 3 } t { c: 9 } } "
+		"p { b: true } q { v: 1 v: 2 v: 9 t: TRUE } r: 3 r: 8 s: 9";
+	static const char ktext[] =
+		"message E { string name; int32 id; } "
+		"message T { hashed E[name] e; E[id] w; }";
+	static const char kbase[] =
+		"w { id: 2 name: \"b\" } w { id: 1 name: \"a\" } e { name: \"x\" }";
+	static const char koverlay[] =
+		"w { id: 1 name: \"z\" } e { name: \"x\" id: 7 }";
+	struct nbuf_buf bbuf, vbuf, ebuf, outbuf, kbuf, text1, text2;
+	struct nbuf_parse_opt paopt = {
+		.filename = "<test input>",
+	};
+	struct nbuf_merge_opt opt = {
+		.outbuf = &outbuf,
+	};
+	struct nbuf_compile_opt kopt = {
+		.outbuf = &kbuf,
+	};
+	struct nbuf_schema_set *ss;
+	nbuf_Schema kschema;
+	nbuf_MsgDef mdef;
+	struct nbuf_obj b, v, e, o, arr, idx, it;
+	size_t i, n, m, len;
+	const char *s;
+
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, schema, 0));
+	nbuf_init_ex(&bbuf, 0);
+	nbuf_init_ex(&vbuf, 0);
+	paopt.outbuf = &bbuf;
+	TEST_ASSERT(nbuf_parse(&paopt, &b, base, sizeof base - 1, mdef));
+	paopt.outbuf = &vbuf;
+	TEST_ASSERT(nbuf_parse(&paopt, &v, overlay, sizeof overlay - 1, mdef));
+
+	for (i = 0; i < 2; i++) {
+		TEST_CASE(i ? "replace" : "append");
+		opt.replace_repeated = i;
+		nbuf_init_ex(&outbuf, 0);
+		nbuf_init_ex(&ebuf, 0);
+		paopt.outbuf = &ebuf;
+		s = i ? replaced : appended;
+		TEST_ASSERT(nbuf_parse(&paopt, &e, s, strlen(s), mdef));
+		TEST_ASSERT(nbuf_merge(&opt, &o, &b, &v, mdef));
+		TEST_CHECK(o.offset == sizeof (nbuf_word_t));
+		print_to_buf(&text1, &e, mdef);
+		print_to_buf(&text2, &o, mdef);
+		check_str_leq(text2.base, text2.len, text1.base, text1.len);
+		nbuf_clear(&text1);
+		nbuf_clear(&text2);
+		nbuf_clear(&ebuf);
+		nbuf_clear(&outbuf);
+	}
+
+	TEST_CASE("keyed");
+	opt.replace_repeated = false;
+	nbuf_clear(&bbuf);
+	nbuf_clear(&vbuf);
+	nbuf_init_ex(&bbuf, 0);
+	nbuf_init_ex(&vbuf, 0);
+	nbuf_init_ex(&kbuf, 0);
+	nbuf_init_ex(&outbuf, 0);
+	ss = nbuf_compile_str(&kopt, ktext, sizeof ktext - 1, "<string>");
+	TEST_ASSERT(ss != NULL);
+	TEST_ASSERT(nbuf_get_Schema(&kschema, &ss->buf, 0));
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, kschema, 1));
+	paopt.outbuf = &bbuf;
+	TEST_ASSERT(nbuf_parse(&paopt, &b, "e { name: \"d\" } e { name: \"b\" }",
+		31, mdef));
+	paopt.outbuf = &vbuf;
+	TEST_ASSERT(nbuf_parse(&paopt, &v, "e { name: \"c\" } e { name: \"a\" }",
+		31, mdef));
+	TEST_ASSERT(nbuf_merge(&opt, &o, &b, &v, mdef));
+	n = nbuf_obj_p(&arr, &o, 0);
+	TEST_ASSERT(n == 4);
+	for (i = 0; i < n; i++) {
+		s = nbuf_key_str_at(&arr, i, 0, &len);
+		TEST_CHECK(len == 1 && *s == "abcd"[i]);
+	}
+	m = nbuf_obj_p(&idx, &o, 1);
+	TEST_CHECK(m > 0);
+	it = arr;
+	TEST_CHECK(nbuf_find_hashed(&it, n, 0, &idx, m, "c", 1) &&
+		nbuf_obj_ptrdiff(&it, &arr) == 2);
+
+	TEST_CASE("keyed, same key");
+	nbuf_clear(&outbuf);
+	nbuf_clear(&bbuf);
+	nbuf_clear(&vbuf);
+	nbuf_init_ex(&bbuf, 0);
+	nbuf_init_ex(&vbuf, 0);
+	nbuf_init_ex(&outbuf, 0);
+	paopt.outbuf = &bbuf;
+	TEST_ASSERT(nbuf_parse(&paopt, &b, kbase, sizeof kbase - 1, mdef));
+	paopt.outbuf = &vbuf;
+	TEST_ASSERT(nbuf_parse(&paopt, &v, koverlay, sizeof koverlay - 1, mdef));
+	TEST_ASSERT(nbuf_merge(&opt, &o, &b, &v, mdef));
+	/* the element of the overlay replaces that of the base */
+	n = nbuf_obj_p(&arr, &o, 2);
+	TEST_CHECK(n == 2);
+	it = arr;
+	TEST_CHECK(nbuf_find_key(&it, n, 0, 4, NBUF_KEY_SIGNED, 1));
+	s = nbuf_key_str_at(&it, 0, 0, &len);
+	TEST_CHECK(len == 1 && *s == 'z');
+	it = arr;
+	TEST_CHECK(nbuf_find_key(&it, n, 0, 4, NBUF_KEY_SIGNED, 2));
+	s = nbuf_key_str_at(&it, 0, 0, &len);
+	TEST_CHECK(len == 1 && *s == 'b');
+	n = nbuf_obj_p(&arr, &o, 0);
+	m = nbuf_obj_p(&idx, &o, 1);
+	TEST_CHECK(n == 1);
+	it = arr;
+	TEST_CHECK(nbuf_find_hashed(&it, n, 0, &idx, m, "x", 1) &&
+		nbuf_u32(nbuf_obj_s(&it, 0, 4)) == 7);
+
+	nbuf_clear(&outbuf);
+	nbuf_clear(&bbuf);
+	nbuf_clear(&vbuf);
+	nbuf_free_compiled(&kopt);
+}
+
+void test_diff(void)
+{
+	static const char *const texts[] = {
+		"b: FALSE c: 1 m: \"abc\" n: \"x\" n: \"y\" "
+		"o { a: true s: \"one\" v: true y: E } "
+		"p { a: true } p { c { h: 1 m: \"deep\" } } "
+		"q { v: 1 t: TRUE } r: 3 s: 1 s: 2",
+		"b: FALSE b: TRUE c: 1 m: \"abd\" n: \"x\" n: \"y\" "
+		"o { a: true t { c: 2 } w: true y: E } "
+		"p { a: true } p { c { h: 1 m: \"deeper\" } } "
+		"q { v: 1 v: 2 t: TRUE } r: 3 s: 1",
+	};
+	static const char small[2][64] = {
+		"c: 1 p { a: true } p { c { g: 1 } }",
+		"c: 2 p { a: true } p { c { g: 2 } }",
+	};
+	static const char printed[] =
+		"- c: 1\n"
+		"+ c: 2\n"
+		"  p {  # [1]\n"
+		"    c {\n"
+		"-     g: 1\n"
+		"+     g: 2\n"
+		"    }\n"
+		"  }\n";
+	struct nbuf_buf bufs[2], patchbuf, copy, text1, text2;
+	struct nbuf_parse_opt paopt = {
+		.filename = "<test input>",
+	};
+	struct nbuf_diff_opt opt = {
+		.outbuf = &patchbuf,
+	};
+	struct nbuf_print_opt popt = {
+		.indent = 2,
+	};
+	nbuf_MsgDef mdef;
+	nbuf_Patch p;
+	struct nbuf_obj o[2], patch, c;
+	size_t len;
+	int i;
+
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, schema, 0));
+	for (i = 0; i < 2; i++) {
+		nbuf_init_ex(&bufs[i], 0);
+		paopt.outbuf = &bufs[i];
+		TEST_ASSERT(nbuf_parse(&paopt, &o[i], texts[i], strlen(texts[i]),
+			mdef));
+	}
+
+	for (i = 0; i < 2; i++) {
+		TEST_CASE(i ? "apply backward" : "apply");
+		nbuf_init_ex(&patchbuf, 0);
+		TEST_ASSERT(nbuf_diff(&opt, &patch, &o[i], &o[!i], mdef));
+		TEST_CHECK(patch.offset == sizeof (nbuf_word_t));
+		nbuf_init_ex(&copy, 0);
+		TEST_ASSERT(nbuf_add(&copy, bufs[i].base, bufs[i].len) != NULL);
+		c = o[i];
+		c.buf = &copy;
+		TEST_ASSERT(nbuf_apply_patch(&c, &patch, mdef));
+		TEST_CHECK(c.offset == o[i].offset);
+		print_to_buf(&text1, &o[!i], mdef);
+		print_to_buf(&text2, &c, mdef);
+		check_str_leq(text2.base, text2.len, text1.base, text1.len);
+		nbuf_clear(&text1);
+		nbuf_clear(&text2);
+
+		/* the patched copy shares what did not change with o[i] */
+		nbuf_clear(&patchbuf);
+		nbuf_init_ex(&patchbuf, 0);
+		TEST_ASSERT(nbuf_diff(&opt, &patch, &c, &o[!i], mdef));
+		*NBUF_OBJ(p) = patch;
+		TEST_CHECK(nbuf_Patch_replaced_size(p) == 0 &&
+			nbuf_Patch_patched_size(p) == 0);
+		nbuf_clear(&patchbuf);
+		nbuf_clear(&copy);
+	}
+
+	TEST_CASE("print");
+	for (i = 0; i < 2; i++) {
+		nbuf_clear(&bufs[i]);
+		nbuf_init_ex(&bufs[i], 0);
+		paopt.outbuf = &bufs[i];
+		TEST_ASSERT(nbuf_parse(&paopt, &o[i], small[i], strlen(small[i]),
+			mdef));
+	}
+	nbuf_init_ex(&patchbuf, 0);
+	TEST_ASSERT(nbuf_diff(&opt, &patch, &o[0], &o[1], mdef));
+	popt.f = tmpfile();
+	TEST_ASSERT(popt.f != NULL);
+	TEST_CHECK(nbuf_print_patch(&popt, &o[0], &patch, mdef));
+	rewind(popt.f);
+	len = nbuf_load_fp(&text1, popt.f);
+	fclose(popt.f);
+	check_str_leq(text1.base, len, printed, sizeof printed - 1);
+	nbuf_clear(&text1);
+
+	nbuf_clear(&patchbuf);
+	nbuf_clear(&bufs[0]);
+	nbuf_clear(&bufs[1]);
+}
+
+/* Flips each bit of the scalar part of o, checking that nbuf_equal and
+ * nbuf_hash tell a change when the printed text does.
+ */
+static void check_flips(const struct nbuf_obj *o, nbuf_MsgDef mdef)
+{
+	struct nbuf_buf copy, text1, text2;
+	struct nbuf_obj c = *o;
+	unsigned char *p;
+	size_t i, same = 0, bad = 0;
+	uint64_t h = nbuf_hash(o, mdef, 0);
+	bool eq;
+
+	nbuf_init_ex(&copy, 0);
+	TEST_ASSERT(nbuf_add(&copy, o->buf->base, o->buf->len) != NULL);
+	c.buf = &copy;
+	p = (unsigned char *) nbuf_obj_s(&c, 0, c.ssize);
+	print_to_buf(&text1, o, mdef);
+	for (i = 0; i < c.ssize * 8u; i++) {
+		p[i / 8] ^= 1 << (i % 8);
+		print_to_buf(&text2, &c, mdef);
+		eq = text1.len == text2.len &&
+			memcmp(text1.base, text2.base, text1.len) == 0;
+		if (nbuf_equal(o, &c, mdef) != eq ||
+			(nbuf_hash(&c, mdef, 0) == h) != eq)
+			bad++;
+		same += eq;
+		nbuf_clear(&text2);
+		p[i / 8] ^= 1 << (i % 8);
+	}
+	TEST_CHECK(bad == 0);
+	TEST_MSG("%zu of %zu bits", bad, i);
+	TEST_CHECK(same > 0 && same < i);
+	nbuf_clear(&text1);
+	nbuf_clear(&copy);
+}
+
+void test_hash(void)
+{
+	static const char *const pairs[][2] = {
+		{ "c: 1", "c: 1 m: \"\" o { c { } }" },
+		{ "c: 1", "c: 2" },
+		{ "c: 1", "c: 1 p { }" },
+		{ "n: \"a\" n: \"b\"", "n: \"ab\"" },
+		{ "n: \"\" n: \"a\"", "n: \"a\" n: \"\"" },
+		{ "o { s: \"x\" }", "o { t { } }" },
+		{ "o { x: true }", "o { x: true x: false }" },
+		{ "s: 1 s: 2", "s: 2 s: 1" },
+		{ "q { v: 1 }", "q { t: TRUE }" },
+	};
+	/* integers only, which print as they are */
+	static const char ptext[] =
+		"enum E { A, B, C, D, F, G, H, I } "
+		"struct S { uint8 x; uint32 y; } "
+		"message P { uint8 a; S s; E b : 3; int16[] c; } "
+		"message W { uint64[65] a; S s; E c : 3; uint16 d; }";
+	struct nbuf_buf bufs[2], outbuf, pbuf;
+	struct nbuf_parse_opt paopt = {
+		.filename = "<test input>",
+	};
+	struct nbuf_dedup_opt dopt = {
+		.outbuf = &outbuf,
+	};
+	struct nbuf_compile_opt popt = {
+		.outbuf = &pbuf,
+	};
+	struct nbuf_schema_set *ss;
+	nbuf_Schema pschema;
+	nbuf_MsgDef mdef;
+	struct nbuf_obj o[2], d;
+	size_t i, j;
+	const char *s;
+
+	TEST_CASE("layout");
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, schema, 0));
+	for (i = 0; i < 2; i++) {
+		nbuf_init_ex(&bufs[i], 0);
+		paopt.outbuf = &bufs[i];
+		TEST_ASSERT(nbuf_parse(&paopt, &o[i], test_input,
+			sizeof test_input - 1, mdef));
+	}
+	nbuf_init_ex(&outbuf, 0);
+	TEST_ASSERT(nbuf_dedup(&dopt, &d, &o[0]));
+	TEST_CHECK(nbuf_equal(&o[0], &o[1], mdef));
+	TEST_CHECK(nbuf_equal(&o[0], &d, mdef));
+	TEST_CHECK(nbuf_hash(&o[0], mdef, 0) == nbuf_hash(&o[1], mdef, 0));
+	TEST_CHECK(nbuf_hash(&o[0], mdef, 0) == nbuf_hash(&d, mdef, 0));
+	TEST_CHECK(nbuf_hash(&o[0], mdef, 0) != nbuf_hash(&o[0], mdef, 1));
+	nbuf_clear(&outbuf);
+
+	for (i = 0; i < sizeof pairs / sizeof pairs[0]; i++) {
+		TEST_CASE(pairs[i][1]);
+		for (j = 0; j < 2; j++) {
+			nbuf_clear(&bufs[j]);
+			nbuf_init_ex(&bufs[j], 0);
+			paopt.outbuf = &bufs[j];
+			s = pairs[i][j];
+			TEST_ASSERT(nbuf_parse(&paopt, &o[j], s, strlen(s), mdef));
+		}
+		/* only the first pair reads the same */
+		TEST_CHECK(nbuf_equal(&o[0], &o[1], mdef) == (i == 0));
+		TEST_CHECK(nbuf_equal(&o[1], &o[0], mdef) == (i == 0));
+		TEST_CHECK((nbuf_hash(&o[0], mdef, 0) ==
+			nbuf_hash(&o[1], mdef, 0)) == (i == 0));
+	}
+
+	TEST_CASE("padding");
+	nbuf_init_ex(&pbuf, 0);
+	ss = nbuf_compile_str(&popt, ptext, sizeof ptext - 1, "<string>");
+	TEST_ASSERT(ss != NULL);
+	TEST_ASSERT(nbuf_get_Schema(&pschema, &ss->buf, 0));
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, pschema, 1));
+	nbuf_clear(&bufs[0]);
+	nbuf_init_ex(&bufs[0], 0);
+	paopt.outbuf = &bufs[0];
+	s = "a: 1 s { x: 2 y: 3 } b: D c: 5";
+	TEST_ASSERT(nbuf_parse(&paopt, &o[0], s, strlen(s), mdef));
+	check_flips(&o[0], mdef);
+
+	TEST_CASE("window");
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, pschema, 2));
+	TEST_CHECK(nbuf_MsgDef_ssize(mdef) > 512);
+	nbuf_clear(&bufs[0]);
+	nbuf_init_ex(&bufs[0], 0);
+	s = "a: 1 a: 2 s { x: 2 y: 3 } c: F d: 5";
+	TEST_ASSERT(nbuf_parse(&paopt, &o[0], s, strlen(s), mdef));
+	check_flips(&o[0], mdef);
+	nbuf_free_compiled(&popt);
+
+	nbuf_clear(&bufs[0]);
+	nbuf_clear(&bufs[1]);
+}
+
+/* Writes o in canonical form to c, and checks that flipping any bit of it
+ * gives a buffer that is not canonical, or reads differently.
+ */
+static void check_canonical(struct nbuf_buf *c, const struct nbuf_obj *o,
+	nbuf_MsgDef mdef)
+{
+	struct nbuf_buf again;
+	struct nbuf_obj co, ao;
+	size_t i, canon = 0, bad = 0;
+
+	nbuf_init_ex(c, 0);
+	TEST_ASSERT(nbuf_canonicalize(c, &co, o, mdef));
+	TEST_CHECK(co.offset == sizeof (nbuf_word_t));
+	TEST_CHECK(nbuf_is_canonical(&co, mdef));
+	TEST_CHECK(nbuf_equal(o, &co, mdef));
+	nbuf_init_ex(&again, 0);
+	TEST_ASSERT(nbuf_canonicalize(&again, &ao, &co, mdef));
+	TEST_CHECK(again.len == c->len &&
+		memcmp(again.base, c->base, c->len) == 0);
+	for (i = 0; i < c->len * 8; i++) {
+		again.base[i / 8] ^= 1 << (i % 8);
+		ao.offset = 0;
+		if (nbuf_get_obj(&ao) && nbuf_is_canonical(&ao, mdef)) {
+			canon++;
+			bad += nbuf_equal(&co, &ao, mdef);
+		}
+		again.base[i / 8] ^= 1 << (i % 8);
+	}
+	TEST_CHECK(bad == 0);
+	TEST_MSG("%zu of %zu bits", bad, i);
+	TEST_CHECK(canon > 0 && canon < i);
+	nbuf_clear(&again);
+}
+
+void test_canonical(void)
+{
+	static const char htext[] =
+		"message E { string name; int32 v; } "
+		"message T { hashed E[name] e; string[] s; }";
+	static const char *const same[] = {
+		"c: 1",
+		"c: 1 m: \"\" o { c { } }",
+	};
+	struct nbuf_buf buf, outbuf, c[2], pbuf;
+	struct nbuf_parse_opt paopt = {
+		.outbuf = &buf,
+		.filename = "<test input>",
+	};
+	struct nbuf_dedup_opt dopt = {
+		.outbuf = &outbuf,
+	};
+	struct nbuf_compile_opt popt = {
+		.outbuf = &pbuf,
+	};
+	struct nbuf_schema_set *ss;
+	nbuf_Schema hschema;
+	nbuf_MsgDef mdef;
+	struct nbuf_obj o, d;
+	size_t i;
+	const char *s;
+
+	TEST_CASE("layout");
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, schema, 0));
+	nbuf_init_ex(&buf, 0);
+	TEST_ASSERT(nbuf_parse(&paopt, &o, test_input, sizeof test_input - 1,
+		mdef));
+	nbuf_init_ex(&outbuf, 0);
+	TEST_ASSERT(nbuf_dedup(&dopt, &d, &o));
+	TEST_CHECK(!nbuf_is_canonical(&d, mdef));
+	check_canonical(&c[0], &o, mdef);
+	check_canonical(&c[1], &d, mdef);
+	TEST_CHECK(c[0].len == c[1].len &&
+		memcmp(c[0].base, c[1].base, c[0].len) == 0);
+	nbuf_clear(&c[0]);
+	nbuf_clear(&c[1]);
+	nbuf_clear(&outbuf);
+
+	TEST_CASE("empty");
+	for (i = 0; i < 2; i++) {
+		nbuf_clear(&buf);
+		nbuf_init_ex(&buf, 0);
+		TEST_ASSERT(nbuf_parse(&paopt, &o, same[i], strlen(same[i]),
+			mdef));
+		TEST_CHECK(nbuf_is_canonical(&o, mdef) == (i == 0));
+		nbuf_init_ex(&c[i], 0);
+		TEST_ASSERT(nbuf_canonicalize(&c[i], &d, &o, mdef));
+	}
+	TEST_CHECK(c[0].len == c[1].len &&
+		memcmp(c[0].base, c[1].base, c[0].len) == 0);
+	nbuf_clear(&c[0]);
+	nbuf_clear(&c[1]);
+
+	TEST_CASE("hashed");
+	nbuf_init_ex(&pbuf, 0);
+	ss = nbuf_compile_str(&popt, htext, sizeof htext - 1, "<string>");
+	TEST_ASSERT(ss != NULL);
+	TEST_ASSERT(nbuf_get_Schema(&hschema, &ss->buf, 0));
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, hschema, 1));
+	nbuf_clear(&buf);
+	nbuf_init_ex(&buf, 0);
+	s = "e { name: \"b\" v: 1 } e { name: \"a\" } e { name: \"c\" v: -1 } "
+		"s: \"x\" s: \"\" s: \"y\"";
+	TEST_ASSERT(nbuf_parse(&paopt, &o, s, strlen(s), mdef));
+	check_canonical(&c[0], &o, mdef);
+	nbuf_clear(&c[0]);
+	nbuf_free_compiled(&popt);
+	nbuf_clear(&buf);
+}
+
+void test_packed(void)
+{
+	static const int32_t in[] = {
+		0, 1, -1, 63, -64, 100000, -2147483647 - 1, 2147483647,
+	};
+	int32_t out[sizeof in / sizeof in[0]];
+	uint16_t ids[1000], ids_out[1000];
+	struct nbuf_buf buf;
+	struct nbuf_obj o = {&buf};
+	size_t i, len;
+
+	nbuf_init_ex(&buf, 0);
+	TEST_CASE("signed");
+	len = nbuf_alloc_packed(&o, in, 8, sizeof in[0], NBUF_PACK_SIGNED);
+	TEST_ASSERT(len > 0);
+	TEST_CHECK(nbuf_packed_size(&o, len) == 8);
+	TEST_CHECK(nbuf_unpack(out, 8, sizeof out[0], NBUF_PACK_SIGNED, &o, len) == 8);
+	TEST_CHECK(memcmp(in, out, sizeof in) == 0);
+	/* 0, 1, -1, 63 and -64 take one byte each */
+	TEST_CHECK(len == 1 + 5 + 3 + 5 + 5);
+
+	TEST_CASE("delta");
+	for (i = 0; i < 1000; i++)
+		ids[i] = 60000 + i * 3;
+	len = nbuf_alloc_packed(&o, ids, 1000, sizeof ids[0], NBUF_PACK_DELTA);
+	TEST_ASSERT(len > 0);
+	TEST_CHECK(len == 2 + 3 + 999);
+	TEST_CHECK(nbuf_unpack(ids_out, 1000, sizeof ids_out[0], NBUF_PACK_DELTA, &o, len) == 1000);
+	TEST_CHECK(memcmp(ids, ids_out, sizeof ids) == 0);
+
+	TEST_CASE("short output");
+	memset(ids_out, 0, sizeof ids_out);
+	TEST_CHECK(nbuf_unpack(ids_out, 10, sizeof ids_out[0], NBUF_PACK_DELTA, &o, len) == 10);
+	TEST_CHECK(memcmp(ids, ids_out, 10 * sizeof ids[0]) == 0 && ids_out[10] == 0);
+
+	TEST_CASE("truncated");
+	TEST_CHECK(nbuf_packed_size(&o, 500) == 0);
+	TEST_CHECK(nbuf_unpack(ids_out, 1000, sizeof ids_out[0], NBUF_PACK_DELTA, &o, 500) == 0);
+	nbuf_clear(&buf);
+}
+
+void test_intern(void)
+{
+	struct nbuf_buf buf;
+	struct nbuf_intern intern;
+	struct nbuf_obj o = {&buf};
+	char name[16];
+	size_t i, a, b, len;
+
+	nbuf_init_ex(&buf, 0);
+	nbuf_intern_init(&intern);
+	buf.intern = &intern;
+	TEST_CASE("shared");
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-1", -1) != NULL);
+	a = o.offset;
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-2", -1) != NULL);
+	b = o.offset;
+	len = buf.len;
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-1", 6) != NULL);
+	TEST_CHECK(o.offset == a && buf.len == len);
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-2", -1) != NULL);
+	TEST_CHECK(o.offset == b && buf.len == len);
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-", 5) != NULL);
+	TEST_CHECK(o.offset != a && buf.len > len);
+
+	TEST_CASE("no contents");
+	TEST_ASSERT(nbuf_alloc_str(&o, NULL, 6) != NULL);
+	TEST_CHECK(o.offset != a);
+
+	TEST_CASE("growth");
+	for (i = 0; i < 1000; i++) {
+		snprintf(name, sizeof name, "%u", (unsigned) i);
+		TEST_ASSERT(nbuf_alloc_str(&o, name, -1) != NULL);
+	}
+	len = buf.len;
+	for (i = 0; i < 1000; i++) {
+		snprintf(name, sizeof name, "%u", (unsigned) i);
+		TEST_ASSERT(nbuf_alloc_str(&o, name, -1) != NULL);
+	}
+	TEST_CHECK(buf.len == len);
+	TEST_CHECK(intern.n == 1003);
+
+	TEST_CASE("reused buffer");
+	buf.len = 0;
+	nbuf_intern_reset(&intern);
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-2", -1) != NULL);
+	TEST_CHECK(o.offset < b);
+	/* a stale table still finds only equal strings */
+	buf.len = 0;
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-3", -1) != NULL);
+	TEST_ASSERT(nbuf_alloc_str(&o, "host-2", -1) != NULL);
+	TEST_CHECK(strcmp(buf.base + o.offset, "host-2") == 0);
+
+	nbuf_intern_free(&intern);
+	nbuf_clear(&buf);
+}
+
+void test_keyed(void)
+{
+	static const char text[] =
+		"message E { int32 id; string name; }"
+		"message T { E[id] by_id; E[name] by_name; hashed E[name] by_hash; }";
+	static const char input[] =
+		"by_id { id: 3 name: \"c\" } by_id { id: -1 name: \"a\" }"
+		"by_id { id: 2 name: \"b\" } by_id { id: 3 name: \"d\" }"
+		"by_name { name: \"y\" } by_name { name: \"x\" }"
+		"by_name { name: \"xy\" }"
+		"by_hash { name: \"x\" } by_hash { name: \"y\" } by_hash { name: \"z\" }";
+	static const char *const ids_order = "abcd";
+	static const char *const names_order[] = { "x", "xy", "y" };
+	static const int missing[] = { -2, 0, 1, 4, 2147483647 };
+	struct nbuf_buf buf, parsebuf;
+	struct nbuf_compile_opt opt = {
+		.outbuf = &buf,
+	};
+	struct nbuf_parse_opt paopt = {
+		.outbuf = &parsebuf,
+		.filename = "<test input>",
+	};
+	struct nbuf_schema_set *ss;
+	nbuf_Schema kschema;
+	nbuf_MsgDef mdef;
+	nbuf_FieldDef fdef;
+	struct nbuf_key id_key, name_key;
+	struct nbuf_obj o, arr, it, idx;
+	size_t i, n, m, len;
+	const char *s;
+
+	nbuf_init_ex(&buf, 0);
+	nbuf_init_ex(&parsebuf, 0);
+	ss = nbuf_compile_str(&opt, text, sizeof text - 1, "<string>");
+	TEST_ASSERT(ss != NULL);
+	TEST_ASSERT(nbuf_get_Schema(&kschema, &ss->buf, 0));
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, kschema, 1));
+	TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "by_id", -1));
+	TEST_ASSERT(nbuf_lookup_key(&id_key, fdef));
+	TEST_CHECK(id_key.offset == 0 && id_key.width == 4 &&
+		id_key.flags == NBUF_KEY_SIGNED);
+	TEST_ASSERT(nbuf_lookup_field(&fdef, mdef, "by_name", -1));
+	TEST_ASSERT(nbuf_lookup_key(&name_key, fdef));
+	TEST_CHECK(name_key.offset == 0 && name_key.flags == NBUF_KEY_STRING);
+	TEST_ASSERT(nbuf_parse(&paopt, &o, input, sizeof input - 1, mdef));
+
+	TEST_CASE("sorted by parser");
+	n = nbuf_obj_p(&arr, &o, 0);
+	TEST_ASSERT(n == 4);
+	for (i = 0, it = arr; i < n; i++, nbuf_next(&it)) {
+		struct nbuf_obj str;
+
+		s = nbuf_obj2str(&str, nbuf_obj_p(&str, &it, 0), &len);
+		TEST_CHECK_(len == 1 && s[0] == ids_order[i], "element %u", (unsigned) i);
+	}
+	n = nbuf_obj_p(&arr, &o, 1);
+	TEST_ASSERT(n == 3);
+	for (i = 0; i < n; i++) {
+		s = nbuf_key_str_at(&arr, i, 0, &len);
+		check_str_leq(s, len, names_order[i], strlen(names_order[i]));
+	}
+
+	TEST_CASE("find");
+	n = nbuf_obj_p(&arr, &o, 0);
+	it = arr;
+	TEST_CHECK(nbuf_find_key(&it, n, 0, 4, NBUF_KEY_SIGNED, (uint64_t) -1) &&
+		nbuf_obj_ptrdiff(&it, &arr) == 0);
+	it = arr;
+	TEST_CHECK(nbuf_find_key(&it, n, 0, 4, NBUF_KEY_SIGNED, 3) &&
+		nbuf_obj_ptrdiff(&it, &arr) == 2);
+	for (i = 0; i < sizeof missing / sizeof missing[0]; i++) {
+		it = arr;
+		TEST_CHECK_(!nbuf_find_key(&it, n, 0, 4, NBUF_KEY_SIGNED,
+			(uint64_t) missing[i]), "%d is missing", missing[i]);
+	}
+	n = nbuf_obj_p(&arr, &o, 1);
+	it = arr;
+	TEST_CHECK(nbuf_find_str_key(&it, n, 0, "xy", 2) &&
+		nbuf_obj_ptrdiff(&it, &arr) == 1);
+	it = arr;
+	TEST_CHECK(!nbuf_find_str_key(&it, n, 0, "xyz", 3));
+	TEST_CHECK(!nbuf_find_str_key(&it, 0, 0, "x", 1));
+
+	TEST_CASE("hash index");
+	n = nbuf_obj_p(&arr, &o, 2);
+	TEST_ASSERT(n == 3);
+	m = nbuf_obj_p(&idx, &o, 3);
+	TEST_CHECK(m == 8);
+	it = arr;
+	TEST_CHECK(nbuf_find_hashed(&it, n, 0, &idx, m, "y", 1) &&
+		nbuf_obj_ptrdiff(&it, &arr) == 1);
+	it = arr;
+	TEST_CHECK(!nbuf_find_hashed(&it, n, 0, &idx, m, "xy", 2));
+	/* without an index, the lookup scans the array */
+	it = arr;
+	TEST_CHECK(nbuf_find_hashed(&it, n, 0, &idx, 0, "z", 1) &&
+		nbuf_obj_ptrdiff(&it, &arr) == 2);
+
+	nbuf_clear(&parsebuf);
+	nbuf_free_compiled(&opt);
+}
+
+void test_zfile(void)
+{
+	struct nbuf_buf buf;
+#if HAVE_ZSTD
+	struct nbuf_buf out, dict, samples[200];
+	char line[100];
+	long plain_size;
+#endif
+	struct nbuf_zopt zopt = {
+		.block_size = 100,
+	};
+	FILE *f = tmpfile();
+	size_t i;
+
+	TEST_ASSERT(f != NULL);
+	nbuf_init_ex(&buf, 0);
+	for (i = 0; i < 1000; i++)
+		TEST_ASSERT(nbuf_add1(&buf, i % 7) != NULL);
+#if HAVE_ZSTD
+	TEST_CASE("save");
+	TEST_CHECK(nbuf_save_zfp(&zopt, &buf, f) == 1000);
+
+	TEST_CASE("load");
+	rewind(f);
+	TEST_CHECK(nbuf_load_zfp(&zopt, &out, f) == 1000);
+	TEST_CHECK(memcmp(out.base, buf.base, 1000) == 0);
+	nbuf_clear(&out);
+
+	TEST_CASE("load range");
+	rewind(f);
+	TEST_CHECK(nbuf_load_zrange(&zopt, &out, f, 250, 300) == 300);
+	TEST_CHECK(memcmp(out.base, buf.base + 250, 300) == 0);
+	nbuf_clear(&out);
+
+	TEST_CASE("load range past end");
+	rewind(f);
+	TEST_CHECK(nbuf_load_zrange(&zopt, &out, f, 950, 100) == 50);
+	TEST_CHECK(memcmp(out.base, buf.base + 950, 50) == 0);
+	nbuf_clear(&out);
+
+	TEST_CASE("not compressed");
+	rewind(f);
+	fputs("not a compressed file", f);
+	rewind(f);
+	TEST_CHECK(nbuf_load_zfp(&zopt, &out, f) == 0);
+
+	TEST_CASE("dictionary");
+	nbuf_clear(&buf);
+	nbuf_init_ex(&buf, 0);
+	for (i = 0; i < sizeof samples / sizeof samples[0]; i++) {
+		snprintf(line, sizeof line, "host: \"web%02u.example.com\" "
+			"path: \"/api/v1/items/%u\" status: %u\n",
+			(unsigned) (i % 17), (unsigned) (i * 7919 % 1000),
+			i % 5 ? 200u : 404u);
+		nbuf_init_ex(&samples[i], 0);
+		TEST_ASSERT(nbuf_add(&samples[i], line, strlen(line)) != NULL);
+		TEST_ASSERT(nbuf_add(&buf, line, strlen(line)) != NULL);
+	}
+	TEST_ASSERT(nbuf_train_zdict(&dict, 1024, samples, i) > 0);
+	for (i = 0; i < sizeof samples / sizeof samples[0]; i++)
+		nbuf_clear(&samples[i]);
+	fclose(f);
+	TEST_ASSERT((f = tmpfile()) != NULL);
+	TEST_CHECK(nbuf_save_zfp(&zopt, &buf, f) == buf.len);
+	plain_size = ftell(f);
+	fclose(f);
+	TEST_ASSERT((f = tmpfile()) != NULL);
+	zopt.dict = dict.base;
+	zopt.dict_len = dict.len;
+	TEST_CHECK(nbuf_save_zfp(&zopt, &buf, f) == buf.len);
+	TEST_CHECK_(ftell(f) < plain_size, "%ld bytes with dictionary, %ld without",
+		ftell(f), plain_size);
+	rewind(f);
+	TEST_CHECK(nbuf_load_zfp(&zopt, &out, f) == buf.len);
+	TEST_CHECK(out.len == buf.len && memcmp(out.base, buf.base, buf.len) == 0);
+	nbuf_clear(&out);
+	rewind(f);
+	TEST_CHECK(nbuf_load_zrange(&zopt, &out, f, 1000, 300) == 300);
+	TEST_CHECK(memcmp(out.base, buf.base + 1000, 300) == 0);
+	nbuf_clear(&out);
+	/* the same dictionary is needed to load */
+	rewind(f);
+	zopt.dict_len = 0;
+	TEST_CHECK(nbuf_load_zfp(&zopt, &out, f) == 0);
+	nbuf_clear(&dict);
+#else
+	TEST_CHECK(nbuf_save_zfp(&zopt, &buf, f) == 0);
+#endif
+	nbuf_clear(&buf);
+	fclose(f);
+}
+
 void test_depth_limit(void)
 {
 	struct nbuf_buf parsebuf;
@@ -232,10 +1257,256 @@ void test_depth_limit(void)
 	nbuf_clear(&parsebuf);
 }
 
+static void write_file(const char *filename, const char *content)
+{
+	FILE *f = fopen(filename, "wb");
+
+	TEST_ASSERT(f != NULL);
+	TEST_ASSERT(fputs(content, f) >= 0);
+	fclose(f);
+}
+
+void test_load_schema(void)
+{
+	static const char *const search_path[] = { NULL };
+	struct nbuf_buf buf, loaded;
+	struct nbuf_compile_opt opt = {
+		.outbuf = &buf,
+		.search_path = search_path,
+	};
+	struct nbuf_compile_opt lopt = {
+		.outbuf = &loaded,
+		.search_path = search_path,
+	};
+	struct nbuf_schema_set *ss, *lss;
+	struct nbuf_buf parsebuf;
+	struct nbuf_parse_opt paopt = {
+		.outbuf = &parsebuf,
+		.filename = "<test input>",
+	};
+	nbuf_Schema lschema;
+	nbuf_MsgDef mdef;
+	struct nbuf_obj o;
+
+	write_file("test_imp.nbuf", "package imp; message Point { int32 x; }");
+	write_file("test_main.nbuf", "import \"test_imp.nbuf\";"
+		"message Line { imp.Point a; imp.Point b; }");
+	nbuf_init_ex(&buf, 0);
+	nbuf_init_ex(&loaded, 0);
+	TEST_ASSERT((ss = nbuf_compile(&opt, "test_main.nbuf")) != NULL);
+	TEST_ASSERT(ss->nimports == 1);
+	TEST_ASSERT(nbuf_save_file(&ss->buf, "test_main.nb"));
+	TEST_ASSERT(nbuf_save_file(&ss->imports[0]->buf, "test_imp.nb"));
+
+	TEST_CASE("load");
+	lss = nbuf_load_schema_set(&lopt, "test_main.nb");
+	TEST_ASSERT(lss != NULL);
+	TEST_CHECK(lss->buf.len == ss->buf.len &&
+		memcmp(lss->buf.base, ss->buf.base, ss->buf.len) == 0);
+	TEST_ASSERT(lss->nimports == 1);
+	TEST_CHECK(lss->imports[0]->buf.len == ss->imports[0]->buf.len);
+
+	TEST_CASE("imported type");
+	TEST_ASSERT(nbuf_get_Schema(&lschema, &lss->buf, 0));
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, lschema, 0));
+	nbuf_init_ex(&parsebuf, 0);
+	TEST_CHECK(nbuf_parse(&paopt, &o, "a { x: 1 } b { x: 2 }", 21, mdef));
+	TEST_CHECK(!nbuf_parse(&paopt, &o, "a { y: 1 }", 10, mdef));
+	nbuf_clear(&parsebuf);
+
+	TEST_CASE("cached");
+	TEST_CHECK(nbuf_load_schema_set(&lopt, "test_main.nb") == lss);
+	TEST_CHECK(nbuf_load_schema_set(&lopt, "test_imp.nb") == lss->imports[0]);
+
+	TEST_CASE("missing import");
+	nbuf_free_compiled(&lopt);
+	remove("test_imp.nb");
+	TEST_CHECK(nbuf_load_schema_set(&lopt, "test_main.nb") == NULL);
+	TEST_CHECK(loaded.len == 0);
+
+	TEST_CASE("not a schema");
+	TEST_CHECK(nbuf_load_schema_set(&lopt, "test_main.nbuf") == NULL);
+
+	nbuf_free_compiled(&lopt);
+	nbuf_free_compiled(&opt);
+	remove("test_main.nb");
+	remove("test_main.nbuf");
+	remove("test_imp.nbuf");
+}
+
+#if HAVE_UNISTD_H && !defined _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Gets the path of the only cache entry in dir. */
+static bool get_cache_entry(char *path, size_t size, const char *dir)
+{
+	struct dirent *e;
+	DIR *d = opendir(dir);
+	int n = 0;
+
+	if (!d)
+		return false;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		if ((size_t) snprintf(path, size, "%s/%s", dir, e->d_name) >=
+			size)
+			n = -1;
+		else if (n >= 0)
+			n++;
+	}
+	closedir(d);
+	return n == 1;
+}
+
+void test_compile_cache(void)
+{
+	static const char *const search_path[] = { NULL };
+	static const char text[] = "message T { int32 x; }";
+	struct nbuf_buf buf;
+	struct nbuf_compile_opt opt = {
+		.outbuf = &buf,
+		.search_path = search_path,
+	};
+	struct nbuf_schema_set *ss;
+	nbuf_Schema cschema;
+	nbuf_MsgDef mdef;
+	char entry[256];
+
+	nbuf_init_ex(&buf, 0);
+	write_file("test_imp.nbuf", "message P { int32 x; }");
+	write_file("test_main.nbuf", "import \"test_imp.nbuf\";"
+		"import \"./test_imp.nbuf\"; message T { P a; }");
+
+	TEST_CASE("same file by another path");
+	TEST_ASSERT((ss = nbuf_compile(&opt, "test_main.nbuf")) != NULL);
+	TEST_CHECK(ss->nimports == 2 && ss->imports[0] == ss->imports[1]);
+	nbuf_free_compiled(&opt);
+
+	TEST_CASE("miss");
+	TEST_ASSERT(mkdir("test_cache", 0777) == 0);
+	opt.cache_dir = "test_cache";
+	write_file("test_main.nbuf", text);
+	TEST_ASSERT(nbuf_compile(&opt, "test_main.nbuf") != NULL);
+	nbuf_free_compiled(&opt);
+	TEST_ASSERT(get_cache_entry(entry, sizeof entry, "test_cache"));
+
+	TEST_CASE("hit");
+	/* replace the entry, to tell that it is used */
+	opt.cache_dir = NULL;
+	write_file("test_main.nbuf", "message T { int32 x; int32 y; }");
+	TEST_ASSERT((ss = nbuf_compile(&opt, "test_main.nbuf")) != NULL);
+	TEST_ASSERT(nbuf_save_file(&ss->buf, entry));
+	nbuf_free_compiled(&opt);
+	opt.cache_dir = "test_cache";
+	write_file("test_main.nbuf", text);
+	TEST_ASSERT((ss = nbuf_compile(&opt, "test_main.nbuf")) != NULL);
+	TEST_ASSERT(nbuf_get_Schema(&cschema, &ss->buf, 0));
+	TEST_ASSERT(nbuf_Schema_messages(&mdef, cschema, 0));
+	TEST_CHECK(nbuf_MsgDef_fields_size(mdef) == 2);
+	nbuf_free_compiled(&opt);
+
+	remove(entry);
+	rmdir("test_cache");
+	remove("test_main.nbuf");
+	remove("test_imp.nbuf");
+}
+#endif
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+
+/* Threads parse and print with one shared schema, each with its own output
+ * buffer and scratch.  Build with -fsanitize=thread to check for races.
+ */
+#define NTHREADS 8
+
+struct parse_print_thread {
+	pthread_t thread;
+	bool ok;
+	struct nbuf_buf textbuf;
+};
+
+static void *parse_print_thread(void *arg)
+{
+	struct parse_print_thread *t = (struct parse_print_thread *) arg;
+	struct nbuf_scratch scratch;
+	struct nbuf_buf parsebuf;
+	struct nbuf_parse_opt paopt = {
+		.outbuf = &parsebuf,
+		.filename = "<test input>",
+		.scratch = &scratch,
+	};
+	struct nbuf_print_opt propt = {
+		.f = tmpfile(),
+		.indent = -1,
+		.msg_type_hdr = true,
+		.scratch = &scratch,
+	};
+	nbuf_MsgDef mdef;
+	struct nbuf_obj o;
+	int i;
+
+	nbuf_scratch_init(&scratch);
+	t->ok = propt.f && nbuf_Schema_messages(&mdef, schema, 0);
+	for (i = 0; t->ok && i < 100; i++) {
+		nbuf_init_ex(&parsebuf, 0);
+		rewind(propt.f);
+		t->ok = nbuf_parse(&paopt, &o, test_input, sizeof test_input - 1, mdef) &&
+			nbuf_print(&propt, &o, mdef);
+		nbuf_clear(&parsebuf);
+	}
+	if (t->ok) {
+		rewind(propt.f);
+		t->ok = nbuf_load_fp(&t->textbuf, propt.f) != 0;
+	}
+	if (propt.f)
+		fclose(propt.f);
+	nbuf_scratch_clear(&scratch);
+	return NULL;
+}
+
+void test_threads(void)
+{
+	struct parse_print_thread threads[NTHREADS];
+	int i;
+
+	for (i = 0; i < NTHREADS; i++)
+		TEST_ASSERT(pthread_create(&threads[i].thread, NULL,
+			parse_print_thread, &threads[i]) == 0);
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (TEST_CHECK_(threads[i].ok, "thread %d succeeds", i)) {
+			check_str_leq(threads[i].textbuf.base, threads[i].textbuf.len,
+				test_output, sizeof test_output - 1);
+			nbuf_clear(&threads[i].textbuf);
+		}
+	}
+}
+#endif
+
 TEST_LIST = {
 	{"bad_compile", test_bad_compile},
 	{"parse_print", test_parse_print},
 	{"bad_parse", test_bad_parse},
+	{"dedup", test_dedup},
+	{"edit", test_edit},
+	{"merge", test_merge},
+	{"diff", test_diff},
+	{"hash", test_hash},
+	{"canonical", test_canonical},
+	{"packed", test_packed},
+	{"intern", test_intern},
+	{"keyed", test_keyed},
+	{"zfile", test_zfile},
 	{"depth_limit", test_depth_limit},
+	{"load_schema", test_load_schema},
+#if HAVE_UNISTD_H && !defined _WIN32
+	{"compile_cache", test_compile_cache},
+#endif
+#if HAVE_PTHREAD_H
+	{"threads", test_threads},
+#endif
 	{NULL, NULL},
 };
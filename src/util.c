@@ -88,6 +88,7 @@ size_t nbuf_load_fd(struct nbuf_buf *buf, int fd)
 	buf->len = 0;
 	buf->cap = 0;
 	buf->realloc = NULL;
+	buf->intern = NULL;
 #if !defined __SANITIZE_ADDRESS__ && (HAVE_MMAP || defined _WIN32)
 	/* Will not ues mmap if using sanitizers,
 	 * so memory leak will be detected.
@@ -198,6 +199,51 @@ size_t nbuf_save_file(struct nbuf_buf *buf, const char *filename)
 	return rc;
 }
 
+struct nbuf_scratch_buf {
+	struct nbuf_buf buf;
+	struct nbuf_scratch_buf *next;
+};
+
+void nbuf_scratch_clear(struct nbuf_scratch *scratch)
+{
+	struct nbuf_scratch_buf *p, *next;
+
+	for (p = scratch->free; p; p = next) {
+		next = p->next;
+		nbuf_clear(&p->buf);
+		free(p);
+	}
+	scratch->free = NULL;
+}
+
+struct nbuf_buf *nbuf_scratch_get(struct nbuf_scratch *scratch)
+{
+	struct nbuf_scratch_buf *p = scratch->free;
+
+	if (p) {
+		scratch->free = p->next;
+		return &p->buf;
+	}
+	if (!(p = (struct nbuf_scratch_buf *) malloc(sizeof *p))) {
+		fprintf(stderr, "nbuf: malloc() failed\n");
+		return NULL;
+	}
+	nbuf_init_ex(&p->buf, 0);
+	return &p->buf;
+}
+
+void nbuf_scratch_put(struct nbuf_scratch *scratch, struct nbuf_buf *buf)
+{
+	struct nbuf_scratch_buf *p = (struct nbuf_scratch_buf *) buf;
+
+	/* memory beyond len is already zero */
+	if (buf->len)
+		memset(buf->base, 0, buf->len);
+	buf->len = 0;
+	p->next = scratch->free;
+	scratch->free = p;
+}
+
 size_t nbuf_unescape(struct nbuf_buf *buf, const char *s, size_t len)
 {
 	size_t oldlen = buf->len;
@@ -0,0 +1,274 @@
+#include "config.h"
+#include "libnbuf.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if HAVE_ZSTD
+# include <zdict.h>
+# include <zstd.h>
+#endif
+
+/* Compressed file layout.  All words are little-endian uint32.
+ *
+ *   "NBZ1" block_size dict_id
+ *   { raw_len comp_len data[comp_len] }
+ *
+ * Each block is a zstd frame of raw_len uncompressed bytes.  Every block but
+ * the last has raw_len == block_size, so the block holding any offset can be
+ * found by skipping over the blocks before it.
+ * dict_id is the zstd dictionary ID, or 0 if no dictionary is used.
+ */
+
+#define ZFILE_MAGIC "NBZ1"
+#define ZFILE_HDR_SIZE 12
+#define ZBLOCK_HDR_SIZE 8
+#define DEFAULT_BLOCK_SIZE (64 * 1024)
+
+bool nbuf_is_zfile(const void *p, size_t len)
+{
+	return len >= ZFILE_HDR_SIZE && memcmp(p, ZFILE_MAGIC, 4) == 0;
+}
+
+#if HAVE_ZSTD
+
+static unsigned
+get_dict_id(const struct nbuf_zopt *opt)
+{
+	if (!opt || !opt->dict_len)
+		return 0;
+	return ZDICT_getDictID(opt->dict, opt->dict_len);
+}
+
+size_t nbuf_save_zfp(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f)
+{
+	static const struct nbuf_zopt default_opt;
+	unsigned char hdr[ZFILE_HDR_SIZE];
+	struct nbuf_buf out;
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	ZSTD_CDict *cdict = NULL;
+	size_t block_size, off, rc = 0;
+
+	if (!opt)
+		opt = &default_opt;
+	block_size = opt->block_size ? opt->block_size : DEFAULT_BLOCK_SIZE;
+	nbuf_init_ex(&out, 0);
+	if (!cctx || (nbuf_word_t) block_size != block_size)
+		goto err;
+	if (!nbuf_alloc(&out, ZBLOCK_HDR_SIZE + ZSTD_compressBound(block_size)))
+		goto err;
+	if (opt->dict_len && !(cdict = ZSTD_createCDict(opt->dict,
+			opt->dict_len, opt->level)))
+		goto err;
+	memcpy(hdr, ZFILE_MAGIC, 4);
+	nbuf_set_u32(hdr + 4, block_size);
+	nbuf_set_u32(hdr + 8, get_dict_id(opt));
+	if (fwrite(hdr, 1, sizeof hdr, f) != sizeof hdr)
+		goto io_err;
+	for (off = 0; off < buf->len; off += block_size) {
+		size_t raw_len = buf->len - off;
+		char *data = out.base + ZBLOCK_HDR_SIZE;
+		size_t cap = out.len - ZBLOCK_HDR_SIZE;
+		size_t comp_len;
+
+		if (raw_len > block_size)
+			raw_len = block_size;
+		comp_len = cdict ?
+			ZSTD_compress_usingCDict(cctx, data, cap,
+				buf->base + off, raw_len, cdict) :
+			ZSTD_compressCCtx(cctx, data, cap,
+				buf->base + off, raw_len, opt->level);
+		if (ZSTD_isError(comp_len)) {
+			fprintf(stderr, "nbuf: %s\n", ZSTD_getErrorName(comp_len));
+			goto err;
+		}
+		nbuf_set_u32(out.base, raw_len);
+		nbuf_set_u32(out.base + 4, comp_len);
+		comp_len += ZBLOCK_HDR_SIZE;
+		if (fwrite(out.base, 1, comp_len, f) != comp_len)
+			goto io_err;
+	}
+	rc = buf->len;
+	goto err;
+io_err:
+	perror("fwrite");
+err:
+	ZSTD_freeCDict(cdict);
+	ZSTD_freeCCtx(cctx);
+	nbuf_clear(&out);
+	return rc;
+}
+
+/* Decompresses the blocks covering [offset, end) into buf. */
+static size_t
+load_blocks(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f,
+	size_t offset, size_t end)
+{
+	unsigned char hdr[ZFILE_HDR_SIZE];
+	struct nbuf_buf in;
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	ZSTD_DDict *ddict = NULL;
+	size_t block_size, pos = 0;
+
+	nbuf_init_ex(buf, 0);
+	nbuf_init_ex(&in, 0);
+	if (!dctx)
+		goto err;
+	if (fread(hdr, 1, sizeof hdr, f) != sizeof hdr ||
+		!nbuf_is_zfile(hdr, sizeof hdr)) {
+		fprintf(stderr, "nbuf: not a compressed file\n");
+		goto err;
+	}
+	block_size = nbuf_u32(hdr + 4);
+	if (nbuf_u32(hdr + 8) != get_dict_id(opt)) {
+		fprintf(stderr, "nbuf: compression dictionary mismatch\n");
+		goto err;
+	}
+	if (nbuf_u32(hdr + 8) && !(ddict = ZSTD_createDDict(opt->dict,
+			opt->dict_len)))
+		goto err;
+	while (pos < end) {
+		unsigned char bhdr[ZBLOCK_HDR_SIZE];
+		size_t raw_len, comp_len, n;
+		char *p;
+
+		n = fread(bhdr, 1, sizeof bhdr, f);
+		if (n == 0 && feof(f))
+			break;
+		if (n != sizeof bhdr)
+			goto corrupt;
+		raw_len = nbuf_u32(bhdr);
+		comp_len = nbuf_u32(bhdr + 4);
+		if (raw_len == 0 || raw_len > block_size)
+			goto corrupt;
+		if (pos + raw_len <= offset) {
+			/* before the range: skip without decompressing */
+			if (fseek(f, comp_len, SEEK_CUR) != 0) {
+				perror("fseek");
+				goto err;
+			}
+			pos += raw_len;
+			continue;
+		}
+		in.len = 0;
+		if (!nbuf_alloc(&in, comp_len) || !(p = nbuf_alloc(buf, raw_len)))
+			goto err;
+		if (fread(in.base, 1, comp_len, f) != comp_len)
+			goto corrupt;
+		n = ddict ?
+			ZSTD_decompress_usingDDict(dctx, p, raw_len,
+				in.base, comp_len, ddict) :
+			ZSTD_decompressDCtx(dctx, p, raw_len, in.base, comp_len);
+		if (ZSTD_isError(n) || n != raw_len)
+			goto corrupt;
+		if (pos < offset) {
+			/* first block: drop the bytes before the range */
+			n = offset - pos;
+			memmove(buf->base, buf->base + n, buf->len - n);
+			memset(buf->base + buf->len - n, 0, n);
+			buf->len -= n;
+		}
+		pos += raw_len;
+	}
+	if (pos > end) {
+		memset(buf->base + buf->len - (pos - end), 0, pos - end);
+		buf->len -= pos - end;
+	}
+	nbuf_clear(&in);
+	ZSTD_freeDDict(ddict);
+	ZSTD_freeDCtx(dctx);
+	return buf->len;
+corrupt:
+	fprintf(stderr, "nbuf: compressed file is corrupt or truncated\n");
+err:
+	nbuf_clear(&in);
+	nbuf_clear(buf);
+	ZSTD_freeDDict(ddict);
+	ZSTD_freeDCtx(dctx);
+	return 0;
+}
+
+size_t nbuf_load_zfp(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f)
+{
+	return load_blocks(opt, buf, f, 0, SIZE_MAX);
+}
+
+size_t nbuf_load_zrange(const struct nbuf_zopt *opt, struct nbuf_buf *buf,
+	FILE *f, size_t offset, size_t len)
+{
+	return load_blocks(opt, buf, f, offset,
+		(len > SIZE_MAX - offset) ? SIZE_MAX : offset + len);
+}
+
+size_t nbuf_train_zdict(struct nbuf_buf *dict, size_t dict_cap,
+	const struct nbuf_buf *samples, size_t nsamples)
+{
+	struct nbuf_buf all;
+	size_t *sizes = (size_t *) malloc(nsamples * sizeof *sizes);
+	size_t i, n;
+
+	nbuf_init_ex(dict, 0);
+	nbuf_init_ex(&all, 0);
+	if (!sizes || !nbuf_alloc(dict, dict_cap))
+		goto err;
+	for (i = 0; i < nsamples; i++) {
+		if (samples[i].len &&
+			!nbuf_add(&all, samples[i].base, samples[i].len))
+			goto err;
+		sizes[i] = samples[i].len;
+	}
+	n = ZDICT_trainFromBuffer(dict->base, dict_cap, all.base, sizes,
+		(unsigned) nsamples);
+	if (ZDICT_isError(n)) {
+		fprintf(stderr, "nbuf: cannot train dictionary: %s\n",
+			ZDICT_getErrorName(n));
+		goto err;
+	}
+	dict->len = n;
+	free(sizes);
+	nbuf_clear(&all);
+	return n;
+err:
+	free(sizes);
+	nbuf_clear(&all);
+	nbuf_clear(dict);
+	return 0;
+}
+
+#else  /* !HAVE_ZSTD */
+
+static size_t
+unsupported(void)
+{
+	fprintf(stderr, "nbuf: compressed files are not supported "
+		"(built without zstd)\n");
+	return 0;
+}
+
+size_t nbuf_save_zfp(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f)
+{
+	return unsupported();
+}
+
+size_t nbuf_load_zfp(const struct nbuf_zopt *opt, struct nbuf_buf *buf, FILE *f)
+{
+	nbuf_init_ex(buf, 0);
+	return unsupported();
+}
+
+size_t nbuf_load_zrange(const struct nbuf_zopt *opt, struct nbuf_buf *buf,
+	FILE *f, size_t offset, size_t len)
+{
+	nbuf_init_ex(buf, 0);
+	return unsupported();
+}
+
+size_t nbuf_train_zdict(struct nbuf_buf *dict, size_t dict_cap,
+	const struct nbuf_buf *samples, size_t nsamples)
+{
+	nbuf_init_ex(dict, 0);
+	return unsupported();
+}
+
+#endif  /* HAVE_ZSTD */
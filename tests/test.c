@@ -2,8 +2,8 @@
 # define _GNU_SOURCE
 #endif
 
-#include "test.nb.h"
 #include "libnbuf.h"
+#include "test.nb.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -93,9 +93,179 @@ static void read_msg(void)
 	nbuf_clear(&buf);
 }
 
+/* Compares the log with a copy; returns 0 on success. */
+static int compare_msg(void)
+{
+	struct nbuf_buf buf, copy;
+	struct nbuf_dedup_opt opt = {
+		.outbuf = &copy,
+	};
+	LogFile a, b;
+	logging_LogEntry entry;
+	int rc = 1;
+
+	nbuf_load_file(&buf, OUTPUT);
+	nbuf_init_ex(&copy, 0);
+	get_LogFile(&a, &buf, 0);
+	if (!nbuf_dedup(&opt, NBUF_OBJ(b), NBUF_OBJ(a)))
+		goto err;
+	if (!equal_LogFile(a, b) ||
+		hash_LogFile(a, 0) != hash_LogFile(b, 0))
+		goto err;
+	LogFile_log_entry(&entry, b, 0);
+	logging_LogEntry_set_severity(entry, logging_LogSeverity_CRITICAL);
+	if (equal_LogFile(a, b) || hash_LogFile(a, 0) == hash_LogFile(b, 0))
+		goto err;
+	rc = 0;
+err:
+	if (rc)
+		fprintf(stderr, "compare_msg failed\n");
+	nbuf_clear(&buf);
+	nbuf_clear(&copy);
+	return rc;
+}
+
+/* Compares Samples differing in one field of each kind, and their copies,
+ * with the generated functions and through reflection; returns 0 on
+ * success.
+ */
+static int generated_equal(void)
+{
+	static const char *const fields[][2] = {
+		{ "a: 1", "a: 2" },
+		{ "b: -2", "b: -3" },
+		{ "c: 0", "c: -0" },
+		{ "d: S", "d: W" },
+		{ "e: true", "e: false" },
+		{ "f: E", "f: N" },
+		{ "g: true g: false g: true", "g: true g: false" },
+		{ "h: 1 h: 2", "h: 1 h: 3" },
+		{ "i: 1 i: 2 i: 3", "i: 1 i: 2" },
+		{ "j: 1 j: 300", "j: 1 j: 301" },
+		{ "k: -5 k: 7", "k: -5 k: 8" },
+		{ "l: \"abc\"", "l: \"abd\"" },
+		{ "m: \"x\" m: \"\"", "m: \"x\"" },
+		{ "n { v: 1 v: 2 v: 3 d: E }", "n { v: 1 v: 2 v: 4 d: E }" },
+		{ "o { v: 1 d: S } o { d: W }", "o { v: 1 d: S } o { d: N }" },
+		{ "p { timestamp { seconds: 1 } message: \"m\" }",
+			"p { message: \"m\" }" },
+		{ "q { a: 5 l: \"y\" q { } }", "q { a: 5 l: \"y\" }" },
+		{ "s: \"u\"", "t { a: 1 }" },
+	};
+	enum { N = sizeof fields / sizeof fields[0] + 1 };
+	struct nbuf_parse_opt popt = { .filename = "<generated_equal>" };
+	struct nbuf_dedup_opt dopt = { 0 };
+	struct nbuf_buf bufs[2][N];
+	Sample msgs[2][N];
+	char text[1024];
+	size_t i, j, k, len;
+	uint64_t seed;
+	int rc = 1, bad = 0;
+
+	for (i = 0; i < N; i++) {
+		nbuf_init_ex(&bufs[0][i], 0);
+		nbuf_init_ex(&bufs[1][i], 0);
+	}
+	/* the first one has all the first values; the others change one */
+	for (i = 0; i < N; i++) {
+		for (j = 0, len = 0; j < N - 1; j++)
+			len += snprintf(text + len, sizeof text - len, "%s ",
+				fields[j][j + 1 == i]);
+		popt.outbuf = &bufs[0][i];
+		dopt.outbuf = &bufs[1][i];
+		if (!nbuf_parse(&popt, NBUF_OBJ(msgs[0][i]), text, len,
+				refl_Sample) ||
+			!nbuf_dedup(&dopt, NBUF_OBJ(msgs[1][i]),
+				NBUF_OBJ(msgs[0][i])))
+			goto err;
+	}
+	for (i = 0; i < N; i++) {
+		for (j = 0; j < N; j++) {
+			for (k = 0; k < 2; k++) {
+				Sample a = msgs[0][i], b = msgs[k][j];
+
+				if (equal_Sample(a, b) != (i == j) ||
+					nbuf_equal(NBUF_OBJ(a), NBUF_OBJ(b),
+						refl_Sample) != (i == j))
+					bad++;
+			}
+		}
+		for (k = 0; k < 2; k++) {
+			for (seed = 0; seed < 2; seed++) {
+				if (hash_Sample(msgs[k][i], seed) != nbuf_hash(
+					NBUF_OBJ(msgs[k][i]), refl_Sample, seed))
+					bad++;
+			}
+		}
+	}
+	if (!bad)
+		rc = 0;
+err:
+	if (rc)
+		fprintf(stderr, "generated_equal failed: %d bad\n", bad);
+	for (i = 0; i < N; i++) {
+		nbuf_clear(&bufs[0][i]);
+		nbuf_clear(&bufs[1][i]);
+	}
+	return rc;
+}
+
+/* Builds repeated fields of unknown length; returns 0 on success. */
+static int append_msg(void)
+{
+	struct nbuf_buf buf;
+	struct nbuf_appender q, m, i;
+	Sample msg, elem;
+	char name[16];
+	const char *s;
+	size_t n;
+	int k, rc = 1;
+
+	nbuf_init_ex(&buf, 0);
+	alloc_Sample(&msg, &buf);
+	Sample_begin_q(&q, msg);
+	Sample_begin_m(&m, msg);
+	Sample_begin_i(&i, msg);
+	for (k = 0; k < 20; k++) {
+		/* the sub-objects of elements come between appends */
+		snprintf(name, sizeof name, "q%d", k);
+		if (!Sample_add_q(&elem, &q) ||
+			!Sample_set_l(elem, name, -1) ||
+			!Sample_add_m(&m, name + 1, -1))
+			goto err;
+		Sample_set_a(elem, k);
+	}
+	for (k = 0; k < 100; k++) {
+		if (!Sample_add_i(&i, k * k))
+			goto err;
+	}
+	if (Sample_end_q(msg, &q) != 20 || Sample_end_m(msg, &m) != 20 ||
+		Sample_end_i(msg, &i) != 100)
+		goto err;
+
+	get_Sample(&msg, &buf, 0);
+	if (Sample_q_size(msg) != 20 || Sample_m_size(msg) != 20 ||
+		Sample_i_size(msg) != 100 || Sample_i(msg, 99) != 99 * 99)
+		goto err;
+	for (k = 0; k < 20; k++) {
+		snprintf(name, sizeof name, "q%d", k);
+		n = Sample_q(&elem, msg, k);
+		s = Sample_l(elem, NULL);
+		if (n != 20 - k || Sample_a(elem) != k || strcmp(s, name) != 0 ||
+			strcmp(Sample_m(msg, k, NULL), name + 1) != 0)
+			goto err;
+	}
+	rc = 0;
+err:
+	if (rc)
+		fprintf(stderr, "append_msg failed\n");
+	nbuf_clear(&buf);
+	return rc;
+}
+
 int main()
 {
 	write_msg();
 	read_msg();
-	return 0;
+	return compare_msg() || generated_equal() || append_msg();
 }
@@ -1,9 +1,15 @@
 #include "test.nb.hpp"
 #include "libnbuf.h"
 
+#include <algorithm>
 #include <iostream>
+#include <numeric>
 #include <sstream>
 #include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include <type_traits>
 
 #include <unistd.h>
 
@@ -68,11 +74,352 @@ static void read_msg()
 	nbuf_clear(&buf);
 }
 
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+		return false; \
+	} \
+} while (0)
+
+#if NBUF_HAVE_BUILDER
+static bool build_msg()
+{
+	static const uint32_t packed[] = { 1, 300, 70000 };
+	static const int64_t delta[] = { -5, 10, 1000 };
+	nbuf::buffer buf;
+	uint32_t u32[3];
+	int64_t i64[3];
+
+	nbuf_init_ex(&buf, 0);
+	{
+		nbuf::arena a(&buf);
+
+		CHECK(a.reserve(4096) == nbuf::status::ok);
+		auto s = Sample::build(a);
+		s.set_a(200);
+		s.set_b(-1);
+		s.set_c(2.5);
+		s.set_d(Dir::S);
+		s.set_e(true);
+		s.set_f(Dir::W);
+		s.alloc_g(10).set(9, true);
+		s.h()[1] = -7;
+		auto i = s.alloc_i(3);
+		for (size_t k = 0; k < i.size(); k++)
+			i[k] = k * k;
+		CHECK(s.set_j(packed, 3) == nbuf::status::ok);
+		CHECK(s.set_k(delta, 3) == nbuf::status::ok);
+		CHECK(s.set_l("hello") == nbuf::status::ok);
+		CHECK(s.alloc_m(2).set(1, "world") == nbuf::status::ok);
+		s.n().v()[2] = 1.5f;
+		s.n().set_d(Dir::E);
+		s.alloc_o(2)[1].set_d(Dir::W);
+		auto p = s.alloc_p();
+		p.alloc_timestamp().set_seconds(42);
+		CHECK(p.set_message("log") == nbuf::status::ok);
+		for (auto q : s.alloc_q(2))
+			q.set_a(7);
+		CHECK(s.set_s("first") == nbuf::status::ok);
+		s.alloc_t().set_a(9);
+		CHECK(a.error() == nbuf::status::ok);
+	}
+
+	auto r = Sample::get(&buf);
+	CHECK(r.a() == 200);
+	CHECK(r.b() == -1);
+	CHECK(r.c() == 2.5);
+	CHECK(r.d() == Dir::S);
+	CHECK(r.e());
+	CHECK(r.f() == Dir::W);
+	CHECK(r.g().size() == 10 && r.g()[9] && !r.g()[8]);
+	CHECK(r.h()[0] == 0 && r.h()[1] == -7);
+	CHECK(r.i().size() == 3 && r.i()[2] == 4);
+	CHECK(r.j(u32, 3) == 3 && u32[2] == 70000);
+	CHECK(r.k(i64, 3) == 3 && i64[0] == -5 && i64[2] == 1000);
+	CHECK(std::string_view(r.l()) == "hello");
+	CHECK(r.m().size() == 2 && r.m()[0].size() == 0 &&
+		std::string_view(r.m()[1]) == "world");
+	CHECK(r.n().v()[2] == 1.5f && r.n().d() == Dir::E);
+	CHECK(r.o().size() == 2 && r.o()[1].d() == Dir::W);
+	CHECK(r.p().timestamp().seconds() == 42);
+	CHECK(std::string_view(r.p().message()) == "log");
+	CHECK(r.q().size() == 2 && r.q()[1].a() == 7);
+	CHECK(r.which_u() == Sample::u_case::t && r.t().a() == 9);
+
+	Sample::view v(r);
+	CHECK(v.a() == 200 && v.b() == -1 && v.c() == 2.5);
+	CHECK(v.d() == Dir::S && v.e() && v.f() == Dir::W);
+	CHECK(v.h(0) == 0 && v.h(1) == -7 && v.h(2) == 0);
+	nbuf_clear(&buf);
+	return true;
+}
+
+static bool reflect()
+{
+	static_assert(std::is_same_v<Sample::fields::f_c::type, double>);
+	static_assert(Sample::all_fields::size == 19);
+	std::string names;
+	size_t npointers = 0;
+
+	nbuf::for_each_field<Sample>([&](auto f) {
+		names += decltype(f)::field_name();
+		names += ' ';
+		if constexpr (decltype(f)::is_pointer)
+			npointers++;
+	});
+	CHECK(names == "a b c d e f g h i j k l m n o p q s t ");
+	CHECK(npointers == 11);
+
+	// A message without the field reads as zero
+	Sample::reader r;
+	Sample::view v(r);
+	CHECK(v.b() == 0 && v.h(1) == 0);
+	return true;
+}
+
+/* Field names that are also members of the descriptors and views */
+static bool clashing_names()
+{
+	nbuf::buffer buf;
+
+	nbuf_init_ex(&buf, 0);
+	auto w = Named::alloc(&buf);
+	w.set_name("n");
+	w.set_type(3);
+	w.set_all(4);
+	w.set_offset(0.5);
+	w.count()[1] = 6;
+	w.set_bits(Dir::W);
+	auto r = Named::get(&buf);
+	CHECK(std::string_view(r.name()) == "n" && r.type() == 3);
+	CHECK(r.all() == 4 && r.offset() == 0.5 && r.count()[1] == 6);
+
+	Named::view v(r);
+	CHECK(v.type() == 3 && v.all() == 4 && v.offset() == 0.5);
+	CHECK(v.count(1) == 6 && v.bits() == Dir::W);
+	static_assert(Named::fields::f_offset::offset == 8);
+	std::string names;
+	nbuf::for_each_field<Named>([&](auto f) {
+		names += decltype(f)::field_name();
+		names += ' ';
+	});
+	CHECK(names == "name type all offset count bits index ");
+	nbuf_clear(&buf);
+	return true;
+}
+
+static bool build_no_space()
+{
+	static char mem[64];
+	nbuf::buffer buf;
+
+	nbuf_init_rw(&buf, mem, sizeof mem);
+	nbuf::arena a(&buf);
+	CHECK(a.reserve(sizeof mem + 1) == nbuf::status::no_memory);
+	CHECK(a.error() == nbuf::status::no_memory);
+
+	nbuf::arena b(&buf);
+	auto s = Sample::build(b);  // does not fit
+	CHECK(b.error() == nbuf::status::no_space);
+	s.set_a(1);
+	CHECK(s.set_l("x") == nbuf::status::no_space);
+	// Builders of failed allocations have their size, and can be written
+	auto i = s.alloc_i(3);
+	CHECK(i.size() == 3);
+	i[2] = 5;
+	s.alloc_o(2)[1].set_d(Dir::W);
+	auto q = s.alloc_q(2);
+	q[1].set_a(3);
+	q[1].alloc_q(4)[3].set_b(-1);
+	auto m = s.alloc_m(2);
+	CHECK(m.size() == 2 && m.set(1, "y") == nbuf::status::no_space);
+	s.alloc_g(10).set(9, true);
+	CHECK(buf.len == 0);
+
+	// The root fits, its array does not
+	nbuf::arena c(&buf);
+	auto n = Named::build(c);
+	CHECK(c.error() == nbuf::status::ok);
+	auto index = n.alloc_index(2);
+	CHECK(c.error() == nbuf::status::no_space && index.size() == 2);
+	index[1].set_type(7);
+	index[1].alloc_index(1)[0].set_all(1);
+	return true;
+}
+#endif  // NBUF_HAVE_BUILDER
+
+static bool algorithms()
+{
+	static const int32_t in[] = { 5, -3, 9, 0, 7 };
+	nbuf::buffer buf;
+
+	nbuf_init_ex(&buf, 0);
+	auto s = Sample::alloc(&buf);
+	auto i = s.alloc_i(5);
+	std::copy(std::begin(in), std::end(in), i.begin());
+	std::sort(i.begin(), i.end());
+	CHECK(std::is_sorted(i.begin(), i.end()));
+	CHECK(i.end() - i.begin() == 5 && i.begin()[4] == 9);
+	CHECK(*std::lower_bound(i.begin(), i.end(), 6) == 7);
+	CHECK(std::accumulate(i.begin(), i.end(), 0L) == 18);
+	auto q = s.alloc_q(3);
+	for (auto it = q.begin(); it != q.end(); it++)
+		(*it).set_a(q.end() - it);
+	CHECK(std::distance(q.begin(), q.end()) == 3);
+	CHECK(q.begin()[1].a() == 2 && (*(q.begin() + 2)).a() == 1);
+#if __cplusplus >= 202002L
+	static_assert(std::contiguous_iterator<decltype(i.begin())>);
+	static_assert(std::random_access_iterator<decltype(q.begin())>);
+	CHECK(std::ranges::max(i) == 9);
+#endif
+	nbuf_clear(&buf);
+	return true;
+}
+
+#if NBUF_HAVE_BUILDER
+static bool keyed()
+{
+	static const char *const names[] = { "b", "c", "a" };
+	static const Dir dirs[] = { Dir::W, Dir::N, Dir::S, Dir::N };
+	nbuf::buffer buf;
+
+	nbuf_init_ex(&buf, 0);
+	auto c = Catalog::alloc(&buf);
+	auto by_name = c.alloc_by_name(3);
+	for (size_t k = 0; k < 3; k++) {
+		by_name[k].set_l(std::string_view(names[k]));
+		by_name[k].set_a(k);
+	}
+	CHECK(c.sort_by_name());
+	CHECK(std::string_view(c.by_name()[0].l()) == "a");
+	CHECK(c.find_by_name_by_l(std::string_view("c")).a() == 1);
+	CHECK(!c.find_by_name_by_l(std::string_view("d")));
+	CHECK(!c.lookup_by_name_by_l(std::string_view("d")));
+	CHECK(c.index_by_name());
+	CHECK(c.lookup_by_name_by_l(std::string_view("b")).a() == 0);
+	CHECK(!c.lookup_by_name_by_l(std::string_view("d")));
+	auto e = c.alloc_by_severity(2);
+	e[0].set_severity(logging::LogSeverity::ERROR);
+	e[1].set_severity(logging::LogSeverity::DEBUG);
+	CHECK(c.sort_by_severity());
+	CHECK(c.find_by_severity_by_severity(logging::LogSeverity::ERROR));
+	CHECK(!c.find_by_severity_by_severity(logging::LogSeverity::INFO));
+	nbuf_clear(&buf);
+
+	nbuf_init_ex(&buf, 0);
+	{
+		nbuf::arena a(&buf);
+
+		CHECK(a.reserve(1024) == nbuf::status::ok);
+		auto b = Catalog::build(a);
+		auto by_dir = b.alloc_by_dir(4);
+
+		for (size_t k = 0; k < 4; k++) {
+			by_dir[k].set_d(dirs[k]);
+			by_dir[k].set_a(k);
+		}
+		CHECK(b.sort_by_dir() == nbuf::status::ok);
+		auto by_name = b.alloc_by_name(3);
+		for (size_t k = 0; k < 3; k++) {
+			CHECK(by_name[k].set_l(names[k]) == nbuf::status::ok);
+			by_name[k].set_a(k);
+		}
+		CHECK(b.index_by_name() == nbuf::status::ok);
+	}
+	auto r = Catalog::get(&buf);
+	CHECK(r.lookup_by_name_by_l(std::string_view("a")).a() == 2);
+	CHECK(!r.lookup_by_name_by_l(std::string_view("")));
+	// Elements with the same key keep their order
+	CHECK(r.by_dir()[0].a() == 1 && r.by_dir()[1].a() == 3);
+	CHECK(r.find_by_dir_by_d(Dir::N).a() == 1);
+	CHECK(r.find_by_dir_by_d(Dir::W).a() == 0);
+	CHECK(!r.find_by_dir_by_d(Dir::E));
+	nbuf_clear(&buf);
+	return true;
+}
+
+static bool intern()
+{
+	static const char *const names[] = { "b", "a", "b" };
+	nbuf::buffer buf;
+	nbuf_intern table;
+
+	nbuf_init_ex(&buf, 0);
+	nbuf_intern_init(&table);
+	buf.intern = &table;
+	{
+		nbuf::arena a(&buf);
+
+		CHECK(a.reserve(1024) == nbuf::status::ok);
+		auto b = Catalog::build(a);
+		auto by_name = b.alloc_by_name(3);
+		for (size_t k = 0; k < 3; k++)
+			CHECK(by_name[k].set_l(names[k]) == nbuf::status::ok);
+		CHECK(a.error() == nbuf::status::ok);
+	}
+	auto r = Catalog::get(&buf);
+	CHECK(std::string_view(r.by_name()[2].l()) == "b");
+	CHECK(r.by_name()[0].l().data() == r.by_name()[2].l().data());
+	CHECK(r.by_name()[0].l().data() != r.by_name()[1].l().data());
+	nbuf_intern_free(&table);
+	nbuf_clear(&buf);
+	return true;
+}
+
+static bool append()
+{
+	nbuf::buffer buf;
+	char name[16];
+
+	nbuf_init_ex(&buf, 0);
+	{
+		nbuf::arena a(&buf);
+
+		CHECK(a.reserve(16384) == nbuf::status::ok);
+		auto s = Sample::build(a);
+		auto q = s.append_q();
+		auto m = s.append_m();
+		for (int k = 0; k < 20; k++) {
+			// the sub-objects of elements come between adds
+			snprintf(name, sizeof name, "q%d", k);
+			auto e = q.add();
+			e.set_a(k);
+			CHECK(e.set_l(name) == nbuf::status::ok);
+			CHECK(m.add(name + 1) == nbuf::status::ok);
+		}
+		auto i = s.append_i();
+		for (int k = 0; k < 100; k++)
+			CHECK(i.add(k * k) == nbuf::status::ok);
+		CHECK(q.finish() == nbuf::status::ok && q.size() == 20);
+		CHECK(m.finish() == nbuf::status::ok);
+		CHECK(i.finish() == nbuf::status::ok);
+		CHECK(a.error() == nbuf::status::ok);
+	}
+	auto r = Sample::get(&buf);
+	CHECK(r.q().size() == 20 && r.m().size() == 20 && r.i().size() == 100);
+	CHECK(r.i()[99] == 99 * 99);
+	for (int k = 0; k < 20; k++) {
+		snprintf(name, sizeof name, "q%d", k);
+		CHECK(r.q()[k].a() == k && std::string_view(r.q()[k].l()) == name);
+		CHECK(std::string_view(r.m()[k]) == name + 1);
+	}
+	nbuf_clear(&buf);
+	return true;
+}
+#endif  // NBUF_HAVE_BUILDER
+
 }  // namespace
 
 int main()
 {
 	write_msg();
 	read_msg();
+	if (!algorithms())
+		return 1;
+#if NBUF_HAVE_BUILDER
+	if (!build_msg() || !build_no_space() || !reflect() || !clashing_names() ||
+		!keyed() || !intern() || !append())
+		return 1;
+#endif
 	return 0;
 }